@@ -175,6 +175,12 @@ namespace settings
 		// {E3DCF37A-315F-4ce2-92AE-8BD30C454DB1}
 		const GUID conversion_temp_files_folder = 
 		{ 0xe3dcf37a, 0x315f, 0x4ce2, { 0x92, 0xae, 0x8b, 0xd3, 0xc, 0x45, 0x4d, 0xb1 } };
+		// {3045B0D8-AE05-4834-89BC-CC812BC773C7}
+		const GUID conversion_cache_size = 
+		{ 0x3045b0d8, 0xae05, 0x4834, { 0x89, 0xbc, 0xcc, 0x81, 0x2b, 0xc7, 0x73, 0xc7 } };
+		// {9641753D-7199-4E95-8D4B-412BAECE184B}
+		const GUID conversion_encode_to_device = 
+		{ 0x9641753d, 0x7199, 0x4e95, { 0x8d, 0x4b, 0x41, 0x2b, 0xae, 0xce, 0x18, 0x4b } };
 
 	}
 	cfg_bool sort_playlists(guids::sort_playlists, true);
@@ -231,6 +237,8 @@ namespace settings
 	advconfig_integer_factory extra_filename_characters("Number of extra filename characters allowed (the iPod wll not play files with paths over a certain length)", settings::guids::extra_filename_characters, guids::advconfig_ipodbranch, 0, 4, 0, 0x1000); 
 	advconfig_integer_factory reserved_diskspace("Reserved disk space (thousandths of total capacity)", settings::guids::reserved_diskspace, guids::advconfig_ipodbranch, 0, 5, 0, 1000); 
 	advconfig_string_factory conversion_temp_files_folder("Conversion temporary files storage folder path (folder must exist; leave blank for the default path)", settings::guids::conversion_temp_files_folder, guids::advconfig_ipodbranch, 6, ""); 
+	advconfig_integer_factory conversion_cache_size("Conversion cache size limit (MB; shared by all devices; 0 disables the cache)", settings::guids::conversion_cache_size, guids::advconfig_ipodbranch, 7, 0, 0, 0x100000); 
+	advconfig_checkbox_factory conversion_encode_to_device("Write encoder output straight to the device instead of a temporary file (drive-based iPods only)", settings::guids::conversion_encode_to_device, guids::advconfig_ipodbranch, 8, false); 
 	cfg_conversion_presets_t encoder_list(guids::encoder_list);
 	cfg_bool encoder_imported (guids::encoder_imported, false);
 	cfg_uint active_encoder (guids::active_encoder, 0);
@@ -83,10 +83,11 @@ namespace settings
 		sync_eject_when_done,
 		conversion_use_bitrate_limit,
 		encoder_imported;
-	extern advconfig_checkbox_factory check_video;
+	extern advconfig_checkbox_factory check_video, conversion_encode_to_device;
 	extern advconfig_integer_factory
 		extra_filename_characters,
-		reserved_diskspace;
+		reserved_diskspace,
+		conversion_cache_size;
 	extern advconfig_string_factory conversion_temp_files_folder;
 	extern cfg_stringlist sync_playlists;
 
@@ -157,6 +157,176 @@ bool g_get_artwork_for_track (metadb_handle_ptr & p_track, album_art_data_ptr &
 	return b_found;
 }
 
+void artwork_preparer_t::start(t_size thread_count)
+{
+	if (thread_count < 1) thread_count = 1;
+	m_window = thread_count*4;
+	m_window_end = m_window;
+	m_threads.set_size(min(thread_count, m_entries.get_size()));
+	for (t_size i=0, count = m_threads.get_size(); i<count; i++)
+	{
+		m_threads[i].m_owner = this;
+		m_threads[i].create_thread();
+	}
+}
+
+void artwork_preparer_t::stop()
+{
+	{
+		insync(m_sync);
+		m_aborting = true;
+	}
+	m_event_exit.set_state(true);
+	for (t_size i=0, count = m_threads.get_size(); i<count; i++)
+		m_threads[i].wait_for_and_release_thread();
+	m_threads.set_size(0);
+}
+
+artwork_preparer_t::entry_t & artwork_preparer_t::wait(t_size index)
+{
+	while (true)
+	{
+		{
+			insync(m_sync);
+			if (m_entries[index].m_done)
+				return m_entries[index];
+		}
+		m_abort.check();
+		m_event_done.wait_for(1);
+	}
+}
+
+void artwork_preparer_t::release_if_unused(entry_t & p_entry)
+{
+	if (p_entry.m_committed && !p_entry.m_pending_duplicates && !p_entry.m_released)
+	{
+		p_entry.m_artwork.release();
+		p_entry.m_released = true;
+	}
+}
+
+void artwork_preparer_t::on_committed(t_size index)
+{
+	{
+		insync(m_sync);
+		if (!m_share_committed)
+		{
+			entry_t & entry = m_entries[index];
+			entry.m_committed = true;
+			if (entry.m_duplicate_of != pfc_infinite)
+			{
+				entry_t & owner = m_entries[entry.m_duplicate_of];
+				owner.m_pending_duplicates--;
+				release_if_unused(owner);
+			}
+			release_if_unused(entry);
+		}
+		if (index + 1 + m_window <= m_window_end)
+			return;
+		m_window_end = index + 1 + m_window;
+	}
+	m_event_window.set_state(true);
+}
+
+bool artwork_preparer_t::get_next(t_size & index)
+{
+	HANDLE events[2] = { m_event_window.get(), m_event_exit.get() };
+	while (true)
+	{
+		{
+			insync(m_sync);
+			if (m_aborting || m_next >= m_entries.get_size())
+				return false;
+			if (m_next < m_window_end)
+			{
+				index = m_next++;
+				//Pass the wake-up on, in case the window moved by more than one entry
+				if (m_next < m_window_end)
+					m_event_window.set_state(true);
+				return true;
+			}
+		}
+		if (WaitForMultipleObjectsEx(tabsize(events), events, FALSE, pfc_infinite, FALSE) == WAIT_OBJECT_0 + 1)
+			return false;
+	}
+}
+
+void artwork_preparer_t::process(entry_t & p_entry, pfc::rcptr_t<video_thumbailer_t> & p_video_thumbailer)
+{
+	album_art_data_ptr artwork_data;
+	g_get_artwork_for_track(p_entry.m_source, artwork_data, m_mappings, false, m_abort);
+	if (!artwork_data.is_valid() && p_entry.m_video_flag && m_mappings.video_thumbnailer_enabled)
+	{
+		const char * path = p_entry.m_source->get_path();
+		if (!stricmp_utf8_max(path, "file://", 7))
+		{
+			if (!p_video_thumbailer.is_valid())
+				p_video_thumbailer = pfc::rcnew_t<video_thumbailer_t>();
+			p_video_thumbailer->create_video_thumbnail(path+7, artwork_data);
+		}
+	}
+	if (!artwork_data.is_valid())
+		return;
+
+	p_entry.m_found = true;
+	p_entry.m_source_size = (t_uint32)artwork_data->get_size();
+	mmh::hash::sha1((const t_uint8*)artwork_data->get_ptr(), artwork_data->get_size(), p_entry.m_sha1);
+
+	bool b_chapter_images = false;
+	if (p_entry.m_chapter_list)
+		for (t_size c=0, ccount = p_entry.m_chapter_list->get_count(); c<ccount && !b_chapter_images; c++)
+			b_chapter_images = (*p_entry.m_chapter_list)[c].m_image_data.get_size() != 0;
+
+	if (!b_chapter_images)
+	{
+		p_entry.m_key.assign((const char *)p_entry.m_sha1, mmh::hash::sha1_digestsize);
+		p_entry.m_key.append((const char *)&p_entry.m_media_type, sizeof(p_entry.m_media_type));
+
+		insync(m_sync);
+		auto result = m_owners.emplace(p_entry.m_key, &p_entry - m_entries.get_ptr());
+		if (!result.second)
+		{
+			entry_t & owner = m_entries[result.first->second];
+			if (!owner.m_released)
+			{
+				owner.m_pending_duplicates++;
+				p_entry.m_duplicate_of = result.first->second;
+				return;
+			}
+			//The previous owner's artwork is gone, so this entry prepares its own
+			result.first->second = &p_entry - m_entries.get_ptr();
+		}
+	}
+
+	pfc::rcptr_t<photodb::t_prepared_artwork> artwork = pfc::rcnew_t<photodb::t_prepared_artwork>();
+	artwork->prepare(m_ipod, p_entry.m_media_type, artwork_data, p_entry.m_chapter_list);
+	p_entry.m_artwork = artwork;
+}
+
+DWORD artwork_preparer_t::worker_t::on_thread()
+{
+	pfc::rcptr_t<video_thumbailer_t> p_video_thumbailer;
+	t_size index;
+	while (m_owner->get_next(index))
+	{
+		entry_t & entry = m_owner->m_entries[index];
+		try
+		{
+			m_owner->process(entry, p_video_thumbailer);
+		}
+		catch (const pfc::exception & ex)
+		{
+			entry.m_error = ex.what();
+		}
+		{
+			insync(m_owner->m_sync);
+			entry.m_done = true;
+		}
+		m_owner->m_event_done.set_state(true);
+	}
+	return 0;
+}
+
 void ipod_add_files::run (ipod_device_ptr_ref_t p_ipod, const pfc::list_base_const_t<metadb_handle_ptr> & items, ipod::tasks::load_database_t & p_library, const t_field_mappings & p_mappings, threaded_process_v2_t & p_status, abort_callback & p_abort)
 {
 	p_status.checkpoint();
@@ -279,10 +449,12 @@ void ipod_add_files::run (ipod_device_ptr_ref_t p_ipod, const pfc::list_base_con
 		metadb_handle_ptr m_source;
 		metadb_handle_ptr m_destination;
 		file_info_impl m_info_source;
+		t_filestats m_stats_source;
+		t_size m_copy_index;
 		bool m_toadd;
 		bool m_transcode_pending;
 		bool m_transcode_succeeded;
-		processing_entry_t() : m_toadd(false), m_transcode_pending(false), m_transcode_succeeded(false) {};
+		processing_entry_t() : m_stats_source(filestats_invalid), m_copy_index(pfc_infinite), m_toadd(false), m_transcode_pending(false), m_transcode_succeeded(false) {};
 	};
 
 	pfc::array_t<processing_entry_t> processing_data;
@@ -296,6 +468,57 @@ void ipod_add_files::run (ipod_device_ptr_ref_t p_ipod, const pfc::list_base_con
 	pfc::ptr_list_t<const file_info> p_hint_info_ptrs;
 	mmh::GenRand gen_rand;
 
+	//Files are copied in the background while the next ones are looked at
+	file_copier_t copier(&p_status, p_abort);
+	copier.start(2, 8);
+	bool b_copies_resolved = false;
+
+	//Checks the queued copies, and stops tracks whose copy did not finish from being added
+	auto resolve_copies = [&] ()
+	{
+		b_copies_resolved = true;
+		for (t_size k=0; k<count; k++)
+		{
+			processing_entry_t & entry = processing_data[k];
+			if (entry.m_copy_index == pfc_infinite) continue;
+			const file_copier_t::job_t & job = copier.get_job(entry.m_copy_index);
+			if (job.m_done && job.m_succeeded && entry.m_toadd)
+			{
+				bool dummy;
+				t_filestats stats_dest = filestats_invalid;
+				try {
+					g_set_filetimestamp(job.m_destination, entry.m_stats_source.m_timestamp);
+					filesystem::g_get_stats(job.m_destination, stats_dest, dummy, abort_callback_dummy());
+				} catch (pfc::exception const &) {};
+				m_added_items.add_item(job.m_destination);
+				if (stats_dest != filestats_invalid)
+				{
+					p_hint_handles.add_item(entry.m_destination);
+					p_hint_info.add_item(entry.m_info_source);
+					p_hint_stats.add_item(stats_dest);
+				}
+			}
+			else
+			{
+				entry.m_toadd = false;
+				try {
+					filesystem::g_remove(job.m_destination, abort_callback_dummy());
+				} catch (pfc::exception const &) {};
+				if (job.m_done && !job.m_succeeded && !p_abort.is_aborting())
+					m_errors.add_item(results_viewer::result_t(metadb_handle_ptr(), items[k], pfc::string8() << "Failed to add file to iPod: " << job.m_error));
+			}
+		}
+
+#ifdef LOG_FILE_COPY
+		t_filesize bytes_copied;
+		double seconds;
+		copier.get_totals(bytes_copied, seconds);
+		if (copier.get_job_count())
+			console::formatter() << "iPod manager: Copied " << copier.get_job_count() << " file" << (copier.get_job_count() != 1 ? "s" : "") << ", " << bytes_copied << " bytes in "
+				<< pfc::format_float(seconds, 0, 2) << " s (" << pfc::format_float(seconds > 0 ? bytes_copied / seconds / (1024.0*1024.0) : 0, 0, 2) << " MB/s)";
+#endif
+	};
+
 	t_size j, counter=0, count_added=0, progress_index=0;
 	try
 	{
@@ -495,7 +718,7 @@ void ipod_add_files::run (ipod_device_ptr_ref_t p_ipod, const pfc::list_base_con
 #else
 						//blah, filesystem::g_copy sucks
 						bool dummy;
-						t_filestats stats_source, stats_dest = filestats_invalid;
+						t_filestats stats_source;
 						filesystem::g_get_stats(items[i]->get_path(), stats_source, dummy, p_abort);
 						if (b_to_convert)
 						{
@@ -514,14 +737,25 @@ void ipod_add_files::run (ipod_device_ptr_ref_t p_ipod, const pfc::list_base_con
 						{
 							drive_space_info_t spaceinfo;
 							p_ipod->get_capacity_information(spaceinfo);
+							//Copies still queued have not taken their space yet
+							spaceinfo.m_freespace -= min(spaceinfo.m_freespace, copier.get_pending_bytes());
 							if ((t_sfilesize)spaceinfo.m_freespace - (t_sfilesize)items[i]->get_filesize() <= ((t_sfilesize)p_mappings.reserved_diskspace * (t_sfilesize)spaceinfo.m_capacity) / 1000)
 								throw pfc::exception(pfc::string8 () << "Reserved disk space limit exceeded (" << "Capacity: " << spaceinfo.m_capacity << "; Free: " << spaceinfo.m_freespace << "; File To Copy: " << items[i]->get_filesize() << "; Reserved 0.1%s: " << p_mappings.reserved_diskspace << ")");
-							g_copy_file(items[i]->get_path(), dst, &p_status, p_abort);
-							g_set_filetimestamp(dst, stats_source.m_timestamp);
-							try {
-								filesystem::g_get_stats(dst, stats_dest, dummy, p_abort);
-							} catch (pfc::exception const &) {};
-							m_added_items.add_item(dst);
+							//The file is created now so that later files see its name as taken
+							filesystem::g_open_write_new(file::ptr(), dst, p_abort);
+							processing_data[i].m_stats_source = stats_source;
+							try
+							{
+								processing_data[i].m_copy_index = copier.add(items[i]->get_path(), dst, items[i]->get_filesize());
+							}
+							catch (const pfc::exception &)
+							{
+								//Not queued, so resolve_copies() will not clean the placeholder up
+								try {
+									filesystem::g_remove(dst, abort_callback_dummy());
+								} catch (pfc::exception const &) {};
+								throw;
+							}
 						}
 #endif
 						dir_counts[permutation_dir_counts[dir_position]]++;
@@ -535,13 +769,6 @@ void ipod_add_files::run (ipod_device_ptr_ref_t p_ipod, const pfc::list_base_con
 						else if (dir_position == max_directory_number && dir_counts[permutation_dir_counts[dir_position]] > dir_counts[permutation_dir_counts[dir_position-1]])
 							dir_position=0;
 						static_api_ptr_t<metadb>()->handle_create(ptr, make_playable_location(dst, 0/*items[i]->get_subsong_index()*/));
-						if (!b_to_convert && stats_dest != filestats_invalid)
-						{
-							//p_hint_list->add_hint(ptr, info, stats_dest, true);
-							p_hint_handles.add_item(ptr);
-							p_hint_info.add_item(info);
-							p_hint_stats.add_item(stats_dest);
-						}
 					}
 					else
 					{
@@ -634,6 +861,9 @@ void ipod_add_files::run (ipod_device_ptr_ref_t p_ipod, const pfc::list_base_con
 
 			p_status.update_progress_subpart_helper(progress_index,count_nodups*3);
 		}
+		copier.finish();
+		copier.stop();
+		resolve_copies();
 		{
 			t_size convcount=0;
 			j=0;
@@ -684,6 +914,11 @@ void ipod_add_files::run (ipod_device_ptr_ref_t p_ipod, const pfc::list_base_con
 		}
 	}
 	catch (exception_aborted const &) {};
+	if (!b_copies_resolved)
+	{
+		copier.stop();
+		resolve_copies();
+	}
 	for (i=0; i<count; i++)
 	{
 		if (processing_data[i].m_toadd)
@@ -735,8 +970,7 @@ void ipod_add_files::run (ipod_device_ptr_ref_t p_ipod, const pfc::list_base_con
 				processing_data[i].m_track->id = ++last_tid;
 				processing_data[i].m_track->pid = p_library.get_new_track_pid();//++last_dbid;
 				processing_data[i].m_track->dbid2 = processing_data[i].m_track->pid;
-				m_results[i].index = p_library.m_tracks.add_item(processing_data[i].m_track);
-				p_library.m_handles.add_item(processing_data[i].m_destination);
+				m_results[i].index = p_library.add_track(processing_data[i].m_track, processing_data[i].m_destination);
 				itunesdb::t_playlist_entry pe;
 				pe.position_valid = true;
 				pe.position = m_results[i].index+1;
@@ -826,126 +1060,174 @@ void ipod_add_files::run (ipod_device_ptr_ref_t p_ipod, const pfc::list_base_con
 		t_size count_tracks = p_library.m_tracks.get_count();
 		mmh::Permutation permutation_album_grouping(count_tracks);
 		mmh::sort_get_permutation(p_library.m_tracks, permutation_album_grouping, ipod::tasks::load_database_t::g_compare_track_album_id, false);
-		counter=0;
-		pfc::rcptr_t<video_thumbailer_t> p_video_thumbailer;
-		for (j=0; j<count; j++)
+		pfc::array_t<t_size> album_grouping_positions;
+		album_grouping_positions.set_size(count_tracks);
+		for (t_size k=0; k<count_tracks; k++)
+			album_grouping_positions[permutation_album_grouping[k]] = k;
+
+		pfc::array_t<artwork_preparer_t::entry_t> artwork_entries;
+		pfc::array_t<t_size> artwork_source_indices;
 		{
-			i=j;//order[j];
-			if (!mask[i] && m_results[i].b_added)
+			t_size artwork_count = 0;
+			for (i=0; i<count; i++)
+				if (!mask[i] && m_results[i].b_added)
+					artwork_count++;
+			artwork_entries.set_size(artwork_count);
+			artwork_source_indices.set_size(artwork_count);
+			for (i=0, j=0; i<count; i++)
 			{
-				counter++;
+				if (!mask[i] && m_results[i].b_added)
 				{
-					//mmh::UIntegerNaturalFormatter text_remaining(count_added-counter);
-					progress_details[0].m_value = track_formatter.run(items[j]);
-					progress_details[1].m_value = pfc::string8() << count_added-counter;
-					p_status.update_text_and_details(pfc::string8() << "Copying artwork for " << text_count << " file" << (text_count.is_plural() ? "s" : ""), progress_details);
+					const itunesdb::t_track & track = *p_library.m_tracks[m_results[i].index];
+					artwork_entries[j].m_source = items[i];
+					artwork_entries[j].m_media_type = track.media_type;
+					artwork_entries[j].m_video_flag = track.video_flag != 0;
+					artwork_entries[j].m_chapter_list = &track.m_chapter_list;
+					artwork_source_indices[j] = i;
+					j++;
 				}
-				bool b_album_track = p_library.m_tracks[m_results[i].index]->media_type == t_track::type_audio && strcmp(p_library.m_tracks[m_results[i].index]->album, empty_album) != 0 && p_library.m_tracks[m_results[i].index]->album.length();
-				const auto iter = std::find(permutation_album_grouping.begin(), permutation_album_grouping.end(), m_results[i].index);
-				t_size k = std::distance(permutation_album_grouping.begin(), iter);
-				/*if (k && p_library.m_tracks[i]->album_id == p_library.m_tracks[permutation_album_grouping[k-1]]->album_id))
-				{
-				if (((!p_library.m_tracks[i]->album_artist_valid && strcmp(p_library.m_tracks[i]->artist, empty_artist)) || strcmp(p_library.m_tracks[i]->album_artist, empty_album_artist)) && )
-				b_prev_same_group = true;
-				}*/
+			}
+		}
 
-				try
+		//Artwork shared within this batch on 6G devices, by content hash and media type
+		std::unordered_map<std::string, t_size> committed_artwork;
+
+		artwork_preparer_t preparer(p_ipod, p_mappings, artwork_entries, sixg, p_abort);
+		preparer.start(std::thread::hardware_concurrency());
+
+		counter=0;
+		for (t_size e=0, ecount = artwork_entries.get_size(); e<ecount; e++)
+		{
+			i = artwork_source_indices[e];
+			counter++;
+			{
+				//mmh::UIntegerNaturalFormatter text_remaining(count_added-counter);
+				progress_details[0].m_value = track_formatter.run(items[i]);
+				progress_details[1].m_value = pfc::string8() << count_added-counter;
+				p_status.update_text_and_details(pfc::string8() << "Copying artwork for " << text_count << " file" << (text_count.is_plural() ? "s" : ""), progress_details);
+			}
+			bool b_album_track = p_library.m_tracks[m_results[i].index]->media_type == t_track::type_audio && strcmp(p_library.m_tracks[m_results[i].index]->album, empty_album) != 0 && p_library.m_tracks[m_results[i].index]->album.length();
+			t_size k = album_grouping_positions[m_results[i].index];
+
+			try
+			{
+				artwork_preparer_t::entry_t & entry = preparer.wait(e);
+				p_abort.check();
+				if (!entry.m_error.is_empty())
+					throw pfc::exception(entry.m_error);
+				if (entry.m_found)
 				{
-					album_art_data_ptr artwork_data;
-					g_get_artwork_for_track(items[i], artwork_data, p_mappings, false, p_abort);
-					if (!artwork_data.is_valid() && p_library.m_tracks[m_results[i].index]->video_flag && p_mappings.video_thumbnailer_enabled)
+					pfc::rcptr_t<itunesdb::t_track> p_track = p_library.m_tracks[m_results[i].index] ;
+					p_track->artwork_source_size = entry.m_source_size;
+					p_track->artwork_source_size_valid = true;
+					memcpy(p_track->artwork_source_sha1, entry.m_sha1, mmh::hash::sha1_digestsize);
+					p_track->artwork_source_sha1_valid = true;
+					bool b_processed = false;
+					if (sixg && b_album_track)
 					{
-						const char * path = items[i]->get_path();
-						if (!stricmp_utf8_max(path, "file://", 7))
-						{
-							if (!p_video_thumbailer.is_valid())
-								p_video_thumbailer = pfc::rcnew_t<video_thumbailer_t>();
-							p_video_thumbailer->create_video_thumbnail(path+7, artwork_data);
-						}
-					}
-						if (artwork_data.is_valid())
-						{
-							pfc::rcptr_t<itunesdb::t_track> p_track = p_library.m_tracks[m_results[i].index] ;
-							p_track->artwork_source_size = artwork_data->get_size();
-							p_track->artwork_source_size_valid = true;
-							mmh::hash::sha1((const t_uint8*)artwork_data->get_ptr(), artwork_data->get_size(), p_track->artwork_source_sha1);
-							p_track->artwork_source_sha1_valid = true;
-							bool b_processed = false;
-							if (sixg && b_album_track)
-							{
-								t_size l = k;
-								if (l)
-									while (--l && !b_processed && p_library.m_tracks[m_results[i].index]->album_id == p_library.m_tracks[permutation_album_grouping[l]]->album_id)
-									{
-										pfc::rcptr_t<itunesdb::t_track> p_album_track = p_library.m_tracks[permutation_album_grouping[l]];
-										if (p_album_track->artwork_cache_id && (!p_album_track->artwork_source_sha1_valid || !memcmp(p_track->artwork_source_sha1, p_album_track->artwork_source_sha1, mmh::hash::sha1_digestsize)))
-										{
-											p_library.m_tracks[m_results[i].index]->artwork_cache_id = p_album_track->artwork_cache_id;
-											p_library.m_tracks[m_results[i].index]->artwork_count = 1;
-											p_library.m_tracks[m_results[i].index]->artwork_flag = 1;
-											p_library.m_tracks[m_results[i].index]->artwork_size = p_album_track->artwork_size;
-											b_processed = true;
-										}
-										//l--;
-									}
-									l=k;
-									if (l<count_tracks)
-										while (++l < count_tracks && !b_processed && p_library.m_tracks[m_results[i].index]->album_id == p_library.m_tracks[permutation_album_grouping[l]]->album_id)
-										{
-											pfc::rcptr_t<itunesdb::t_track> p_album_track = p_library.m_tracks[permutation_album_grouping[l]];
-											if (p_album_track->artwork_cache_id && (!p_album_track->artwork_source_sha1_valid || !memcmp(p_track->artwork_source_sha1, p_album_track->artwork_source_sha1, mmh::hash::sha1_digestsize)))
-											{
-												p_library.m_tracks[m_results[i].index]->artwork_cache_id = p_album_track->artwork_cache_id;
-												p_library.m_tracks[m_results[i].index]->artwork_count = 1;
-												p_library.m_tracks[m_results[i].index]->artwork_flag = 1;
-												p_library.m_tracks[m_results[i].index]->artwork_size = p_album_track->artwork_size;
-												b_processed = true;
-											}
-										}
-							}
-							bool b_incRef = true;
-							if (!b_processed)
+						t_size l = k;
+						if (l)
+							while (--l && !b_processed && p_library.m_tracks[m_results[i].index]->album_id == p_library.m_tracks[permutation_album_grouping[l]]->album_id)
 							{
-								if (!p_library.m_artwork_valid)
-									p_library.m_artwork.initialise_artworkdb(p_ipod);
-								p_library.m_artwork_valid=true;
-								//pfc::dynamic_assert(p_library.m_artwork_valid, "No ArtworkDB found");
-								b_incRef = p_library.m_artwork.add_artwork_v3(p_ipod, p_library.m_tracks[m_results[i].index]->media_type, p_library.m_tracks[m_results[i].index]->pid, p_library.m_tracks[m_results[i].index]->artwork_cache_id, artwork_data, count_added, p_abort, &p_library.m_tracks[m_results[i].index]->m_chapter_list);
-								p_library.m_tracks[m_results[i].index]->artwork_count = 1;
-								p_library.m_tracks[m_results[i].index]->artwork_flag = 1;
-								p_library.m_tracks[m_results[i].index]->artwork_size = artwork_data->get_size();
-								b_processed = true;
-							}// else console::formatter() << artwork;
-							if (sixg && b_processed && b_incRef)
-							{
-								t_size ii_index;
-								if (p_library.m_artwork.find_by_image_id(ii_index, p_library.m_tracks[m_results[i].index]->artwork_cache_id))
+								pfc::rcptr_t<itunesdb::t_track> p_album_track = p_library.m_tracks[permutation_album_grouping[l]];
+								if (p_album_track->artwork_cache_id && (!p_album_track->artwork_source_sha1_valid || !memcmp(p_track->artwork_source_sha1, p_album_track->artwork_source_sha1, mmh::hash::sha1_digestsize)))
 								{
-									p_library.m_artwork.image_list[ii_index].refcount++;
-									p_library.m_artwork.image_list[ii_index].unk8 = 1;
+									p_library.m_tracks[m_results[i].index]->artwork_cache_id = p_album_track->artwork_cache_id;
+									p_library.m_tracks[m_results[i].index]->artwork_count = 1;
+									p_library.m_tracks[m_results[i].index]->artwork_flag = 1;
+									p_library.m_tracks[m_results[i].index]->artwork_size = p_album_track->artwork_size;
+									b_processed = true;
 								}
+								//l--;
 							}
-
-						
+							l=k;
+							if (l<count_tracks)
+								while (++l < count_tracks && !b_processed && p_library.m_tracks[m_results[i].index]->album_id == p_library.m_tracks[permutation_album_grouping[l]]->album_id)
+								{
+									pfc::rcptr_t<itunesdb::t_track> p_album_track = p_library.m_tracks[permutation_album_grouping[l]];
+									if (p_album_track->artwork_cache_id && (!p_album_track->artwork_source_sha1_valid || !memcmp(p_track->artwork_source_sha1, p_album_track->artwork_source_sha1, mmh::hash::sha1_digestsize)))
+									{
+										p_library.m_tracks[m_results[i].index]->artwork_cache_id = p_album_track->artwork_cache_id;
+										p_library.m_tracks[m_results[i].index]->artwork_count = 1;
+										p_library.m_tracks[m_results[i].index]->artwork_flag = 1;
+										p_library.m_tracks[m_results[i].index]->artwork_size = p_album_track->artwork_size;
+										b_processed = true;
+									}
+								}
 					}
-					p_status.checkpoint();
-				}
-				catch (const exception_aborted &)
-				{
-					try {
-						p_library.m_artwork.finalise_add_artwork_v2(p_ipod, abort_callback_dummy());
-					} catch (pfc::exception &) {};
-					throw;
-				}
-				catch (const pfc::exception & ex)
-				{
-					m_errors.add_item(results_viewer::result_t(metadb_handle_ptr(), items[i], pfc::string8() << "Failed to add album art for track: " << ex.what()));
-					//pfc::string8_fast_aggressive err; err << "Failed to add album art for track: " <<  items[i]->get_path() << "; Reason: " <<ex.what();
-					//m_error_list.add_item(err);
+					if (sixg && !b_processed && !entry.m_key.empty())
+					{
+						auto iter = committed_artwork.find(entry.m_key);
+						if (iter != committed_artwork.end())
+						{
+							pfc::rcptr_t<itunesdb::t_track> p_shared_track = p_library.m_tracks[iter->second];
+							p_track->artwork_cache_id = p_shared_track->artwork_cache_id;
+							p_track->artwork_count = 1;
+							p_track->artwork_flag = 1;
+							p_track->artwork_size = p_shared_track->artwork_size;
+							b_processed = true;
+						}
+					}
+					bool b_incRef = true;
+					if (!b_processed)
+					{
+						pfc::rcptr_t<photodb::t_prepared_artwork> artwork = entry.m_artwork;
+						if (!artwork.is_valid() && entry.m_duplicate_of != pfc_infinite)
+						{
+							const artwork_preparer_t::entry_t & owner = preparer.wait(entry.m_duplicate_of);
+							if (!owner.m_error.is_empty())
+								throw pfc::exception(owner.m_error);
+							artwork = owner.m_artwork;
+						}
+						if (!artwork.is_valid())
+							throw pfc::exception_bug_check();
+
+						if (!p_library.m_artwork_valid)
+							p_library.m_artwork.initialise_artworkdb(p_ipod);
+						p_library.m_artwork_valid=true;
+						//pfc::dynamic_assert(p_library.m_artwork_valid, "No ArtworkDB found");
+						b_incRef = p_library.m_artwork.add_artwork_v3(p_ipod, p_track->pid, p_track->artwork_cache_id, *artwork, count_added, p_abort);
+						p_track->artwork_count = 1;
+						p_track->artwork_flag = 1;
+						p_track->artwork_size = entry.m_source_size;
+						b_processed = true;
+					}// else console::formatter() << artwork;
+					//Whichever way the image was found, later duplicates can share it once this entry's artwork is released
+					if (sixg && b_processed && !entry.m_key.empty())
+						committed_artwork.emplace(entry.m_key, m_results[i].index);
+					if (sixg && b_processed && b_incRef)
+					{
+						t_size ii_index;
+						if (p_library.m_artwork.find_by_image_id(ii_index, p_library.m_tracks[m_results[i].index]->artwork_cache_id))
+						{
+							p_library.m_artwork.image_list[ii_index].refcount++;
+							p_library.m_artwork.image_list[ii_index].unk8 = 1;
+						}
+					}
+					//Later duplicates on 6G devices share the committed image instead
+					if (sixg)
+						entry.m_artwork.release();
 				}
+				p_status.checkpoint();
+			}
+			catch (const exception_aborted &)
+			{
+				preparer.stop();
+				try {
+					p_library.m_artwork.finalise_add_artwork_v2(p_ipod, abort_callback_dummy());
+				} catch (pfc::exception &) {};
+				throw;
+			}
+			catch (const pfc::exception & ex)
+			{
+				m_errors.add_item(results_viewer::result_t(metadb_handle_ptr(), items[i], pfc::string8() << "Failed to add album art for track: " << ex.what()));
+				//pfc::string8_fast_aggressive err; err << "Failed to add album art for track: " <<  items[i]->get_path() << "; Reason: " <<ex.what();
+				//m_error_list.add_item(err);
 			}
-			p_status.update_progress_subpart_helper(j+1+count,count*3);
+			preparer.on_committed(e);
+			p_status.update_progress_subpart_helper(i+1+count,count*3);
 		}
+		preparer.stop();
 		p_library.m_artwork.finalise_add_artwork_v2(p_ipod, abort_callback_dummy());
 	}
 	//p_library.m_handles.add_items(handles_sent);
@@ -3,10 +3,156 @@
 #include "reader.h"
 #include "results.h"
 
+//#define LOG_FILE_COPY
+
 void g_convert_file (metadb_handle_ptr src, const char * dst, const char * cmd, abort_callback & p_abort);
 bool g_get_artwork_for_track (metadb_handle_ptr & p_track, album_art_data_ptr & p_out, const t_field_mappings & p_mappings, bool b_absolute_only, abort_callback & p_abort);
 album_art_extractor_instance_ptr g_get_album_art_extractor_instance(const char * path, abort_callback & p_abort);
 
+/**
+ * Fetches, hashes and formats artwork for a batch of tracks on a pool of worker threads,
+ * for a single writer to commit to the ArtworkDB in entry order.
+ *
+ * Workers only run a fixed window ahead of the writer. Artwork with the same content and
+ * media type is formatted once; later entries record the entry that owns it. Unless the writer
+ * shares committed images itself, an owner's artwork is released once it and every duplicate
+ * recorded against it have been committed, and the next copy found becomes a new owner.
+ */
+class artwork_preparer_t
+{
+public:
+	class entry_t
+	{
+	public:
+		metadb_handle_ptr m_source;
+		t_uint32 m_media_type;
+		bool m_video_flag;
+		const itunesdb::chapter_list * m_chapter_list;
+
+		bool m_done;
+		bool m_found;
+		t_uint32 m_source_size;
+		t_uint8 m_sha1[mmh::hash::sha1_digestsize];
+		std::string m_key;
+		t_size m_duplicate_of;
+		pfc::rcptr_t<photodb::t_prepared_artwork> m_artwork;
+		pfc::string8 m_error;
+
+		bool m_committed, m_released;
+		t_size m_pending_duplicates;
+
+		entry_t() : m_media_type(0), m_video_flag(false), m_chapter_list(NULL), m_done(false), m_found(false), m_source_size(0), m_duplicate_of(pfc_infinite),
+			m_committed(false), m_released(false), m_pending_duplicates(0) {};
+	};
+
+	artwork_preparer_t(ipod_device_ptr_ref_t p_ipod, const t_field_mappings & p_mappings, pfc::array_t<entry_t> & p_entries, bool p_share_committed, abort_callback & p_abort)
+		: m_ipod(p_ipod), m_mappings(p_mappings), m_entries(p_entries), m_abort(p_abort), m_next(0), m_window_end(0), m_window(0), m_aborting(false),
+		m_share_committed(p_share_committed)
+	{
+		m_event_window.create(false, false);
+		m_event_done.create(false, false);
+		m_event_exit.create(true, false);
+	};
+	~artwork_preparer_t() {stop();}
+
+	void start(t_size thread_count);
+	void stop();
+	/** Waits for an entry to be prepared. Entries must be waited on in ascending order, apart from the owners of duplicates. */
+	entry_t & wait(t_size index);
+	/** Lets the workers move on past index, and releases any artwork no longer needed. */
+	void on_committed(t_size index);
+private:
+	class worker_t : public mmh::Thread
+	{
+	public:
+		worker_t() : m_owner(NULL) {};
+		DWORD on_thread();
+		artwork_preparer_t * m_owner;
+	};
+
+	bool get_next(t_size & index);
+	void process(entry_t & p_entry, pfc::rcptr_t<video_thumbailer_t> & p_video_thumbailer);
+	void release_if_unused(entry_t & p_entry);
+
+	ipod_device_ptr_t m_ipod;
+	const t_field_mappings & m_mappings;
+	pfc::array_t<entry_t> & m_entries;
+	abort_callback & m_abort;
+
+	pfc::array_t<worker_t> m_threads;
+	critical_section m_sync;
+	win32_event m_event_window, m_event_done, m_event_exit;
+	t_size m_next, m_window_end, m_window;
+	bool m_aborting, m_share_committed;
+	std::unordered_map<std::string, t_size> m_owners;
+};
+
+/**
+ * Copies files to the device on a few worker threads, so that the adder can read the metadata
+ * of the next files in the meantime. add() waits once a fixed number of copies are queued.
+ */
+class file_copier_t
+{
+public:
+	class job_t
+	{
+	public:
+		pfc::string8 m_source, m_destination;
+		t_filesize m_size;
+		bool m_done, m_succeeded;
+		double m_seconds;
+		pfc::string8 m_error;
+
+		job_t() : m_size(0), m_done(false), m_succeeded(false), m_seconds(0) {};
+	};
+
+	file_copier_t(checkpoint_base * p_checkpoint, abort_callback & p_abort)
+		: m_checkpoint(p_checkpoint), m_abort(p_abort), m_next(0), m_completed(0), m_queue_size(0), m_pending_bytes(0), m_copied_bytes(0), m_aborting(false)
+	{
+		m_event_queued.create(false, false);
+		m_event_done.create(false, false);
+		m_event_exit.create(true, false);
+	};
+	~file_copier_t() {stop();}
+
+	void start(t_size thread_count, t_size queue_size);
+	/** Stops the workers once their current copies are done. Copies not yet started are left undone. */
+	void stop();
+	/** Queues a copy and returns its index. */
+	t_size add(const char * src, const char * dst, t_filesize size);
+	/** Waits for every queued copy to finish. */
+	void finish();
+	/** Bytes queued but not yet copied, so free space checks can allow for them. */
+	t_filesize get_pending_bytes();
+	const job_t & get_job(t_size index) const {return *m_jobs[index];}
+	t_size get_job_count() const {return m_jobs.get_count();}
+	/** Bytes copied successfully, and the time since start() was called. */
+	void get_totals(t_filesize & p_bytes, double & p_seconds);
+private:
+	class worker_t : public mmh::Thread
+	{
+	public:
+		worker_t() : m_owner(NULL) {};
+		DWORD on_thread();
+		file_copier_t * m_owner;
+	};
+
+	bool get_next(pfc::rcptr_t<job_t> & p_job);
+	void copy(job_t & p_job);
+
+	checkpoint_base * m_checkpoint;
+	abort_callback & m_abort;
+
+	pfc::array_t<worker_t> m_threads;
+	pfc::list_t<pfc::rcptr_t<job_t> > m_jobs;
+	critical_section m_sync;
+	win32_event m_event_queued, m_event_done, m_event_exit;
+	t_size m_next, m_completed, m_queue_size;
+	t_filesize m_pending_bytes, m_copied_bytes;
+	bool m_aborting;
+	pfc::hires_timer m_timer;
+};
+
 class ipod_add_files
 {
 public:
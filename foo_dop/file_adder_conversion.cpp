@@ -321,7 +321,15 @@ DWORD conversion_thread_t::on_thread()
 	try
 	{
 		if (m_checkpoint) m_checkpoint->checkpoint();
-		g_convert_file_v2(m_source, m_temporary_destination, m_command, m_replaygain_processing_mode, m_replaygain_gain_mode, abort_callback_dummy());
+		pfc::string8 cache_key, cache_destination;
+		cache_destination << "file://" << m_temporary_destination;
+		bool b_cacheable = m_cache && m_cache->get_key(m_source, m_command, m_replaygain_processing_mode, m_replaygain_gain_mode, cache_key, abort_callback_dummy());
+		if (!b_cacheable || !m_cache->lookup(cache_key, cache_destination, abort_callback_dummy()))
+		{
+			g_convert_file_v2(m_source, m_temporary_destination, m_command, m_replaygain_processing_mode, m_replaygain_gain_mode, abort_callback_dummy());
+			if (b_cacheable)
+				m_cache->store(cache_key, cache_destination, abort_callback_dummy());
+		}
 		m_succeeded = true;
 		if (m_replaygain_api.is_valid())
 			g_replaygain_scan_file(m_temporary_destination, m_replaygain_api->instantiate(), m_replaygain_result, abort_callback_dummy());
@@ -426,6 +434,7 @@ void conversion_filemover_thread_t::initialise(ipod_device_ptr_cref_t p_ipod, t_
 		m_entries[i].m_destination = entries[i].m_destination;
 		m_entries[i].m_destination_handle = entries[i].m_destination_handle;
 		m_entries[i].m_info = entries[i].m_info;
+		m_entries[i].m_source_on_device = entries[i].m_source_on_device;
 	}
 	m_pending_request.create(false, false);
 	m_exit.create(false, false);
@@ -527,17 +536,27 @@ DWORD conversion_filemover_thread_t::on_thread()
 						t_filestats stats; bool blah;
 						filesystem::g_get_stats(newTemp, stats, blah, abort_callback_dummy());
 
-						if ((t_sfilesize)spaceinfo.m_freespace - (t_sfilesize)stats.m_size <= ((t_sfilesize)m_reserved_diskspace * (t_sfilesize)spaceinfo.m_capacity) / 1000)
-							throw pfc::exception(pfc::string8() << "Reserved disk space limit exceeded (" << "Capacity: " << spaceinfo.m_capacity << "; Free: " << spaceinfo.m_freespace << "; File To Copy: " << stats.m_size << "; Reserved 0.1%s: " << m_reserved_diskspace << ")");
-
-						g_copy_file(newTemp, m_entries[entry.index].m_destination, m_checkpoint, abort_callback_dummy());
+						//A file encoded on the device already takes its space from the free space
+						t_sfilesize size_to_copy = m_entries[entry.index].m_source_on_device ? 0 : (t_sfilesize)stats.m_size;
+						if ((t_sfilesize)spaceinfo.m_freespace - size_to_copy <= ((t_sfilesize)m_reserved_diskspace * (t_sfilesize)spaceinfo.m_capacity) / 1000)
+							throw pfc::exception(pfc::string8() << "Reserved disk space limit exceeded (" << "Capacity: " << spaceinfo.m_capacity << "; Free: " << spaceinfo.m_freespace << "; File To Copy: " << size_to_copy << "; Reserved 0.1%s: " << m_reserved_diskspace << ")");
 
-						try
+						if (m_entries[entry.index].m_source_on_device)
 						{
-							filesystem::g_remove(newTemp, abort_callback_dummy());
+							try { filesystem::g_remove(m_entries[entry.index].m_destination, abort_callback_dummy()); } catch (exception_io_not_found const &) {};
+							filesystem::g_move(newTemp, m_entries[entry.index].m_destination, abort_callback_dummy());
 						}
-						catch (pfc::exception &)
+						else
 						{
+							g_copy_file(newTemp, m_entries[entry.index].m_destination, m_checkpoint, abort_callback_dummy());
+
+							try
+							{
+								filesystem::g_remove(newTemp, abort_callback_dummy());
+							}
+							catch (pfc::exception &)
+							{
+							}
 						}
 						if (1)
 						{
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "ipod_manager.h"
+#include "file_adder_conversion_cache.h"
 
 class t_main_thread_tagger : public main_thread_callback
 {
@@ -130,7 +131,7 @@ private:
 class conversion_thread_t : public mmh::Thread
 {
 public:
-	conversion_thread_t() : m_replaygain_processing_mode(0), m_replaygain_gain_mode(0), m_checkpoint(NULL) {};
+	conversion_thread_t() : m_replaygain_processing_mode(0), m_replaygain_gain_mode(0), m_checkpoint(NULL), m_cache(NULL) {};
 
 	void set_command(const settings::conversion_preset_t & str)
 	{
@@ -142,6 +143,10 @@ public:
 		m_replaygain_gain_mode = gain_mode;
 		m_replaygain_api = api;
 	}
+	void set_cache(conversion_cache_t * p_cache)
+	{
+		m_cache = p_cache;
+	}
 	void initialise(t_size index, const metadb_handle_ptr & src, const char * dst, checkpoint_base * p_checkpoint)
 	{
 		m_source = src;
@@ -162,6 +167,7 @@ private:
 	t_uint8 m_replaygain_processing_mode, m_replaygain_gain_mode;
 	service_ptr_t<replaygain_scanner_entry> m_replaygain_api;
 	checkpoint_base * m_checkpoint;
+	conversion_cache_t * m_cache;
 };
 class conversion_filemover_entry_t
 {
@@ -170,6 +176,10 @@ public:
 	pfc::string8 m_destination;
 	metadb_handle_ptr m_destination_handle;
 	file_info_impl m_info;
+	/** The source is a temporary file next to the destination, so it is renamed rather than copied. */
+	bool m_source_on_device;
+
+	conversion_filemover_entry_t() : m_source_on_device(false) {};
 };
 class completion_notify_event : public completion_notify, public win32_event
 {
@@ -212,6 +222,13 @@ public:
 		replaygain_result::ptr trackgain;
 		replaygain_result::ptr albumgain;
 	};
+	/** Points an entry at a different temporary file. Only valid before the entry is requested. */
+	void set_index_source(t_size index, const char * p_source, bool b_source_on_device)
+	{
+		insync(m_sync);
+		m_entries[index].m_source = p_source;
+		m_entries[index].m_source_on_device = b_source_on_device;
+	}
 	void request(t_size index, replaygain_result::ptr trackgain, replaygain_result::ptr albumgain)
 	{
 		{
@@ -250,16 +267,21 @@ class conversion_manager_t
 	public:
 		metadb_handle_ptr m_source;
 		pfc::string8 m_temporary_destination;
+		/** Temporary file in the local folder, used if a file to be encoded on the device might not fit. */
+		pfc::string8 m_local_temporary_destination;
 		pfc::string8 m_destination;
 		metadb_handle_ptr m_destination_handle;
 		file_info_impl m_info;
 		bool m_succeeded;
 		bool m_early_fail;
 		bool m_succeeded_to_temp_file;
+		bool m_temporary_on_device;
+		/** Upper bound on the size of the encoded file, while it is being encoded on the device. */
+		t_sfilesize m_estimated_size;
 		pfc::string8 m_error;
 		replaygain_result::ptr m_replaygain_result;
 
-		entry_t() : m_succeeded(false), m_early_fail(false), m_succeeded_to_temp_file(false) {};
+		entry_t() : m_succeeded(false), m_early_fail(false), m_succeeded_to_temp_file(false), m_temporary_on_device(false), m_estimated_size(0) {};
 	};
 	bit_array_bittable m_mask_flush_items;//, m_mask_move_processed;
 	mmh::Permutation m_permutation, m_inverse_permutation;
@@ -273,7 +295,16 @@ public:
 	void flush_filemoves(conversion_filemover_thread_t & p_mover, const bit_array_var & mask_flush, const bit_array_var & mask_processed);
 	void run(ipod_device_ptr_cref_t p_ipod, const t_field_mappings & p_mappings, threaded_process_v2_t & p_status, t_size progress_start, t_size progress_range, abort_callback & p_abort);
 private:
+	void append_cache_details(pfc::array_t<threaded_process_v2_t::detail_entry> & p_details);
+	/**
+	 * Moves an entry's temporary file to the local folder if its estimated size, together with the
+	 * encodes already writing to the device, would exceed the reserved disk space. Called before
+	 * the entry is encoded.
+	 */
+	void check_device_space(t_size index, ipod_device_ptr_cref_t p_ipod, t_size reserved_diskspace, t_sfilesize & p_device_pending, conversion_filemover_thread_t & p_mover);
+
 	settings::conversion_preset_t m_command;
+	conversion_cache_t m_cache;
 	pfc::array_t<entry_t> m_entries;
 	pfc::array_t<conversion_thread_t> m_threads;
 	service_ptr_t<replaygain_scanner_entry> m_replaygain_api;
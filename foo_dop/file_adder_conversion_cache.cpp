@@ -0,0 +1,206 @@
+#include "stdafx.h"
+
+#include "file_adder.h"
+#include "file_adder_conversion.h"
+
+void conversion_cache_t::initialise(t_filesize max_size)
+{
+	insync(m_sync);
+	m_enabled = false;
+	m_entries.clear();
+	m_size = 0;
+	m_max_size = max_size;
+	m_hits = 0;
+	m_misses = 0;
+
+	if (!m_max_size)
+		return;
+
+	try
+	{
+		abort_callback_dummy p_abort;
+		m_folder.reset();
+		m_folder << core_api::get_profile_path() << "\\dop-conversion-cache";
+		try { filesystem::g_create_directory(m_folder, p_abort); } catch (exception_io_already_exists const &) {};
+
+		directory_callback_impl files(false);
+		filesystem::g_list_directory(m_folder, files, p_abort);
+		for (t_size i = 0, count = files.get_count(); i<count; i++)
+		{
+			pfc::string_filename_ext name(files[i]);
+			if (!stricmp_utf8(pfc::string_extension(name), "tmp"))
+			{
+				//Left behind by an interrupted store
+				try { filesystem::g_remove(files[i], p_abort); } catch (pfc::exception const &) {};
+				continue;
+			}
+			entry_t & entry = m_entries[name.get_ptr()];
+			entry.m_size = files.get_item_stats(i).m_size;
+			entry.m_last_used = files.get_item_stats(i).m_timestamp;
+			m_size += entry.m_size;
+		}
+		m_enabled = true;
+		trim();
+	}
+	catch (const pfc::exception & ex)
+	{
+		m_entries.clear();
+		m_size = 0;
+		console::formatter() << "iPod manager: Conversion cache disabled - " << ex.what();
+	}
+}
+
+bool conversion_cache_t::get_key(const metadb_handle_ptr & p_source, const settings::conversion_preset_t & p_preset, t_uint8 replaygain_processing_mode, t_uint8 replaygain_gain_mode, pfc::string8 & p_out, abort_callback & p_abort)
+{
+	if (!m_enabled)
+		return false;
+
+	static_api_ptr_t<hasher_md5> api;
+	hasher_md5_state state;
+	api->initialize(state);
+
+	try
+	{
+		file::ptr p_file;
+		filesystem::g_open_read(p_file, p_source->get_path(), p_abort);
+		pfc::array_t<t_uint8> buffer;
+		buffer.set_size(1024 * 1024);
+		t_size read;
+		while ((read = p_file->read(buffer.get_ptr(), buffer.get_size(), p_abort)))
+			api->process(state, buffer.get_ptr(), read);
+	}
+	catch (const pfc::exception &)
+	{
+		//Anything that cannot be read here is left to the encoder to report
+		return false;
+	}
+
+	pfc::string8 command, settings;
+	p_preset.get_command(command);
+	settings << "|" << p_source->get_subsong_index() << "|" << command << "|" << p_preset.m_file_extension
+		<< "|" << p_preset.get_max_bps() << "|" << (p_preset.m_encoder_requires_accurate_length ? 1 : 0)
+		<< "|" << (unsigned)replaygain_processing_mode << "|" << (unsigned)replaygain_gain_mode;
+	api->process_string(state, settings);
+
+	hasher_md5_result result = api->get_result(state);
+	p_out.reset();
+	for (t_size i = 0; i<tabsize(result.m_data); i++)
+		p_out << pfc::format_hex((t_uint8)result.m_data[i], 2);
+	p_out << "." << p_preset.m_file_extension;
+	return true;
+}
+
+bool conversion_cache_t::lookup(const char * p_key, const char * p_destination, abort_callback & p_abort)
+{
+	pfc::string8 path;
+	{
+		insync(m_sync);
+		auto iter = m_entries.find(p_key);
+		if (iter == m_entries.end())
+		{
+			m_misses++;
+			return false;
+		}
+		iter->second.m_last_used = filetimestamp_from_system_timer();
+		iter->second.m_readers++;
+		get_path(p_key, path);
+	}
+
+	bool b_copied = false;
+	try
+	{
+		g_copy_file(path, p_destination, NULL, p_abort);
+		b_copied = true;
+		//The file time is what orders the entries when the cache is next loaded
+		t_filetimestamp now = filetimestamp_from_system_timer();
+		g_set_filetimestamp(path, now);
+	}
+	catch (const pfc::exception &)
+	{
+	}
+
+	insync(m_sync);
+	auto iter = m_entries.find(p_key);
+	if (iter != m_entries.end())
+		iter->second.m_readers--;
+	if (b_copied)
+		m_hits++;
+	else
+	{
+		m_misses++;
+		//An aborted copy says nothing about the cached file
+		if (iter != m_entries.end() && !iter->second.m_readers && !p_abort.is_aborting())
+			remove(iter);
+	}
+	//Entries skipped while they were being read
+	trim();
+	return b_copied;
+}
+
+void conversion_cache_t::store(const char * p_key, const char * p_source, abort_callback & p_abort)
+{
+	pfc::string8 path, temp_path;
+	get_path(p_key, path);
+	temp_path << path << "." << pfc::format_hex(GetCurrentThreadId(), 8) << ".tmp";
+
+	try
+	{
+		g_copy_file(p_source, temp_path, NULL, p_abort);
+		t_filestats stats;
+		bool b_is_writeable;
+		filesystem::g_get_stats(temp_path, stats, b_is_writeable, p_abort);
+
+		insync(m_sync);
+		if (m_entries.find(p_key) == m_entries.end())
+		{
+			filesystem::g_move(temp_path, path, p_abort);
+			entry_t & entry = m_entries[p_key];
+			entry.m_size = stats.m_size;
+			entry.m_last_used = filetimestamp_from_system_timer();
+			m_size += entry.m_size;
+			trim();
+		}
+		else
+			filesystem::g_remove(temp_path, p_abort);
+	}
+	catch (const pfc::exception & ex)
+	{
+		try { filesystem::g_remove(temp_path, abort_callback_dummy()); } catch (pfc::exception const &) {};
+		console::formatter() << "iPod manager: Failed to add file to conversion cache - " << ex.what();
+	}
+}
+
+bool conversion_cache_t::remove(std::unordered_map<std::string, entry_t>::iterator iter)
+{
+	pfc::string8 path;
+	get_path(iter->first.c_str(), path);
+	try
+	{
+		filesystem::g_remove(path, abort_callback_dummy());
+	}
+	catch (exception_io_not_found const &) {}
+	catch (pfc::exception const &)
+	{
+		//Still on disk, so it still counts towards the limit and is retried by the next trim
+		return false;
+	}
+	m_size -= iter->second.m_size;
+	m_entries.erase(iter);
+	return true;
+}
+
+void conversion_cache_t::trim()
+{
+	if (m_size <= m_max_size)
+		return;
+
+	std::vector< std::pair<t_filetimestamp, std::string> > entries_by_age;
+	entries_by_age.reserve(m_entries.size());
+	for (auto & entry : m_entries)
+		if (!entry.second.m_readers)
+			entries_by_age.emplace_back(entry.second.m_last_used, entry.first);
+	std::sort(entries_by_age.begin(), entries_by_age.end());
+
+	for (t_size i = 0, count = entries_by_age.size(); i<count && m_size > m_max_size; i++)
+		remove(m_entries.find(entries_by_age[i].second));
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+/**
+ * On-disk cache of encoder output in the profile folder, shared between devices and syncs.
+ * Entries are keyed by a hash of the source file contents together with everything else that
+ * affects the encoded file, and the least recently used entries are removed once the cache
+ * grows over its size limit.
+ */
+class conversion_cache_t
+{
+public:
+	conversion_cache_t() : m_enabled(false), m_size(0), m_max_size(0), m_hits(0), m_misses(0) {};
+
+	/** Loads the list of cached files. A limit of zero disables the cache. */
+	void initialise(t_filesize max_size);
+	bool is_enabled() const { return m_enabled; }
+
+	/** Reads the whole source file. Returns false if the source cannot be cached. */
+	bool get_key(const metadb_handle_ptr & p_source, const settings::conversion_preset_t & p_preset, t_uint8 replaygain_processing_mode, t_uint8 replaygain_gain_mode, pfc::string8 & p_out, abort_callback & p_abort);
+	/** Copies the cached file to p_destination. Returns false on a miss. */
+	bool lookup(const char * p_key, const char * p_destination, abort_callback & p_abort);
+	/** Adds a copy of an encoded file. Failures are ignored, the cache is only an optimisation. */
+	void store(const char * p_key, const char * p_source, abort_callback & p_abort);
+
+	void get_counts(t_size & p_hits, t_size & p_misses)
+	{
+		insync(m_sync);
+		p_hits = m_hits;
+		p_misses = m_misses;
+	}
+private:
+	class entry_t
+	{
+	public:
+		t_filesize m_size;
+		t_filetimestamp m_last_used;
+		/** Number of lookups copying the file, which is not removed until they finish. */
+		t_size m_readers;
+
+		entry_t() : m_size(0), m_last_used(filetimestamp_invalid), m_readers(0) {};
+	};
+	void get_path(const char * p_key, pfc::string8 & p_out) const
+	{
+		p_out.reset();
+		p_out << m_folder << "\\" << p_key;
+	}
+	/**
+	 * Deletes the file of an entry and then the entry. Returns false, keeping the entry and its size,
+	 * if the file could not be deleted. Caller holds m_sync.
+	 */
+	bool remove(std::unordered_map<std::string, entry_t>::iterator iter);
+	/** Removes least recently used entries not being read until the cache is within its limit. Caller holds m_sync. */
+	void trim();
+
+	critical_section m_sync;
+	bool m_enabled;
+	pfc::string8 m_folder;
+	std::unordered_map<std::string, entry_t> m_entries;
+	t_filesize m_size, m_max_size;
+	t_size m_hits, m_misses;
+};
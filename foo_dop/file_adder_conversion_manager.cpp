@@ -2,12 +2,24 @@
 
 #include "file_adder_conversion.h"
 
+/** Adds a trailing separator to a temporary files folder, and checks it exists. */
+static void g_check_temporary_folder(pfc::string8 & p_folder)
+{
+	char last_char = p_folder.is_empty() ? 0 : p_folder[p_folder.get_length() - 1];
+	if (last_char != '\\' && last_char != '/')
+		p_folder.add_byte('\\');
+	DWORD attribs = uGetFileAttributes(p_folder);
+	if (attribs == INVALID_FILE_ATTRIBUTES || !(attribs & FILE_ATTRIBUTE_DIRECTORY))
+		throw pfc::exception("Invalid conversion temporary files folder");
+}
+
 void conversion_manager_t::initialise(const pfc::array_t<conversion_entry_t>& entries, const t_field_mappings & p_mappings, t_size thread_count)
 {
 	t_uint8 replaygain_processing_mode = p_mappings.replaygain_processing_mode;
 	t_size i, count = entries.get_count();
 
 	m_command = p_mappings.m_conversion_encoder;
+	m_cache.initialise((t_filesize)p_mappings.conversion_cache_size * 1024 * 1024);
 	m_threads.set_count(thread_count);
 	m_entries.set_count(count);
 
@@ -55,24 +67,46 @@ void conversion_manager_t::initialise(const pfc::array_t<conversion_entry_t>& en
 		};
 	}
 
+	pfc::string8 localFolder = p_mappings.conversion_temp_files_folder, localFolderError;
+	try
+	{
+		if (!localFolder.length() && !uGetTempPath(localFolder))
+			throw pfc::exception("uGetTempPath failed");
+		g_check_temporary_folder(localFolder);
+	}
+	catch (pfc::exception & ex)
+	{
+		localFolderError = ex.what();
+	}
+
 	for (i = 0; i<count; i++)
 	{
 		try
 		{
-			pfc::string8 tempFolder = p_mappings.conversion_temp_files_folder, tempFile;
-			if (!tempFolder.length() && !uGetTempPath(tempFolder))
-				throw pfc::exception("uGetTempPath failed");
-			char last_char = tempFolder.is_empty() ? 0 : tempFolder[tempFolder.get_length() - 1];
-			if (last_char != '\\' && last_char != '/')
-				tempFolder.add_byte('\\');
-			DWORD attribs = uGetFileAttributes(tempFolder);
-			if (attribs == INVALID_FILE_ATTRIBUTES || !(attribs & FILE_ATTRIBUTE_DIRECTORY))
-				throw pfc::exception("Invalid conversion temporary files folder");
-			tempFile << tempFolder << "dop" << pfc::format_hex(i + 1, 8) << ".dop.tmp." << pfc::string_extension(entries[i].m_destination);
+			pfc::string8 tempName, tempFile, localTempFile;
+			tempName << "dop" << pfc::format_hex(i + 1, 8) << ".dop.tmp." << pfc::string_extension(entries[i].m_destination);
+			if (localFolderError.is_empty())
+				localTempFile << localFolder << tempName;
+			//Encoding next to the destination leaves only a rename once the file is tagged
+			bool b_on_device = p_mappings.conversion_encode_to_device && !stricmp_utf8_max(entries[i].m_destination, "file://", 7);
+			if (b_on_device)
+			{
+				pfc::string8 destination;
+				filesystem::g_get_display_path(entries[i].m_destination, destination);
+				pfc::string8 tempFolder = pfc::string_directory(destination);
+				g_check_temporary_folder(tempFolder);
+				tempFile << tempFolder << tempName;
+			}
+			else if (!localFolderError.is_empty())
+				throw pfc::exception(localFolderError);
+			else
+				tempFile = localTempFile;
 			//if (!uGetTempFileName(tempFolder, "dop", i+1, tempFile))
 			//	throw pfc::exception("uGetTempFileName failed");
 			//tempFile << ".dop." << pfc::string_extension(entries[i].m_destination);
 			m_entries[i].m_temporary_destination = tempFile;
+			m_entries[i].m_local_temporary_destination = localTempFile;
+			m_entries[i].m_temporary_on_device = b_on_device;
 			m_entries[i].m_source = entries[i].m_source;
 			m_entries[i].m_destination = entries[i].m_destination;
 			m_entries[i].m_destination_handle = entries[i].m_destination_handle;
@@ -90,7 +124,11 @@ void conversion_manager_t::initialise(const pfc::array_t<conversion_entry_t>& en
 		try
 		{
 			if (!m_entries[i].m_early_fail)
+			{
+				if (m_entries[i].m_temporary_on_device && !m_entries[i].m_local_temporary_destination.is_empty())
+					try { filesystem::g_remove(m_entries[i].m_local_temporary_destination, abort_callback_impl()); } catch (const exception_io_not_found &) {};
 				filesystem::g_remove(m_entries[i].m_temporary_destination, abort_callback_impl());
+			}
 		}
 		catch (const exception_io_not_found &)
 		{
@@ -107,9 +145,57 @@ void conversion_manager_t::initialise(const pfc::array_t<conversion_entry_t>& en
 	{
 		m_threads[i].set_command(m_command);
 		m_threads[i].set_replaygain_data(replaygain_processing_mode, (t_uint8)p_mappings.soundcheck_rgmode, m_replaygain_api);
+		m_threads[i].set_cache(m_cache.is_enabled() ? &m_cache : NULL);
+	}
+}
+
+void conversion_manager_t::append_cache_details(pfc::array_t<threaded_process_v2_t::detail_entry> & p_details)
+{
+	if (m_cache.is_enabled())
+	{
+		t_size hits, misses;
+		m_cache.get_counts(hits, misses);
+		p_details.append_single(threaded_process_v2_t::detail_entry("Conversion cache:", pfc::string8() << hits << " hit" << (hits == 1 ? "" : "s") << ", " << misses << " miss" << (misses == 1 ? "" : "es")));
 	}
 }
 
+void conversion_manager_t::check_device_space(t_size index, ipod_device_ptr_cref_t p_ipod, t_size reserved_diskspace, t_sfilesize & p_device_pending, conversion_filemover_thread_t & p_mover)
+{
+	entry_t & entry = m_entries[index];
+	if (!entry.m_temporary_on_device)
+		return;
+
+	//The decoded audio at the encoder's bit depth bounds the size of the encoded file
+	t_filesize size = entry.m_source->get_filesize();
+	entry.m_estimated_size = size == filesize_invalid ? 0 : (t_sfilesize)size;
+	file_info_impl info;
+	if (entry.m_source->get_info_async(info))
+	{
+		double length = info.get_length();
+		t_int64 samplerate = info.info_get_int("samplerate"), channels = info.info_get_int("channels");
+		t_int64 bps = m_command.get_max_bps(), source_bps = info.info_get_int("bitspersample");
+		if (source_bps > 0 && source_bps < bps)
+			bps = source_bps;
+		if (length > 0 && samplerate > 0 && channels > 0)
+			entry.m_estimated_size = (t_sfilesize)(length * samplerate) * channels * bps / 8;
+	}
+
+	drive_space_info_t spaceinfo;
+	p_ipod->get_capacity_information(spaceinfo);
+	if ((t_sfilesize)spaceinfo.m_freespace - p_device_pending - entry.m_estimated_size > ((t_sfilesize)reserved_diskspace * (t_sfilesize)spaceinfo.m_capacity) / 1000)
+	{
+		p_device_pending += entry.m_estimated_size;
+		return;
+	}
+
+	//Encode locally instead; the mover's reserved space check then applies to the copy as usual
+	if (entry.m_local_temporary_destination.is_empty())
+		return;
+	entry.m_temporary_destination = entry.m_local_temporary_destination;
+	entry.m_temporary_on_device = false;
+	p_mover.set_index_source(index, pfc::string8() << "file://" << entry.m_temporary_destination, false);
+}
+
 void conversion_manager_t::flush_filemoves(conversion_filemover_thread_t & p_mover, const bit_array_var & mask_flush, const bit_array_var & mask_processed)
 {
 	bool b_need_move = false;
@@ -171,6 +257,7 @@ void conversion_manager_t::run(ipod_device_ptr_cref_t p_ipod, const t_field_mapp
 			moverentries[i].m_destination = m_entries[i].m_destination;
 			moverentries[i].m_destination_handle = m_entries[i].m_destination_handle;
 			moverentries[i].m_info = m_entries[i].m_info;
+			moverentries[i].m_source_on_device = m_entries[i].m_temporary_on_device;
 		}
 		p_mover.initialise(p_ipod, p_mappings.reserved_diskspace, moverentries, &p_status);
 	}
@@ -178,12 +265,15 @@ void conversion_manager_t::run(ipod_device_ptr_cref_t p_ipod, const t_field_mapp
 	p_mover.create_thread();
 
 	pfc::array_staticsize_t<pfc::string8> progress_filenames(threadcount);
+	//Estimated sizes of the files currently being encoded onto the device
+	t_sfilesize device_pending = 0;
 
 	while (thread_index < threadcount)
 	{
 		//thread_index = index%threadcount;
 		if (!m_entries[index].m_early_fail)
 		{
+			check_device_space(m_permutation[index], p_ipod, p_mappings.reserved_diskspace, device_pending, p_mover);
 			m_threads[thread_index].initialise(m_permutation[index], m_entries[m_permutation[index]].m_source, m_entries[m_permutation[index]].m_temporary_destination, &p_status);
 			m_threads[thread_index].create_thread();
 			progress_filenames[thread_index] = track_formatter.run(m_entries[m_permutation[index]].m_source);
@@ -207,6 +297,7 @@ void conversion_manager_t::run(ipod_device_ptr_cref_t p_ipod, const t_field_mapp
 					progress_details.append_single(threaded_process_v2_t::detail_entry("Item:", progress_filenames[pfindex]));
 			}
 			progress_details.append_single(threaded_process_v2_t::detail_entry("Remaining:", pfc::string8() << count - index));
+			append_cache_details(progress_details);
 
 			p_status.update_text_and_details(pfc::string8() << "Copying " << text_count << " file" << (text_count.is_plural() ? "s" : "") << " - encoding", progress_details);
 		}
@@ -231,6 +322,8 @@ void conversion_manager_t::run(ipod_device_ptr_cref_t p_ipod, const t_field_mapp
 			m_entries[m_threads[thread_index].m_index].m_succeeded_to_temp_file = m_threads[thread_index].m_succeeded;
 			m_entries[m_threads[thread_index].m_index].m_error = m_threads[thread_index].m_error;
 			m_entries[m_threads[thread_index].m_index].m_replaygain_result = m_threads[thread_index].m_replaygain_result;
+			if (m_entries[m_threads[thread_index].m_index].m_temporary_on_device)
+				device_pending -= m_entries[m_threads[thread_index].m_index].m_estimated_size;
 			mask_processed.set(m_threads[thread_index].m_index, true);
 			progress_filenames[thread_index].reset();
 			//console::formatter() << "flushing: " << m_threads[thread_index].m_index;
@@ -242,6 +335,7 @@ void conversion_manager_t::run(ipod_device_ptr_cref_t p_ipod, const t_field_mapp
 			}
 			if (index < count)
 			{
+				check_device_space(m_permutation[index], p_ipod, p_mappings.reserved_diskspace, device_pending, p_mover);
 				m_threads[thread_index].initialise(m_permutation[index], m_entries[m_permutation[index]].m_source, m_entries[m_permutation[index]].m_temporary_destination, &p_status);
 				progress_filenames[thread_index] = track_formatter.run(m_entries[m_permutation[index]].m_source);
 				index++;
@@ -260,6 +354,7 @@ void conversion_manager_t::run(ipod_device_ptr_cref_t p_ipod, const t_field_mapp
 						progress_details.append_single(threaded_process_v2_t::detail_entry("Item:", progress_filenames[pfindex]));
 				}
 				progress_details.append_single(threaded_process_v2_t::detail_entry("Remaining:", pfc::string8() << count - progress_index - min(threadcount, count - progress_index)));
+				append_cache_details(progress_details);
 				p_status.update_text_and_details(pfc::string8() << "Copying " << text_count << " file" << (text_count.is_plural() ? "s" : "") << " - encoding", progress_details);
 				p_status.update_progress_subpart_helper(progress_start + index, progress_range);
 			}
@@ -283,6 +378,7 @@ void conversion_manager_t::run(ipod_device_ptr_cref_t p_ipod, const t_field_mapp
 								progress_details.append_single(threaded_process_v2_t::detail_entry("Item:", progress_filenames[pfindex]));
 						}
 						progress_details.append_single(threaded_process_v2_t::detail_entry("Remaining:", pfc::string8() << count - progress_index - min(threadcount, count - progress_index)));
+						append_cache_details(progress_details);
 
 						mmh::UIntegerNaturalFormatter text_remaining(count - progress_index), text_count(progress_range / 3);
 						p_status.update_text_and_details(pfc::string8() << "Copying " << text_count << " file" << (text_count.is_plural() ? "s" : "") << " - encoding", progress_details);
@@ -291,6 +387,8 @@ void conversion_manager_t::run(ipod_device_ptr_cref_t p_ipod, const t_field_mapp
 				m_entries[m_threads[thread_index].m_index].m_succeeded_to_temp_file = m_threads[thread_index].m_succeeded;
 				m_entries[m_threads[thread_index].m_index].m_error = m_threads[thread_index].m_error;
 				m_entries[m_threads[thread_index].m_index].m_replaygain_result = m_threads[thread_index].m_replaygain_result;
+				if (m_entries[m_threads[thread_index].m_index].m_temporary_on_device)
+					device_pending -= m_entries[m_threads[thread_index].m_index].m_estimated_size;
 				mask_processed.set(m_threads[thread_index].m_index, true);
 				//console::formatter() << "flushing: " << m_threads[thread_index].m_index;
 				//if (m_threads[thread_index].m_succeeded)
@@ -304,6 +402,7 @@ void conversion_manager_t::run(ipod_device_ptr_cref_t p_ipod, const t_field_mapp
 	p_mover.exit();
 	p_mover.wait_for_and_release_thread();
 
+	//Every conversion thread has been joined above, including those still running when aborting
 	for (i = 0; i<count; i++)
 	{
 		if (m_entries[i].m_succeeded_to_temp_file)
@@ -311,6 +410,12 @@ void conversion_manager_t::run(ipod_device_ptr_cref_t p_ipod, const t_field_mapp
 			m_entries[i].m_succeeded = p_mover.get_index_succeeded(i);
 			m_entries[i].m_error = p_mover.get_index_error(i);
 		}
+		//Failed or partial encodes, and files never handed to the mover, would otherwise be left in the device's music folders
+		if (!m_entries[i].m_succeeded && m_entries[i].m_temporary_on_device)
+		{
+			try { filesystem::g_remove(pfc::string8() << "file://" << m_entries[i].m_temporary_destination, abort_callback_dummy()); }
+			catch (pfc::exception const &) {};
+		}
 		//console::formatter() << i << " " << m_entries[i].m_succeeded_to_temp_file << " " << m_entries[i].m_succeeded;
 	}
 	/*for (i=0; i<count; i++)
@@ -1,5 +1,6 @@
 #include "stdafx.h"
 
+#include "file_adder.h"
 #include "mobile_device_v2.h"
 #include "writer.h"
 
@@ -65,22 +66,78 @@ t_uint32 g_get_directory_child_count(const char * path, abort_callback & p_abort
 	return callback.m_count;
 }
 
+class copy_file_progress_data_t
+{
+public:
+	checkpoint_base * m_checkpoint;
+	abort_callback & m_abort;
+	std::exception_ptr m_error;
+
+	copy_file_progress_data_t(checkpoint_base * p_checkpoint, abort_callback & p_abort) : m_checkpoint(p_checkpoint), m_abort(p_abort) {};
+};
+
+static DWORD CALLBACK g_copy_file_progress(LARGE_INTEGER, LARGE_INTEGER, LARGE_INTEGER, LARGE_INTEGER, DWORD, DWORD, HANDLE, HANDLE, LPVOID p_data)
+{
+	copy_file_progress_data_t * data = static_cast<copy_file_progress_data_t *>(p_data);
+	try
+	{
+		//Blocks here while the sync is paused
+		if (data->m_checkpoint)
+			data->m_checkpoint->checkpoint();
+	}
+	catch (...)
+	{
+		//Exceptions must not pass through CopyFileEx, so this is rethrown once it returns
+		data->m_error = std::current_exception();
+		return PROGRESS_CANCEL;
+	}
+	return data->m_abort.is_aborting() ? PROGRESS_CANCEL : PROGRESS_CONTINUE;
+}
+
 void g_copy_file(const char * src, const char * dst, checkpoint_base * p_checkpoint, abort_callback & p_abort)
 {
 	service_ptr_t<file> r_src, r_dst;
 	t_filesize size;
 
+	//Between local files the system copies without the data passing through here
+	if (!stricmp_utf8_max(src, "file://", 7) && !stricmp_utf8_max(dst, "file://", 7))
+	{
+		pfc::string8 dsrc, ddst;
+		filesystem::g_get_display_path(src, dsrc);
+		filesystem::g_get_display_path(dst, ddst);
+		pfc::stringcvt::string_os_from_utf8 wdst(ddst);
+		copy_file_progress_data_t data(p_checkpoint, p_abort);
+		if (!CopyFileEx(pfc::stringcvt::string_os_from_utf8(dsrc), wdst, &g_copy_file_progress, &data, NULL, 0))
+		{
+			DWORD err = GetLastError();
+			DeleteFile(wdst);
+			if (data.m_error)
+				std::rethrow_exception(data.m_error);
+			p_abort.check();
+			throw exception_win32(err);
+		}
+		//CopyFileEx copies the source attributes, and a read-only copy could not be retagged or removed later
+		SetFileAttributes(wdst, FILE_ATTRIBUTE_NORMAL);
+		return;
+	}
+
 	filesystem::g_open(r_src, src, filesystem::open_mode_read, p_abort);
 	size = r_src->get_size_ex(p_abort);
 	filesystem::g_open(r_dst, dst, filesystem::open_mode_write_new, p_abort);
 
 	file_mobile_device::ptr r_dstm;
-	if (p_checkpoint && r_dst->service_query_t(r_dstm))
-		r_dstm->set_checkpoint(p_checkpoint);
+	if (r_dst->service_query_t(r_dstm))
+	{
+		if (p_checkpoint)
+			r_dstm->set_checkpoint(p_checkpoint);
+		r_dstm->enable_write_pipeline();
+	}
 
 	if (size > 0) {
 		try {
 			file::g_transfer_object(r_src, r_dst, size, p_abort);
+			if (r_dstm.is_valid())
+				r_dstm->flush_writes(p_abort);
 		}
 		catch (...) {
 			r_dst.release();
@@ -91,6 +148,144 @@ void g_copy_file(const char * src, const char * dst, checkpoint_base * p_checkpo
 	}
 }
 
+void file_copier_t::start(t_size thread_count, t_size queue_size)
+{
+	if (thread_count < 1) thread_count = 1;
+	m_queue_size = max(queue_size, thread_count);
+	m_timer.start();
+	m_threads.set_size(thread_count);
+	for (t_size i=0; i<thread_count; i++)
+	{
+		m_threads[i].m_owner = this;
+		m_threads[i].create_thread();
+	}
+}
+
+void file_copier_t::stop()
+{
+	{
+		insync(m_sync);
+		m_aborting = true;
+	}
+	m_event_exit.set_state(true);
+	for (t_size i=0, count = m_threads.get_size(); i<count; i++)
+		m_threads[i].wait_for_and_release_thread();
+	m_threads.set_size(0);
+}
+
+t_size file_copier_t::add(const char * src, const char * dst, t_filesize size)
+{
+	while (true)
+	{
+		{
+			insync(m_sync);
+			if (m_jobs.get_count() - m_completed < m_queue_size)
+			{
+				pfc::rcptr_t<job_t> job = pfc::rcnew_t<job_t>();
+				job->m_source = src;
+				job->m_destination = dst;
+				job->m_size = size;
+				m_pending_bytes += size;
+				t_size index = m_jobs.add_item(job);
+				m_event_queued.set_state(true);
+				return index;
+			}
+		}
+		m_abort.check();
+		m_event_done.wait_for(1);
+	}
+}
+
+void file_copier_t::finish()
+{
+	while (true)
+	{
+		{
+			insync(m_sync);
+			if (m_completed == m_jobs.get_count())
+				return;
+		}
+		m_abort.check();
+		m_event_done.wait_for(1);
+	}
+}
+
+t_filesize file_copier_t::get_pending_bytes()
+{
+	insync(m_sync);
+	return m_pending_bytes;
+}
+
+void file_copier_t::get_totals(t_filesize & p_bytes, double & p_seconds)
+{
+	insync(m_sync);
+	p_bytes = m_copied_bytes;
+	p_seconds = m_timer.query();
+}
+
+bool file_copier_t::get_next(pfc::rcptr_t<job_t> & p_job)
+{
+	HANDLE events[2] = { m_event_queued.get(), m_event_exit.get() };
+	while (true)
+	{
+		{
+			insync(m_sync);
+			if (m_aborting)
+				return false;
+			if (m_next < m_jobs.get_count())
+			{
+				p_job = m_jobs[m_next++];
+				//Pass the wake-up on, in case more than one copy was queued
+				if (m_next < m_jobs.get_count())
+					m_event_queued.set_state(true);
+				return true;
+			}
+		}
+		if (WaitForMultipleObjectsEx(tabsize(events), events, FALSE, pfc_infinite, FALSE) == WAIT_OBJECT_0 + 1)
+			return false;
+	}
+}
+
+void file_copier_t::copy(job_t & p_job)
+{
+	pfc::hires_timer timer;
+	timer.start();
+	try
+	{
+		m_abort.check();
+		g_copy_file(p_job.m_source, p_job.m_destination, m_checkpoint, m_abort);
+		p_job.m_succeeded = true;
+	}
+	catch (const pfc::exception & ex)
+	{
+		p_job.m_error = ex.what();
+	}
+	p_job.m_seconds = timer.query();
+#ifdef LOG_FILE_COPY
+	console::formatter() << "File copied. Path: " << p_job.m_destination << ", Bytes: " << p_job.m_size << ", Time: " << pfc::format_float(p_job.m_seconds)
+		<< ", Bytes/s: " << pfc::format_float(p_job.m_seconds > 0 ? p_job.m_size / p_job.m_seconds : 0, 0, 0);
+#endif
+}
+
+DWORD file_copier_t::worker_t::on_thread()
+{
+	pfc::rcptr_t<job_t> job;
+	while (m_owner->get_next(job))
+	{
+		m_owner->copy(*job);
+		{
+			insync(m_owner->m_sync);
+			job->m_done = true;
+			m_owner->m_completed++;
+			m_owner->m_pending_bytes -= job->m_size;
+			if (job->m_succeeded)
+				m_owner->m_copied_bytes += job->m_size;
+		}
+		m_owner->m_event_done.set_state(true);
+	}
+	return 0;
+}
+
 void g_load_info(HWND wnd, const pfc::list_base_const_t<metadb_handle_ptr> & p_list, threaded_process_v2_t & p_status)
 {
 	//p_status.update_progress_subpart_helper(0,1);
@@ -3,183 +3,156 @@
 #include "file_remover.h"
 #include "ipod_manager.h"
 
-void ipod_file_remover::run (ipod_device_ptr_ref_t p_ipod, const pfc::list_base_const_t<metadb_handle_ptr> & items, ipod::tasks::load_database_t & p_library, threaded_process_v2_t & p_status, abort_callback & p_abort)
+void ipod_file_remover::remove_files (ipod_device_ptr_ref_t p_ipod, pfc::array_t<removal_t> & p_removals, ipod::tasks::load_database_t & p_library, threaded_process_v2_t & p_status, abort_callback & p_abort)
 {
-	////p_status.update_progress_subpart_helper(0);
-	//p_status.force_update();
-	
-	t_size i, count = items.get_count();
+	//Deletes are mostly waiting on the device, so a few are kept in flight regardless of the core count
+	enum {thread_count = 4};
+
+	pfc::string8 speakableTracks;
+	p_ipod->get_database_path(speakableTracks);
+	speakableTracks << p_ipod->get_path_separator_ptr() << "Speakable" << p_ipod->get_path_separator_ptr() << "Tracks" << p_ipod->get_path_separator_ptr();
+
+	t_size i, count = p_removals.get_size(), count_remaining = 0;
+	for (i=0; i<count; i++)
+		if (p_removals[i].m_index != pfc_infinite) ++count_remaining;
 
 	pfc::array_staticsize_t<threaded_process_v2_t::detail_entry> progress_details(2);
 	string_format_metadb_handle_for_progress track_formatter;
 	progress_details[0].m_label = "Item:";
 	progress_details[1].m_label = "Remaining:";
 	progress_details[0].m_value = "Processing...";
-	progress_details[1].m_value = pfc::string8() << count;
+	progress_details[1].m_value = pfc::string8() << count_remaining;
 	p_status.update_text_and_details("Removing files", progress_details);
 
-	{
+	critical_section sync;
+	t_size count_processed = 0;
 
-		t_size j, count_playlists = p_library.m_playlists.get_size();
-		for (i=0; i<count; i++)
+	auto remove_file = [&] (t_size index)
+	{
+		removal_t & removal = p_removals[index];
+		if (removal.m_index != pfc_infinite && !p_abort.is_aborting())
 		{
-			progress_details[0].m_value = track_formatter.run(items[i]);
-			progress_details[1].m_value = pfc::string8() << count-i-1;
-			p_status.update_detail_entries(progress_details);
+			const itunesdb::t_track & track = *p_library.m_tracks[removal.m_index];
 			try
 			{
-				metadb_handle_ptr ptr;
-				pfc::string8 can, speakableTracks;
-				p_ipod->get_root_path(can);
-				p_ipod->get_database_path(speakableTracks);
-				speakableTracks << p_ipod->get_path_separator_ptr() << "Speakable" << p_ipod->get_path_separator_ptr() << "Tracks" << p_ipod->get_path_separator_ptr();
-				if (!stricmp_utf8_max(items[i]->get_path(), can, can.length()))
+				try
 				{
-					t_size index;
-					index = p_library.m_handles.find_item(items[i]);
-					if (index != pfc_infinite)
+					if (p_ipod->m_device_properties.m_Speakable)
 					{
-						if (p_library.m_tracks[index]->dshm_type_6)
-							throw pfc::exception("Cannot remove tracks downloaded on-device. Please use the device to remove these.");
-						try 
-						{
-							if (p_ipod->m_device_properties.m_Speakable)
-							{
-								filesystem::g_remove(pfc::string8() << speakableTracks << pfc::format_hex(p_library.m_tracks[index]->pid, 16) << ".wav", abort_callback_dummy());
-							}
-						}
-						catch (exception_io_not_found const &) {};
-						try 
-						{
-							filesystem::g_remove(items[i]->get_path(), abort_callback_dummy());
-						}
-						catch (exception_io_not_found)
-						{
-							for (j=0; j<count_playlists; j++)
-								p_library.m_playlists[j]->remove_track_by_id(p_library.m_tracks[index]->id);
-							p_library.m_library_playlist->remove_track_by_id(p_library.m_tracks[index]->id);
-							p_library.remove_artwork(p_ipod, p_library.m_tracks[index]);
-							p_library.m_tracks.remove_by_idx(index);
-							p_library.m_handles.remove_by_idx(index);
-							m_deleted_items.add_item(items[i]->get_path());
-							throw;
-						}
-						for (j=0; j<count_playlists; j++)
-							p_library.m_playlists[j]->remove_track_by_id(p_library.m_tracks[index]->id);
-						p_library.m_library_playlist->remove_track_by_id(p_library.m_tracks[index]->id);
-						p_library.remove_artwork(p_ipod, p_library.m_tracks[index]);
-						p_library.m_tracks.remove_by_idx(index);
-						p_library.m_handles.remove_by_idx(index);
-						m_deleted_items.add_item(items[i]->get_path());
+						filesystem::g_remove(pfc::string8() << speakableTracks << pfc::format_hex(track.pid, 16) << ".wav", abort_callback_dummy());
 					}
-					else throw pfc::exception("Failed to find file in database");
 				}
-				else throw pfc::exception("File is not located on iPod");
+				catch (exception_io_not_found const &) {};
+				try
+				{
+					filesystem::g_remove(removal.m_handle->get_path(), abort_callback_dummy());
+				}
+				catch (exception_io_not_found const &)
+				{
+					removal.m_remove_track = true;
+					throw;
+				}
+				removal.m_remove_track = true;
 			}
-			catch (exception_aborted &) {throw;}
 			catch (const pfc::exception & ex)
 			{
-				m_errors.add_item(results_viewer::result_t(items[i], metadb_handle_ptr(), pfc::string8() << "Failed to remove file: " << ex.what()));
-				//pfc::string8_fast_aggressive err; err << "Failed to remove file : " <<  items[i]->get_path() << "; Reason: " <<ex.what();
-				//m_error_list.add_item(err);
-				//console::print(err);
+				removal.m_error = ex.what();
 			}
 
-			p_status.checkpoint();
+			insync(sync);
+			++count_processed;
+			progress_details[0].m_value = track_formatter.run(removal.m_handle);
+			progress_details[1].m_value = pfc::string8() << count_remaining - count_processed;
+			p_status.update_detail_entries(progress_details);
+		}
+		p_status.update_progress_subpart_helper(index, count);
+	};
+	parallel_for_t<decltype(remove_file)>(count, remove_file, 1).run(thread_count);
+
+	//Results are reported in the order the tracks were given
+	pfc::array_t<bool> mask;
+	mask.set_size(p_library.m_tracks.get_count());
+	mask.fill_null();
+	for (i=0; i<count; i++)
+	{
+		removal_t & removal = p_removals[i];
+		if (removal.m_remove_track)
+		{
+			mask[removal.m_index] = true;
+			m_deleted_items.add_item(removal.m_handle->get_path());
+		}
+		if (!removal.m_error.is_empty())
+			m_errors.add_item(results_viewer::result_t(removal.m_handle, metadb_handle_ptr(), pfc::string8() << "Failed to remove file: " << removal.m_error));
+	}
+
+	p_library.remove_tracks(p_ipod, mask.get_ptr());
+	p_status.checkpoint();
+	p_library.repopulate_albumlist();
+}
+
+void ipod_file_remover::run (ipod_device_ptr_ref_t p_ipod, const pfc::list_base_const_t<metadb_handle_ptr> & items, ipod::tasks::load_database_t & p_library, threaded_process_v2_t & p_status, abort_callback & p_abort)
+{
+	t_size i, count = items.get_count(), count_library = p_library.m_handles.get_count();
+
+	pfc::string8 can;
+	p_ipod->get_root_path(can);
+
+	mmh::Permutation permutation_handles(count_library);
+	mmh::sort_get_permutation(p_library.m_handles, permutation_handles, pfc::compare_t<metadb_handle_ptr,metadb_handle_ptr>, false);
+
+	pfc::array_t<bool> queued;
+	queued.set_size(count_library);
+	queued.fill_null();
+
+	pfc::array_t<removal_t> removals;
+	removals.set_size(count);
 
-			p_status.update_progress_subpart_helper(i,count);
+	for (i=0; i<count; i++)
+	{
+		removal_t & removal = removals[i];
+		removal.m_handle = items[i];
+		t_size index;
+		if (stricmp_utf8_max(items[i]->get_path(), can, can.length()))
+			removal.m_error = "File is not located on iPod";
+		else if (!pfc::bsearch_permutation_t(count_library, p_library.m_handles, pfc::compare_t<metadb_handle_ptr,metadb_handle_ptr>, items[i], permutation_handles, index)
+			|| queued[index])
+			removal.m_error = "Failed to find file in database";
+		else if (p_library.m_tracks[index]->dshm_type_6)
+			removal.m_error = "Cannot remove tracks downloaded on-device. Please use the device to remove these.";
+		else
+		{
+			removal.m_index = index;
+			queued[index] = true;
 		}
-		p_library.repopulate_albumlist();
 	}
+
+	remove_files(p_ipod, removals, p_library, p_status, p_abort);
 }
 
 void ipod_file_remover::run (ipod_device_ptr_ref_t p_ipod, const bool * items, ipod::tasks::load_database_t & p_library, threaded_process_v2_t & p_status, abort_callback & p_abort)
 {
 	p_status.update_text("Removing files");
-	//p_status.update_progress_subpart_helper(0);
-	//p_status.force_update();
 
-	pfc::string8 speakableTracks;
-	p_ipod->get_database_path(speakableTracks);
-	speakableTracks  << p_ipod->get_path_separator_ptr() << "Speakable" << p_ipod->get_path_separator_ptr() << "Tracks" << p_ipod->get_path_separator_ptr();
 	t_size i, count = p_library.m_tracks.get_count(), countFilesToRemove = 0;
 
 	for (i=count; i; i--)
 		if (items[i-1]) ++countFilesToRemove;
 
-	pfc::array_staticsize_t<threaded_process_v2_t::detail_entry> progress_details(2);
-	string_format_metadb_handle_for_progress track_formatter;
-	progress_details[0].m_label = "Item:";
-	progress_details[1].m_label = "Remaining:";
-	progress_details[0].m_value = "Processing...";
-	progress_details[1].m_value = pfc::string8() << countFilesToRemove;
-	p_status.update_text_and_details("Removing files", progress_details);
-
-	{
+	pfc::array_t<removal_t> removals;
+	removals.set_size(countFilesToRemove);
 
-		t_size j, count_playlists = p_library.m_playlists.get_size();
-		for (i=count; i; i--)
+	//Last to first, as the tracks used to be removed
+	t_size j = 0;
+	for (i=count; i; i--)
+		if (items[i-1])
 		{
-			metadb_handle_ptr temp = p_library.m_handles[i-1];
-			try
-			{
-				{
-					if (items[i-1])
-					{
-						progress_details[0].m_value = track_formatter.run(p_library.m_handles[i-1]);
-						progress_details[1].m_value = pfc::string8() << countFilesToRemove;
-						p_status.update_detail_entries(progress_details);
-
-						--countFilesToRemove;
-
-						if (p_library.m_tracks[i-1]->dshm_type_6)
-							throw pfc::exception("Cannot remove tracks downloaded on-device. Please use the device to remove these.");
-						try 
-						{
-							if (p_ipod->m_device_properties.m_Speakable)
-							{
-								filesystem::g_remove(pfc::string8() << speakableTracks << pfc::format_hex(p_library.m_tracks[i-1]->pid, 16) << ".wav", abort_callback_dummy());
-							}
-						}
-						catch (exception_io_not_found const &) {};
-						try 
-						{
-							filesystem::g_remove(p_library.m_handles[i-1]->get_path(), abort_callback_dummy());
-						}
-						catch (exception_io_not_found)
-						{
-							for (j=0; j<count_playlists; j++)
-								p_library.m_playlists[j]->remove_track_by_id(p_library.m_tracks[i-1]->id);
-							p_library.m_library_playlist->remove_track_by_id(p_library.m_tracks[i-1]->id);
-							p_library.remove_artwork(p_ipod, p_library.m_tracks[i-1]);
-							p_library.m_tracks.remove_by_idx(i-1);
-							p_library.m_handles.remove_by_idx(i-1);
-							m_deleted_items.add_item(temp->get_path());
-							throw;
-						}
-						for (j=0; j<count_playlists; j++)
-							p_library.m_playlists[j]->remove_track_by_id(p_library.m_tracks[i-1]->id);
-						p_library.m_library_playlist->remove_track_by_id(p_library.m_tracks[i-1]->id);
-						p_library.remove_artwork(p_ipod, p_library.m_tracks[i-1]);
-						p_library.m_tracks.remove_by_idx(i-1);
-						p_library.m_handles.remove_by_idx(i-1);
-						m_deleted_items.add_item(temp->get_path());
-					}
-					//else throw pfc::exception("Failed to find file in database");
-				}
-			}
-			catch (exception_aborted &) {throw;}
-			catch (const pfc::exception & ex)
-			{
-				m_errors.add_item(results_viewer::result_t(temp, metadb_handle_ptr(), pfc::string8() << "Failed to remove file: " << ex.what()));
-				//pfc::string8_fast_aggressive err; err << "Failed to remove file : " <<  temp->get_path() << "; Reason: " <<ex.what();
-				//m_error_list.add_item(err);
-				//console::print(err);
-			}
-
-			p_status.checkpoint();
-			p_status.update_progress_subpart_helper(count-i,count);
+			removal_t & removal = removals[j++];
+			removal.m_handle = p_library.m_handles[i-1];
+			if (p_library.m_tracks[i-1]->dshm_type_6)
+				removal.m_error = "Cannot remove tracks downloaded on-device. Please use the device to remove these.";
+			else
+				removal.m_index = i-1;
 		}
-		p_library.repopulate_albumlist();
-	}
+
+	remove_files(p_ipod, removals, p_library, p_status, p_abort);
 }
@@ -11,4 +11,17 @@ public:
 	//pfc::string_list_impl m_error_list;
 	pfc::list_t<results_viewer::result_t> m_errors;
 	pfc::string_list_impl m_deleted_items;
+private:
+	/** A track selected for removal. m_index is pfc_infinite if it was rejected with m_error. */
+	class removal_t
+	{
+	public:
+		metadb_handle_ptr m_handle;
+		t_size m_index;
+		bool m_remove_track;
+		pfc::string8 m_error;
+		removal_t() : m_index(pfc_infinite), m_remove_track(false) {};
+	};
+	/** Deletes the files concurrently, then removes the deleted tracks from the library in one pass. */
+	void remove_files (ipod_device_ptr_ref_t p_ipod, pfc::array_t<removal_t> & p_removals, ipod::tasks::load_database_t & p_library, threaded_process_v2_t & p_status, abort_callback & p_abort);
 };
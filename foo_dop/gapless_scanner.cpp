@@ -83,29 +83,84 @@ namespace ipod
 		{
 			p_status.update_progress_subpart_helper(progress_start,progress_count);
 
-			t_size i, count = items.get_count();
+			//Scanning is mostly waiting on the files, so a few are kept in flight regardless of the core count
+			enum {thread_count = 4};
 
+			t_size i, count = items.get_count(), count_library = p_library.m_handles.get_count();
+
+			mmh::Permutation permutation_handles(count_library);
+			mmh::sort_get_permutation(p_library.m_handles, permutation_handles, pfc::compare_t<metadb_handle_ptr,metadb_handle_ptr>, false);
+
+			pfc::array_t<t_size> indices;
+			pfc::array_t<bool> claimed, deferred;
+			pfc::array_t<pfc::string8> errors;
+			indices.set_size(count);
+			claimed.set_size(count_library);
+			claimed.fill_null();
+			deferred.set_size(count);
+			deferred.fill_null();
+			errors.set_size(count);
+
+			//A track listed more than once is scanned after the others, as it would have been in order
+			for (i=0; i<count; i++)
+			{
+				t_size index;
+				if (!pfc::bsearch_permutation_t(count_library, p_library.m_handles, pfc::compare_t<metadb_handle_ptr,metadb_handle_ptr>, items[i], permutation_handles, index))
+					index = pfc_infinite;
+				else if (claimed[index])
+					deferred[i] = true;
+				else
+					claimed[index] = true;
+				indices[i] = index;
+			}
+
+			critical_section sync;
+			t_size count_processed = 0;
+
+			auto scan = [&] (t_size index)
+			{
+				if (p_abort.is_aborting()) return;
+				try
+				{
+					if (indices[index] != pfc_infinite)
+					{
+						if (!deferred[index])
+							g_scan_gapless(NULL, *p_library.m_tracks[indices[index]], items[index], p_mappings.use_dummy_gapless_data, p_abort);
+					}
+					else throw exception_dop_gapless_not_on_device();
+				}
+				catch (const pfc::exception & ex)
+				{
+					errors[index] = ex.what();
+				}
+
+				insync(sync);
+				p_status.update_progress_subpart_helper(progress_start + ++count_processed, progress_count);
+			};
+			parallel_for_t<decltype(scan)>(count, scan, 1).run(thread_count);
+			p_status.checkpoint();
+
+			for (i=0; i<count; i++)
 			{
-				for (i=0; i<count; i++)
+				if (deferred[i])
 				{
-					t_size index = p_library.m_handles.find_item(items[i]);
 					try
 					{
-						t_size index = p_library.m_handles.find_item(items[i]);
-						if (index != pfc_infinite)
-						{
-							g_scan_gapless(NULL, *p_library.m_tracks[index], items[i], p_mappings.use_dummy_gapless_data, p_abort);
-						}
-						else throw exception_dop_gapless_not_on_device();
+						g_scan_gapless(NULL, *p_library.m_tracks[indices[i]], items[i], p_mappings.use_dummy_gapless_data, p_abort);
 					}
 					catch (const pfc::exception & ex)
 					{
-						m_errors.add_item(results_viewer::result_t(items[i], index != pfc_infinite ? p_library.m_tracks[index]->create_source_handle() : metadb_handle_ptr(), pfc::string8() << "Failed to add gapless data for file: " << ex.what()));
+						errors[i] = ex.what();
 					}
-
-					p_status.update_progress_subpart_helper(progress_start+i+1,progress_count);
 				}
 			}
+
+			//Errors are reported in the order the files were given
+			for (i=0; i<count; i++)
+			{
+				if (!errors[i].is_empty())
+					m_errors.add_item(results_viewer::result_t(items[i], indices[i] != pfc_infinite ? p_library.m_tracks[indices[i]]->create_source_handle() : metadb_handle_ptr(), pfc::string8() << "Failed to add gapless data for file: " << errors[i]));
+			}
 		}
 
 	}
@@ -324,3 +324,61 @@ LRESULT threaded_process_v2_t::on_message(HWND wnd, UINT msg, WPARAM wp, LPARAM
 	}
 	return DefWindowProc(wnd, msg, wp, lp);
 }
+
+bool file_mapping_t::open(const char * p_path)
+{
+	close();
+
+	const char * path = p_path;
+	if (!stricmp_utf8_partial(path, "file://"))
+		path += 7;
+
+	m_file = CreateFile(pfc::stringcvt::string_os_from_utf8(path), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (m_file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0 || (t_uint64)size.QuadPart > (t_uint64)pfc_infinite)
+	{
+		close();
+		return false;
+	}
+
+	m_mapping = CreateFileMapping(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (m_mapping)
+		m_view = (const t_uint8 *)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!m_view)
+	{
+		close();
+		return false;
+	}
+	m_size = (t_size)size.QuadPart;
+	return true;
+}
+
+bool file_mapping_t::read(t_size p_offset, void * p_buffer, t_size p_bytes) const
+{
+	__try
+	{
+		memcpy(p_buffer, m_view + p_offset, p_bytes);
+	}
+	__except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+	{
+		return false;
+	}
+	return true;
+}
+
+void file_mapping_t::close()
+{
+	if (m_view)
+		UnmapViewOfFile(m_view);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+	if (m_file != INVALID_HANDLE_VALUE)
+		CloseHandle(m_file);
+	m_file = INVALID_HANDLE_VALUE;
+	m_mapping = NULL;
+	m_view = NULL;
+	m_size = 0;
+}
@@ -74,6 +74,81 @@ private:
 #endif
 };
 
+/**
+ * Calls p_func(index) for each index in [0, count) on up to thread_count threads, the calling
+ * thread included. Indices are handed out chunk_size at a time. The first exception thrown
+ * stops the remaining work and is rethrown on the calling thread with its original type.
+ */
+template <typename t_func>
+class parallel_for_t
+{
+public:
+	parallel_for_t(t_size count, t_func & p_func, t_size chunk_size = 32)
+		: m_count(count), m_func(p_func), m_chunk_size(chunk_size), m_next(0), m_failed(false) {};
+
+	void run(t_size thread_count)
+	{
+		t_size chunk_count = (m_count + m_chunk_size - 1) / m_chunk_size;
+		pfc::array_t<worker_t> threads;
+		threads.set_size(thread_count > 1 ? min(thread_count, chunk_count) - 1 : 0);
+		for (t_size i=0, count = threads.get_size(); i<count; i++)
+		{
+			threads[i].m_owner = this;
+			threads[i].create_thread();
+		}
+		work();
+		for (t_size i=0, count = threads.get_size(); i<count; i++)
+			threads[i].wait_for_and_release_thread();
+		if (m_failed)
+			std::rethrow_exception(m_error);
+	}
+private:
+	class worker_t : public mmh::Thread
+	{
+	public:
+		worker_t() : m_owner(NULL) {};
+		DWORD on_thread() {m_owner->work(); return 0;}
+		parallel_for_t * m_owner;
+	};
+
+	void work()
+	{
+		while (true)
+		{
+			t_size start;
+			{
+				insync(m_sync);
+				if (m_failed || m_next >= m_count)
+					return;
+				start = m_next;
+				m_next = min(m_next + m_chunk_size, m_count);
+			}
+			try
+			{
+				for (t_size i = start, end = min(start + m_chunk_size, m_count); i<end; i++)
+					m_func(i);
+			}
+			catch (...)
+			{
+				insync(m_sync);
+				if (!m_failed)
+				{
+					m_failed = true;
+					m_error = std::current_exception();
+				}
+			}
+		}
+	}
+
+	t_size m_count;
+	t_func & m_func;
+	t_size m_chunk_size;
+	critical_section m_sync;
+	t_size m_next;
+	bool m_failed;
+	std::exception_ptr m_error;
+};
+
 class NOVTABLE checkpoint_base
 {
 public:
@@ -329,6 +404,30 @@ private:
 	bool m_MFInitialised;
 };
 
+/** Read-only mapping of a whole local file. */
+class file_mapping_t
+{
+public:
+	file_mapping_t() : m_file(INVALID_HANDLE_VALUE), m_mapping(NULL), m_view(NULL), m_size(0) {};
+	~file_mapping_t() {close();}
+
+	/** Returns false if the file could not be mapped, in which case it should be read normally. */
+	bool open(const char * p_path);
+	void close();
+	/**
+	 * Copies bytes out of the view. A read error in a mapped view raises EXCEPTION_IN_PAGE_ERROR
+	 * rather than failing a call, e.g. when a removable drive goes away; this returns false instead.
+	 */
+	bool read(t_size p_offset, void * p_buffer, t_size p_bytes) const;
+
+	const t_uint8 * get_ptr() const {return m_view;}
+	t_size get_size() const {return m_size;}
+private:
+	HANDLE m_file, m_mapping;
+	const t_uint8 * m_view;
+	t_size m_size;
+};
+
 class video_thumbailer_t 
 {
 public:
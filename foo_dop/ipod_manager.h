@@ -724,6 +724,7 @@ public:
 			m_drives[index]->m_database.m_tracks.remove_all();
 			m_drives[index]->m_database.m_playlists.remove_all();
 			m_drives[index]->m_database.m_handles.remove_all();
+			m_drives[index]->m_database.invalidate_index();
 			if (m_drives[index]->m_database.m_library_playlist.is_valid())
 			{
 				m_drives[index]->m_database.m_library_playlist->name = ex.what();
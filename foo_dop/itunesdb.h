@@ -50,10 +50,12 @@ public:
 	pfc::string8 conversion_command,conversion_extension,conversion_parameters;
 	pfc::string8 artwork_sources;
 	t_size reserved_diskspace;
+	t_size conversion_cache_size;
 
 	t_size extra_filename_characters;
 	t_size soundcheck_rgmode;
 	bool check_video;
+	bool conversion_encode_to_device;
 	bool use_ipod_sorting;
 	bool add_artwork, scan_gapless, convert_files, numbers_last, use_fb2k_artwork, conversion_use_bitrate_limit;
 	bool conversion_use_custom_thread_count;
@@ -85,7 +87,18 @@ public:
 	bool get_sort_composer(const metadb_handle_ptr & ptr, const file_info & info, pfc::string_base & p_out) const;
 	bool get_comment(const metadb_handle_ptr & ptr, const file_info & info, pfc::string_base & p_out) const;
 	bool get_compilation(const metadb_handle_ptr & ptr, const file_info & info, pfc::string_base & p_out) const;
+
+	/**
+	 * Returns the compiled form of a script, false if it is empty or invalid. The mapping
+	 * scripts are compiled once on construction and can then be used from any thread;
+	 * other scripts are compiled on every call.
+	 */
+	bool get_compiled_script(const char * script, titleformat_object::ptr & p_out) const;
 	t_field_mappings();
+private:
+	void precompile_script(const char * script);
+
+	std::unordered_map<std::string, titleformat_object::ptr> m_compiled_scripts;
 };
 
 class itunesprefs 
@@ -1278,6 +1291,30 @@ namespace itunesdb
 								items[j].position--;
 					}
 		}
+		/** Same as calling remove_track_by_id for each of p_ids, which must be sorted. */
+		void remove_tracks_by_id(const pfc::list_base_const_t<t_uint32> & p_ids)
+		{
+			t_size i, index, count = items.get_count();
+			pfc::array_t<bool> mask;
+			pfc::list_t<t_uint32> removed_positions;
+			mask.set_size(count);
+			for (i=0; i<count; i++)
+			{
+				mask[i] = !items[i].is_podcast_group && p_ids.bsearch_t(pfc::compare_t<t_uint32, t_uint32>, items[i].track_id, index);
+				if (mask[i] && items[i].position_valid)
+					removed_positions.add_item(items[i].position);
+			}
+			if (removed_positions.get_count())
+			{
+				removed_positions.sort_t(pfc::compare_t<t_uint32, t_uint32>);
+				const t_uint32 * p_positions = removed_positions.get_ptr();
+				t_size count_positions = removed_positions.get_count();
+				for (i=0; i<count; i++)
+					if (!mask[i] && items[i].position_valid)
+						items[i].position -= std::lower_bound(p_positions, p_positions + count_positions, items[i].position) - p_positions;
+			}
+			items.remove_mask(mask.get_ptr());
+		}
 
 		static int g_compare_pid (const t_playlist::ptr &p1, const t_playlist::ptr &p2) {return pfc::compare_t(p1->id, p2->id);}
 		static int g_compare_pid_by_value (const t_playlist::ptr &p1, const t_uint64 &p2) {return pfc::compare_t(p1->id, p2);}
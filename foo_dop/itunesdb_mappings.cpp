@@ -2,10 +2,28 @@
 
 #include "itunesdb.h"
 
+void t_field_mappings::precompile_script(const char * script)
+{
+	titleformat_object::ptr to;
+	if (*script && !static_api_ptr_t<titleformat_compiler>()->compile(to, script))
+		to.release();
+	m_compiled_scripts[script] = to;
+}
+
+bool t_field_mappings::get_compiled_script(const char * script, titleformat_object::ptr & p_out) const
+{
+	auto iter = m_compiled_scripts.find(script);
+	if (iter != m_compiled_scripts.end())
+		p_out = iter->second;
+	else if (!*script || !static_api_ptr_t<titleformat_compiler>()->compile(p_out, script))
+		p_out.release();
+	return p_out.is_valid();
+}
+
 bool t_field_mappings::get_field(const metadb_handle_ptr & ptr, const file_info & info, const char * format, const char * field, pfc::string_base & p_out) const
 {
 	service_ptr_t<titleformat_object> to;
-	if (!strlen(format) || !static_api_ptr_t<titleformat_compiler>()->compile(to, format))
+	if (!get_compiled_script(format, to))
 		return field ? g_print_meta(info, field, p_out) : false;
 	else if (ptr.is_valid())
 	{
@@ -89,7 +107,9 @@ t_field_mappings::t_field_mappings()
 	comment(settings::comment_mapping),
 	//conversion_command(settings::conversion_command), 
 	//conversion_extension(settings::conversion_extension),
-	check_video(settings::check_video.get_static_instance().get_state()), use_ipod_sorting(settings::use_ipod_sorting),
+	check_video(settings::check_video.get_static_instance().get_state()),
+	conversion_encode_to_device(settings::conversion_encode_to_device.get_static_instance().get_state()),
+	use_ipod_sorting(settings::use_ipod_sorting),
 	add_artwork(settings::add_artwork), scan_gapless(settings::add_gapless), convert_files(settings::convert_files),
 	extra_filename_characters((t_size)settings::extra_filename_characters.get_static_instance().get_state_int()),
 	compilation(settings::compilation_mapping), numbers_last(settings::numbers_last), use_fb2k_artwork(settings::use_fb2k_artwork),
@@ -101,6 +121,7 @@ t_field_mappings::t_field_mappings()
 	//conversion_parameters(settings::conversion_parameters), 
 	artwork_sources(settings::artwork_sources), video_thumbnailer_enabled(settings::video_thumbnailer_enabled),
 	reserved_diskspace((t_size)settings::reserved_diskspace.get_static_instance().get_state_int()),
+	conversion_cache_size((t_size)settings::conversion_cache_size.get_static_instance().get_state_int()),
 	soundcheck_rgmode(settings::soundcheck_rgmode), conversion_use_bitrate_limit(settings::conversion_use_bitrate_limit),
 	conversion_bitrate_limit(settings::conversion_bitrate_limit), sort_ipod_library_playlist(settings::sort_ipod_library),
 	ipod_library_sort_script(settings::ipod_library_sort_script), sort_artist_mapping(settings::sort_artist_mapping),
@@ -117,6 +138,12 @@ t_field_mappings::t_field_mappings()
 
 	settings::conversion_temp_files_folder.get_static_instance().get_state(conversion_temp_files_folder);
 
+	const char * scripts[] = {artist_mapping, album_artist_mapping, album, title, composer, genre, compilation, comment,
+		sort_artist_mapping, sort_album_artist_mapping, sort_title_mapping, sort_album_mapping, sort_composer_mapping,
+		"[%rating%]", "[%play_count%]", "[%last_played_timestamp%]"};
+	for (t_size i=0; i<tabsize(scripts); i++)
+		precompile_script(scripts[i]);
+
 	m_media_library.prealloc(64);
 	static_api_ptr_t<library_manager>()->get_all_items(m_media_library);
 	m_media_library.sort_by_pointer();
@@ -175,17 +175,17 @@ namespace itunesdb {
 					{
 						pfc::string8 temp;
 						titleformat_object::ptr to;
-						static_api_ptr_t<titleformat_compiler>()->compile_force(to, "[%rating%]");
+						p_mappings.get_compiled_script("[%rating%]", to);
 						p_original_file->format_title_from_external_info(info, NULL, temp, to, NULL);
 						if (!temp.is_empty())
 							rating = mmh::strtoul_n(temp.get_ptr(), pfc_infinite) * 20;
 
-						static_api_ptr_t<titleformat_compiler>()->compile_force(to, "[%play_count%]");
+						p_mappings.get_compiled_script("[%play_count%]", to);
 						p_original_file->format_title_from_external_info(info, NULL, temp, to, NULL);
 						if (temp.length())
 							play_count_user = mmh::strtoul_n(temp.get_ptr(), pfc_infinite);
 
-						static_api_ptr_t<titleformat_compiler>()->compile_force(to, "[%last_played_timestamp%]");
+						p_mappings.get_compiled_script("[%last_played_timestamp%]", to);
 						p_original_file->format_title_from_external_info(info, NULL, temp, to, NULL);
 						if (temp.length())
 							lastplayedtime = apple_time_from_filetime(mmh::strtoul64_n(temp.get_ptr(), pfc_infinite));
@@ -38,6 +38,220 @@ void _check_afc_ret (unsigned code, const char * function, const char * path)
 const GUID file_mobile_device::class_guid = 
 { 0xa3089296, 0x1bbd, 0x42e2, { 0x9e, 0x7f, 0x8e, 0xa6, 0xab, 0xa9, 0x4f, 0x8e } };
 
+/**
+ * Sends the writes to an AFC file from a worker thread.
+ *
+ * Writes are gathered into chunks. Up to max_queued chunks wait for the worker while the caller
+ * fills the next one, so producing the data overlaps the device round trips. The chunk size
+ * grows while requests complete quickly and shrinks when they become slow.
+ */
+class afc_write_pipeline_t : public mmh::Thread
+{
+public:
+	enum
+	{
+		max_queued = 3,
+		min_chunk_size = 64*1024,
+		initial_chunk_size = 512*1024,
+		max_chunk_size = 8*1024*1024,
+	};
+
+	afc_write_pipeline_t(const mobile_device_api_handle::ptr & p_api, const mobile_device_handle::ptr & p_device, afc_file_ref p_handle)
+		: m_api(p_api), m_device(p_device), m_handle(p_handle), m_thread_started(false),
+		m_chunk_size(initial_chunk_size), m_error(0), m_api_lost(false), m_exit(false), m_discard(false)
+	{
+		m_event_queued.create(false, false);
+		m_event_done.create(false, false);
+	}
+	~afc_write_pipeline_t() {stop();}
+
+	void write(const void * p_buffer, t_size p_bytes, abort_callback & p_abort)
+	{
+		const t_uint8 * ptr = reinterpret_cast<const t_uint8*>(p_buffer);
+		while (p_bytes)
+		{
+			check_error();
+			if (!m_pending.is_valid())
+			{
+				insync(m_sync);
+				if (m_spare.get_count())
+				{
+					m_pending = m_spare[m_spare.get_count()-1];
+					m_spare.remove_by_idx(m_spare.get_count()-1);
+				}
+				else
+					m_pending.new_t();
+				m_pending->m_data.set_size(m_chunk_size);
+				m_pending->m_size = 0;
+			}
+			t_size delta = min(p_bytes, m_pending->m_data.get_size() - m_pending->m_size);
+			memcpy(m_pending->m_data.get_ptr() + m_pending->m_size, ptr, delta);
+			m_pending->m_size += delta;
+			ptr += delta;
+			p_bytes -= delta;
+			if (m_pending->m_size == m_pending->m_data.get_size())
+				submit(p_abort);
+		}
+	}
+	/** Waits until every write has been sent. */
+	void flush(abort_callback & p_abort)
+	{
+		if (m_pending.is_valid() && m_pending->m_size)
+			submit(p_abort);
+		while (true)
+		{
+			{
+				insync(m_sync);
+				if (!m_queue.get_count())
+					break;
+			}
+			p_abort.check();
+			m_event_done.wait_for(0.1);
+		}
+		check_error();
+	}
+	void get_stats(afc_transfer_stats_t & p_out)
+	{
+		insync(m_sync);
+		p_out = m_stats;
+	}
+	/** Drops the pending chunk and everything queued. A chunk the worker is already sending is finished. */
+	void discard()
+	{
+		m_pending.release();
+		{
+			insync(m_sync);
+			m_discard = true;
+		}
+		m_event_queued.set_state(true);
+	}
+	/** Sends anything still queued, unless discarded, then ends the worker. */
+	void stop()
+	{
+		if (m_thread_started)
+		{
+			{
+				insync(m_sync);
+				m_exit = true;
+			}
+			m_event_queued.set_state(true);
+			wait_for_and_release_thread();
+			m_thread_started = false;
+		}
+	}
+private:
+	class chunk_t
+	{
+	public:
+		pfc::array_t<t_uint8> m_data;
+		t_size m_size;
+		chunk_t() : m_size(0) {};
+	};
+
+	void check_error()
+	{
+		insync(m_sync);
+		if (m_api_lost)
+			throw exception_io("AMDS APIs unavailable");
+		_check_afc_ret(m_error, "AFCFileRefWrite");
+	}
+	void submit(abort_callback & p_abort)
+	{
+		if (!m_thread_started)
+		{
+			create_thread();
+			m_thread_started = true;
+		}
+		while (true)
+		{
+			{
+				insync(m_sync);
+				if (m_queue.get_count() < max_queued)
+				{
+					m_queue.add_item(m_pending);
+					m_pending.release();
+					break;
+				}
+			}
+			p_abort.check();
+			m_event_done.wait_for(0.1);
+		}
+		m_event_queued.set_state(true);
+	}
+	DWORD on_thread()
+	{
+		while (true)
+		{
+			pfc::rcptr_t<chunk_t> chunk;
+			{
+				insync(m_sync);
+				if (m_discard)
+					m_queue.remove_all();
+				if (m_queue.get_count())
+					chunk = m_queue[0];
+				else if (m_exit)
+					break;
+			}
+			if (!chunk.is_valid())
+			{
+				m_event_queued.wait_for(-1);
+				continue;
+			}
+
+			pfc::hires_timer timer;
+			timer.start();
+			afc_error_t err = 0;
+			bool b_api_valid = false;
+			{
+				in_mobile_device_api_handle_sync lockedAPI (m_api);
+				b_api_valid = lockedAPI.is_valid();
+				if (b_api_valid)
+					err = lockedAPI->AFCFileRefWrite(m_device->m_pafc, m_handle, chunk->m_data.get_ptr(), chunk->m_size);
+			}
+			double latency = timer.query();
+
+			{
+				insync(m_sync);
+				m_queue.remove_by_idx(0);
+				if (!b_api_valid)
+					m_api_lost = true;
+				else if (err && !m_error)
+					m_error = err;
+
+				if (m_api_lost || m_error)
+					m_queue.remove_all();
+				else
+				{
+					m_stats.add_request(chunk->m_size, latency);
+					if (latency < 0.1 && chunk->m_size == m_chunk_size && m_chunk_size < max_chunk_size)
+						m_chunk_size *= 2;
+					else if (latency > 0.5 && m_chunk_size > min_chunk_size)
+						m_chunk_size /= 2;
+				}
+				m_spare.add_item(chunk);
+			}
+			m_event_done.set_state(true);
+		}
+		return 0;
+	}
+
+	mobile_device_api_handle::ptr m_api;
+	mobile_device_handle::ptr m_device;
+	afc_file_ref m_handle;
+
+	/** Only used by the writing thread */
+	pfc::rcptr_t<chunk_t> m_pending;
+	bool m_thread_started;
+
+	critical_section m_sync;
+	win32_event m_event_queued, m_event_done;
+	pfc::list_t<pfc::rcptr_t<chunk_t> > m_queue, m_spare;
+	t_size m_chunk_size;
+	afc_error_t m_error;
+	bool m_api_lost, m_exit, m_discard;
+	afc_transfer_stats_t m_stats;
+};
+
 class file_afc : public file_mobile_device
 {
 public:
@@ -51,8 +265,29 @@ public:
 		if (m_checkpoint) m_checkpoint->checkpoint();
 	}
 
+	virtual void enable_write_pipeline()
+	{
+		if (m_mode != 1 && !m_pipeline)
+			m_pipeline.reset(new afc_write_pipeline_t(m_api, m_device, m_handle));
+	}
+	virtual void flush_writes(abort_callback & p_abort)
+	{
+		if (m_pipeline)
+			m_pipeline->flush(p_abort);
+	}
+	virtual void get_transfer_stats(afc_transfer_stats_t & p_out)
+	{
+		p_out = m_stats;
+		if (m_pipeline)
+		{
+			afc_transfer_stats_t pipeline_stats;
+			m_pipeline->get_stats(pipeline_stats);
+			p_out.add(pipeline_stats);
+		}
+	}
 	virtual t_size read(void * p_buffer,t_size p_bytes,abort_callback & p_abort)
 	{
+		flush_writes(p_abort);
 		in_mobile_device_api_handle_sync lockedAPI (m_api);
 		lockedAPI.ensure_valid_io();
 
@@ -68,7 +303,10 @@ public:
 			checkpoint(p_abort);
 			t_size toread = min(remaining, buffsize);
 			t_size read = toread;
+			pfc::hires_timer request_timer;
+			request_timer.start();
 			afc_error_t err = lockedAPI->AFCFileRefRead(m_device->m_pafc, m_handle, ptr+position, &read);
+			m_stats.add_request(read, request_timer.query());
 			position += toread;
 			remaining -= toread;
 			ret += read;
@@ -83,6 +321,13 @@ public:
 	}
 	virtual void write(const void * p_buffer,t_size p_bytes,abort_callback & p_abort)
 	{
+		if (m_pipeline)
+		{
+			checkpoint(p_abort);
+			m_pipeline->write(p_buffer, p_bytes, p_abort);
+			return;
+		}
+
 		in_mobile_device_api_handle_sync lockedAPI (m_api);
 		lockedAPI.ensure_valid_io();
 
@@ -98,7 +343,10 @@ public:
 				DECLARE_AFC_TIMER;
 				checkpoint(p_abort);
 				t_size towrite = min(remaining, buffsize);
+				pfc::hires_timer request_timer;
+				request_timer.start();
 				afc_error_t err = lockedAPI->AFCFileRefWrite(m_device->m_pafc, m_handle, ptr+position, towrite);
+				m_stats.add_request(towrite, request_timer.query());
 				position += towrite;
 				remaining -= towrite;
 #ifdef LOG_AFC_FILE
@@ -110,6 +358,7 @@ public:
 	}
 	virtual t_filesize get_size(abort_callback & p_abort)
 	{
+		flush_writes(p_abort);
 		in_mobile_device_api_handle_sync lockedAPI (m_api);
 		lockedAPI.ensure_valid_io();
 
@@ -138,6 +387,7 @@ public:
 	}
 	virtual t_filetimestamp get_timestamp(abort_callback & p_abort)
 	{
+		flush_writes(p_abort);
 		in_mobile_device_api_handle_sync lockedAPI (m_api);
 		lockedAPI.ensure_valid_io();
 
@@ -166,6 +416,7 @@ public:
 	}
 	virtual t_filesize get_position(abort_callback & p_abort)
 	{
+		flush_writes(p_abort);
 		in_mobile_device_api_handle_sync lockedAPI (m_api);
 		lockedAPI.ensure_valid_io();
 
@@ -181,6 +432,7 @@ public:
 	}
 	virtual void resize(t_filesize p_size,abort_callback & p_abort)
 	{
+		flush_writes(p_abort);
 		in_mobile_device_api_handle_sync lockedAPI (m_api);
 		lockedAPI.ensure_valid_io();
 
@@ -196,6 +448,7 @@ public:
 	}
 	virtual void seek(t_filesize p_position,abort_callback & p_abort)
 	{
+		flush_writes(p_abort);
 		in_mobile_device_api_handle_sync lockedAPI (m_api);
 		lockedAPI.ensure_valid_io();
 
@@ -217,6 +470,7 @@ public:
 	}
 	virtual void reopen(abort_callback & p_abort)
 	{
+		flush_writes(p_abort);
 		in_mobile_device_api_handle_sync lockedAPI (m_api);
 		lockedAPI.ensure_valid_io();
 
@@ -268,6 +522,21 @@ public:
 	file_afc() : m_handle(NULL), m_mode(NULL), m_checkpoint(NULL) {};
 	~file_afc() 
 	{
+		//Successful writers call flush_writes() first, so anything left belongs to a failed or aborted file
+		if (m_pipeline)
+		{
+			m_pipeline->discard();
+			m_pipeline.reset();
+		}
+#ifdef LOG_AFC_FILE
+		{
+			afc_transfer_stats_t stats;
+			get_transfer_stats(stats);
+			console::formatter() << "AFC transfer stats. Path: " << m_path << ", Bytes: " << stats.m_bytes << ", Requests: " << stats.m_requests
+				<< ", Bytes/s: " << pfc::format_float(stats.get_bytes_per_second(), 0, 0) << ", Average latency: " << pfc::format_float(stats.get_average_latency())
+				<< ", Max latency: " << pfc::format_float(stats.m_max_latency);
+		}
+#endif
 		if (m_handle && m_api.is_valid())
 		{
 			in_mobile_device_api_handle_sync lockedAPI (m_api);
@@ -290,6 +559,8 @@ private:
 	t_uint64 m_mode;
 	//critical_section m_sync;
 	const checkpoint_base * m_checkpoint;
+	std::unique_ptr<afc_write_pipeline_t> m_pipeline;
+	afc_transfer_stats_t m_stats;
 };
 
 class filesystem_afc : public filesystem
@@ -293,10 +293,48 @@ private:
 	pfc::refcounted_object_ptr_t<class mobile_device_api_handle> m_ptr;
 };
 
+/** Counters for the AFC requests made for one file. */
+class afc_transfer_stats_t
+{
+public:
+	t_uint64 m_bytes;
+	t_size m_requests;
+	/** Seconds spent waiting on requests, in total and for the slowest one */
+	double m_request_time, m_max_latency;
+
+	void add_request(t_size bytes, double latency)
+	{
+		m_bytes += bytes;
+		m_requests++;
+		m_request_time += latency;
+		if (latency > m_max_latency) m_max_latency = latency;
+	}
+	void add(const afc_transfer_stats_t & p_other)
+	{
+		m_bytes += p_other.m_bytes;
+		m_requests += p_other.m_requests;
+		m_request_time += p_other.m_request_time;
+		if (p_other.m_max_latency > m_max_latency) m_max_latency = p_other.m_max_latency;
+	}
+	double get_bytes_per_second() const {return m_request_time > 0 ? m_bytes / m_request_time : 0;}
+	double get_average_latency() const {return m_requests ? m_request_time / m_requests : 0;}
+
+	afc_transfer_stats_t() : m_bytes(0), m_requests(0), m_request_time(0), m_max_latency(0) {};
+};
+
 class NOVTABLE file_mobile_device : public file
 {
 public:
 	virtual void set_checkpoint(const class checkpoint_base * p_checkpoint)=0;
+	/**
+	 * Sends subsequent writes from a worker thread, so that the caller can carry on producing data
+	 * while the device handles them. Errors are reported by a later write or by flush_writes(),
+	 * which must be called before closing the file to find out whether all data was written.
+	 * Writes that have not been flushed when the file is closed are dropped.
+	 */
+	virtual void enable_write_pipeline()=0;
+	virtual void flush_writes(abort_callback & p_abort)=0;
+	virtual void get_transfer_stats(afc_transfer_stats_t & p_out)=0;
 	FB2K_MAKE_SERVICE_INTERFACE(file_mobile_device, file);
 };
 
@@ -81,57 +81,89 @@ t_filesize g_skip_null(service_ptr_t<file> & p_file, abort_callback & p_abort)
 	return ret;
 }
 
-t_filesize g_search_mpeg_frame(service_ptr_t<file> & p_file, abort_callback & p_abort)
+/** Reads a file forwards through a large buffer, so frame headers can be inspected without a seek per frame. */
+class mp3_scan_window_t
 {
-	t_filesize ret=0;
-	t_uint16 bytes = 0;
-	bool bread=false;
-	do
+public:
+	enum {window_size = 1024*1024};
+
+	mp3_scan_window_t(service_ptr_t<file> & p_file, abort_callback & p_abort)
+		: m_file(p_file), m_abort(p_abort), m_base(p_file->get_position(p_abort)), m_size(0), m_eof(false)
 	{
-		p_file->read_lendian_t(bytes, p_abort);
-		ret+=2;
-		bread=true;
-		p_file->seek_ex(-1, file::seek_from_current, p_abort);
-		ret--;
+		m_data.set_size(window_size);
 	}
-	while ((bytes & 0x70ff) != 0x70ff);
-	if (bread)
+
+	t_filesize get_base() const {return m_base;}
+
+	/** Returns p_bytes bytes at an absolute position, or NULL if the file ends first. Positions may not go back past an earlier request. */
+	const t_uint8 * get(t_filesize position, t_size p_bytes)
 	{
-		p_file->seek_ex(-1, file::seek_from_current, p_abort);
-		ret--;
+		if (position + p_bytes > m_base + m_size)
+		{
+			if (position < m_base || p_bytes > window_size)
+				throw pfc::exception_bug_check();
+			t_size keep = position < m_base + m_size ? (t_size)(m_base + m_size - position) : 0;
+			if (keep)
+				memmove(m_data.get_ptr(), m_data.get_ptr() + m_size - keep, keep);
+			else if (position > m_base + m_size && !m_eof)
+				m_file->seek(position, m_abort);
+			m_base = position;
+			m_size = keep;
+			while (m_size < p_bytes && !m_eof)
+			{
+				m_abort.check();
+				t_size wanted = window_size - m_size;
+				t_size read = m_file->read(m_data.get_ptr() + m_size, wanted, m_abort);
+				m_size += read;
+				if (read < wanted) m_eof = true;
+			}
+			if (m_size < p_bytes)
+				return NULL;
+		}
+		return m_data.get_ptr() + (t_size)(position - m_base);
 	}
-	return ret;
-}
+private:
+	service_ptr_t<file> & m_file;
+	abort_callback & m_abort;
+	pfc::array_t<t_uint8> m_data;
+	t_filesize m_base;
+	t_size m_size;
+	bool m_eof;
+};
 
 t_filesize g_get_gapless_sync_frame_mp3_v2(service_ptr_t<file> p_file, abort_callback & p_abort)
 {
-	pfc::list_t<t_filesize> offsets;
+	//Only the last eight frame offsets are needed, so they are kept in a ring
+	t_filesize offsets[8];
+	t_size count = 0;
 	t_filesize skippedid3=0, skipped=0;
-	//double scanned_length = 0;
 	try 
 	{
-		//skipped += g_skip_null(p_file, p_abort);
 		tag_processor_id3v2::g_skip(p_file, skippedid3, p_abort);
-		skipped += skippedid3;
-		skipped += g_search_mpeg_frame(p_file, p_abort);
 
-		skipped = p_file->get_position(p_abort);
+		mp3_scan_window_t window(p_file, p_abort);
+		t_filesize position = window.get_base();
+		const t_uint8 * ptr;
 
-		while (!p_file->is_eof(p_abort))
+		while ((ptr = window.get(position, 2)) && !(ptr[0] == 0xff && (ptr[1] & 0x70) == 0x70))
+			position++;
+		if (!ptr) return 0;
+
+		skipped = position;
+
+		while ((ptr = window.get(position, 4)))
 		{
-			t_filesize start = p_file->get_position(p_abort);
-			t_uint8 header[4];
-			p_file->read(header, sizeof(header), p_abort);
 			mp3_utils::TMPEGFrameInfo headerinfo;
-			bool valid = mp3_utils::ParseMPEGFrameHeader(headerinfo, header);
+			bool valid = mp3_utils::ParseMPEGFrameHeader(headerinfo, ptr);
 			if (!valid || headerinfo.m_bytes < 4) break;
-			p_file->skip_object(headerinfo.m_bytes-4, p_abort);
-			offsets.add_item(start);
-			//scanned_length += audio_math::samples_to_time(headerinfo.m_duration, headerinfo.m_sample_rate);
+			//The frame only counts if the file holds all of it
+			if (!window.get(position, headerinfo.m_bytes)) break;
+			offsets[count++ % tabsize(offsets)] = position;
+			position += headerinfo.m_bytes;
 		}
 	}
 	catch (const pfc::exception &) {};
-	return offsets.get_count() > 8 ? (offsets[offsets.get_count()-8] -skipped) : 0;
+	return count > 8 ? (offsets[(count-8) % tabsize(offsets)] -skipped) : 0;
 }
 
 t_filesize g_get_gapless_sync_frame_mp3(const char * path, abort_callback & p_abort)
@@ -143,11 +175,7 @@ t_filesize g_get_gapless_sync_frame_mp3(const char * path, abort_callback & p_ab
 
 t_filesize g_get_gapless_sync_frame_mp3_v2(const char * path, abort_callback & p_abort)
 {
-	//try
-	//{
-	service_ptr_t<file> file, fileCached;
+	service_ptr_t<file> file;
 	filesystem::g_open_read(file, path, p_abort);
-	file_cached::g_create(fileCached, file, p_abort, 8*1024*1024);
-	return g_get_gapless_sync_frame_mp3_v2(fileCached, p_abort);
-	//} catch (const pfc::exception &) {return 0;}
+	return g_get_gapless_sync_frame_mp3_v2(file, p_abort);
 }
\ No newline at end of file
@@ -220,23 +220,35 @@ protected:
 		virtual void on_init() 
 		{
 			m_node->m_device->m_ipod->get_root_path(m_path);
-			m_path << "metadata_cache.fpl";
 		}
 		virtual void on_run()
 		{
-			service_ptr_t<playlist_loader_callback_dop> cache = new service_impl_t<playlist_loader_callback_dop>;
-			bool cache_valid = true;
+			//Shared with the database, so that appended records match what it last read or wrote
+			ipod::tasks::metadata_cache_t & metadata_cache = m_node->m_device->m_ipod->m_database.get_metadata_cache();
+			bool cache_valid = false;
 
 			try {
-				playlist_loader::g_load_playlist(m_path, cache, m_process.get_abort());
-				cache->hint_metadb();
-			} catch (const exception_io_not_found &) {
-				cache_valid=false;
+				insync (m_node->m_device->m_ipod->m_database_sync);
+				cache_valid = metadata_cache.load(m_path, m_node->m_device->m_ipod->m_database.m_tracks, m_node->m_device->m_ipod->m_database.m_handles, m_process.get_abort());
 			}
+			catch (const exception_aborted &) {throw;}
 			catch (const pfc::exception & ex) {
 				console::formatter() << "iPod manager: Error reading metadata cache: " << ex.what();
 			}
 
+			if (!cache_valid)
+			{
+				service_ptr_t<playlist_loader_callback_dop> cache = new service_impl_t<playlist_loader_callback_dop>;
+				try {
+					playlist_loader::g_load_playlist(pfc::string8() << m_path << "metadata_cache.fpl", cache, m_process.get_abort());
+					cache->hint_metadb();
+				} catch (const exception_io_not_found &) {
+				}
+				catch (const pfc::exception & ex) {
+					console::formatter() << "iPod manager: Error reading metadata cache: " << ex.what();
+				}
+			}
+
 			metadb_handle_list handlestoread;
 
 			{
@@ -262,10 +274,15 @@ protected:
 					try
 					{
 						insync(m_node->m_device->m_ipod->m_database_sync);
-						playlist_loader::g_save_playlist(m_path, m_node->m_device->m_ipod->m_database.m_handles, abort_callback_dummy());
+						metadata_cache.save(m_path, m_node->m_device->m_ipod->m_database.m_tracks, m_node->m_device->m_ipod->m_database.m_handles, abort_callback_dummy());
 					}
 					catch (const pfc::exception & ex)
 					{
+						//The file may be partly written, so the next save rewrites it
+						{
+							insync(m_node->m_device->m_ipod->m_database_sync);
+							metadata_cache = ipod::tasks::metadata_cache_t();
+						}
 						console::formatter() << "iPod manager: Could not save metadata cache to iPod: " << ex.what();
 					}
 				}
@@ -2,6 +2,11 @@
 
 #include "ipod_manager.h"
 
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#define DOP_PIXELS_SSE2
+#endif
+
 extern bool g_Gdiplus_initialised;
 
 	void g_create_IStream_from_datablock(const void * p_data, t_size p_size, mmh::ComPtr<IStream> & p_out)
@@ -153,16 +158,8 @@ namespace photodb
 
 			location << temp;
 
-			pfc::list_t<t_image_name> list;
-			t_size i, count = image_list.get_count(), j;
-			for (i=0; i<count; i++)
-			{
-				t_size ncount = image_list[i].image_names.get_count();
-				for (j=0; j<ncount; j++)
-					if (!stricmp_utf8(image_list[i].image_names[j].location, p_thumb))
-						list.add_item(image_list[i].image_names[j]);
-			}
-			list.sort_t(t_image_name::g_compare_offset);
+			if (!m_allocator.is_valid())
+				m_allocator.build(p_ipod, image_list);
 
 			t_filestats stats;
 			stats.m_size = 0;
@@ -174,13 +171,10 @@ namespace photodb
 
 			t_filesize data_end = 0;
 
-			count = list.get_count();
+			t_uint32 last_offset;
+			if (m_allocator.get_last_offset(p_thumb, last_offset))
+				data_end = last_offset + fmt.get_size();
 
-			if (count)
-			{
-				i = count-1;
-				data_end = list[i].file_offset + fmt.get_size();
-			}
 			if (data_end < stats.m_size)
 			{
 				file::ptr file;
@@ -196,7 +190,160 @@ namespace photodb
 
 		}
 	}
-	void t_datafile::find_empty_block(ipod_device_ptr_ref_t p_ipod, const artwork_format_t & fmt, t_size padded_size, t_uint32 & offset, t_uint32 & fileno, const pfc::list_t<t_image_name> & pending_images, /*t_filesize & dataend,*/ abort_callback & p_abort)
+	void t_ithmb_allocator::g_get_key(const char * location, std::string & p_out)
+	{
+		p_out = string_lower(location).get_ptr();
+	}
+
+	const t_ithmb_allocator::t_file * t_ithmb_allocator::find_file(const char * location) const
+	{
+		std::string key;
+		g_get_key(location, key);
+		auto iter = m_files.find(key);
+		return iter != m_files.end() ? &iter->second : NULL;
+	}
+
+	void t_ithmb_allocator::t_file::update_gap(std::map<t_uint32, t_extent>::iterator iter)
+	{
+		auto next = iter;
+		++next;
+		erase_gap(iter->first);
+		if (next != m_extents.end() && iter->second.m_end < next->first)
+		{
+			m_gaps[iter->first] = std::make_pair(iter->second.m_end, next->first);
+			m_gaps_by_size.emplace(next->first - iter->second.m_end, iter->first);
+		}
+	}
+
+	void t_ithmb_allocator::t_file::erase_gap(t_uint32 key)
+	{
+		auto iter = m_gaps.find(key);
+		if (iter != m_gaps.end())
+		{
+			m_gaps_by_size.erase(std::make_pair(iter->second.second - iter->second.first, key));
+			m_gaps.erase(iter);
+		}
+	}
+
+	void t_ithmb_allocator::build(ipod_device_ptr_ref_t p_ipod, const t_image_list & p_images)
+	{
+		m_files.clear();
+		m_alignments.clear();
+
+		t_size i, count = p_ipod->m_device_properties.m_artwork_formats.get_count();
+		for (i=0; i<count; i++)
+			m_alignments[p_ipod->m_device_properties.m_artwork_formats[i].m_format_id] = p_ipod->m_device_properties.m_artwork_formats[i].m_offset_alignment;
+		count = p_ipod->m_device_properties.m_chapter_artwork_formats.get_count();
+		for (i=0; i<count; i++)
+			m_alignments[p_ipod->m_device_properties.m_chapter_artwork_formats[i].m_format_id] = p_ipod->m_device_properties.m_chapter_artwork_formats[i].m_offset_alignment;
+
+		m_valid = true;
+
+		count = p_images.get_count();
+		for (i=0; i<count; i++)
+		{
+			t_size j, ncount = p_images[i].image_names.get_count();
+			for (j=0; j<ncount; j++)
+			{
+				add(p_images[i].image_names[j]);
+			}
+		}
+	}
+
+	void t_ithmb_allocator::add(const t_image_name & p_name)
+	{
+		auto iter = m_alignments.find(p_name.correlation_id);
+		add(p_name, iter != m_alignments.end() ? iter->second : 0);
+	}
+
+	void t_ithmb_allocator::add(const t_image_name & p_name, t_size alignment)
+	{
+		if (!m_valid || !p_name.location.length())
+			return;
+
+		t_uint32 end = p_name.file_offset + p_name.file_size;
+		if (alignment && (end%alignment))
+			end += alignment - (end%alignment);
+
+		std::string key;
+		g_get_key(p_name.location, key);
+		t_file & file = m_files[key];
+
+		auto iter = file.m_extents.find(p_name.file_offset);
+		if (iter == file.m_extents.end())
+			iter = file.m_extents.emplace(p_name.file_offset, t_extent()).first;
+		iter->second.m_end = max(iter->second.m_end, end);
+		iter->second.m_refcount++;
+
+		file.update_gap(iter);
+		if (iter != file.m_extents.begin())
+			file.update_gap(std::prev(iter));
+	}
+
+	void t_ithmb_allocator::remove(const t_image_name & p_name)
+	{
+		if (!m_valid || !p_name.location.length())
+			return;
+
+		std::string key;
+		g_get_key(p_name.location, key);
+		auto iter_file = m_files.find(key);
+		if (iter_file == m_files.end())
+			return;
+		t_file & file = iter_file->second;
+
+		auto iter = file.m_extents.find(p_name.file_offset);
+		if (iter == file.m_extents.end())
+			return;
+
+		if (--iter->second.m_refcount == 0)
+		{
+			file.erase_gap(iter->first);
+			auto prev = iter == file.m_extents.begin() ? file.m_extents.end() : std::prev(iter);
+			file.m_extents.erase(iter);
+			if (prev != file.m_extents.end())
+				file.update_gap(prev);
+		}
+	}
+
+	bool t_ithmb_allocator::find_gap(const char * location, t_uint32 size, t_uint32 size_cap, t_uint32 & offset) const
+	{
+		const t_file * file = find_file(location);
+		if (!file)
+			return false;
+
+		//Gaps must be larger than size, as before; only gaps past size_cap are skipped over
+		for (auto iter = file->m_gaps_by_size.lower_bound(std::make_pair(size + 1, t_uint32(0))); iter != file->m_gaps_by_size.end(); ++iter)
+		{
+			t_uint32 start = file->m_gaps.find(iter->second)->second.first;
+			if (start + size <= size_cap)
+			{
+				offset = start;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool t_ithmb_allocator::get_data_end(const char * location, t_uint32 & data_end) const
+	{
+		const t_file * file = find_file(location);
+		if (!file || file->m_extents.empty())
+			return false;
+		data_end = file->m_extents.rbegin()->second.m_end;
+		return true;
+	}
+
+	bool t_ithmb_allocator::get_last_offset(const char * location, t_uint32 & offset) const
+	{
+		const t_file * file = find_file(location);
+		if (!file || file->m_extents.empty())
+			return false;
+		offset = file->m_extents.rbegin()->first;
+		return true;
+	}
+
+	void t_datafile::find_empty_block(ipod_device_ptr_ref_t p_ipod, const artwork_format_t & fmt, t_size padded_size, t_uint32 & offset, t_uint32 & fileno, /*t_filesize & dataend,*/ abort_callback & p_abort)
 	{
 		pfc::string8 path;
 		p_ipod->get_database_path(path);
@@ -204,8 +351,12 @@ namespace photodb
 		t_size fno = 1;
 		t_uint32 correlation_id=fmt.m_format_id;
 		t_uint32 size=padded_size;//fmt.get_size();
+		const t_uint32 size_cap = 500*1024*1024;
 		//dataend = 0;
 
+		if (!m_allocator.is_valid())
+			m_allocator.build(p_ipod, image_list);
+
 		do
 		{
 			pfc::string8 location = path, filename, temp;
@@ -213,57 +364,33 @@ namespace photodb
 			location << temp;
 			filename << ":" << temp;
 
-			pfc::list_t<t_image_name> list;
-			t_size i, count = image_list.get_count(), j;
-			for (i=0; i<count; i++)
+			t_uint32 gap_offset;
+			if (m_allocator.find_gap(filename, size, size_cap, gap_offset))
 			{
-				t_size ncount = image_list[i].image_names.get_count();
-				for (j=0; j<ncount; j++)
-					if (!stricmp_utf8(image_list[i].image_names[j].location, filename))
-						list.add_item(image_list[i].image_names[j]);
+				offset = gap_offset;
+				fileno = fno;
+				return;
 			}
 
-			for (t_size j=0, jcount=pending_images.get_count(); j<jcount; j++)
-				if (!stricmp_utf8(pending_images[j].location, filename))
-					list.add_item(pending_images[j]);
-
-			list.sort_t(t_image_name::g_compare_offset);
-
-			t_filestats stats;
-			stats.m_size = 0;
-			bool dummy;
-			//console::formatter() << location;
-			if (filesystem::g_exists(location, p_abort))
-				filesystem::g_get_stats(location, stats, dummy, p_abort);
-
-			t_filesize data_end = stats.m_size;
+			t_filesize data_end = 0;
+			t_uint32 images_end;
 
-			count = list.get_count();
-			//dataend = count ? list[count-1].file_offset + list[count-1].file_size : 0;
-			if (count)
+			if (m_allocator.get_data_end(filename, images_end))
+				data_end = images_end;
+			else
 			{
-				for (i=0; i<count; i++)
-				{
-					t_uint32 end = list[i].file_offset + list[i].file_size;
-					if (fmt.m_offset_alignment && (end%fmt.m_offset_alignment))
-						end += fmt.m_offset_alignment - (end%fmt.m_offset_alignment);
-					if (i+1 >= count)
-					{
-						data_end = end;
-					}
-					else if (end + size < list[i+1].file_offset)
-					{
-						if (end + size > 500*1024*1024) break;
-						offset = end;
-						fileno = fno;
-						return;
-					}
-
-				}
+				t_filestats stats;
+				stats.m_size = 0;
+				bool dummy;
+				//console::formatter() << location;
+				if (filesystem::g_exists(location, p_abort))
+					filesystem::g_get_stats(location, stats, dummy, p_abort);
+				data_end = stats.m_size;
 			}
+
 			if (fmt.m_offset_alignment && (data_end%fmt.m_offset_alignment))
 				data_end += fmt.m_offset_alignment - (data_end%fmt.m_offset_alignment);
-			if (data_end + size <= 500*1024*1024)
+			if (data_end + size <= size_cap)
 			{
 				offset = (t_uint32) data_end;
 				fileno = fno;
@@ -301,6 +428,7 @@ namespace photodb
 			if (image_list[i-1].image_id == iiid)
 			{
 				image_list.remove_by_idx(i-1);
+				m_allocator.invalidate();
 				break;
 			}
 	}
@@ -308,7 +436,11 @@ namespace photodb
 	{
 		t_size i = image_list.get_count();
 		for (; i; i--)
-			if (image_list[i-1].song_dbid == dbid) image_list.remove_by_idx(i-1);
+			if (image_list[i-1].song_dbid == dbid) 
+			{
+				image_list.remove_by_idx(i-1);
+				m_allocator.invalidate();
+			}
 	}
 	void t_datafile::remove_by_dbid_v2(ipod_device_ptr_ref_t p_ipod, t_uint64 dbid)
 	{
@@ -328,50 +460,71 @@ namespace photodb
 
 		if (!b_found) return;
 
+		if (!m_allocator.is_valid())
+			m_allocator.build(p_ipod, image_list);
+
 		photodb::t_image_item & image = image_list[index];
 
 		t_size k, count = image.image_names.get_count();
 
 		for (k=0; k<count; k++)
 		{
-			pfc::list_t<t_image_name> list;
-			t_size i, icount = image_list.get_count(), j;
-			for (i=0; i<icount; i++)
+			t_image_name & name = image.image_names[k];
+
+			//The image stored last in the same file is moved into the space being freed.
+			//The allocator knows its offset, so only the offsets of other images are compared.
+			t_image_name * p_last = NULL;
+			t_uint32 last_offset_in_file;
+			if (m_allocator.get_last_offset(name.location, last_offset_in_file))
 			{
-				t_size ncount = image_list[i].image_names.get_count();
-				for (j=0; j<ncount; j++)
-					if (!stricmp_utf8(image_list[i].image_names[j].location, image.image_names[k].location))
-						list.add_item(image_list[i].image_names[j]);
+				t_size i, icount = image_list.get_count(), j;
+				for (i=0; i<icount && !p_last; i++)
+				{
+					t_size ncount = image_list[i].image_names.get_count();
+					for (j=0; j<ncount; j++)
+					{
+						t_image_name & candidate = image_list[i].image_names[j];
+						if (candidate.file_offset == last_offset_in_file && !stricmp_utf8(candidate.location, name.location))
+						{
+							p_last = &candidate;
+							break;
+						}
+					}
+				}
 			}
-			list.sort_t(t_image_name::g_compare_offset);
 
-			pfc::string8 file_open = image.image_names[k].location, location_open = path;
+			pfc::string8 file_open = name.location, location_open = path;
 			file_open.replace_byte(':', p_ipod->get_path_separator());
 			location_open << file_open;
 
-			t_size l = list.get_count();
-			if (l)
+			if (p_last)
 			{
-				l--;
-
-				if (image.image_names[k].file_size != list[l].file_size)
+				if (name.file_size != p_last->file_size)
 					throw exception_io_unsupported_format("Failed to remove artwork: Malformed artwork database");
 
-				pfc::array_t<t_uint8> data;
-				data.set_count(list[l].file_size);
+				t_uint32 last_offset = p_last->file_offset;
 
 				service_ptr_t<file> p_file;
 				filesystem::g_open(p_file, location_open, filesystem::open_mode_write_existing, p_abort);
-				p_file->seek(list[l].file_offset, p_abort);
-				p_file->read(data.get_ptr(), list[l].file_size, p_abort);
 
-				p_file->seek(image.image_names[k].file_offset, p_abort);
-				p_file->write(data.get_ptr(), list[l].file_size, p_abort);
-				list[l].file_offset = image.image_names[k].file_offset;
-				p_file->truncate(list[l].file_offset, p_abort);
-			}
-			
+				m_allocator.remove(name);
+				if (p_last != &name)
+				{
+					pfc::array_t<t_uint8> data;
+					data.set_count(p_last->file_size);
+
+					p_file->seek(last_offset, p_abort);
+					p_file->read(data.get_ptr(), p_last->file_size, p_abort);
+
+					p_file->seek(name.file_offset, p_abort);
+					p_file->write(data.get_ptr(), p_last->file_size, p_abort);
 
+					m_allocator.remove(*p_last);
+					p_last->file_offset = name.file_offset;
+					m_allocator.add(*p_last);
+				}
+				p_file->truncate(last_offset, p_abort);
+			}
 		}
 		image_list.remove_by_idx(index);
 	}
@@ -412,16 +565,6 @@ namespace photodb
 		thumb_info_list.remove_all();
 	}
 
-	class formatted_image
-	{
-	public:
-		pfc::array_t<t_uint8> data;
-		INT x, y;
-		UINT cx, cy;
-		t_size m_data_size;
-		t_size m_padded_size;
-	};
-
 	void _check_hresult (HRESULT hr) {if (FAILED(hr)) throw pfc::exception(pfc::string8() << "WIC error: " << format_win32_error(hr));}
 
 	Gdiplus::PixelFormat g_get_gdiplus_pixelformat(t_uint32 apple_pixel_format)
@@ -574,53 +717,27 @@ namespace photodb
 
 			const t_uint8 * ptr= (t_uint8*)GdiBitmapdata.Scan0;
 			t_uint8 * dest_ptr = p_out.data.get_ptr();
-			t_size j;
 
-			pfc::array_t<t_uint8> buffer;
+			//Only the drawn image is opaque in RGB555, not the background around it
+			RECT rc_opaque = {safe_x, safe_y, LONG(safe_x + safe_cx), LONG(safe_y + safe_cy)};
+			const RECT * p_opaque = b_rgb_555 ? &rc_opaque : NULL;
 
-			if (b_rgb_555)
+			if (fmt.m_alternate_pixel_order)
 			{
-				buffer.set_size(GdiBitmapdata.Stride*GdiBitmapdata.Height);
-				buffer.fill_null();
-				t_uint8 * buffer_ptr = buffer.get_ptr();
-
-				t_size k, height_limit = min(GdiBitmapdata.Height, (safe_y + safe_cy) ), width_limit = min( (safe_x+safe_cx) ,GdiBitmapdata.Width);
-				for (j=0; j<GdiBitmapdata.Height; j++)
+				pfc::array_t<t_uint8> buffer;
+				if (p_opaque)
 				{
-					for (k=0; k<GdiBitmapdata.Width; k++)
-					{
-						t_uint16 * pixel = (t_uint16*)(&ptr[j*GdiBitmapdata.Stride + k*2]);
-						t_uint16 * dest_pixel = (t_uint16*)(&buffer_ptr[j*GdiBitmapdata.Stride + k*2]);
-						if ((int)j >= safe_y && j<height_limit && (int)k >= safe_x && k < width_limit)
-							*dest_pixel = ( (*pixel) | 1<<15 );
-						else
-						{
-							*dest_pixel = *pixel;
-						}
-					}
+					buffer.set_size(GdiBitmapdata.Stride*GdiBitmapdata.Height);
+					bitmap_utils::copy_rgb16_rows(ptr, GdiBitmapdata.Stride, buffer.get_ptr(), GdiBitmapdata.Stride, GdiBitmapdata.Width, GdiBitmapdata.Height, p_opaque);
+					ptr = buffer.get_ptr();
 				}
-				ptr = buffer_ptr;
-			}
 
-			bitmap_utils::bitmap_to_alternative_pixel_order_t reordered((t_uint16*)ptr, GdiBitmapdata.Width, GdiBitmapdata.Height, GdiBitmapdata.Stride / 2);
-			if (fmt.m_alternate_pixel_order)
-			{
+				bitmap_utils::bitmap_to_alternative_pixel_order_t reordered((t_uint16*)ptr, GdiBitmapdata.Width, GdiBitmapdata.Height, GdiBitmapdata.Stride / 2);
 				ptr = reordered.to_alternative_order();
+				bitmap_utils::copy_rgb16_rows(ptr, GdiBitmapdata.Stride, dest_ptr, fmt.get_row_stride(), GdiBitmapdata.Width, GdiBitmapdata.Height);
 			}
-
-			//if (b_rgb_555)
-			{
-				t_size k;
-				for (j=0; j<GdiBitmapdata.Height; j++)
-				{
-					for (k=0; k<GdiBitmapdata.Width; k++)
-					{
-						t_uint16 * source_pixel = (t_uint16*)(&ptr[j*GdiBitmapdata.Stride + k*2]);
-						t_uint16 * dest_pixel = (t_uint16*)(dest_ptr + fmt.get_row_stride()*j + k*2);
-						*dest_pixel = *source_pixel;
-					}
-				}
-			}
+			else
+				bitmap_utils::copy_rgb16_rows(ptr, GdiBitmapdata.Stride, dest_ptr, fmt.get_row_stride(), GdiBitmapdata.Width, GdiBitmapdata.Height, p_opaque);
 
 			g_check_gdiplus_ret(image2.UnlockBits(&GdiBitmapdata), "Gdiplus::Bitmap::UnlockBits");
 		}
@@ -632,7 +749,7 @@ namespace photodb
 	}
 
 
-	void t_datafile::_add_image_name(ipod_device_ptr_ref_t p_ipod, const artwork_format_t & fmt, bool b_new, Gdiplus::Bitmap& image, t_image_item & item, t_uint32 timems, t_size count_alloc, abort_callback & p_abort)
+	void t_datafile::_add_image_name(ipod_device_ptr_ref_t p_ipod, const artwork_format_t & fmt, bool b_new, const formatted_image & fi, t_image_item & item, t_uint32 timems, t_size count_alloc, abort_callback & p_abort)
 	{
 		pfc::string8 path;
 		p_ipod->get_database_path(path);
@@ -644,10 +761,6 @@ namespace photodb
 		if (!b_new && item.find_image_name_by_format(fmt.m_format_id, image_name_index, timems))
 			b_image_name_new = false;
 
-		formatted_image fi;
-		g_format_image(image, fmt, fi);
-		//pImageFormatter.FormatImage(fmt, fi);
-
 		t_image_name in_new;
 		t_image_name & in = b_image_name_new ? in_new : item.image_names[image_name_index];
 
@@ -657,7 +770,7 @@ namespace photodb
 		if (b_image_name_new || in.file_size_2 != fi.m_padded_size)
 		{
 			t_size fileno;
-			find_empty_block(p_ipod, fmt, fi.m_padded_size, offset, fileno, item.image_names, p_abort);
+			find_empty_block(p_ipod, fmt, fi.m_padded_size, offset, fileno, p_abort);
 			filename << "F" << fmt.m_format_id << "_" << fileno << ".ithmb";
 			location << p_ipod->get_path_separator_ptr() << filename; 
 			ipod_location << ":" << filename;
@@ -721,6 +834,9 @@ namespace photodb
 			thumb_info_list.remove_by_idx(thumb_index);
 
 
+		if (!b_image_name_new)
+			m_allocator.remove(in);
+
 		in.do_type = 2;
 		in.file_size = fi.m_data_size;
 		in.file_size_2 = fi.m_padded_size;
@@ -737,89 +853,135 @@ namespace photodb
 		in.location_valid = true;
 		in.location.reset();
 		in.location << ":" << filename;
+		m_allocator.add(in, fmt.m_offset_alignment);
 		if (b_image_name_new)
 			item.image_names.add_item(in);
 	}
 
-	bool t_datafile::add_artwork_v3(ipod_device_ptr_ref_t p_ipod, t_uint32 mediatype, t_uint64 dbid, t_uint32 & mhii_id, const album_art_data_ptr & data, t_size count_alloc, abort_callback & p_abort, itunesdb::chapter_list * p_chapter_list)
+	void t_prepared_artwork::prepare(ipod_device_ptr_ref_t p_ipod, t_uint32 mediatype, const album_art_data_ptr & data, const itunesdb::chapter_list * p_chapter_list)
 	{
-		//pfc::ptr_list_t<const t_bitmap_info> bitmaps;
-		//g_get_artwork_bitmaplist(p_ipod, bitmaps);
-		if (p_ipod->is_6g_format())
-			count_alloc = (count_alloc+9)/10;
+		if (!g_Gdiplus_initialised)
+			throw pfc::exception_bug_check();
 
-		pfc::string8 path;
-		p_ipod->get_database_path(path);
-		path << p_ipod->get_path_separator_ptr() << "Artwork";
-		bool b_new = true;
+		const pfc::list_t<artwork_format_t> & formats = p_ipod->m_device_properties.m_artwork_formats;
+		const pfc::list_t<artwork_format_t> & chapter_formats = p_ipod->m_device_properties.m_chapter_artwork_formats;
 
-		if (g_Gdiplus_initialised)
-		{
-			t_size index = pfc_infinite;
-			if ( (mhii_id && find_by_image_id(index, mhii_id)) || (!p_ipod->is_6g_format() && find_by_dbid(index, dbid)))
-				b_new = false;
+		m_source_size = (t_uint32)data->get_size();
 
-			t_image_item item_new;
-			t_image_item & item = b_new ? item_new : image_list[index];
+		pfc::list_t<const artwork_format_t *> applicable_formats, applicable_chapter_formats;
+		for (t_size i=0, count = formats.get_count(); i<count; i++)
+			if ( (mediatype & g_translate_associated_format(formats[i].m_associated_format)) && (mediatype & formats[i].m_excluded_formats) == 0)
+				applicable_formats.add_item(&formats[i]);
+		for (t_size i=0, count = chapter_formats.get_count(); i<count; i++)
+			if ( (mediatype & g_translate_associated_format(chapter_formats[i].m_associated_format)) && (mediatype & chapter_formats[i].m_excluded_formats) == 0)
+				applicable_chapter_formats.add_item(&chapter_formats[i]);
 
-			if (b_new)
-			{
-				item.image_id = get_next_ii_id();
-				next_ii_id++;
-				item.song_dbid = dbid;
-			}
+		t_size chapter_image_count = 0;
+		if (p_chapter_list && applicable_chapter_formats.get_count())
+			for (t_size c=0, ccount = p_chapter_list->get_count(); c<ccount; c++)
+				if ((*p_chapter_list)[c].m_image_data.get_size())
+					chapter_image_count++;
 
-			item.source_image_size = (t_uint32)data->get_size();
+		m_images.set_size(chapter_image_count*applicable_chapter_formats.get_count() + applicable_formats.get_count());
+		t_size image_index = 0;
 
-			mmh::ComPtr<IStream> pStream;
-			g_create_IStream_from_datablock(*data, pStream);
+		mmh::ComPtr<IStream> pStream;
+		g_create_IStream_from_datablock(*data, pStream);
 
-			Gdiplus::Bitmap image(pStream);
-			pStream.release();
+		Gdiplus::Bitmap image(pStream);
+		pStream.release();
 
-			g_check_gdiplus_ret(image.GetLastStatus(), "Gdiplus::Bitmap::c'tor");
-			bool b_have_chapter_zero_ms = false;
-			if (p_chapter_list)
+		g_check_gdiplus_ret(image.GetLastStatus(), "Gdiplus::Bitmap::c'tor");
+		bool b_have_chapter_zero_ms = false;
+		if (p_chapter_list)
+		{
+			for (t_size c=0, ccount = p_chapter_list->get_count(); c<ccount; c++)
 			{
-				for (t_size c=0, ccount = p_chapter_list->get_count(); c<ccount; c++)
+				if ((*p_chapter_list)[c].m_image_data.get_size())
 				{
-					if ((*p_chapter_list)[c].m_image_data.get_size())
+					t_uint32 position = (*p_chapter_list)[c].m_start_position;
+					if (position == 1) {position = 0; b_have_chapter_zero_ms=true;}
+					if (!applicable_chapter_formats.get_count())
+						continue;
+
+					mmh::ComPtr<IStream> pStreamChap;
+					g_create_IStream_from_datablock((*p_chapter_list)[c].m_image_data, pStreamChap);
+
+					Gdiplus::Bitmap imagec(pStreamChap);
+					pStreamChap.release();
+					g_check_gdiplus_ret(imagec.GetLastStatus(), "Gdiplus::Bitmap::c'tor");
+
+					for (t_size i=0, count = applicable_chapter_formats.get_count(); i<count; i++)
 					{
-						mmh::ComPtr<IStream> pStreamChap;
-						g_create_IStream_from_datablock((*p_chapter_list)[c].m_image_data, pStreamChap);
-
-						Gdiplus::Bitmap imagec(pStreamChap);
-						pStreamChap.release();
-						g_check_gdiplus_ret(imagec.GetLastStatus(), "Gdiplus::Bitmap::c'tor");
-
-						t_uint32 position = (*p_chapter_list)[c].m_start_position;
-						if (position == 1) {position = 0; b_have_chapter_zero_ms=true;}
-						for (t_size i=0, count = p_ipod->m_device_properties.m_chapter_artwork_formats.get_count(); i<count; i++)
-						{			
-							const artwork_format_t & fmt = p_ipod->m_device_properties.m_chapter_artwork_formats[i];
-							if ( (mediatype & g_translate_associated_format(fmt.m_associated_format)) && (mediatype & fmt.m_excluded_formats) == 0)
-							{
-								_add_image_name(p_ipod, fmt, b_new, imagec, item, position, count_alloc*10, p_abort);
-							}
-						}
+						t_image & out = m_images[image_index++];
+						out.m_format = applicable_chapter_formats[i];
+						out.m_timems = position;
+						out.m_chapter = true;
+						g_format_image(imagec, *out.m_format, out.m_image);
 					}
 				}
 			}
-			for (t_size i=0, count = p_ipod->m_device_properties.m_artwork_formats.get_count(); i<count; i++)
+		}
+		for (t_size i=0, count = applicable_formats.get_count(); i<count; i++)
+		{
+			t_image & out = m_images[image_index++];
+			out.m_format = applicable_formats[i];
+			out.m_timems = b_have_chapter_zero_ms ? -1 : 0;
+			out.m_chapter = false;
+			g_format_image(image, *out.m_format, out.m_image);
+		}
+	}
+
+	bool t_datafile::add_artwork_v3(ipod_device_ptr_ref_t p_ipod, t_uint32 mediatype, t_uint64 dbid, t_uint32 & mhii_id, const album_art_data_ptr & data, t_size count_alloc, abort_callback & p_abort, itunesdb::chapter_list * p_chapter_list)
+	{
+		t_prepared_artwork artwork;
+		artwork.prepare(p_ipod, mediatype, data, p_chapter_list);
+		return add_artwork_v3(p_ipod, dbid, mhii_id, artwork, count_alloc, p_abort);
+	}
+
+	bool t_datafile::add_artwork_v3(ipod_device_ptr_ref_t p_ipod, t_uint64 dbid, t_uint32 & mhii_id, const t_prepared_artwork & p_artwork, t_size count_alloc, abort_callback & p_abort)
+	{
+		if (p_ipod->is_6g_format())
+			count_alloc = (count_alloc+9)/10;
+
+		bool b_new = true;
+
+		t_size index = pfc_infinite;
+		if ( (mhii_id && find_by_image_id(index, mhii_id)) || (!p_ipod->is_6g_format() && find_by_dbid(index, dbid)))
+			b_new = false;
+
+		t_image_item item_new;
+		t_image_item & item = b_new ? item_new : image_list[index];
+
+		if (b_new)
+		{
+			item.image_id = get_next_ii_id();
+			next_ii_id++;
+			item.song_dbid = dbid;
+		}
+
+		item.source_image_size = p_artwork.m_source_size;
+
+		try
+		{
+			for (t_size i=0, count = p_artwork.m_images.get_size(); i<count; i++)
 			{
-				
-				const artwork_format_t & fmt = p_ipod->m_device_properties.m_artwork_formats[i];
-				if ( (mediatype & g_translate_associated_format(fmt.m_associated_format)) && (mediatype & fmt.m_excluded_formats) == 0)
-				{
-					_add_image_name(p_ipod, fmt, b_new, image, item, b_have_chapter_zero_ms ? -1 : 0, count_alloc, p_abort);
-				}
+				const t_prepared_artwork::t_image & image = p_artwork.m_images[i];
+				_add_image_name(p_ipod, *image.m_format, b_new, image.m_image, item, image.m_timems, image.m_chapter ? count_alloc*10 : count_alloc, p_abort);
 			}
-			//remove_by_dbid(dbid);
+		}
+		catch (const pfc::exception &)
+		{
+			//A new item is discarded, so the space its image names took is free again
 			if (b_new)
-				image_list.add_item(item);
-			mhii_id = item.image_id;			
+				for (t_size i=0, count = item.image_names.get_count(); i<count; i++)
+					m_allocator.remove(item.image_names[i]);
+			throw;
 		}
-		else throw pfc::exception_bug_check();
+		//remove_by_dbid(dbid);
+		if (b_new)
+			image_list.add_item(item);
+		mhii_id = item.image_id;
 
 		return b_new;
 
@@ -1595,6 +1757,43 @@ namespace bitmap_utils
 		}
 	}
 
+	static void g_set_rgb555_alpha(const t_uint16 * src, t_uint16 * dst, unsigned count)
+	{
+		unsigned i = 0;
+#ifdef DOP_PIXELS_SSE2
+		const __m128i alpha = _mm_set1_epi16(short(0x8000));
+		for (; i + 8 <= count; i += 8)
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(_mm_loadu_si128((const __m128i*)(src + i)), alpha));
+#endif
+		for (; i < count; i++)
+			dst[i] = src[i] | 0x8000;
+	}
+
+	void copy_rgb16_rows(const t_uint8 * src, t_size src_stride, t_uint8 * dst, t_size dst_stride, unsigned width, unsigned height, const RECT * p_opaque)
+	{
+		unsigned left = 0, right = 0, top = 0, bottom = 0;
+		if (p_opaque)
+		{
+			left = min(unsigned(max(p_opaque->left, 0L)), width);
+			right = max(min(unsigned(max(p_opaque->right, 0L)), width), left);
+			top = min(unsigned(max(p_opaque->top, 0L)), height);
+			bottom = max(min(unsigned(max(p_opaque->bottom, 0L)), height), top);
+		}
+		for (unsigned j=0; j<height; j++)
+		{
+			const t_uint16 * src_row = reinterpret_cast<const t_uint16*>(src + src_stride*j);
+			t_uint16 * dst_row = reinterpret_cast<t_uint16*>(dst + dst_stride*j);
+			if (j < top || j >= bottom || left == right)
+				memcpy(dst_row, src_row, width*2);
+			else
+			{
+				memcpy(dst_row, src_row, left*2);
+				g_set_rgb555_alpha(src_row + left, dst_row + left, right - left);
+				memcpy(dst_row + right, src_row + right, (width - right)*2);
+			}
+		}
+	}
+
 	const t_uint8 * bitmap_from_alternative_pixel_order_t::from_alternative_order() {
 		m_buffer.set_size(m_width*m_height);
 		m_buffer.fill_null();
@@ -203,6 +203,94 @@ namespace photodb
 		}
 	};
 
+	class formatted_image
+	{
+	public:
+		pfc::array_t<t_uint8> data;
+		INT x, y;
+		UINT cx, cy;
+		t_size m_data_size;
+		t_size m_padded_size;
+	};
+
+	/**
+	 * Artwork decoded and rendered into each device format that applies to a media type.
+	 *
+	 * Preparing does not touch the database, so it can run on worker threads; the result
+	 * is then written with t_datafile::add_artwork_v3.
+	 */
+	class t_prepared_artwork
+	{
+	public:
+		class t_image
+		{
+		public:
+			const artwork_format_t * m_format;
+			t_uint32 m_timems;
+			bool m_chapter;
+			formatted_image m_image;
+		};
+
+		t_uint32 m_source_size;
+		pfc::array_t<t_image> m_images;
+
+		t_prepared_artwork() : m_source_size(0) {};
+
+		void prepare(ipod_device_ptr_ref_t p_ipod, t_uint32 mediatype, const album_art_data_ptr & data, const itunesdb::chapter_list * p_chapter_list = NULL);
+	};
+
+	/**
+	 * Occupied extents and free gaps of each ithmb file, keyed by image name location
+	 * (e.g. ":F1028_1.ithmb").
+	 *
+	 * Built from the image list on first use and then kept up to date as image names
+	 * are added and removed. Extent ends are padded to the format's offset alignment.
+	 */
+	class t_ithmb_allocator
+	{
+	public:
+		bool is_valid() const {return m_valid;}
+		void invalidate() {m_valid = false; m_files.clear();}
+		void build(ipod_device_ptr_ref_t p_ipod, const t_image_list & p_images);
+
+		void add(const t_image_name & p_name);
+		void add(const t_image_name & p_name, t_size alignment);
+		void remove(const t_image_name & p_name);
+
+		/** Smallest gap that size bytes fit in without ending past size_cap, the lowest one of equal gaps. */
+		bool find_gap(const char * location, t_uint32 size, t_uint32 size_cap, t_uint32 & offset) const;
+		/** Aligned end of the image with the highest offset. Fails if the file holds no images. */
+		bool get_data_end(const char * location, t_uint32 & data_end) const;
+		bool get_last_offset(const char * location, t_uint32 & offset) const;
+	private:
+		class t_extent
+		{
+		public:
+			t_uint32 m_end;
+			t_size m_refcount;
+			t_extent() : m_end(0), m_refcount(0) {};
+		};
+		class t_file
+		{
+		public:
+			std::map<t_uint32, t_extent> m_extents;
+			/** Keyed by the offset of the extent preceding the gap; value is (gap start, gap end). */
+			std::map<t_uint32, std::pair<t_uint32, t_uint32> > m_gaps;
+			/** The same gaps as (gap size, key), so a fitting gap is found without walking every gap. */
+			std::set<std::pair<t_uint32, t_uint32> > m_gaps_by_size;
+
+			void update_gap(std::map<t_uint32, t_extent>::iterator iter);
+			void erase_gap(t_uint32 key);
+		};
+
+		static void g_get_key(const char * location, std::string & p_out);
+		const t_file * find_file(const char * location) const;
+
+		std::unordered_map<std::string, t_file> m_files;
+		std::unordered_map<t_uint32, t_size> m_alignments;
+		bool m_valid{false};
+	};
+
 	class t_datafile
 	{
 	public:
@@ -227,7 +315,7 @@ namespace photodb
 		t_uint32 t_datafile::get_next_ii_id();
 		bool find_by_dbid(t_size & index, t_uint64 dbid);
 		bool find_by_image_id(t_size & index, t_uint32 id);
-		void find_empty_block(ipod_device_ptr_ref_t p_ipod, const artwork_format_t & fmt, t_size padded_size, t_uint32 & offset, t_uint32 & fileno, const pfc::list_t<t_image_name> & pending_images, /*t_filesize & dataend,*/ abort_callback & p_abort);
+		void find_empty_block(ipod_device_ptr_ref_t p_ipod, const artwork_format_t & fmt, t_size padded_size, t_uint32 & offset, t_uint32 & fileno, /*t_filesize & dataend,*/ abort_callback & p_abort);
 		void truncate_thumb_file(ipod_device_ptr_ref_t p_ipod, const artwork_format_t & fmt, const char * p_thumb, abort_callback & p_abort);
 		void truncate_thumb_file(ipod_device_ptr_ref_t p_ipod, t_uint32 fmt_id, const char * p_thumb, abort_callback & p_abort);
 
@@ -238,6 +326,7 @@ namespace photodb
 			{
 				pfc::string8 path = image_list[index].image_names[i-1].location;
 				t_uint32 fmt_id = image_list[index].image_names[i-1].correlation_id;
+				m_allocator.remove(image_list[index].image_names[i-1]);
 				image_list[index].image_names.remove_by_idx(i-1);
 				if (path.length())
 					truncate_thumb_file(p_ipod, fmt_id, path, p_abort);
@@ -249,6 +338,7 @@ namespace photodb
 		
 		//returns false is existing entry was modified
 		bool add_artwork_v3(ipod_device_ptr_ref_t p_ipod, t_uint32 mediatype, t_uint64 dbid, t_uint32 & mhii_id, const album_art_data_ptr & data, t_size count_alloc, abort_callback & p_abort, itunesdb::chapter_list * p_chapter_list = NULL);
+		bool add_artwork_v3(ipod_device_ptr_ref_t p_ipod, t_uint64 dbid, t_uint32 & mhii_id, const t_prepared_artwork & p_artwork, t_size count_alloc, abort_callback & p_abort);
 		void replace_artwork(ipod_device_ptr_ref_t p_ipod, t_uint32 mediatype, t_uint64 dbid, t_uint32 mhii_id, const album_art_data_ptr & data, t_size count_alloc, abort_callback & p_abort);
 		void finalise_add_artwork_v2(ipod_device_ptr_ref_t p_ipod, abort_callback & p_abort);
 		void initialise_artworkdb(ipod_device_ptr_ref_t p_ipod);
@@ -257,10 +347,12 @@ namespace photodb
 		void remove_by_image_id(t_uint32 iiid);
 		void remove_by_dbid_v2(ipod_device_ptr_ref_t p_ipod, t_uint64 dbid);
 
-		void _add_image_name(ipod_device_ptr_ref_t p_ipod, const artwork_format_t & fmt, bool b_new, Gdiplus::Bitmap& image, t_image_item & p_item, t_uint32 timems, t_size count_alloc, abort_callback & p_abort);
+		void _add_image_name(ipod_device_ptr_ref_t p_ipod, const artwork_format_t & fmt, bool b_new, const formatted_image & fi, t_image_item & p_item, t_uint32 timems, t_size count_alloc, abort_callback & p_abort);
 
 		t_datafile() : unk1(0), unk2(2), unk3(0), next_ii_id(0), unk5(0), unk6(0), unk7(0), unk8(0), unk9(0), unk10(0), unk11(0)
 		{};
+	private:
+		t_ithmb_allocator m_allocator;
 	};
 	using namespace shareddb;
 
@@ -392,6 +484,10 @@ namespace bitmap_utils
 		void from_alternative_order(t_size dst_offset, t_size src_offset, int width, int height);
 	};
 
+	/** Copies rows of 16-bit pixels between buffers with different strides. Pixels inside p_opaque, if given,
+		have the RGB555 alpha bit set. */
+	void copy_rgb16_rows(const t_uint8 * src, t_size src_stride, t_uint8 * dst, t_size dst_stride, unsigned width, unsigned height, const RECT * p_opaque = NULL);
+
 	HBITMAP create_bitmap_from_uyvy(const t_uint8 * data, t_size size, t_uint32 width, t_uint32 height);
 	HBITMAP create_bitmap_from_rgb565(const t_uint8 * data, t_size size, t_uint32 width, t_uint32 height, t_uint32 stride, bool b_rgb555 = false);
 	HBITMAP create_bitmap_from_jpeg(const t_uint8 * data, t_size size, t_uint32 width, t_uint32 height);
@@ -11,6 +11,183 @@ namespace ipod
 	namespace tasks
 	{
 
+		/**
+		 * Hands out iTunesDB records one at a time, from memory, inflated on demand from an iTunesCDB,
+		 * or copied out of a file mapping. Mapped records are copied before they are parsed, so that
+		 * a page that cannot be read only makes the source fall back to reading the file.
+		 */
+		class itunesdb_record_source_t
+		{
+		public:
+			itunesdb_record_source_t(const t_uint8 * p_data, t_size p_size)
+				: m_data(p_data), m_size(p_size), m_position(0), m_inflater(NULL), m_mapping(NULL), m_offset(0), m_mapping_failed(false) {};
+			itunesdb_record_source_t(zlib_inflate_reader & p_inflater)
+				: m_data(NULL), m_size(0), m_position(0), m_inflater(&p_inflater), m_mapping(NULL), m_offset(0), m_mapping_failed(false) {};
+			itunesdb_record_source_t(const file_mapping_t & p_mapping, t_size p_offset, const file_ptr & p_file)
+				: m_data(NULL), m_size(p_mapping.get_size() - p_offset), m_position(0), m_inflater(NULL), m_mapping(&p_mapping), m_offset(p_offset), m_file(p_file), m_mapping_failed(false) {};
+
+			/**
+			 * Reads the next record and passes a reader positioned after its header to p_func.
+			 * If b_whole_record is false, only the header is read, as for list headers, whose
+			 * section size is a count.
+			 */
+			template <t_uint32 id, typename t_func>
+			void read_record(bool b_whole_record, t_func && p_func, abort_callback & p_abort)
+			{
+				t_size size;
+				const t_uint8 * ptr = read_block(b_whole_record, size, p_abort);
+				itunesdb::stream_reader_memblock_ref_dop stream(ptr, size);
+				itunesdb::reader reader(&stream);
+				t_header_marker<id> header;
+				reader.read_header(header, p_abort);
+				p_func(reader, header);
+			}
+			/**
+			 * Reads count sibling records and decodes them on a pool of threads, calling
+			 * p_func(reader, header, index). Record boundaries come from the section sizes,
+			 * so each batch is split up serially and only decoding runs in parallel.
+			 */
+			template <t_uint32 id, typename t_func>
+			void read_records_parallel(t_size count, t_func && p_func, abort_callback & p_abort)
+			{
+				const t_size batch_size = 4096;
+				const t_size thread_count = max(std::thread::hardware_concurrency(), 1u);
+
+				pfc::array_t<const t_uint8 *> blocks;
+				pfc::array_t<t_size> sizes, offsets;
+				for (t_size start = 0; start < count; start += batch_size)
+				{
+					t_size batch_count = min(batch_size, count - start);
+					blocks.set_size(batch_count);
+					sizes.set_size(batch_count);
+					offsets.set_size(batch_count);
+					m_batch.set_size(0);
+					for (t_size k = 0; k < batch_count; k++)
+					{
+						blocks[k] = read_block(true, sizes[k], p_abort);
+						if (!m_data)
+						{
+							offsets[k] = m_batch.get_size();
+							m_batch.append_fromptr(blocks[k], sizes[k]);
+						}
+					}
+					if (!m_data)
+						for (t_size k = 0; k < batch_count; k++)
+							blocks[k] = m_batch.get_ptr() + offsets[k];
+
+					auto decode = [&] (t_size k)
+					{
+						itunesdb::stream_reader_memblock_ref_dop stream(blocks[k], sizes[k]);
+						itunesdb::reader reader(&stream);
+						t_header_marker<id> header;
+						reader.read_header(header, p_abort);
+						p_func(reader, header, start + k);
+					};
+					try
+					{
+						parallel_for_t<decltype(decode)>(batch_count, decode).run(thread_count);
+					}
+					catch (const pfc::exception &)
+					{
+						p_abort.check();
+						throw;
+					}
+				}
+			}
+			void read(void * p_buffer, t_size p_bytes, abort_callback & p_abort)
+			{
+				if (m_data)
+					memcpy(p_buffer, advance(p_bytes), p_bytes);
+				else
+					fetch(p_buffer, p_bytes, p_abort);
+			}
+			void skip(t_size p_bytes, abort_callback & p_abort)
+			{
+				if (m_inflater)
+					m_inflater->skip_object(p_bytes, p_abort);
+				else
+					advance(p_bytes);
+			}
+		private:
+			/** Copies the next bytes from the inflater or the mapping. */
+			void fetch(void * p_buffer, t_size p_bytes, abort_callback & p_abort)
+			{
+				if (m_inflater)
+				{
+					m_inflater->read_object(p_buffer, p_bytes, p_abort);
+					return;
+				}
+				if (p_bytes > m_size - m_position)
+					throw exception_io_data_truncation();
+				t_size offset = m_offset + m_position;
+				//EXCEPTION_IN_PAGE_ERROR, e.g. the iPod was unplugged; reading the file reports it as an exception instead
+				if (m_mapping_failed || !m_mapping->read(offset, p_buffer, p_bytes))
+				{
+					m_mapping_failed = true;
+					m_file->seek(offset, p_abort);
+					m_file->read_object(p_buffer, p_bytes, p_abort);
+				}
+				m_position += p_bytes;
+			}
+			const t_uint8 * advance(t_size p_bytes)
+			{
+				if (p_bytes > m_size - m_position)
+					throw exception_io_data_truncation();
+				const t_uint8 * ptr = m_data + m_position;
+				m_position += p_bytes;
+				return ptr;
+			}
+			const t_uint8 * read_block(bool b_whole_record, t_size & p_size, abort_callback & p_abort)
+			{
+				const t_size marker_size = 4*3;
+				const t_uint8 * marker = NULL;
+				if (!m_data)
+				{
+					if (m_buffer.get_size() < marker_size)
+						m_buffer.set_size(marker_size);
+					fetch(m_buffer.get_ptr(), marker_size, p_abort);
+					marker = m_buffer.get_ptr();
+				}
+				else
+				{
+					if (m_size - m_position < marker_size)
+						throw exception_io_data_truncation();
+					marker = m_data + m_position;
+				}
+
+				t_uint32 header_size, section_size;
+				itunesdb::stream_reader_memblock_ref_dop marker_stream(marker + 4, marker_size - 4);
+				marker_stream.read_lendian_t(header_size, p_abort);
+				marker_stream.read_lendian_t(section_size, p_abort);
+				p_size = b_whole_record ? section_size : header_size;
+				if (p_size < marker_size || header_size < marker_size || header_size > p_size)
+					throw pfc::exception("Invalid record size");
+
+				if (m_data)
+					return advance(p_size);
+
+				if (m_buffer.get_size() < p_size)
+				{
+					t_uint8 marker_copy[marker_size];
+					memcpy(marker_copy, m_buffer.get_ptr(), marker_size);
+					m_buffer.set_size(p_size);
+					memcpy(m_buffer.get_ptr(), marker_copy, marker_size);
+				}
+				fetch(m_buffer.get_ptr() + marker_size, p_size - marker_size, p_abort);
+				return m_buffer.get_ptr();
+			}
+
+			const t_uint8 * m_data;
+			t_size m_size, m_position;
+			zlib_inflate_reader * m_inflater;
+			const file_mapping_t * m_mapping;
+			t_size m_offset;
+			file_ptr m_file;
+			bool m_mapping_failed;
+			pfc::array_t<t_uint8> m_buffer;
+			pfc::array_t<t_uint8, pfc::alloc_fast_aggressive> m_batch;
+		};
+
 		void load_database_t::cleanup_before_write(ipod_device_ptr_ref_t p_ipod, threaded_process_v2_t & p_status,abort_callback & p_abort)
 		{
 			if (!IsValidCodePage(pfc::stringcvt::codepage_ascii))
@@ -37,30 +214,28 @@ namespace ipod
 			p_ipod->get_database_path(database_folder);
 			t_filetimestamp time;
 			GetSystemTimeAsFileTime((LPFILETIME)&time);
-			t_size i, count_otg = m_onthego_playlists.get_size(), count_old = m_playlists.get_size(), count = count_old + count_otg;
+			t_size i, count_otg = m_onthego_playlists.get_size();
 			t_size name_index = 1;
 
-			m_playlists.set_size(count);
-			for (i=0; i<count_otg; i++)
-				m_playlists[count_old+i] = pfc::rcnew_t<t_playlist>();
-
 			while (have_playlist(pfc::string8() << "On-The-Go " << name_index)) name_index++;
 			for (i=0; i<count_otg; i++)
 			{
-				m_playlists[count_old+i]->name = pfc::string8() << "On-The-Go " << name_index;
+				pfc::rcptr_t<t_playlist> p_playlist = pfc::rcnew_t<t_playlist>();
+				p_playlist->name = pfc::string8() << "On-The-Go " << name_index;
 				t_size j, count_items = m_onthego_playlists[i].items.get_size();
-				m_playlists[count_old+i]->items.set_count(count_items);
-				m_playlists[count_old+i]->timestamp = apple_time_from_filetime(time);
-				m_playlists[count_old+i]->id = get_new_playlist_pid();
+				p_playlist->items.set_count(count_items);
+				p_playlist->timestamp = apple_time_from_filetime(time);
+				p_playlist->id = get_new_playlist_pid();
 				for (j=0; j<count_items; j++)
 				{
 					t_uint32 index = m_onthego_playlists[i].items[j];
 					if (index < m_tracks.get_count())
-						m_playlists[count_old+i]->items[j].track_id = m_tracks[index]->id;
-					m_playlists[count_old+i]->items[j].timestamp = apple_time_from_filetime(time);
-					m_playlists[count_old+i]->items[j].position = j+1;
-					m_playlists[count_old+i]->items[j].position_valid = true;
+						p_playlist->items[j].track_id = m_tracks[index]->id;
+					p_playlist->items[j].timestamp = apple_time_from_filetime(time);
+					p_playlist->items[j].position = j+1;
+					p_playlist->items[j].position_valid = true;
 				}
+				add_playlist(p_playlist);
 				if (i+1 < count_otg)
 				{
 					name_index++;
@@ -128,12 +303,34 @@ namespace ipod
 				}
 			}
 		}
+		void load_database_t::remove_tracks (ipod_device_ptr_ref_t p_ipod, const bool * p_mask)
+		{
+			t_size i, count = m_tracks.get_count();
+			pfc::list_t<t_uint32> ids;
+			for (i=0; i<count; i++)
+				if (p_mask[i])
+				{
+					ids.add_item(m_tracks[i]->id);
+					remove_artwork(p_ipod, m_tracks[i]);
+				}
+			if (!ids.get_count())
+				return;
+
+			ids.sort_t(pfc::compare_t<t_uint32, t_uint32>);
+			for (i=0, count=m_playlists.get_count(); i<count; i++)
+				m_playlists[i]->remove_tracks_by_id(ids);
+			m_library_playlist->remove_tracks_by_id(ids);
+			m_tracks.remove_mask(p_mask);
+			m_handles.remove_mask(p_mask);
+			m_index.invalidate_tracks();
+		}
 		void load_database_t::run(ipod_device_ptr_ref_t p_ipod, threaded_process_v2_t & p_status,abort_callback & p_abort, bool b_photos)
 		{
 			//pfc::hires_timer timer;
 			//timer.start();
 
 			p_status.checkpoint();
+			m_index.invalidate();
 
 			p_status.update_text("Loading database files");
 			service_ptr_t<file> p_file;
@@ -146,27 +343,37 @@ namespace ipod
 				pfc::string8 base = database_folder;
 				base << p_ipod->get_path_separator_ptr() << "iTunes" << p_ipod->get_path_separator_ptr();
 
+				pfc::string8 database_path;
 				try 
 				{
-					filesystem::g_open_read(p_file, pfc::string8() << base << "iTunesCDB", p_abort);
+					database_path << base << "iTunesCDB";
+					filesystem::g_open_read(p_file, database_path, p_abort);
 				}
 				catch (exception_io_not_found const &)
 				{
-					filesystem::g_open_read(p_file, pfc::string8() << base << "iTunesDB", p_abort);
+					database_path.reset();
+					database_path << base << "iTunesDB";
+					filesystem::g_open_read(p_file, database_path, p_abort);
 				}
 
 				p_status.checkpoint();
 
 				t_filesize filesize = p_file->get_size_ex(p_abort);
-				pfc::array_t<t_uint8> data;
-				data.set_size(pfc::downcast_guarded<t_size>(filesize));
+				pfc::array_t<t_uint8> header_data;
 				{
 					//profiler(readingaa);
-					p_file->read(data.get_ptr(), data.get_size(), p_abort);
+					t_uint32 header_size = 0;
+					header_data.set_size(4*3);
+					p_file->read_object(header_data.get_ptr(), header_data.get_size(), p_abort);
+					itunesdb::stream_reader_memblock_ref_dop(header_data.get_ptr() + 4, 4).read_lendian_t(header_size, p_abort);
+					if (header_size < 4*3 || header_size > filesize)
+						throw pfc::exception("Invalid database header size");
+					header_data.set_size(header_size);
+					p_file->read_object(header_data.get_ptr() + 4*3, header_size - 4*3, p_abort);
 				}
 				p_status.checkpoint();
 
-				itunesdb::stream_reader_memblock_ref_dop stream(data.get_ptr(), data.get_size());
+				itunesdb::stream_reader_memblock_ref_dop stream(header_data.get_ptr(), header_data.get_size());
 
 				itunesdb::reader reader(&stream);
 				itunesdb::t_header_marker<identifiers::dbhm> dbhm;
@@ -211,25 +418,43 @@ namespace ipod
 				if (encoding > 1)
 					throw pfc::exception(pfc::string8() << "Unknown file encoding: " << encoding);
 
-				pfc::array_t<t_uint8, pfc::alloc_fast_aggressive> decompressed_data;
+				//iTunesCDB is inflated a record at a time as it is parsed, rather than up front
+				pfc::array_t<t_uint8> data;
+				file_mapping_t mapping;
+				pfc::rcptr_t<zlib_inflate_reader> inflater;
+				pfc::rcptr_t<itunesdb_record_source_t> source;
 				if (format == 2 && encoding == 1)
 				{
-					zlib_stream zs;
-					zs.decompress_singlerun(data.get_ptr()+stream.get_position(p_abort), stream.get_remaining(), decompressed_data);
-					stream.set_data(decompressed_data);
+					inflater = pfc::rcnew_t<zlib_inflate_reader>(p_file);
+					source = pfc::rcnew_t<itunesdb_record_source_t>(*inflater);
+				}
+				//Copy local databases out of a mapping a record at a time, rather than reading them into memory first
+				else if (!stricmp_utf8_partial(database_path, "file://") && mapping.open(database_path) && mapping.get_size() == filesize)
+				{
+					source = pfc::rcnew_t<itunesdb_record_source_t>(mapping, header_data.get_size(), p_file);
 				}
+				else
+				{
+					data.set_size(pfc::downcast_guarded<t_size>(filesize - header_data.get_size()));
+					p_file->read_object(data.get_ptr(), data.get_size(), p_abort);
+					source = pfc::rcnew_t<itunesdb_record_source_t>(data.get_ptr(), data.get_size());
+				}
+				p_status.checkpoint();
 
 				bool b_got_playlists = false;
 
 				unsigned i;
 				for (i=0; i<dshm_count; i++)
 				{
-					t_header_marker<identifiers::dshm> dshm;
-					reader.read_header(dshm, p_abort);
+					t_uint32 type = 0, dshm_header_size = 0, dshm_section_size = 0;
+					source->read_record<identifiers::dshm>(false, [&] (itunesdb::reader &, t_header_marker<identifiers::dshm> & dshm)
 					{
-						t_uint32 type;
 						itunesdb::stream_reader_memblock_ref_dop p_dshm(dshm.data.get_ptr(), dshm.data.get_size());
 						p_dshm.read_lendian_t(type, p_abort);
+						dshm_header_size = dshm.header_size;
+						dshm_section_size = dshm.section_size;
+					}, p_abort);
+					{
 						if (type == dataset_tracklist
 #if 1
 							|| type == dataset_tracklist2
@@ -237,20 +462,25 @@ namespace ipod
 							)
 						{
 							//profiler(readingab);
-							t_header_marker<identifiers::tlhm> tlhm;
-							reader.read_header(tlhm, p_abort);
+							t_uint32 track_count = 0;
+							source->read_record<identifiers::tlhm>(false, [&] (itunesdb::reader &, t_header_marker<identifiers::tlhm> & tlhm)
+							{
+								track_count = tlhm.section_size;
+							}, p_abort);
 
-							m_tracks.prealloc(tlhm.section_size);
+							m_tracks.prealloc(track_count);
 
-							unsigned j;
-							for (j=0; j<tlhm.section_size; j++)
+							pfc::array_t< pfc::rcptr_t <t_track> > tracks;
+							tracks.set_size(track_count);
+							source->read_records_parallel<identifiers::tihm>(track_count, [&] (itunesdb::reader & reader, t_header_marker<identifiers::tihm> & tihm, t_size index)
 							{
-								t_header_marker<identifiers::tihm> tihm;
-								reader.read_header(tihm, p_abort);
-
-								pfc::rcptr_t <t_track> track;
-								reader.read_tihm(tihm, track, p_abort);
+								reader.read_tihm(tihm, tracks[index], p_abort);
+							}, p_abort);
 
+							unsigned j;
+							for (j=0; j<track_count; j++)
+							{
+								pfc::rcptr_t <t_track> & track = tracks[j];
 								if (track.is_valid())
 								{
 									track->dshm_type_6 = (type == dataset_tracklist2);
@@ -262,71 +492,72 @@ namespace ipod
 							&& (!b_got_playlists /*|| type == dataset_specialplaylists*/) )
 						{
 							//profiler(readingad);
-							t_header_marker<identifiers::plhm> plhm;
-							reader.read_header(plhm, p_abort);
-							if (plhm.section_size)
+							t_uint32 playlist_count = 0;
+							source->read_record<identifiers::plhm>(false, [&] (itunesdb::reader &, t_header_marker<identifiers::plhm> & plhm)
 							{
+								playlist_count = plhm.section_size;
+							}, p_abort);
+							if (playlist_count)
+							{
+								source->read_record<identifiers::pyhm>(true, [&] (itunesdb::reader & reader, t_header_marker<identifiers::pyhm> & pyhm)
 								{
-									t_header_marker<identifiers::pyhm> pyhm;
-									reader.read_header(pyhm, p_abort);
 									reader.read_pyhm(pyhm, m_library_playlist, p_abort);
-									if (!m_library_playlist->is_master) throw pfc::exception("Expected master playlist in first position");
-								}
+								}, p_abort);
+								if (!m_library_playlist->is_master) throw pfc::exception("Expected master playlist in first position");
 
 								t_size base = m_playlists.get_count();
-								m_playlists.set_size(base+plhm.section_size-1);
-								unsigned j;
-								for (j=0; j<plhm.section_size-1; j++)
+								m_playlists.set_size(base+playlist_count-1);
+								source->read_records_parallel<identifiers::pyhm>(playlist_count-1, [&] (itunesdb::reader & reader, t_header_marker<identifiers::pyhm> & pyhm, t_size index)
 								{
-									t_header_marker<identifiers::pyhm> pyhm;
-									reader.read_header(pyhm, p_abort);
-									reader.read_pyhm(pyhm, m_playlists[base+j], p_abort);
-								}
+									reader.read_pyhm(pyhm, m_playlists[base+index], p_abort);
+								}, p_abort);
 							}
 							b_got_playlists = (type == dataset_playlistlist || type == dataset_playlistlist_v2);
 						}
 						else if ( type == dataset_specialplaylists )
 						{
-							t_header_marker<identifiers::plhm> plhm;
-							reader.read_header(plhm, p_abort);
-							if (plhm.section_size)
+							t_uint32 playlist_count = 0;
+							source->read_record<identifiers::plhm>(false, [&] (itunesdb::reader &, t_header_marker<identifiers::plhm> & plhm)
+							{
+								playlist_count = plhm.section_size;
+							}, p_abort);
+							if (playlist_count)
 							{
 								t_size base = m_special_playlists.get_count();
-								m_special_playlists.set_size(base+plhm.section_size);
-								unsigned j;
-								for (j=0; j<plhm.section_size; j++)
+								m_special_playlists.set_size(base+playlist_count);
+								source->read_records_parallel<identifiers::pyhm>(playlist_count, [&] (itunesdb::reader & reader, t_header_marker<identifiers::pyhm> & pyhm, t_size index)
 								{
-									t_header_marker<identifiers::pyhm> pyhm;
-									reader.read_header(pyhm, p_abort);
-									reader.read_pyhm(pyhm, m_special_playlists[base+j], p_abort);
-								}
+									reader.read_pyhm(pyhm, m_special_playlists[base+index], p_abort);
+								}, p_abort);
 							}
 							m_special_playlists_valid = true;
 						}
 						else if (type == dataset_genius_cuid)
 						{
-							t_size len = dshm.section_size-dshm.header_size;
+							t_size len = dshm_section_size-dshm_header_size;
 							m_genius_cuid.set_size(len);
-							stream.read(m_genius_cuid.get_ptr(), len, p_abort);
+							source->read(m_genius_cuid.get_ptr(), len, p_abort);
 							m_genius_cuid_valid = true;
 						}
 						else if (type == dataset_albumlist)
 						{
 							//profiler(readingab);
-							t_header_marker<identifiers::alhm> alhm;
-							reader.read_header(alhm, p_abort);
+							t_uint32 album_count = 0;
+							source->read_record<identifiers::alhm>(false, [&] (itunesdb::reader &, t_header_marker<identifiers::alhm> & alhm)
+							{
+								album_count = alhm.section_size;
+							}, p_abort);
 
-							m_album_list.m_master_list.set_count(alhm.section_size);
+							m_album_list.m_master_list.set_count(album_count);
 
 							unsigned j;
-							for (j=0; j<alhm.section_size; j++)
+							for (j=0; j<album_count; j++)
 							{
 								t_album::ptr album;
-								t_header_marker<identifiers::aihm> aihm;
-								reader.read_header(aihm, p_abort);
-
-								reader.read_aihm(aihm, album, p_abort);
-
+								source->read_record<identifiers::aihm>(true, [&] (itunesdb::reader & reader, t_header_marker<identifiers::aihm> & aihm)
+								{
+									reader.read_aihm(aihm, album, p_abort);
+								}, p_abort);
 								m_album_list.m_master_list[j] = (album);
 
 								switch(album->kind)
@@ -346,24 +577,27 @@ namespace ipod
 						else if (type == dataset_artistlist)
 						{
 							//profiler(readingab);
-							t_header_marker<identifiers::ilhm> ilhm;
-							reader.read_header(ilhm, p_abort);
+							t_uint32 artist_count = 0;
+							source->read_record<identifiers::ilhm>(false, [&] (itunesdb::reader &, t_header_marker<identifiers::ilhm> & ilhm)
+							{
+								artist_count = ilhm.section_size;
+							}, p_abort);
 
-							m_artist_list.set_count(ilhm.section_size);
+							m_artist_list.set_count(artist_count);
 
 							unsigned j;
-							for (j=0; j<ilhm.section_size; j++)
+							for (j=0; j<artist_count; j++)
 							{
 								//t_artist::ptr artist;
-								t_header_marker<identifiers::iihm> iihm;
-								reader.read_header(iihm, p_abort);
-
-								reader.read_iihm(iihm, m_artist_list[j], p_abort);
+								source->read_record<identifiers::iihm>(true, [&] (itunesdb::reader & reader, t_header_marker<identifiers::iihm> & iihm)
+								{
+									reader.read_iihm(iihm, m_artist_list[j], p_abort);
+								}, p_abort);
 								//m_artist_list.add_item(artist);
 							}
 						}
 						else
-							stream.skip_object(dshm.section_size - dshm.header_size,p_abort);
+							source->skip(dshm_section_size - dshm_header_size,p_abort);
 						p_status.update_progress_subpart_helper(i, dshm_count);
 					}
 
@@ -699,10 +933,10 @@ namespace ipod
 				//timesttamp == dateadded
 			}
 			for (t_size i = m_playlists.get_count(); i; i--)
-				if (m_playlists[i-1]->podcast_flag) {m_playlists.remove_by_idx(i-1);}
+				if (m_playlists[i-1]->podcast_flag) {m_playlists.remove_by_idx(i-1); m_index.invalidate_playlists();}
 
 			if (p_playlist->items.get_count())
-				m_playlists.add_item(p_playlist);
+				add_playlist(p_playlist);
 		}
 
 
@@ -731,12 +965,8 @@ namespace ipod
 		t_uint64 load_database_t::get_new_playlist_pid()
 		{
 			t_uint64 pid = NULL;
-			t_size count = m_playlists.get_count();
-			mmh::Permutation permutation(count);
-
-			mmh::sort_get_permutation(m_playlists, permutation, g_compare_playlist_id, false);
-
-			t_size index, counter = max(100 + 10*m_playlists.get_count(), m_playlists.get_count());
+			t_uint32 index;
+			t_size counter = max(100 + 10*m_playlists.get_count(), m_playlists.get_count());
 
 			mmh::GenRand p_genrand;
 			//service_ptr_t<genrand_service> p_rand = genrand_service::g_create();
@@ -748,7 +978,7 @@ namespace ipod
 				//pid = p1|(p2<<32);
 				pid = p_genrand.run_uint64(0x100, -0x10000);
 			}
-			while ((m_playlists.bsearch_permutation_t(t_playlist::g_compare_pid_by_value, pid, permutation, index) || pid == m_library_playlist->id) && --counter);
+			while ((find_playlist_by_id(pid, index) || pid == m_library_playlist->id) && --counter);
 
 			if (counter == 0) {pid = NULL; console::formatter() << "iPod manager: Error - couldn't generate a new playlist pid.";}
 
@@ -757,12 +987,7 @@ namespace ipod
 		t_uint64 load_database_t::get_new_track_pid()
 		{
 			t_uint64 pid = NULL;
-			t_size count = m_tracks.get_count();
-			mmh::Permutation permutation(count);
-
-			mmh::sort_get_permutation(m_tracks, permutation, g_compare_track_dbid, false);
-
-			t_size index, counter = max(100 + 10*m_tracks.get_count(), m_tracks.get_count());
+			t_size counter = max(100 + 10*m_tracks.get_count(), m_tracks.get_count());
 
 			mmh::GenRand p_genrand;
 			//service_ptr_t<genrand_service> p_rand = genrand_service::g_create();
@@ -774,7 +999,7 @@ namespace ipod
 				//pid = p1|(p2<<32);
 				pid = p_genrand.run_uint64(0x100, -0x10000);
 			}
-			while ((m_tracks.bsearch_permutation_t(g_compare_track_dbid_with_dbid, pid, permutation, index)) && --counter);
+			while (have_track(pid) && --counter);
 
 			if (counter == 0) {pid = NULL; console::formatter() << "iPod manager: Error - couldn't generate a new track pid.";}
 
@@ -849,9 +1074,10 @@ namespace ipod
 				m_tracks[i]->pid = ++dbid_base;
 				m_tracks[i]->dbid2 = dbid_base;
 			}
+			m_index.invalidate_tracks();
 		}
 
-		void load_database_t::__update_folder_smart_playlists_recur(pfc::array_t<bool> & mask_processed, t_uint64 id)
+		void load_database_t::__update_folder_smart_playlists_recur(pfc::array_t<bool> & mask_processed, t_uint64 id, ipod::smart_playlist::track_columns_t & p_columns)
 		{
 			t_size i, count = m_playlists.get_count();
 			for (i=0; i<count; i++)
@@ -859,8 +1085,8 @@ namespace ipod
 				if (!mask_processed[i] && m_playlists[i]->parentid == id && (m_playlists[i]->smart_data_valid || m_playlists[i]->smart_rules_valid))
 				{
 					if (m_playlists[i]->folder_flag)
-						__update_folder_smart_playlists_recur(mask_processed, m_playlists[i]->id);
-					ipod::smart_playlist::generator_t(*this).run(*m_playlists[i]);
+						__update_folder_smart_playlists_recur(mask_processed, m_playlists[i]->id, p_columns);
+					ipod::smart_playlist::generator_t(*this, p_columns).run(*m_playlists[i]);
 					mask_processed[i] = true;
 				}
 			}
@@ -871,15 +1097,17 @@ namespace ipod
 			pfc::array_t<bool> mask_processed;
 			mask_processed.set_count(count_playlists);
 			mask_processed.fill_null();
+			//Track columns are shared by all the playlists, as m_tracks does not change here
+			ipod::smart_playlist::track_columns_t columns(*this);
 			for (i=0; i<count_playlists; i++)
 			{
 				if (!mask_processed[i] && (m_playlists[i]->smart_data_valid || m_playlists[i]->smart_rules_valid)) 
 				{
 					if(m_playlists[i]->folder_flag)
 					{
-						__update_folder_smart_playlists_recur(mask_processed, m_playlists[i]->id);
+						__update_folder_smart_playlists_recur(mask_processed, m_playlists[i]->id, columns);
 					}
-					ipod::smart_playlist::generator_t(*this).run(*m_playlists[i]);
+					ipod::smart_playlist::generator_t(*this, columns).run(*m_playlists[i]);
 					mask_processed[i] = true;
 				}
 			}
@@ -7,6 +7,11 @@
 
 namespace ipod
 {
+	namespace smart_playlist
+	{
+		class track_columns_t;
+	}
+
 	enum
 	{
 		candy_flag_version_1 = (1<<0),
@@ -27,6 +32,85 @@ namespace ipod
 			std::vector<int64_t> track_persistent_ids;
 		};
 
+		/**
+		 * Hash lookup tables over the track and playlist lists of load_database_t.
+		 *
+		 * The tables hold list indices and are built lazily. Appends are indexed as they are
+		 * made through on_track_added() / on_playlist_added(), and removals must invalidate
+		 * the tables, as they shift every later index. A miss is then final. An entry that no
+		 * longer matches when looked up (e.g. after the list was reordered) causes a rebuild.
+		 * Code that changes track pids/ids or playlist ids/names in place must call
+		 * invalidate_tracks() / invalidate_playlists().
+		 */
+		class library_index_t
+		{
+		public:
+			typedef pfc::list_t< pfc::rcptr_t <t_track>, pfc::alloc_fast_aggressive > track_list_t;
+			typedef pfc::list_t< pfc::rcptr_t <t_playlist> > playlist_list_t;
+
+			bool find_track_by_pid(const track_list_t & p_tracks, t_uint64 pid, t_size & index);
+			bool find_track_by_id(const track_list_t & p_tracks, t_uint32 id, t_size & index);
+			bool find_playlist_by_id(const playlist_list_t & p_playlists, t_uint64 id, t_size & index);
+			/** Matches find_playlist() semantics: case-insensitive, skips master and podcast playlists. */
+			bool find_playlist_by_name(const playlist_list_t & p_playlists, const char * name, t_size & index);
+
+			/** Call after appending to the list, with the index of the new entry. */
+			void on_track_added(const track_list_t & p_tracks, t_size index);
+			void on_playlist_added(const playlist_list_t & p_playlists, t_size index);
+
+			void invalidate_tracks() {insync(m_sync); m_tracks_valid = false;}
+			void invalidate_playlists() {insync(m_sync); m_playlists_valid = false;}
+			void invalidate() {invalidate_tracks(); invalidate_playlists();}
+
+			static void g_fold_name(const char * name, std::string & p_out);
+			/** Appends the folded name and a null separator, for building composite keys. */
+			static void g_append_folded_name(const char * name, std::string & p_out);
+
+			library_index_t() {};
+			library_index_t(const library_index_t &) {};
+			library_index_t & operator = (const library_index_t &) {invalidate(); return *this;}
+		private:
+			static bool g_is_named_playlist(const t_playlist & p_playlist) {return !p_playlist.is_master && !p_playlist.podcast_flag;}
+
+			void build_tracks(const track_list_t & p_tracks);
+			void build_playlists(const playlist_list_t & p_playlists);
+
+			critical_section m_sync;
+			bool m_tracks_valid{false}, m_playlists_valid{false};
+			t_size m_track_count{0}, m_playlist_count{0};
+			std::unordered_map<t_uint64, t_size> m_track_pids;
+			std::unordered_map<t_uint32, t_size> m_track_ids;
+			std::unordered_map<t_uint64, t_size> m_playlist_ids;
+			std::unordered_map<std::string, t_size> m_playlist_names;
+		};
+
+		/** Binary metadata cache stored on the device as metadata_cache.dop. Records are keyed by track pid and
+			appended when they change; the file is rewritten once stale records outweigh live ones. */
+		class metadata_cache_t
+		{
+		public:
+			typedef library_index_t::track_list_t track_list_t;
+
+			/** Hints the cached info of the tracks to the metadb. Returns false if there is no usable cache file. */
+			bool load(const char * p_root, const track_list_t & p_tracks, const pfc::list_base_const_t<metadb_handle_ptr> & p_handles, abort_callback & p_abort);
+			void save(const char * p_root, const track_list_t & p_tracks, const pfc::list_base_const_t<metadb_handle_ptr> & p_handles, abort_callback & p_abort);
+
+			static void g_get_path(const char * p_root, pfc::string8 & p_out) {p_out.reset(); p_out << p_root << "metadata_cache.dop";}
+		private:
+			enum {cache_identifier = 'dmc1', cache_version = 1};
+			enum {record_info = 0, record_removed = 1};
+			/** type, pid, payload size */
+			enum {record_header_size = 1 + 8 + 4};
+
+			static t_uint64 g_hash(const t_uint8 * p_data, t_size size);
+			static void g_write_info(stream_writer_mem & p_out, const metadb_handle_ptr & p_handle, const file_info & p_info, const t_filestats & p_stats, abort_callback & p_abort);
+			static bool g_read_info(const t_uint8 * p_data, t_size size, const metadb_handle_ptr & p_handle, file_info & p_info, t_filestats & p_stats, abort_callback & p_abort);
+
+			std::unordered_map<t_uint64, t_uint64> m_hashes;
+			t_size m_record_count{0};
+			bool m_valid{false};
+		};
+
 		class load_database_t
 		{
 			class portable_device_playbackdata_notifier_impl : public dop::portable_device_playbackdata_notifier_t
@@ -145,21 +229,66 @@ namespace ipod
 				return pfc::compare_t(item1->pid,dbid);
 			}
 
-			pfc::rcptr_t <t_track> get_track_by_pid(t_uint64 pid)
+			pfc::rcptr_t <t_track> get_track_by_pid(t_uint64 pid) const
 			{
-				for (t_size i = 0, count = m_tracks.get_count(); i<count; i++)
-				{
-					if (m_tracks[i]->pid == pid)
-						return m_tracks[i];
-				}
+				t_size index;
+				if (m_index.find_track_by_pid(m_tracks, pid, index))
+					return m_tracks[index];
+				return {};
+			}
+
+			pfc::rcptr_t <t_track> get_track_by_id(t_uint32 id) const
+			{
+				t_size index;
+				if (m_index.find_track_by_id(m_tracks, id, index))
+					return m_tracks[index];
 				return {};
 			}
 
-			bool have_track(t_uint64 pid)
+			bool find_track_by_id(t_uint32 id, t_size & index) const
+			{
+				return m_index.find_track_by_id(m_tracks, id, index);
+			}
+
+			bool find_track_by_pid(t_uint64 pid, t_size & index) const
 			{
-				return get_track_by_pid(pid).is_valid();
+				return m_index.find_track_by_pid(m_tracks, pid, index);
+			}
+
+			bool have_track(t_uint64 pid) const
+			{
+				t_size index;
+				return m_index.find_track_by_pid(m_tracks, pid, index);
 			};
 
+			/** Call after changing track pids/ids or playlist ids/names in place. */
+			void invalidate_index() const {m_index.invalidate();}
+
+			/** The object that tracks what metadata_cache.dop holds. Everything that writes the file must go through it. */
+			metadata_cache_t & get_metadata_cache() const {return m_metadata_cache;}
+
+			/** Appends a track and its handle, and indexes the track. */
+			t_size add_track(const pfc::rcptr_t<t_track> & p_track, const metadb_handle_ptr & p_handle)
+			{
+				t_size index = m_tracks.add_item(p_track);
+				m_handles.add_item(p_handle);
+				m_index.on_track_added(m_tracks, index);
+				return index;
+			}
+			/** Appends a playlist, and indexes it. Its id and name must already be set. */
+			t_size add_playlist(const pfc::rcptr_t<t_playlist> & p_playlist)
+			{
+				t_size index = m_playlists.add_item(p_playlist);
+				m_index.on_playlist_added(m_playlists, index);
+				return index;
+			}
+			/** Removes playlists without recording them as removed from the device. */
+			void remove_playlists(const bool * p_mask)
+			{
+				m_playlists.remove_mask(p_mask);
+				m_index.invalidate_playlists();
+			}
+
 			void glue_items (t_size start);
 			void get_next_ids (t_uint32 & next_tid, t_uint64 & next_dbid);
 
@@ -174,29 +303,19 @@ namespace ipod
 			}
 			bool find_playlist (const char * title, t_uint32 & index) const
 			{
-				t_size i, count = m_playlists.get_size();
-				for (i=0; i<count; i++)
-				{
-					if  (!m_playlists[i]->is_master && !m_playlists[i]->podcast_flag && !stricmp_utf8(title, m_playlists[i]->name)) 
-					{
-						index = i;
-						return true;
-					}
-				}
-				return false;
+				t_size i;
+				if (!m_index.find_playlist_by_name(m_playlists, title, i))
+					return false;
+				index = i;
+				return true;
 			}
 			bool find_playlist_by_id (t_uint64 id, t_uint32 & index) const
 			{
-				t_size i, count = m_playlists.get_size();
-				for (i=0; i<count; i++)
-				{
-					if  (id == m_playlists[i]->id) 
-					{
-						index = i;
-						return true;
-					}
-				}
-				return false;
+				t_size i;
+				if (!m_index.find_playlist_by_id(m_playlists, id, i))
+					return false;
+				index = i;
+				return true;
 			}
 			void rebuild_podcast_playlist();
 			void repopulate_albumlist();
@@ -225,6 +344,7 @@ namespace ipod
 						//t_uint64 pid_child = m_playlists[i-1]->id;
 						m_playlists_removed.add_item(m_playlists[i-1]);
 						m_playlists.remove_by_idx(i-1);
+						m_index.invalidate_playlists();
 						//remove_playlist_voiceover_title(p_ipod, pid_child);
 					}
 				}
@@ -236,6 +356,7 @@ namespace ipod
 			{
 				pfc::rcptr_t< itunesdb::t_playlist > playlist = m_playlists[index];
 				m_playlists.remove_by_idx(index);
+				m_index.invalidate_playlists();
 				//remove_playlist_voiceover_title(p_ipod, playlist->id);
 				m_playlists_removed.add_item(playlist);
 
@@ -255,7 +376,7 @@ namespace ipod
 					__remove_playlist_folder_recur(playlist->id);
 				}
 			}
-			void __update_folder_smart_playlists_recur(pfc::array_t<bool> & mask_processed, t_uint64 id);
+			void __update_folder_smart_playlists_recur(pfc::array_t<bool> & mask_processed, t_uint64 id, smart_playlist::track_columns_t & p_columns);
 			void update_smart_playlists();
 
 			void set_up_playlist(t_playlist::ptr & p_playlist, const t_uint32 * p_tracks, t_uint32 count, bool b_timestamp = true)
@@ -305,8 +426,9 @@ namespace ipod
 				{
 					//m_playlists.get_size();
 					p_playlist = pfc::rcnew_t<itunesdb::t_playlist>();
-					index = m_playlists.add_item(p_playlist);
 					p_playlist->id = pid;
+					p_playlist->name = name;
+					index = add_playlist(p_playlist);
 				}
 
 				if (parentid)
@@ -318,7 +440,6 @@ namespace ipod
 					}
 				}
 
-				p_playlist->name = name;
 				p_playlist->timestamp = apple_time_from_filetime(time);
 				p_playlist->date_modified = p_playlist->timestamp;
 
@@ -339,6 +460,8 @@ namespace ipod
 			void save_cache(HWND wnd, ipod_device_ptr_ref_t p_ipod, threaded_process_v2_t & p_status,abort_callback & p_abort) const;
 			void refresh_cache(HWND wnd, ipod_device_ptr_ref_t p_ipod, bool b_CheckIfFilesChanged, threaded_process_v2_t & p_status,abort_callback & p_abort);
 			void remove_artwork (ipod_device_ptr_ref_t p_ipod, const pfc::rcptr_t<itunesdb::t_track> & p_track);
+			/** Removes the masked tracks, their artwork and their playlist entries. */
+			void remove_tracks (ipod_device_ptr_ref_t p_ipod, const bool * p_mask);
 
 
 			static int g_compare_track_album(const pfc::rcptr_t<const t_track> & track1, const pfc::rcptr_t<const t_track> & track2)
@@ -429,6 +552,8 @@ namespace ipod
 			bool m_failed;
 			bool m_writing;
 			pfc::list_t< pfc::string8 > m_read_device_playlists;
+			mutable library_index_t m_index;
+			mutable metadata_cache_t m_metadata_cache;
 		};
 	}
 }
@@ -6,53 +6,67 @@ namespace ipod
 {
 	namespace tasks
 	{
-		void load_database_t::update_albumlist()
+		namespace
 		{
-
-			t_size track_count = m_tracks.get_count();
+			/** Equal for an album and a track exactly when t_album::g_compare_album_mixed_track returns 0. */
+			void g_get_album_key(t_uint32 media_type, const char * artist, const char * album, const char * show, t_uint32 season_number, t_uint64 pid, std::string & p_out)
 			{
-				mmh::Permutation pTrackAIDInit(track_count);
-				mmh::sort_get_permutation(m_tracks.get_ptr(), pTrackAIDInit, t_track::g_compare_album_id, false);
-
-				for (t_size i = 0; i<m_album_list.m_master_list.get_count(); i++)
+				p_out.assign(reinterpret_cast<const char *>(&media_type), sizeof(media_type));
+				switch (media_type)
 				{
-					t_size index;
-					if (pfc::bsearch_permutation_t(track_count, m_tracks, t_track::g_compare_album_id_value, m_album_list.m_master_list[i]->id, pTrackAIDInit, index))
-					{
-						m_album_list.m_master_list[i]->temp_track_pid = m_tracks[index]->pid;
-						m_album_list.m_master_list[i]->temp_media_type = m_tracks[index]->media_type2;
-					}
-				}
+					case itunesdb::t_track::type_audio:
+					case itunesdb::t_track::type_music_video:
+						library_index_t::g_append_folded_name(artist, p_out);
+						library_index_t::g_append_folded_name(album, p_out);
+						break;
+					case itunesdb::t_track::type_podcast:
+						library_index_t::g_append_folded_name(album, p_out);
+						break;
+					case itunesdb::t_track::type_tv_show:
+						library_index_t::g_append_folded_name(show, p_out);
+						p_out.append(reinterpret_cast<const char *>(&season_number), sizeof(season_number));
+						break;
+					default:
+						p_out.append(reinterpret_cast<const char *>(&pid), sizeof(pid));
+						break;
+				};
 			}
-			mmh::Permutation
-				pMaster(m_album_list.m_master_list.get_count());
+		}
 
-			//pfc::list_t<t_album::ptr> newSongs, newPodcasts, newTvShows;
+		void load_database_t::update_albumlist()
+		{
+			t_size i, count = m_tracks.get_count();
+			t_size current_album_count = m_album_list.m_master_list.get_count();
 
-			mmh::sort_get_permutation(m_album_list.m_master_list.get_ptr(), pMaster, t_album::g_compare_album_mixed, false);
-			m_album_list.m_master_list.reorder(pMaster.data());
-			//pfc::list_permutation_t<t_album> masterListOrdered(
+			std::unordered_map<t_uint32, t_size> track_by_album_id;
+			track_by_album_id.reserve(count);
+			for (i = 0; i<count; i++)
+				track_by_album_id.emplace(m_tracks[i]->album_id, i);
 
-			//m_album_list.m_normal.reorder(pNormal.get_ptr());
+			//Existing albums keep their ids; tracks are matched to them by hashed key rather than by bsearch
+			std::unordered_map<std::string, t_size> albums_by_key;
+			albums_by_key.reserve(current_album_count + count);
+			std::string key;
 
 			t_uint32 next_id = 0x81;
-			t_size current_album_count = m_album_list.m_master_list.get_count();
-			if (current_album_count)
+			for (i = 0; i<current_album_count; i++)
 			{
-				mmh::Permutation perm(current_album_count);
-				mmh::sort_get_permutation(m_album_list.m_master_list.get_ptr(), perm, t_album::g_compare_id, false);
-				next_id = m_album_list.m_master_list[perm[current_album_count - 1]]->id + 1;
+				t_album::ptr album = m_album_list.m_master_list[i];
+				auto iter = track_by_album_id.find(album->id);
+				if (iter != track_by_album_id.end())
+				{
+					album->temp_track_pid = m_tracks[iter->second]->pid;
+					album->temp_media_type = m_tracks[iter->second]->media_type2;
+				}
+				g_get_album_key(album->temp_media_type, album->artist, album->album, album->show, album->season_number, album->temp_track_pid, key);
+				albums_by_key.emplace(key, i);
+				if (i == 0 || album->id >= next_id)
+					next_id = album->id + 1;
 			}
-			//console::formatter() << (m_album_list.m_normal.get_count() + m_album_list.m_podcasts.get_count() + m_album_list.m_tv_shows.get_count()) << " " << m_album_list.m_master_list.get_count();
 
-			t_size i, count = m_tracks.get_count();
 			for (i = 0; i<count; i++)
 			{
-				t_track::ptr p_track = m_tracks[i];
-				t_size index = pfc_infinite;
-				bool b_found = false, b_other_type = false;
-
-				pfc::rcptr_t<itunesdb::t_track> track = m_tracks[i];
+				bool b_other_type = false;
 
 				t_uint32 type = 0;
 				if (m_tracks[i]->media_type == itunesdb::t_track::type_audio
@@ -71,10 +85,13 @@ namespace ipod
 					b_other_type = true;
 				}
 
-				if (b_found = m_album_list.m_master_list.bsearch_t(t_album::g_compare_album_mixed_track, m_tracks[i], index))
-					m_tracks[i]->album_id = m_album_list.m_master_list[index]->id;
+				g_get_album_key(m_tracks[i]->media_type2, m_tracks[i]->album_artist_valid ? m_tracks[i]->album_artist : m_tracks[i]->artist,
+					m_tracks[i]->album, m_tracks[i]->show, m_tracks[i]->season_number, m_tracks[i]->pid, key);
 
-				if (!b_found)
+				auto iter = albums_by_key.find(key);
+				if (iter != albums_by_key.end())
+					m_tracks[i]->album_id = m_album_list.m_master_list[iter->second]->id;
+				else
 				{
 					t_album::ptr temp = new t_album;
 					temp->id = next_id;
@@ -103,8 +120,6 @@ namespace ipod
 								temp->album = m_tracks[i]->album;
 							}
 						}
-
-						//m_album_list.m_normal.insert_item(temp, index);
 					}
 					else if (type == ai_types::podcast)
 					{
@@ -118,7 +133,6 @@ namespace ipod
 							temp->podcast_url_valid = true;
 							temp->podcast_url = m_tracks[i]->podcast_rss_url;
 						}
-						//m_album_list.m_podcasts.insert_item(temp, index);
 					}
 					else if (type == ai_types::tv_show)
 					{
@@ -128,84 +142,90 @@ namespace ipod
 							temp->show = m_tracks[i]->show;
 						}
 						temp->season_number = m_tracks[i]->season_number;
-						//m_album_list.m_tv_shows.insert_item(temp, index);
 					}
 
 					temp->temp_track_pid = m_tracks[i]->pid;
 					temp->temp_media_type = m_tracks[i]->media_type2;
 
 					m_tracks[i]->album_id = temp->id;
-					m_album_list.m_master_list.insert_item(temp, index);
+					albums_by_key.emplace(key, m_album_list.m_master_list.add_item(temp));
 					next_id++;
-
 				}
 			}
 
 			//purge dead entries
-			current_album_count = m_album_list.m_master_list.get_count();
-			pfc::array_staticsize_t<bool> mask(current_album_count);
-			mmh::Permutation perm_aid(m_tracks.get_count());
-
-			mmh::sort_get_permutation(m_tracks.get_ptr(), perm_aid, t_track::g_compare_album_id, false);
-
-			t_size dummy;
+			{
+				std::unordered_set<t_uint32> used_ids;
+				used_ids.reserve(count);
+				for (i = 0; i<count; i++)
+					used_ids.insert(m_tracks[i]->album_id);
 
-			for (i = 0; i<current_album_count; i++)
-				mask[i] = !pfc::bsearch_permutation_t(m_tracks.get_count(), m_tracks, t_track::g_compare_album_id_value, m_album_list.m_master_list[i]->id, perm_aid, dummy);
+				current_album_count = m_album_list.m_master_list.get_count();
+				pfc::array_staticsize_t<bool> mask(current_album_count);
+				for (i = 0; i<current_album_count; i++)
+					mask[i] = used_ids.find(m_album_list.m_master_list[i]->id) == used_ids.end();
 
-			m_album_list.m_master_list.remove_mask(mask.get_ptr());
+				m_album_list.m_master_list.remove_mask(mask.get_ptr());
+			}
 
-			//generate pids
+			//Sorted once here rather than kept sorted by each insert, so the list order is as before
 			current_album_count = m_album_list.m_master_list.get_count();
+			{
+				mmh::Permutation pMaster(current_album_count);
+				mmh::sort_get_permutation(m_album_list.m_master_list.get_ptr(), pMaster, t_album::g_compare_album_mixed, false);
+				m_album_list.m_master_list.reorder(pMaster.data());
+			}
 
-			mmh::Permutation perm_pid(current_album_count);
-			mmh::sort_get_permutation(m_album_list.m_master_list.get_ptr(), perm_pid, t_album::g_compare_pid, false);
+			//generate pids
+			{
+				std::unordered_set<t_uint64> pids;
+				pids.reserve(current_album_count);
+				for (i = 0; i<current_album_count; i++)
+					pids.insert(m_album_list.m_master_list[i]->pid);
 
-			genrand_service::ptr p_genrand = genrand_service::g_create();
-			p_genrand->seed(GetTickCount());
+				genrand_service::ptr p_genrand = genrand_service::g_create();
+				p_genrand->seed(GetTickCount());
 
-			for (i = 0; i<current_album_count; i++)
-			{
-				if (m_album_list.m_master_list[i]->pid == NULL)
+				for (i = 0; i<current_album_count; i++)
 				{
-					t_uint64 new_pid = NULL;
-					t_size attempts = 66;
-					do {
-						t_uint64 p1 = p_genrand->genrand(MAXUINT32 - 1) + 1;
-						t_uint64 p2 = p_genrand->genrand(MAXUINT32);
-						new_pid = p1 | (p2 << 32);
-					} while (m_album_list.have_pid(new_pid) && --attempts);
-					if (attempts)
-						m_album_list.m_master_list[i]->pid = new_pid;
-					else
-						break;
+					if (m_album_list.m_master_list[i]->pid == NULL)
+					{
+						t_uint64 new_pid = NULL;
+						t_size attempts = 66;
+						do {
+							t_uint64 p1 = p_genrand->genrand(MAXUINT32 - 1) + 1;
+							t_uint64 p2 = p_genrand->genrand(MAXUINT32);
+							new_pid = p1 | (p2 << 32);
+						} while (pids.find(new_pid) != pids.end() && --attempts);
+						if (attempts)
+						{
+							m_album_list.m_master_list[i]->pid = new_pid;
+							pids.insert(new_pid);
+						}
+						else
+							break;
+					}
 				}
 			}
 
 			//fill artwork_item_pids
 			{
-				pfc::list_t< pfc::rcptr_t <t_track>, pfc::alloc_fast_aggressive > p_artwork_tracks;
-				p_artwork_tracks.prealloc(count);
+				std::unordered_set<t_uint64> artwork_track_pids;
+				std::unordered_map<t_uint32, t_uint64> artwork_track_by_album_id;
 				for (i = 0; i<count; i++)
 					if (m_tracks[i]->artwork_flag == 0x1)
-						p_artwork_tracks.add_item(m_tracks[i]);
-				t_size count_artwork_tracks = p_artwork_tracks.get_count();
-				mmh::Permutation perm_track_pid(count_artwork_tracks), perm_track_album_id(count_artwork_tracks);
-				mmh::sort_get_permutation(p_artwork_tracks.get_ptr(), perm_track_pid, ipod::tasks::load_database_t::g_compare_track_dbid, false);
-				mmh::sort_get_permutation(p_artwork_tracks.get_ptr(), perm_track_album_id, ipod::tasks::load_database_t::g_compare_track_album_id, false);
+					{
+						artwork_track_pids.insert(m_tracks[i]->pid);
+						artwork_track_by_album_id.emplace(m_tracks[i]->album_id, m_tracks[i]->pid);
+					}
 
 				for (i = 0; i<current_album_count; i++)
 				{
 					t_album::ptr album = m_album_list.m_master_list[i];
-					t_size dummy_index = pfc_infinite;
-					if (album->artwork_item_pid == NULL || !p_artwork_tracks.bsearch_permutation_t(ipod::tasks::load_database_t::g_compare_track_dbid_with_dbid, album->artwork_item_pid, perm_track_pid, dummy_index))
+					if (album->artwork_item_pid == NULL || artwork_track_pids.find(album->artwork_item_pid) == artwork_track_pids.end())
 					{
-						t_size index;
-						if (p_artwork_tracks.bsearch_permutation_t(t_track::g_compare_album_id_value, album->id, perm_track_album_id, index))
-						{
-							album->artwork_item_pid = p_artwork_tracks[index]->pid;
-						}
-						else album->artwork_item_pid = NULL;
+						auto iter = artwork_track_by_album_id.find(album->id);
+						album->artwork_item_pid = iter != artwork_track_by_album_id.end() ? iter->second : NULL;
 					}
 				}
 			}
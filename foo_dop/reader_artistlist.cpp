@@ -6,190 +6,186 @@ namespace ipod
 {
 	namespace tasks
 	{
-		void load_database_t::update_artistlist()
+		namespace
 		{
-			//m_artist_list.remove_all();
-
+			/** Equal for an artist and a track exactly when t_artist::g_compare_standard_track returns 0. */
+			void g_get_artist_key(const char * artist, const char * show, t_uint32 season_number, std::string & p_out)
+			{
+				p_out.clear();
+				library_index_t::g_append_folded_name(artist, p_out);
+				library_index_t::g_append_folded_name(show, p_out);
+				p_out.append(reinterpret_cast<const char *>(&season_number), sizeof(season_number));
+			}
+		}
 
-			t_size track_count = m_tracks.get_count();
+		void load_database_t::update_artistlist()
+		{
+			t_size i, track_count = m_tracks.get_count();
 			t_size current_artist_count = m_artist_list.get_count();
-			t_size album_count = m_album_list.m_master_list.get_count();
-			mmh::Permutation permAlbumListbyID(album_count);
-			mmh::sort_get_permutation(m_album_list.m_master_list.get_ptr(), permAlbumListbyID, t_album::g_compare_id, false);
 
+			std::unordered_map<t_uint32, t_size> track_by_artist_id;
+			track_by_artist_id.reserve(track_count);
+			for (i = 0; i<track_count; i++)
+				track_by_artist_id.emplace(m_tracks[i]->artist_id, i);
 
-			{
-				mmh::Permutation pTrackAIDInit(track_count);
-				mmh::sort_get_permutation(m_tracks.get_ptr(), pTrackAIDInit, t_track::g_compare_artist_id, false);
-
-				for (t_size i = 0; i<current_artist_count; i++)
-				{
-					t_size index;
-					if (pfc::bsearch_permutation_t(track_count, m_tracks, t_track::g_compare_artist_id_value, m_artist_list[i]->id, pTrackAIDInit, index))
-					{
-						m_artist_list[i]->temp_season_number = m_tracks[index]->season_number;
-						m_artist_list[i]->temp_show = m_tracks[index]->show;
-						m_artist_list[i]->temp_track_pid = m_tracks[index]->pid;
-					}
-				}
-			}
-
-			{
-				mmh::Permutation pNormal(current_artist_count);
-				mmh::sort_get_permutation(m_artist_list.get_ptr(), pNormal, t_artist::g_compare_standard, false);
-				m_artist_list.reorder(pNormal.data());
-			}
+			//Existing artists keep their ids; tracks are matched to them by hashed key rather than by bsearch
+			std::unordered_map<std::string, t_size> artists_by_key;
+			artists_by_key.reserve(current_artist_count + track_count);
+			std::string key;
 
 			t_uint32 next_id = 0x81;
-			if (current_artist_count)
+			for (i = 0; i<current_artist_count; i++)
 			{
-				mmh::Permutation perm(current_artist_count);
-				mmh::sort_get_permutation(m_artist_list.get_ptr(), perm, t_artist::g_compare_id, false);
-				next_id = m_artist_list[perm[current_artist_count - 1]]->id + 1;
+				t_artist::ptr artist = m_artist_list[i];
+				auto iter = track_by_artist_id.find(artist->id);
+				if (iter != track_by_artist_id.end())
+				{
+					artist->temp_season_number = m_tracks[iter->second]->season_number;
+					artist->temp_show = m_tracks[iter->second]->show;
+					artist->temp_track_pid = m_tracks[iter->second]->pid;
+				}
+				g_get_artist_key(artist->artist, artist->temp_show, artist->temp_season_number, key);
+				artists_by_key.emplace(key, i);
+				if (i == 0 || artist->id >= next_id)
+					next_id = artist->id + 1;
 			}
 
-			t_size i;
 			for (i = 0; i<track_count; i++)
 			{
-				t_size index = pfc_infinite;
-				bool b_found = false;
-
-				t_uint32 type = 0;
-				//if (m_tracks[i]->album_artist_valid || m_tracks[i]->artist_valid || m_tracks[i]->show_valid || m_tracks[i]->season_number)
-				type = ai_types::song;
-
-				//if (type == ai_types::song)
-				{
-					if (b_found = m_artist_list.bsearch_t(t_artist::g_compare_standard_track, m_tracks[i], index))
-						m_tracks[i]->artist_id = m_artist_list[index]->id;
-				}
+				g_get_artist_key(m_tracks[i]->album_artist_valid ? m_tracks[i]->album_artist : m_tracks[i]->artist, m_tracks[i]->show, m_tracks[i]->season_number, key);
 
-				if (!b_found)
+				auto iter = artists_by_key.find(key);
+				if (iter != artists_by_key.end())
+					m_tracks[i]->artist_id = m_artist_list[iter->second]->id;
+				else
 				{
 					t_artist::ptr temp = new t_artist;
 					temp->id = next_id;
-					temp->type = type;
+					temp->type = ai_types::song;
 
 					temp->temp_season_number = m_tracks[i]->season_number;
 					temp->temp_show = m_tracks[i]->show;
 					temp->temp_track_pid = m_tracks[i]->pid;
 
-					//if (type == ai_types::song)
+					if (m_tracks[i]->album_artist_valid || m_tracks[i]->artist_valid)
 					{
-						if (m_tracks[i]->album_artist_valid || m_tracks[i]->artist_valid)
-						{
-							temp->artist_valid = true;
-							temp->artist = (m_tracks[i]->album_artist_valid ? m_tracks[i]->album_artist : m_tracks[i]->artist);
-						}
-
-						if (m_tracks[i]->album_artist_valid)
-						{
-							temp->sort_artist_valid = m_tracks[i]->sort_album_artist_valid;
-							temp->sort_artist = m_tracks[i]->sort_album_artist;
-						}
-						else if (m_tracks[i]->sort_artist_valid)
-						{
-							temp->sort_artist_valid = true;
-							temp->sort_artist = m_tracks[i]->sort_artist;
-						}
+						temp->artist_valid = true;
+						temp->artist = (m_tracks[i]->album_artist_valid ? m_tracks[i]->album_artist : m_tracks[i]->artist);
 					}
-					m_artist_list.insert_item(temp, index);
 
-					//else
-					//	temp.release();
-
-					if (temp.is_valid())
+					if (m_tracks[i]->album_artist_valid)
+					{
+						temp->sort_artist_valid = m_tracks[i]->sort_album_artist_valid;
+						temp->sort_artist = m_tracks[i]->sort_album_artist;
+					}
+					else if (m_tracks[i]->sort_artist_valid)
 					{
-						m_tracks[i]->artist_id = temp->id;
-						//m_artist_list.add_item(temp);
-						next_id++;
+						temp->sort_artist_valid = true;
+						temp->sort_artist = m_tracks[i]->sort_artist;
 					}
+
+					m_tracks[i]->artist_id = temp->id;
+					artists_by_key.emplace(key, m_artist_list.add_item(temp));
+					next_id++;
 				}
 			}
 
-#if 1
 			//purge dead entries
-			current_artist_count = m_artist_list.get_count();
-			pfc::array_staticsize_t<bool> mask(current_artist_count);
-			mmh::Permutation perm_aid(m_tracks.get_count());
-
-			mmh::sort_get_permutation(m_tracks.get_ptr(), perm_aid, t_track::g_compare_artist_id, false);
-
-			t_size dummy;
+			{
+				std::unordered_set<t_uint32> used_ids;
+				used_ids.reserve(track_count);
+				for (i = 0; i<track_count; i++)
+					used_ids.insert(m_tracks[i]->artist_id);
 
-			for (i = 0; i<current_artist_count; i++)
-				mask[i] = !pfc::bsearch_permutation_t(m_tracks.get_count(), m_tracks, t_track::g_compare_artist_id_value, m_artist_list[i]->id, perm_aid, dummy);
+				current_artist_count = m_artist_list.get_count();
+				pfc::array_staticsize_t<bool> mask(current_artist_count);
+				for (i = 0; i<current_artist_count; i++)
+					mask[i] = used_ids.find(m_artist_list[i]->id) == used_ids.end();
 
-			m_artist_list.remove_mask(mask.get_ptr());
-#endif
+				m_artist_list.remove_mask(mask.get_ptr());
+			}
 
-			//generate pids
+			//Sorted once here rather than kept sorted by each insert, so the list order is as before
 			current_artist_count = m_artist_list.get_count();
+			{
+				mmh::Permutation pNormal(current_artist_count);
+				mmh::sort_get_permutation(m_artist_list.get_ptr(), pNormal, t_artist::g_compare_standard, false);
+				m_artist_list.reorder(pNormal.data());
+			}
 
-			mmh::Permutation perm_pid(current_artist_count);
-			mmh::sort_get_permutation(m_artist_list.get_ptr(), perm_pid, t_artist::g_compare_pid, false);
+			//generate pids
+			{
+				std::unordered_set<t_uint64> pids;
+				pids.reserve(current_artist_count);
+				for (i = 0; i<current_artist_count; i++)
+					pids.insert(m_artist_list[i]->pid);
 
-			genrand_service::ptr p_genrand = genrand_service::g_create();
-			p_genrand->seed(GetTickCount());
+				genrand_service::ptr p_genrand = genrand_service::g_create();
+				p_genrand->seed(GetTickCount());
 
-			for (i = 0; i<current_artist_count; i++)
-			{
-				if (m_artist_list[i]->pid == NULL)
+				for (i = 0; i<current_artist_count; i++)
 				{
-					t_uint64 new_pid = NULL;
-					t_size attempts = 66;
-					do {
-						t_uint64 p1 = p_genrand->genrand(MAXUINT32 - 1) + 1;
-						t_uint64 p2 = p_genrand->genrand(MAXUINT32);
-						new_pid = p1 | (p2 << 32);
-					} while (m_artist_list.have_pid(new_pid) && --attempts);
-					if (attempts)
-						m_artist_list[i]->pid = new_pid;
-					else
-						break;
+					if (m_artist_list[i]->pid == NULL)
+					{
+						t_uint64 new_pid = NULL;
+						t_size attempts = 66;
+						do {
+							t_uint64 p1 = p_genrand->genrand(MAXUINT32 - 1) + 1;
+							t_uint64 p2 = p_genrand->genrand(MAXUINT32);
+							new_pid = p1 | (p2 << 32);
+						} while (pids.find(new_pid) != pids.end() && --attempts);
+						if (attempts)
+						{
+							m_artist_list[i]->pid = new_pid;
+							pids.insert(new_pid);
+						}
+						else
+							break;
+					}
 				}
 			}
 
 			//fill album artist_pids
 			{
-				mmh::Permutation permArtistListbyID(current_artist_count);
-				mmh::sort_get_permutation(m_artist_list.get_ptr(), permArtistListbyID, t_artist::g_compare_id, false);
+				t_size count_albums = m_album_list.m_master_list.get_count();
+				std::unordered_map<t_uint32, t_size> albums_by_id, artists_by_id;
+				albums_by_id.reserve(count_albums);
+				artists_by_id.reserve(current_artist_count);
+				for (i = 0; i<count_albums; i++)
+					albums_by_id.emplace(m_album_list.m_master_list[i]->id, i);
+				for (i = 0; i<current_artist_count; i++)
+					artists_by_id.emplace(m_artist_list[i]->id, i);
 
-				for (t_size i = 0; i<track_count; i++)
+				for (i = 0; i<track_count; i++)
 				{
-					t_size index_album, index_artist;
-					if (m_album_list.m_master_list.bsearch_permutation_t(t_album::g_compare_id_value, m_tracks[i]->album_id, permAlbumListbyID, index_album)
-						&& m_artist_list.bsearch_permutation_t(t_artist::g_compare_id_value, m_tracks[i]->artist_id, permArtistListbyID, index_artist))
-						m_album_list.m_master_list[index_album]->artist_pid = m_artist_list[index_artist]->pid;
+					auto iter_album = albums_by_id.find(m_tracks[i]->album_id);
+					auto iter_artist = artists_by_id.find(m_tracks[i]->artist_id);
+					if (iter_album != albums_by_id.end() && iter_artist != artists_by_id.end())
+						m_album_list.m_master_list[iter_album->second]->artist_pid = m_artist_list[iter_artist->second]->pid;
 				}
 			}
 			//fill artwork_album_pids
 			{
 				t_size count_albums = m_album_list.m_master_list.get_count();
-				pfc::list_t< t_album::ptr, pfc::alloc_fast_aggressive > p_artwork_albums;
-				p_artwork_albums.prealloc(count_albums);
+				std::unordered_set<t_uint64> artwork_album_pids;
+				std::unordered_map<t_uint64, t_uint64> artwork_album_by_artist_pid;
 				for (i = 0; i<count_albums; i++)
-					if (m_album_list.m_master_list[i]->artwork_item_pid)
-						p_artwork_albums.add_item(m_album_list.m_master_list[i]);
-
-				current_artist_count = m_artist_list.get_count();
-				t_size count_artwork_albums = p_artwork_albums.get_count();
-				mmh::Permutation perm_album_pid(count_artwork_albums), perm_album_artist_pid(count_artwork_albums);
-				mmh::sort_get_permutation(p_artwork_albums.get_ptr(), perm_album_pid, t_album::g_compare_pid, false);
-				mmh::sort_get_permutation(p_artwork_albums.get_ptr(), perm_album_artist_pid, t_album::g_compare_artist_pid, false);
+				{
+					const t_album::ptr & album = m_album_list.m_master_list[i];
+					if (album->artwork_item_pid)
+					{
+						artwork_album_pids.insert(album->pid);
+						artwork_album_by_artist_pid.emplace(album->artist_pid, album->pid);
+					}
+				}
 
 				for (i = 0; i<current_artist_count; i++)
 				{
 					t_artist::ptr artist = m_artist_list[i];
-					t_size dummy_index = pfc_infinite;
-					if (artist->artwork_album_pid == NULL || !p_artwork_albums.bsearch_permutation_t(t_album::g_compare_pid_value, artist->artwork_album_pid, perm_album_pid, dummy_index))
+					if (artist->artwork_album_pid == NULL || artwork_album_pids.find(artist->artwork_album_pid) == artwork_album_pids.end())
 					{
-						t_size index;
-						if (p_artwork_albums.bsearch_permutation_t(t_album::g_compare_artist_pid_value, artist->pid, perm_album_artist_pid, index))
-						{
-							artist->artwork_album_pid = p_artwork_albums[index]->pid;
-						}
-						else artist->artwork_album_pid = NULL;
+						auto iter = artwork_album_by_artist_pid.find(artist->pid);
+						artist->artwork_album_pid = iter != artwork_album_by_artist_pid.end() ? iter->second : NULL;
 					}
 				}
 			}
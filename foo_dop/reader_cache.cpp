@@ -7,6 +7,325 @@ namespace ipod
 {
 	namespace tasks
 	{
+		class folder_file_stats_t
+		{
+		public:
+			std::unordered_map<std::string, t_filestats> m_files;
+			bool m_valid;
+
+			folder_file_stats_t() : m_valid(false) {};
+		};
+
+		/** Lists the files in a folder with their sizes and last write times, keyed by lower case name. */
+		static void g_get_folder_file_stats(const char * folder, folder_file_stats_t & p_out)
+		{
+			p_out.m_valid = false;
+			p_out.m_files.clear();
+
+			pfc::string8 pattern = folder;
+			pattern << "\\*";
+			WIN32_FIND_DATA data;
+			HANDLE find = FindFirstFileEx(pfc::stringcvt::string_os_from_utf8(pattern), FindExInfoBasic, &data, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+			if (find == INVALID_HANDLE_VALUE)
+				return;
+
+			pfc::string8 name;
+			do
+			{
+				if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+				t_filestats stats = filestats_invalid;
+				stats.m_size = (t_filesize(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+				stats.m_timestamp = (t_filetimestamp(data.ftLastWriteTime.dwHighDateTime) << 32) | data.ftLastWriteTime.dwLowDateTime;
+				uStringLower(name, pfc::stringcvt::string_utf8_from_os(data.cFileName));
+				p_out.m_files[name.get_ptr()] = stats;
+			}
+			while (FindNextFile(find, &data));
+
+			p_out.m_valid = GetLastError() == ERROR_NO_MORE_FILES;
+			FindClose(find);
+		}
+
+		t_uint64 metadata_cache_t::g_hash(const t_uint8 * p_data, t_size size)
+		{
+			//FNV-1a
+			t_uint64 hash = 14695981039346656037ULL;
+			for (t_size i=0; i<size; i++)
+			{
+				hash ^= p_data[i];
+				hash *= 1099511628211ULL;
+			}
+			return hash;
+		}
+
+		void metadata_cache_t::g_write_info(stream_writer_mem & p_out, const metadb_handle_ptr & p_handle, const file_info & p_info, const t_filestats & p_stats, abort_callback & p_abort)
+		{
+			p_out.write_string(p_handle->get_path(), p_abort);
+			p_out.write_lendian_t(t_uint32(p_handle->get_subsong_index()), p_abort);
+			p_out.write_lendian_t(t_uint64(p_stats.m_size), p_abort);
+			p_out.write_lendian_t(t_uint64(p_stats.m_timestamp), p_abort);
+			p_out.write_lendian_t(p_info.get_length(), p_abort);
+
+			replaygain_info rg = p_info.get_replaygain();
+			p_out.write_lendian_t(rg.m_album_gain, p_abort);
+			p_out.write_lendian_t(rg.m_track_gain, p_abort);
+			p_out.write_lendian_t(rg.m_album_peak, p_abort);
+			p_out.write_lendian_t(rg.m_track_peak, p_abort);
+
+			t_size i, count = p_info.meta_get_count();
+			p_out.write_lendian_t(t_uint32(count), p_abort);
+			for (i=0; i<count; i++)
+			{
+				p_out.write_string(p_info.meta_enum_name(i), p_abort);
+				t_size j, count_values = p_info.meta_enum_value_count(i);
+				p_out.write_lendian_t(t_uint32(count_values), p_abort);
+				for (j=0; j<count_values; j++)
+					p_out.write_string(p_info.meta_enum_value(i, j), p_abort);
+			}
+
+			count = p_info.info_get_count();
+			p_out.write_lendian_t(t_uint32(count), p_abort);
+			for (i=0; i<count; i++)
+			{
+				p_out.write_string(p_info.info_enum_name(i), p_abort);
+				p_out.write_string(p_info.info_enum_value(i), p_abort);
+			}
+		}
+
+		bool metadata_cache_t::g_read_info(const t_uint8 * p_data, t_size size, const metadb_handle_ptr & p_handle, file_info & p_info, t_filestats & p_stats, abort_callback & p_abort)
+		{
+			fbh::StreamReaderMemblock stream(p_data, size);
+			pfc::string8 name, value;
+			t_uint32 subsong;
+			stream.read_string(value, p_abort);
+			stream.read_lendian_t(subsong, p_abort);
+			//The pid may since have been given to a different file
+			if (subsong != p_handle->get_subsong_index() || strcmp(value, p_handle->get_path()))
+				return false;
+
+			stream.read_lendian_t(p_stats.m_size, p_abort);
+			stream.read_lendian_t(p_stats.m_timestamp, p_abort);
+			double length;
+			stream.read_lendian_t(length, p_abort);
+
+			p_info.reset();
+			p_info.set_length(length);
+
+			replaygain_info rg;
+			stream.read_lendian_t(rg.m_album_gain, p_abort);
+			stream.read_lendian_t(rg.m_track_gain, p_abort);
+			stream.read_lendian_t(rg.m_album_peak, p_abort);
+			stream.read_lendian_t(rg.m_track_peak, p_abort);
+			p_info.set_replaygain(rg);
+
+			t_uint32 i, count;
+			stream.read_lendian_t(count, p_abort);
+			for (i=0; i<count; i++)
+			{
+				t_uint32 j, count_values;
+				stream.read_string(name, p_abort);
+				stream.read_lendian_t(count_values, p_abort);
+				for (j=0; j<count_values; j++)
+				{
+					stream.read_string(value, p_abort);
+					p_info.meta_add(name, value);
+				}
+			}
+
+			stream.read_lendian_t(count, p_abort);
+			for (i=0; i<count; i++)
+			{
+				stream.read_string(name, p_abort);
+				stream.read_string(value, p_abort);
+				p_info.info_set(name, value);
+			}
+			return true;
+		}
+
+		bool metadata_cache_t::load(const char * p_root, const track_list_t & p_tracks, const pfc::list_base_const_t<metadb_handle_ptr> & p_handles, abort_callback & p_abort)
+		{
+			m_hashes.clear();
+			m_record_count = 0;
+			m_valid = false;
+
+			pfc::string8 path;
+			g_get_path(p_root, path);
+			if (!filesystem::g_exists(path, p_abort))
+				return false;
+
+			pfc::array_t<t_uint8> data;
+			{
+				service_ptr_t<file> p_file;
+				filesystem::g_open_read(p_file, path, p_abort);
+				data.set_size(pfc::downcast_guarded<t_size>(p_file->get_size_ex(p_abort)));
+				p_file->read_object(data.get_ptr(), data.get_size(), p_abort);
+			}
+
+			fbh::StreamReaderMemblock stream(data.get_ptr(), data.get_size());
+			t_uint32 identifier = 0, version = 0;
+			if (stream.get_remaining() >= 8)
+			{
+				stream.read_lendian_t(identifier, p_abort);
+				stream.read_lendian_t(version, p_abort);
+			}
+			if (identifier != cache_identifier || version != cache_version)
+			{
+				console::formatter() << "iPod manager: Warning: Unrecognised metadata_cache.dop on iPod. Cache will be regenerated.";
+				return false;
+			}
+
+			//Later records supersede earlier ones
+			std::unordered_map<t_uint64, std::pair<t_size, t_size> > records;
+			m_valid = true;
+			while (stream.get_remaining())
+			{
+				if (stream.get_remaining() < record_header_size)
+				{
+					m_valid = false;
+					break;
+				}
+				t_uint8 type;
+				t_uint64 pid;
+				t_uint32 size;
+				stream.read_lendian_t(type, p_abort);
+				stream.read_lendian_t(pid, p_abort);
+				stream.read_lendian_t(size, p_abort);
+				if (stream.get_remaining() < size)
+				{
+					m_valid = false;
+					break;
+				}
+				t_size offset = data.get_size() - pfc::downcast_guarded<t_size>(stream.get_remaining());
+				stream.skip_object(size, p_abort);
+				m_record_count++;
+
+				if (type == record_removed)
+					records.erase(pid);
+				else if (type == record_info)
+					records[pid] = std::make_pair(offset, t_size(size));
+			}
+			if (!m_valid)
+				console::formatter() << "iPod manager: Warning: metadata_cache.dop on iPod is truncated. Cache will be compacted.";
+
+			for (auto iter = records.begin(); iter != records.end(); ++iter)
+				m_hashes[iter->first] = g_hash(data.get_ptr() + iter->second.first, iter->second.second);
+
+			metadb_handle_list handles;
+			pfc::list_t<file_info_impl> infos;
+			pfc::list_t<t_filestats> stats;
+			t_size i, count = p_tracks.get_count();
+			for (i=0; i<count; i++)
+			{
+				auto iter = records.find(p_tracks[i]->pid);
+				if (iter == records.end()) continue;
+
+				file_info_impl info;
+				t_filestats item_stats;
+				try
+				{
+					if (!g_read_info(data.get_ptr() + iter->second.first, iter->second.second, p_handles[i], info, item_stats, p_abort))
+						continue;
+				}
+				catch (exception_io_data const &)
+				{
+					m_hashes.erase(iter->first);
+					m_valid = false;
+					continue;
+				}
+				handles.add_item(p_handles[i]);
+				infos.add_item(info);
+				stats.add_item(item_stats);
+			}
+
+			if (handles.get_count())
+			{
+				pfc::list_t<const file_info*> info_ptrs;
+				count = infos.get_count();
+				info_ptrs.set_count(count);
+				for (i=0; i<count; i++)
+					info_ptrs[i] = &infos[i];
+				static_api_ptr_t<metadb_io_v3>()->hint_multi_async(handles, info_ptrs, stats, pfc::bit_array_false());
+			}
+			return true;
+		}
+
+		void metadata_cache_t::save(const char * p_root, const track_list_t & p_tracks, const pfc::list_base_const_t<metadb_handle_ptr> & p_handles, abort_callback & p_abort)
+		{
+			std::unordered_map<t_uint64, t_uint64> hashes;
+			stream_writer_mem changes, all, record;
+			t_size count_changed = 0, i, count = p_tracks.get_count();
+			hashes.reserve(count);
+
+			auto write_record = [&p_abort] (stream_writer_mem & p_out, t_uint8 type, t_uint64 pid, const void * p_data, t_size size)
+			{
+				p_out.write_lendian_t(type, p_abort);
+				p_out.write_lendian_t(pid, p_abort);
+				p_out.write_lendian_t(t_uint32(size), p_abort);
+				p_out.write(p_data, size, p_abort);
+			};
+
+			for (i=0; i<count; i++)
+			{
+				metadb_info_container::ptr p_info;
+				if (!p_handles[i]->get_async_info_ref(p_info))
+					continue;
+				t_uint64 pid = p_tracks[i]->pid;
+				if (hashes.count(pid))
+					continue;
+
+				record.set_size(0);
+				g_write_info(record, p_handles[i], p_info->info(), p_info->stats(), p_abort);
+				t_uint64 hash = g_hash(record.get_ptr(), record.get_size());
+				hashes[pid] = hash;
+
+				write_record(all, record_info, pid, record.get_ptr(), record.get_size());
+				auto iter = m_hashes.find(pid);
+				if (iter == m_hashes.end() || iter->second != hash)
+				{
+					write_record(changes, record_info, pid, record.get_ptr(), record.get_size());
+					count_changed++;
+				}
+			}
+			for (auto iter = m_hashes.begin(); iter != m_hashes.end(); ++iter)
+			{
+				if (!hashes.count(iter->first))
+				{
+					write_record(changes, record_removed, iter->first, NULL, 0);
+					count_changed++;
+				}
+			}
+
+			pfc::string8 path;
+			g_get_path(p_root, path);
+
+			bool b_compact = !m_valid || m_record_count + count_changed > 2 * hashes.size() + 64;
+			if (b_compact)
+			{
+				pfc::string8 newpath = path;
+				newpath << ".temp";
+				{
+					service_ptr_t<file> p_file;
+					filesystem::g_open_write_new(p_file, newpath, p_abort);
+					p_file->write_lendian_t(t_uint32(cache_identifier), p_abort);
+					p_file->write_lendian_t(t_uint32(cache_version), p_abort);
+					p_file->write(all.get_ptr(), all.get_size(), p_abort);
+				}
+				if (filesystem::g_exists(path, p_abort))
+					filesystem::g_remove(path, p_abort);
+				filesystem::g_move(newpath, path, p_abort);
+				m_record_count = hashes.size();
+				m_valid = true;
+			}
+			else if (count_changed)
+			{
+				service_ptr_t<file> p_file;
+				filesystem::g_open(p_file, path, filesystem::open_mode_write_existing, p_abort);
+				p_file->seek(p_file->get_size_ex(p_abort), p_abort);
+				p_file->write(changes.get_ptr(), changes.get_size(), p_abort);
+				m_record_count += count_changed;
+			}
+			m_hashes.swap(hashes);
+		}
+
 		void load_database_t::load_cache(HWND wnd, ipod_device_ptr_ref_t p_ipod, bool b_CheckIfFilesChanged, threaded_process_v2_t & p_status, abort_callback & p_abort)
 		{
 			pfc::string8 base;
@@ -14,26 +333,75 @@ namespace ipod
 
 			metadb_handle_list handlestoread(m_handles);
 
-			pfc::string8 cachePath = base;
-			cachePath << "metadata_cache.fpl";
-
-			//We want to hint from main thread to avoid annoyances
 			static_api_ptr_t<main_thread_callback_manager> p_main_thread;
 			p_status.update_text("Loading metadata cache");
-			service_ptr_t<t_main_thread_load_cache_v2_t> p_cache_loader = new service_impl_t<t_main_thread_load_cache_v2_t>
-				(base);
 
-			p_cache_loader->callback_run();
-			//p_main_thread->add_callback(p_cache_loader);
-			if (!p_cache_loader->m_signal.wait_for(-1))
-				throw pfc::exception("Cache read timeout!");
-			if (!p_cache_loader->m_ret)
-				throw pfc::exception(pfc::string8() << "Error reading metadata cache: " << p_cache_loader->m_error);
+			bool b_cache_loaded = false;
+			try
+			{
+				b_cache_loaded = m_metadata_cache.load(base, m_tracks, m_handles, p_abort);
+			}
+			catch (exception_aborted const &) {throw;}
+			catch (pfc::exception const & ex)
+			{
+				console::formatter() << "iPod manager: Warning: Error reading metadata_cache.dop from iPod: " << ex.what() << " Cache will be regenerated.";
+			}
+
+			//Devices last written by older versions only have the playlist based cache
+			if (!b_cache_loaded)
+			{
+				service_ptr_t<t_main_thread_load_cache_v2_t> p_cache_loader = new service_impl_t<t_main_thread_load_cache_v2_t>
+					(base);
+
+				p_cache_loader->callback_run();
+				//p_main_thread->add_callback(p_cache_loader);
+				if (!p_cache_loader->m_signal.wait_for(-1))
+					throw pfc::exception("Cache read timeout!");
+				if (!p_cache_loader->m_ret)
+					throw pfc::exception(pfc::string8() << "Error reading metadata cache: " << p_cache_loader->m_error);
+			}
 
 			p_status.update_text("Checking files for changes");
 			//pfc::hires_timer timer2;
 			//timer2.start();
 			t_size n = handlestoread.get_count(), count = n;
+
+			//Each folder is listed once, rather than every file being opened. The folders are listed in parallel.
+			std::unordered_map<std::string, t_size> folder_indices;
+			pfc::list_t<pfc::string8> folders;
+			pfc::array_t<t_size> track_folders;
+			if (!p_ipod->mobile && b_CheckIfFilesChanged)
+			{
+				track_folders.set_size(count);
+				pfc::string8 folder;
+				for (t_size i=0; i<count; i++)
+				{
+					track_folders[i] = pfc_infinite;
+					const char * path = handlestoread[i]->get_path();
+					if (stricmp_utf8_max(path, "file://", 7)) continue;
+					path += 7;
+					t_size length = pfc::scan_filename(path);
+					if (!length) continue;
+					uStringLower(folder, path, length - 1);
+					auto iter = folder_indices.find(folder.get_ptr());
+					if (iter == folder_indices.end())
+						iter = folder_indices.emplace(folder.get_ptr(), folders.add_item(pfc::string8(path, length - 1))).first;
+					track_folders[i] = iter->second;
+				}
+			}
+			pfc::array_t<folder_file_stats_t> folder_stats;
+			folder_stats.set_size(folders.get_count());
+			{
+				auto list_folder = [&] (t_size index)
+				{
+					if (!p_abort.is_aborting())
+						g_get_folder_file_stats(folders[index], folder_stats[index]);
+				};
+				parallel_for_t<decltype(list_folder)>(folders.get_count(), list_folder, 1).run(8);
+				p_abort.check();
+			}
+
+			pfc::string8 filename;
 			for (; n; n--)
 			{
 				if (p_ipod->mobile || !b_CheckIfFilesChanged)
@@ -58,13 +426,34 @@ namespace ipod
 						if (!stricmp_utf8_max(path, "file://", 7))
 						{
 							path += 7;
-							win32::handle_ptr_t p_file =
-								CreateFile(pfc::stringcvt::string_os_from_utf8(path), FILE_READ_ATTRIBUTES, FILE_SHARE_READ, NULL, OPEN_EXISTING, NULL, NULL);
-							if (p_file.is_valid())
+							bool b_found = false;
+							t_filestats newstats = filestats_invalid;
+
+							t_size folder = track_folders[n - 1];
+							if (folder != pfc_infinite && folder_stats[folder].m_valid)
+							{
+								uStringLower(filename, path + pfc::scan_filename(path));
+								auto iter = folder_stats[folder].m_files.find(filename.get_ptr());
+								if (iter != folder_stats[folder].m_files.end())
+								{
+									newstats = iter->second;
+									b_found = true;
+								}
+							}
+							else
+							{
+								win32::handle_ptr_t p_file =
+									CreateFile(pfc::stringcvt::string_os_from_utf8(path), FILE_READ_ATTRIBUTES, FILE_SHARE_READ, NULL, OPEN_EXISTING, NULL, NULL);
+								if (p_file.is_valid())
+								{
+									GetFileSizeEx(p_file, (PLARGE_INTEGER)&newstats.m_size);
+									GetFileTime(p_file, NULL, NULL, (LPFILETIME)&newstats.m_timestamp);
+									b_found = true;
+								}
+							}
+
+							if (b_found)
 							{
-								t_filestats newstats = filestats_invalid;
-								GetFileSizeEx(p_file, (PLARGE_INTEGER)&newstats.m_size);
-								GetFileTime(p_file, NULL, NULL, (LPFILETIME)&newstats.m_timestamp);
 								m_tracks[n - 1]->m_runtime_filestats = newstats;
 								if (handlestoread[n - 1]->is_info_loaded_async())
 								{
@@ -109,16 +498,22 @@ namespace ipod
 			pfc::string8 base;
 			p_ipod->get_root_path(base);
 
-			pfc::string8 path = base; path << "metadata_cache.fpl";
+			pfc::string8 path;
+			metadata_cache_t::g_get_path(base, path);
 			try
 			{
-				playlist_loader::g_save_playlist(path, m_handles, abort_callback_dummy());
+				m_metadata_cache.save(base, m_tracks, m_handles, abort_callback_dummy());
+
+				pfc::string8 legacy_path = base; legacy_path << "metadata_cache.fpl";
+				try { filesystem::g_remove(legacy_path, abort_callback_dummy()); }
+				catch (pfc::exception const &) {};
 			}
 			catch (const pfc::exception & ex)
 			{
+				m_metadata_cache = metadata_cache_t();
 				try { filesystem::g_remove(path, abort_callback_dummy()); }
 				catch (pfc::exception const &) {};
-				console::formatter() << "iPod manager: Error saving metadata_cache.fpl to iPod: " << ex.what();
+				console::formatter() << "iPod manager: Error saving metadata_cache.dop to iPod: " << ex.what();
 				//throw;
 			}
 			p_status.checkpoint();
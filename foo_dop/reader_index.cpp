@@ -0,0 +1,208 @@
+#include "stdafx.h"
+
+#include "reader.h"
+
+namespace ipod
+{
+	namespace tasks
+	{
+		void library_index_t::g_fold_name(const char * name, std::string & p_out)
+		{
+			p_out.clear();
+			g_append_folded_name(name, p_out);
+			p_out.pop_back();
+		}
+
+		void library_index_t::g_append_folded_name(const char * name, std::string & p_out)
+		{
+			//Same folding as stricmp_utf8
+			char buffer[8];
+			for (;;)
+			{
+				unsigned c;
+				t_size len = pfc::utf8_decode_char(name, c);
+				if (len == 0) break;
+				name += len;
+				t_size len_out = pfc::utf8_encode_char(pfc::charLower(c), buffer);
+				p_out.append(buffer, len_out);
+			}
+			p_out.push_back('\0');
+		}
+
+		void library_index_t::build_tracks(const track_list_t & p_tracks)
+		{
+			t_size count = p_tracks.get_count(), start = 0;
+
+			//Tracks are normally added by appending, so only index the new tail if the
+			//previously indexed entries still look to be in place.
+			if (m_tracks_valid && m_track_count && count > m_track_count)
+			{
+				auto iter = m_track_pids.find(p_tracks[m_track_count-1]->pid);
+				if (iter != m_track_pids.end() && iter->second == m_track_count-1)
+					start = m_track_count;
+			}
+
+			if (!start)
+			{
+				m_track_pids.clear();
+				m_track_ids.clear();
+			}
+			m_track_pids.reserve(count);
+			m_track_ids.reserve(count);
+			for (t_size i = start; i<count; i++)
+			{
+				//emplace keeps the first occurence, as the linear searches did
+				m_track_pids.emplace(p_tracks[i]->pid, i);
+				m_track_ids.emplace(p_tracks[i]->id, i);
+			}
+			m_track_count = count;
+			m_tracks_valid = true;
+		}
+
+		void library_index_t::build_playlists(const playlist_list_t & p_playlists)
+		{
+			t_size count = p_playlists.get_count();
+			m_playlist_ids.clear();
+			m_playlist_names.clear();
+			m_playlist_ids.reserve(count);
+			m_playlist_names.reserve(count);
+			std::string name;
+			for (t_size i = 0; i<count; i++)
+			{
+				m_playlist_ids.emplace(p_playlists[i]->id, i);
+				if (g_is_named_playlist(*p_playlists[i]))
+				{
+					g_fold_name(p_playlists[i]->name, name);
+					m_playlist_names.emplace(name, i);
+				}
+			}
+			m_playlist_count = count;
+			m_playlists_valid = true;
+		}
+
+		void library_index_t::on_track_added(const track_list_t & p_tracks, t_size index)
+		{
+			insync(m_sync);
+			//Anything but an append to an up to date index is left to the next lookup to rebuild
+			if (m_tracks_valid && index == m_track_count && index + 1 == p_tracks.get_count())
+			{
+				m_track_pids.emplace(p_tracks[index]->pid, index);
+				m_track_ids.emplace(p_tracks[index]->id, index);
+				m_track_count++;
+			}
+			else
+				m_tracks_valid = false;
+		}
+
+		void library_index_t::on_playlist_added(const playlist_list_t & p_playlists, t_size index)
+		{
+			insync(m_sync);
+			if (m_playlists_valid && index == m_playlist_count && index + 1 == p_playlists.get_count())
+			{
+				m_playlist_ids.emplace(p_playlists[index]->id, index);
+				if (g_is_named_playlist(*p_playlists[index]))
+				{
+					std::string name;
+					g_fold_name(p_playlists[index]->name, name);
+					m_playlist_names.emplace(name, index);
+				}
+				m_playlist_count++;
+			}
+			else
+				m_playlists_valid = false;
+		}
+
+		bool library_index_t::find_track_by_pid(const track_list_t & p_tracks, t_uint64 pid, t_size & index)
+		{
+			insync(m_sync);
+			t_size count = p_tracks.get_count();
+			for (t_size pass = 0; pass < 2; pass++)
+			{
+				if (pass)
+					m_tracks_valid = false;
+				if (!m_tracks_valid || m_track_count != count)
+					build_tracks(p_tracks);
+				auto iter = m_track_pids.find(pid);
+				//Additions and removals keep the index up to date, so a miss is final
+				if (iter == m_track_pids.end())
+					break;
+				if (iter->second < count && p_tracks[iter->second]->pid == pid)
+				{
+					index = iter->second;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		bool library_index_t::find_track_by_id(const track_list_t & p_tracks, t_uint32 id, t_size & index)
+		{
+			insync(m_sync);
+			t_size count = p_tracks.get_count();
+			for (t_size pass = 0; pass < 2; pass++)
+			{
+				if (pass)
+					m_tracks_valid = false;
+				if (!m_tracks_valid || m_track_count != count)
+					build_tracks(p_tracks);
+				auto iter = m_track_ids.find(id);
+				if (iter == m_track_ids.end())
+					break;
+				if (iter->second < count && p_tracks[iter->second]->id == id)
+				{
+					index = iter->second;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		bool library_index_t::find_playlist_by_id(const playlist_list_t & p_playlists, t_uint64 id, t_size & index)
+		{
+			insync(m_sync);
+			t_size count = p_playlists.get_count();
+			for (t_size pass = 0; pass < 2; pass++)
+			{
+				if (pass)
+					m_playlists_valid = false;
+				if (!m_playlists_valid || m_playlist_count != count)
+					build_playlists(p_playlists);
+				auto iter = m_playlist_ids.find(id);
+				if (iter == m_playlist_ids.end())
+					break;
+				if (iter->second < count && p_playlists[iter->second]->id == id)
+				{
+					index = iter->second;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		bool library_index_t::find_playlist_by_name(const playlist_list_t & p_playlists, const char * name, t_size & index)
+		{
+			std::string key;
+			g_fold_name(name, key);
+
+			insync(m_sync);
+			t_size count = p_playlists.get_count();
+			for (t_size pass = 0; pass < 2; pass++)
+			{
+				if (pass)
+					m_playlists_valid = false;
+				if (!m_playlists_valid || m_playlist_count != count)
+					build_playlists(p_playlists);
+				auto iter = m_playlist_names.find(key);
+				if (iter == m_playlist_names.end())
+					break;
+				if (iter->second < count && g_is_named_playlist(*p_playlists[iter->second])
+					&& !stricmp_utf8(name, p_playlists[iter->second]->name))
+				{
+					index = iter->second;
+					return true;
+				}
+			}
+			return false;
+		}
+	}
+}
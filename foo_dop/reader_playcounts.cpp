@@ -345,6 +345,7 @@ namespace ipod
 						}
 						m_tracks.remove_mask(mask_to_remove.get_ptr());
 						m_handles.remove_mask(mask_to_remove.get_ptr());
+						m_index.invalidate_tracks();
 					}
 				}
 				catch (const exception_aborted &)
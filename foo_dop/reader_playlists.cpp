@@ -88,6 +88,7 @@ void load_database_t::load_device_playlist(const DevicePlaylist& otg_playlist)
 		size_t playlist_index;
 		if (find_playlist_by_id(otg_playlist.playlist_persistent_id, playlist_index)) {
 			m_playlists.remove_by_idx(playlist_index);
+			m_index.invalidate_playlists();
 		}
 		return;
 	}
@@ -97,6 +98,8 @@ void load_database_t::load_device_playlist(const DevicePlaylist& otg_playlist)
 	const bool is_new_playlist = !find_playlist_by_id(otg_playlist.playlist_persistent_id, index);
 	auto playlist = is_new_playlist ? pfc::rcnew_t<itunesdb::t_playlist>() : m_playlists[index];
 	playlist->id = static_cast<uint64_t>(otg_playlist.playlist_persistent_id);
+	if (!is_new_playlist && strcmp(playlist->name, otg_playlist.name))
+		m_index.invalidate_playlists();
 	playlist->name = otg_playlist.name;
 	if (is_new_playlist)
 		playlist->timestamp = now;
@@ -118,7 +121,7 @@ void load_database_t::load_device_playlist(const DevicePlaylist& otg_playlist)
 	// In theory we would need to (re)generate VoiceOver files for playlist names, however
 	// those are only for iPod shuffles.
 	if (is_new_playlist) {
-		m_playlists.add_item(playlist);
+		add_playlist(playlist);
 	}
 }
 
@@ -167,8 +167,7 @@ namespace ipod
 
 												metadb_handle_ptr handle;
 												static_api_ptr_t<metadb>()->handle_create(handle, make_playable_location(pfc::string8() << path_podcasts << fname, 0/*items[i]->get_subsong_index()*/));
-												m_tracks.add_item(track);
-												m_handles.add_item(handle);
+												add_track(track, handle);
 
 												//console::formatter() << "iPod manager: Importing: PID: " << track->pid << "; Title : " << track->title;
 											}
@@ -9,11 +9,6 @@ static int g_compare_rcptr(const pfc::rcptr_t< t_item1 > & p_item1, const pfc::r
 	return pfc::compare_t(&*p_item1, &*p_item2);
 }
 
-static int g_compare_track_ptr (const pfc::rcptr_t<t_track> & item1, const pfc::rcptr_t<t_track> &item2)
-{
-	return pfc::compare_t(&(*item1),&(*item2)); //BLAH
-}
-
 namespace ipod
 {
 namespace smart_playlist
@@ -49,17 +44,17 @@ namespace smart_playlist
 		timestamp_is_in_the_last = (0<<24)|(1<<9),
 		timestamp_is_not_in_the_last = (0<<24)|(1<<9)|(1<<25),
 	};
-	bool g_test_track_generic_string(const char * str, const itunesdb::t_smart_playlist_rule & rule)
+	/** value is the rule's string in UTF-8 and value_lower the same passed through string_lower. */
+	bool g_test_track_generic_string(const char * str, const char * str_lower, const itunesdb::t_smart_playlist_rule & rule, const pfc::string8 & value, const pfc::string8 & value_lower)
 	{
-		pfc::stringcvt::string_utf8_from_wide value(rule.string.get_ptr());
 		if (rule.action == string_is)
 			return !stricmp_utf8(str, value.get_ptr());
 		else if (rule.action == string_is_not)
 			return 0 != stricmp_utf8(str, value.get_ptr());
 		else if (rule.action == string_contains)
-			return 0 != strstr(string_lower(str), string_lower(value.get_ptr()));
+			return 0 != strstr(str_lower, value_lower.get_ptr());
 		else if (rule.action == string_does_not_contain)
-			return 0 == strstr(string_lower(str), string_lower(value.get_ptr()));
+			return 0 == strstr(str_lower, value_lower.get_ptr());
 		else if (rule.action == string_begins_with)
 			return !stricmp_utf8_partial(str, value.get_ptr());
 		else if (rule.action == string_ends_with)
@@ -72,6 +67,10 @@ namespace smart_playlist
 		}
 		return false;
 	}
+	bool g_is_string_contains_action(t_uint32 action)
+	{
+		return action == string_contains || action == string_does_not_contain;
+	}
 	bool g_test_track_generic_integer(t_uint64 value, const itunesdb::t_smart_playlist_rule & rule)
 	{
 		if (rule.action == integer_is)
@@ -112,88 +111,226 @@ namespace smart_playlist
 			return rule.from_date*rule.from_units + currenttime/*_from_adjusted*/ >= value;
 		return false;
 	}
-	bool generator_t::g_test_track(const pfc::rcptr_t<t_track> & track, const itunesdb::t_smart_playlist_rule & rule)
+	void track_bitmap_t::reset(t_size count, bool value)
+	{
+		m_count = count;
+		m_words.assign((count+31)/32, 0);
+		if (value)
+			invert();
+	}
+	void track_bitmap_t::invert()
+	{
+		for (t_size i = 0, count = m_words.size(); i<count; i++)
+			m_words[i] = ~m_words[i];
+		if (m_count % 32)
+			m_words.back() &= (1u << (m_count % 32)) - 1;
+	}
+	void track_bitmap_t::and_with(const track_bitmap_t & other)
+	{
+		for (t_size i = 0, count = m_words.size(); i<count; i++)
+			m_words[i] &= other.m_words[i];
+	}
+	void track_bitmap_t::or_with(const track_bitmap_t & other)
 	{
-		switch (rule.field)
+		for (t_size i = 0, count = m_words.size(); i<count; i++)
+			m_words[i] |= other.m_words[i];
+	}
+
+	track_columns_t::field_type_t track_columns_t::g_get_field_type(t_uint32 field)
+	{
+		switch (field)
 		{
 		case itunesdb::smart_playlist_fields::album:
-			return g_test_track_generic_string(track->album, rule);
 		case itunesdb::smart_playlist_fields::album_artist:
-			return g_test_track_generic_string(track->album_artist, rule);
 		case itunesdb::smart_playlist_fields::artist:
-			return g_test_track_generic_string(track->artist, rule);
-		case itunesdb::smart_playlist_fields::bitrate:
-			return g_test_track_generic_integer(track->bitrate, rule);
-		case itunesdb::smart_playlist_fields::bpm:
-			return g_test_track_generic_integer(track->bpm, rule);
 		case itunesdb::smart_playlist_fields::category:
-			return g_test_track_generic_string(track->category, rule);
 		case itunesdb::smart_playlist_fields::comment:
-			return g_test_track_generic_string(track->comment, rule);
-		case itunesdb::smart_playlist_fields::compilation:
-			return g_test_track_generic_integer(track->is_compilation, rule);
 		case itunesdb::smart_playlist_fields::composer:
-			return g_test_track_generic_string(track->composer, rule);
-		case itunesdb::smart_playlist_fields::date_added:
-			return g_test_track_generic_timestamp(track->dateadded, rule, m_timestamp);
-		case itunesdb::smart_playlist_fields::date_modified:
-			return g_test_track_generic_timestamp(track->lastmodifiedtime, rule, m_timestamp);
 		case itunesdb::smart_playlist_fields::description:
-			return g_test_track_generic_string(track->description, rule);
-		case itunesdb::smart_playlist_fields::disc_number:
-			return g_test_track_generic_integer(track->discnumber, rule);
 		case itunesdb::smart_playlist_fields::genre:
-			return g_test_track_generic_string(track->genre, rule);
 		case itunesdb::smart_playlist_fields::grouping:
-			return g_test_track_generic_string(track->grouping, rule);
 		case itunesdb::smart_playlist_fields::kind:
-			return g_test_track_generic_string(track->filetype, rule);
-		case itunesdb::smart_playlist_fields::last_played:
-			return g_test_track_generic_timestamp(track->lastplayedtime, rule, m_timestamp);
-		case itunesdb::smart_playlist_fields::last_skipped:
-			return g_test_track_generic_timestamp(track->last_skipped, rule, m_timestamp);
+		case itunesdb::smart_playlist_fields::sort_album:
+		case itunesdb::smart_playlist_fields::sort_album_artist:
+		case itunesdb::smart_playlist_fields::sort_artist:
+		case itunesdb::smart_playlist_fields::sort_composer:
+		case itunesdb::smart_playlist_fields::sort_show:
+		case itunesdb::smart_playlist_fields::sort_title:
+		case itunesdb::smart_playlist_fields::title:
+		case itunesdb::smart_playlist_fields::tv_show:
+			return field_type_string;
+		case itunesdb::smart_playlist_fields::bitrate:
+		case itunesdb::smart_playlist_fields::bpm:
+		case itunesdb::smart_playlist_fields::compilation:
+		case itunesdb::smart_playlist_fields::disc_number:
 		case itunesdb::smart_playlist_fields::play_count:
-			return g_test_track_generic_integer(track->play_count_user, rule);
 		case itunesdb::smart_playlist_fields::podcast:
-			return g_test_track_generic_integer(track->podcast_flag, rule);
 		case itunesdb::smart_playlist_fields::rating:
-			return g_test_track_generic_integer(track->rating, rule);
 		case itunesdb::smart_playlist_fields::sample_rate:
-			return g_test_track_generic_integer(track->samplerate / 0x10000, rule);
 		case itunesdb::smart_playlist_fields::season_number:
-			return g_test_track_generic_integer(track->season_number, rule);
 		case itunesdb::smart_playlist_fields::size:
-			return g_test_track_generic_integer(track->file_size_32, rule);
 		case itunesdb::smart_playlist_fields::skip_count:
-			return g_test_track_generic_integer(track->skip_count_user, rule);
+		case itunesdb::smart_playlist_fields::time:
+		case itunesdb::smart_playlist_fields::track_number:
+		case itunesdb::smart_playlist_fields::year:
+			return field_type_integer;
+		case itunesdb::smart_playlist_fields::date_added:
+		case itunesdb::smart_playlist_fields::date_modified:
+		case itunesdb::smart_playlist_fields::last_played:
+		case itunesdb::smart_playlist_fields::last_skipped:
+			return field_type_timestamp;
+		case itunesdb::smart_playlist_fields::video_kind:
+			return field_type_bitmask;
+		default:
+			return field_type_none;
+		};
+	}
+	const char * track_columns_t::g_get_string_field(const itunesdb::t_track & track, t_uint32 field)
+	{
+		switch (field)
+		{
+		case itunesdb::smart_playlist_fields::album:
+			return track.album;
+		case itunesdb::smart_playlist_fields::album_artist:
+			return track.album_artist;
+		case itunesdb::smart_playlist_fields::artist:
+			return track.artist;
+		case itunesdb::smart_playlist_fields::category:
+			return track.category;
+		case itunesdb::smart_playlist_fields::comment:
+			return track.comment;
+		case itunesdb::smart_playlist_fields::composer:
+			return track.composer;
+		case itunesdb::smart_playlist_fields::description:
+			return track.description;
+		case itunesdb::smart_playlist_fields::genre:
+			return track.genre;
+		case itunesdb::smart_playlist_fields::grouping:
+			return track.grouping;
+		case itunesdb::smart_playlist_fields::kind:
+			return track.filetype;
 		case itunesdb::smart_playlist_fields::sort_album:
-			return g_test_track_generic_string(track->sort_album, rule);
+			return track.sort_album;
 		case itunesdb::smart_playlist_fields::sort_album_artist:
-			return g_test_track_generic_string(track->sort_album_artist, rule);
+			return track.sort_album_artist;
 		case itunesdb::smart_playlist_fields::sort_artist:
-			return g_test_track_generic_string(track->sort_artist, rule);
+			return track.sort_artist;
 		case itunesdb::smart_playlist_fields::sort_composer:
-			return g_test_track_generic_string(track->sort_composer, rule);
+			return track.sort_composer;
 		case itunesdb::smart_playlist_fields::sort_show:
-			return g_test_track_generic_string(track->sort_show, rule);
+			return track.sort_show;
 		case itunesdb::smart_playlist_fields::sort_title:
-			return g_test_track_generic_string(track->sort_title, rule);
-		case itunesdb::smart_playlist_fields::time:
-			return g_test_track_generic_integer(track->length, rule);
+			return track.sort_title;
 		case itunesdb::smart_playlist_fields::title:
-			return g_test_track_generic_string(track->title, rule);
-		case itunesdb::smart_playlist_fields::track_number:
-			return g_test_track_generic_integer(track->tracknumber, rule);
+			return track.title;
 		case itunesdb::smart_playlist_fields::tv_show:
-			return g_test_track_generic_string(track->show, rule);
+			return track.show;
+		default:
+			return "";
+		};
+	}
+	t_uint64 track_columns_t::g_get_integer_field(const itunesdb::t_track & track, t_uint32 field)
+	{
+		switch (field)
+		{
+		case itunesdb::smart_playlist_fields::bitrate:
+			return track.bitrate;
+		case itunesdb::smart_playlist_fields::bpm:
+			return track.bpm;
+		case itunesdb::smart_playlist_fields::compilation:
+			return track.is_compilation;
+		case itunesdb::smart_playlist_fields::date_added:
+			return track.dateadded;
+		case itunesdb::smart_playlist_fields::date_modified:
+			return track.lastmodifiedtime;
+		case itunesdb::smart_playlist_fields::disc_number:
+			return track.discnumber;
+		case itunesdb::smart_playlist_fields::last_played:
+			return track.lastplayedtime;
+		case itunesdb::smart_playlist_fields::last_skipped:
+			return track.last_skipped;
+		case itunesdb::smart_playlist_fields::play_count:
+			return track.play_count_user;
+		case itunesdb::smart_playlist_fields::podcast:
+			return track.podcast_flag;
+		case itunesdb::smart_playlist_fields::rating:
+			return track.rating;
+		case itunesdb::smart_playlist_fields::sample_rate:
+			return track.samplerate / 0x10000;
+		case itunesdb::smart_playlist_fields::season_number:
+			return track.season_number;
+		case itunesdb::smart_playlist_fields::size:
+			return track.file_size_32;
+		case itunesdb::smart_playlist_fields::skip_count:
+			return track.skip_count_user;
+		case itunesdb::smart_playlist_fields::time:
+			return track.length;
+		case itunesdb::smart_playlist_fields::track_number:
+			return track.tracknumber;
 		case itunesdb::smart_playlist_fields::video_kind:
-			return g_test_track_generic_bitmask(track->media_type, rule);
+			return track.media_type;
 		case itunesdb::smart_playlist_fields::year:
-			return g_test_track_generic_integer(track->year, rule);
+			return track.year;
 		default:
-			return false;
+			return 0;
 		};
 	}
+	const std::vector<const char *> & track_columns_t::get_string_column(t_uint32 field)
+	{
+		auto iter = m_string_columns.find(field);
+		if (iter != m_string_columns.end())
+			return iter->second;
+
+		std::vector<const char *> & column = m_string_columns[field];
+		t_size i, count = get_count();
+		column.resize(count);
+		for (i=0; i<count; i++)
+			column[i] = g_get_string_field(*m_library.m_tracks[i], field);
+		return column;
+	}
+	const std::vector<pfc::string8> & track_columns_t::get_lowercase_column(t_uint32 field)
+	{
+		auto iter = m_lowercase_columns.find(field);
+		if (iter != m_lowercase_columns.end())
+			return iter->second;
+
+		const std::vector<const char *> & strings = get_string_column(field);
+		std::vector<pfc::string8> & column = m_lowercase_columns[field];
+		t_size i, count = strings.size();
+		column.resize(count);
+		for (i=0; i<count; i++)
+			column[i] = string_lower(strings[i]);
+		return column;
+	}
+	const std::vector<t_uint64> & track_columns_t::get_integer_column(t_uint32 field)
+	{
+		auto iter = m_integer_columns.find(field);
+		if (iter != m_integer_columns.end())
+			return iter->second;
+
+		std::vector<t_uint64> & column = m_integer_columns[field];
+		t_size i, count = get_count();
+		column.resize(count);
+		for (i=0; i<count; i++)
+			column[i] = g_get_integer_field(*m_library.m_tracks[i], field);
+		return column;
+	}
+	bool track_columns_t::find_track(const itunesdb::t_track * p_track, t_size & index)
+	{
+		if (!m_track_indices_valid)
+		{
+			t_size i, count = get_count();
+			m_track_indices.reserve(count);
+			for (i=0; i<count; i++)
+				m_track_indices.emplace(&*m_library.m_tracks[i], i);
+			m_track_indices_valid = true;
+		}
+		auto iter = m_track_indices.find(p_track);
+		if (iter == m_track_indices.end())
+			return false;
+		index = iter->second;
+		return true;
+	}
 
 	enum limit_sort_values_t
 	{
@@ -395,78 +532,163 @@ namespace smart_playlist
 			};
 		}
 
-		void generator_t::process_rules (const itunesdb::t_smart_playlist_rules & p_rules)
+		void generator_t::compile_rule (const itunesdb::t_smart_playlist_rule & p_rule, compiled_rule_t & p_out)
 		{
-			bool b_or = p_rules.rule_operator != 0;
-			t_size i, count = p_rules.rules.get_count();
-			for (i=0; i<count; i++)
+			p_out.m_rule = &p_rule;
+			p_out.m_field_type = track_columns_t::g_get_field_type(p_rule.field);
+			p_out.m_playlist = p_rule.field == smart_playlist_fields::playlist;
+			p_out.m_playlist_found = false;
+			p_out.m_negate = false;
+			p_out.m_playlist_index = pfc_infinite;
+
+			if (p_out.m_playlist)
+			{
+				t_uint32 index;
+				p_out.m_playlist_found = m_library.find_playlist_by_id(p_rule.from_value, index);
+				if (p_out.m_playlist_found)
+					p_out.m_playlist_index = index;
+				p_out.m_negate = p_rule.action == ((0<<24)|(1<<0)|(1<<25));
+			}
+			else if (p_out.m_field_type == track_columns_t::field_type_string)
 			{
-				if (p_rules.rules[i].field == smart_playlist_fields::playlist)
+				p_out.m_value = pfc::stringcvt::string_utf8_from_wide(p_rule.string.get_ptr());
+				if (g_is_string_contains_action(p_rule.action))
+					p_out.m_value_lower = string_lower(p_out.m_value);
+			}
+		}
+
+		void generator_t::evaluate_rule (const compiled_rule_t & p_rule, track_bitmap_t & p_out, std::vector<t_size> & p_ordered, bool & b_ordered)
+		{
+			const itunesdb::t_smart_playlist_rule & rule = *p_rule.m_rule;
+			t_size i, count = m_columns->get_count();
+
+			p_out.reset(count, false);
+			p_ordered.clear();
+			b_ordered = false;
+
+			if (p_rule.m_playlist)
+			{
+				pfc::list_t <pfc::rcptr_t <itunesdb::t_track>, pfc::alloc_fast_aggressive > tracksPlaylist;
+				g_playlist_get_tracks(m_library.m_playlists[p_rule.m_playlist_index], m_library, tracksPlaylist, metadb_handle_list_t<pfc::alloc_fast_aggressive> ());
+
+				t_size j, jcount = tracksPlaylist.get_count();
+				p_ordered.reserve(jcount);
+				for (j=0; j<jcount; j++)
 				{
 					t_size index;
-					if (m_library.find_playlist_by_id(p_rules.rules[i].from_value, index))
+					if (m_columns->find_track(&*tracksPlaylist[j], index))
 					{
-						bool negate = p_rules.rules[i].action == ((0<<24)|(1<<0)|(1<<25));
-						pfc::list_t <pfc::rcptr_t <itunesdb::t_track>, pfc::alloc_fast_aggressive > tracksPlaylist, tracksToAdd;
-						g_playlist_get_tracks(m_library.m_playlists[index], m_library, tracksPlaylist, metadb_handle_list_t<pfc::alloc_fast_aggressive> ());
-						if (negate)
-						{
-							tracksToAdd = m_library.m_tracks;
-							pfc::array_t<bool> mask;
-							mask.set_count(tracksToAdd.get_count());
-							mask.fill(false);
-							for (t_size j=0; j<tracksPlaylist.get_count(); j++)
-							{
-								t_size index = tracksToAdd.find_item(tracksPlaylist[j]);
-								if (index != pfc_infinite) mask[index] = true;
-							}
-							tracksToAdd.remove_mask(mask.get_ptr());
-						}
-						else
-							tracksToAdd = tracksPlaylist;
-						if (b_or || i==0)
-						{
-							m_tracks.add_items(tracksToAdd);
-						}
-						else
-						{
-							t_size j, jcount = tracksToAdd.get_count();
-							pfc::array_t<bool> mask;
-							mask.set_count(m_tracks.get_count());
-							mask.fill(true);
-
-							for (j=0; j<jcount; j++)
-							{
-								t_size index_track;
-								if (pfc_infinite != (index_track = m_tracks.find_item(tracksToAdd[j])))
-									mask[index_track] = false;
-							}
-							m_tracks.remove_mask(mask.get_ptr());
-						}
+						p_out.set(index);
+						p_ordered.push_back(index);
 					}
 				}
+
+				if (p_rule.m_negate)
+					p_out.invert();
 				else
+					b_ordered = true;
+				return;
+			}
+
+			switch (p_rule.m_field_type)
+			{
+			case track_columns_t::field_type_string:
 				{
-					pfc::list_t< pfc::rcptr_t<itunesdb::t_track>, pfc::alloc_fast_aggressive > tracks (b_or || i==0 ? m_library.m_tracks : m_tracks);
-					if (!b_or)
-						m_tracks.remove_all();
-					process_tracks (tracks, p_rules.rules[i]);
+					const std::vector<const char *> & column = m_columns->get_string_column(rule.field);
+					if (g_is_string_contains_action(rule.action))
+					{
+						const std::vector<pfc::string8> & column_lower = m_columns->get_lowercase_column(rule.field);
+						for (i=0; i<count; i++)
+							if (g_test_track_generic_string(column[i], column_lower[i], rule, p_rule.m_value, p_rule.m_value_lower))
+								p_out.set(i);
+					}
+					else
+					{
+						for (i=0; i<count; i++)
+							if (g_test_track_generic_string(column[i], "", rule, p_rule.m_value, p_rule.m_value_lower))
+								p_out.set(i);
+					}
 				}
+				break;
+			case track_columns_t::field_type_integer:
 				{
-					mmh::remove_duplicates(m_tracks, g_compare_track_ptr);
+					const std::vector<t_uint64> & column = m_columns->get_integer_column(rule.field);
+					for (i=0; i<count; i++)
+						if (g_test_track_generic_integer(column[i], rule))
+							p_out.set(i);
 				}
-			}
+				break;
+			case track_columns_t::field_type_timestamp:
+				{
+					const std::vector<t_uint64> & column = m_columns->get_integer_column(rule.field);
+					for (i=0; i<count; i++)
+						if (g_test_track_generic_timestamp(column[i], rule, m_timestamp))
+							p_out.set(i);
+				}
+				break;
+			case track_columns_t::field_type_bitmask:
+				{
+					const std::vector<t_uint64> & column = m_columns->get_integer_column(rule.field);
+					for (i=0; i<count; i++)
+						if (g_test_track_generic_bitmask(column[i], rule))
+							p_out.set(i);
+				}
+				break;
+			default:
+				break;
+			};
 		}
 
-
-		void generator_t::process_tracks (const pfc::list_t< pfc::rcptr_t<itunesdb::t_track>, pfc::alloc_fast_aggressive > & p_tracks, const itunesdb::t_smart_playlist_rule & p_rule)
+		void generator_t::process_rules (const itunesdb::t_smart_playlist_rules & p_rules)
 		{
-			t_size i, count = p_tracks.get_count();
+			//Each rule yields a bitmap over the library. With 'any' (OR), the tracks a rule
+			//matches that are not yet included are appended in the rule's order; with 'all'
+			//(AND), the first rule sets the order and the others filter it. A playlist rule
+			//whose playlist no longer exists leaves the result unchanged.
+			bool b_or = p_rules.rule_operator != 0;
+			t_size i, count = p_rules.rules.get_count(), count_tracks = m_columns->get_count();
+
+			pfc::array_t<compiled_rule_t> program;
+			program.set_count(count);
+			for (i=0; i<count; i++)
+				compile_rule(p_rules.rules[i], program[i]);
+
+			std::vector<t_size> result, ordered;
+			track_bitmap_t included(count_tracks), matches(count_tracks);
+
 			for (i=0; i<count; i++)
 			{
-				if (g_test_track(p_tracks[i], p_rule))
-					m_tracks.add_item(p_tracks[i]);
+				if (program[i].m_playlist && !program[i].m_playlist_found)
+					continue;
+
+				bool b_ordered;
+				evaluate_rule(program[i], matches, ordered, b_ordered);
+
+				if (b_or || i==0)
+				{
+					auto append = [&result, &included] (t_size index)
+					{
+						if (!included.get(index))
+						{
+							included.set(index);
+							result.push_back(index);
+						}
+					};
+					if (b_ordered)
+						for (t_size j=0, jcount = ordered.size(); j<jcount; j++)
+							append(ordered[j]);
+					else
+						matches.for_each_set(append);
+				}
+				else
+					included.and_with(matches);
 			}
+
+			m_tracks.remove_all();
+			m_tracks.prealloc(result.size());
+			for (i=0, count = result.size(); i<count; i++)
+				if (included.get(result[i]))
+					m_tracks.add_item(m_library.m_tracks[result[i]]);
 		}
 };
 };
\ No newline at end of file
@@ -8,15 +8,90 @@ namespace ipod
 namespace smart_playlist
 {
 
+/** Fixed-size bit set with one bit per library track. */
+class track_bitmap_t
+{
+public:
+	track_bitmap_t(t_size count = 0) {reset(count, false);}
+
+	void reset(t_size count, bool value);
+	t_size get_count() const {return m_count;}
+	bool get(t_size index) const {return (m_words[index/32] & (1u << (index%32))) != 0;}
+	void set(t_size index) {m_words[index/32] |= (1u << (index%32));}
+	void invert();
+	void and_with(const track_bitmap_t & other);
+	void or_with(const track_bitmap_t & other);
+
+	/** Calls p_func with the index of every set bit, in ascending order. */
+	template <typename t_func>
+	void for_each_set(t_func && p_func) const
+	{
+		for (t_size i = 0, count = m_words.size(); i<count; i++)
+		{
+			t_uint32 word = m_words[i];
+			for (t_size j = 0; word; j++, word >>= 1)
+				if (word & 1) p_func(i*32 + j);
+		}
+	}
+private:
+	std::vector<t_uint32> m_words;
+	t_size m_count;
+};
+
+/**
+ * Columnar snapshot of the library's tracks for rule evaluation.
+ *
+ * Columns are built on first use. A snapshot can be shared between the generators
+ * of one update pass, provided m_tracks is not modified in the meantime.
+ */
+class track_columns_t
+{
+public:
+	enum field_type_t
+	{
+		field_type_none,
+		field_type_string,
+		field_type_integer,
+		field_type_timestamp,
+		field_type_bitmask,
+	};
+
+	static field_type_t g_get_field_type(t_uint32 field);
+
+	track_columns_t(const ipod::tasks::load_database_t & p_library) : m_library(p_library) {};
+
+	t_size get_count() const {return m_library.m_tracks.get_count();}
+	const std::vector<const char *> & get_string_column(t_uint32 field);
+	/** Lower-cased with string_lower, for the 'contains' operators. */
+	const std::vector<pfc::string8> & get_lowercase_column(t_uint32 field);
+	const std::vector<t_uint64> & get_integer_column(t_uint32 field);
+	bool find_track(const itunesdb::t_track * p_track, t_size & index);
+private:
+	static const char * g_get_string_field(const itunesdb::t_track & track, t_uint32 field);
+	static t_uint64 g_get_integer_field(const itunesdb::t_track & track, t_uint32 field);
+
+	const ipod::tasks::load_database_t & m_library;
+	std::unordered_map<t_uint32, std::vector<const char *> > m_string_columns;
+	std::unordered_map<t_uint32, std::vector<pfc::string8> > m_lowercase_columns;
+	std::unordered_map<t_uint32, std::vector<t_uint64> > m_integer_columns;
+	std::unordered_map<const itunesdb::t_track *, t_size> m_track_indices;
+	bool m_track_indices_valid{false};
+};
+
 class generator_t
 {
 public:
 	generator_t ( const ipod::tasks::load_database_t & p_library )
-		: m_library (p_library) 
+		: m_library (p_library), m_columns_owned(new track_columns_t(p_library))
 	{
-		t_filetimestamp time;
-		GetSystemTimeAsFileTime((LPFILETIME)&time);
-		m_timestamp = apple_time_from_filetime(time);
+		m_columns = m_columns_owned.get();
+		init_timestamp();
+	};
+
+	generator_t ( const ipod::tasks::load_database_t & p_library, track_columns_t & p_columns )
+		: m_library (p_library), m_columns(&p_columns)
+	{
+		init_timestamp();
 	};
 
 	void run (const itunesdb::t_smart_playlist_data & p_data, const itunesdb::t_smart_playlist_rules & p_rules);
@@ -40,16 +115,36 @@ public:
 		to_playlist(p_playlist);
 	}
 private:
+	/** A rule with its operand prepared once, rather than for every track. */
+	class compiled_rule_t
+	{
+	public:
+		const itunesdb::t_smart_playlist_rule * m_rule;
+		track_columns_t::field_type_t m_field_type;
+		pfc::string8 m_value, m_value_lower;
+		bool m_playlist, m_playlist_found, m_negate;
+		t_size m_playlist_index;
+	};
+
+	void init_timestamp()
+	{
+		t_filetimestamp time;
+		GetSystemTimeAsFileTime((LPFILETIME)&time);
+		m_timestamp = apple_time_from_filetime(time);
+	}
 	void process_limits (const itunesdb::t_smart_playlist_data & p_data);
 	void process_rules (const itunesdb::t_smart_playlist_rules & p_rules);
-	void process_tracks (const pfc::list_t< pfc::rcptr_t<itunesdb::t_track>, pfc::alloc_fast_aggressive > & p_tracks, const itunesdb::t_smart_playlist_rule & p_rule);
+	void compile_rule (const itunesdb::t_smart_playlist_rule & p_rule, compiled_rule_t & p_out);
+	/** Evaluates a rule over the whole library. For playlist rules that are not negated, p_ordered receives the matches in playlist order. */
+	void evaluate_rule (const compiled_rule_t & p_rule, track_bitmap_t & p_out, std::vector<t_size> & p_ordered, bool & b_ordered);
 	void sort(t_uint32 order, bool b_desc);
-	bool g_test_track(const pfc::rcptr_t<t_track> & track, const itunesdb::t_smart_playlist_rule & rule);
 
 	const ipod::tasks::load_database_t & m_library;
+	std::unique_ptr<track_columns_t> m_columns_owned;
+	track_columns_t * m_columns;
 	pfc::list_t <pfc::rcptr_t <itunesdb::t_track> , pfc::alloc_fast_aggressive> m_tracks;
 	t_uint32 m_timestamp;
 };
 
 };
-};
\ No newline at end of file
+};
@@ -60,6 +60,16 @@ public:
 			throw pfc::exception(text);
 		}
 	}
+	/** Runs the statement and resets it, so that it can be bound and run again. */
+	void run()
+	{
+		int ret = sqlite3_step(m_stmt);
+		sqlite3_reset(m_stmt);
+		sqlite3_clear_bindings(m_stmt);
+		m_auto_bind_index = 0;
+		if (SQLITE_DONE != ret)
+			throw pfc::exception(pfc::string8 () << "sqlite3_step returned: " << ret);
+	}
 	void finalise()
 	{
 		int ret = sqlite3_step(m_stmt);
@@ -86,6 +96,18 @@ public:
 	{
 		sqlite3_bind_blob(m_stmt, ++m_auto_bind_index, data, data_len, pointer_type);
 	}
+	void autobind_int64(t_int64 value)
+	{
+		sqlite3_bind_int64(m_stmt, ++m_auto_bind_index, value);
+	}
+	void autobind_double(double value)
+	{
+		sqlite3_bind_double(m_stmt, ++m_auto_bind_index, value);
+	}
+	void autobind_null()
+	{
+		sqlite3_bind_null(m_stmt, ++m_auto_bind_index);
+	}
 
 	~sqlite_statement() {if (m_stmt) {sqlite3_finalize(m_stmt);m_stmt=NULL;} }
 private:
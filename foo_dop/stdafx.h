@@ -15,9 +15,14 @@
 //#define LOAD_LIBRARY_INDICES
 //#define PHOTO_BROWSER
 
+#include <exception>
+#include <map>
 #include <optional>
 #include <regex>
+#include <set>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -267,6 +267,69 @@ void g_EjectIPodDelayed()
 		g_EjectTimerId = SetTimer(NULL, NULL, 2000, &g_EjectTimerProc);
 }
 
+void sync_journal_t::load(ipod_device_ptr_ref_t p_ipod, abort_callback & p_abort)
+{
+	m_entries.clear();
+	try
+	{
+		pfc::string8 path;
+		g_get_path(p_ipod, path);
+		if (!filesystem::g_exists(path, p_abort))
+			return;
+
+		service_ptr_t<file> p_file;
+		filesystem::g_open_read(p_file, path, p_abort);
+		pfc::array_t<t_uint8> data;
+		data.set_size(pfc::downcast_guarded<t_size>(p_file->get_size_ex(p_abort)));
+		p_file->read_object(data.get_ptr(), data.get_size(), p_abort);
+		p_file.release();
+
+		fbh::StreamReaderMemblock stream(data.get_ptr(), data.get_size());
+		t_uint32 identifier, count;
+		stream.read_lendian_t(identifier, p_abort);
+		if (identifier != journal_identifier)
+			return;
+		stream.read_lendian_t(count, p_abort);
+		m_entries.reserve(count);
+		pfc::string8 key;
+		for (t_uint32 i=0; i<count; i++)
+		{
+			entry_t entry;
+			stream.read_string(key, p_abort);
+			stream.read_lendian_t(entry.m_stats.m_size, p_abort);
+			stream.read_lendian_t(entry.m_stats.m_timestamp, p_abort);
+			stream.read_lendian_t(entry.m_pid, p_abort);
+			m_entries[key.get_ptr()] = entry;
+		}
+	}
+	catch (exception_aborted const &) {throw;}
+	catch (pfc::exception const & ex)
+	{
+		m_entries.clear();
+		console::formatter() << "iPod manager: Ignoring sync journal - " << ex.what();
+	}
+}
+
+void sync_journal_t::save(ipod_device_ptr_ref_t p_ipod, abort_callback & p_abort)
+{
+	stream_writer_mem data;
+	data.write_lendian_t(t_uint32(journal_identifier), p_abort);
+	data.write_lendian_t(t_uint32(m_entries.size()), p_abort);
+	for (auto iter = m_entries.begin(); iter != m_entries.end(); ++iter)
+	{
+		data.write_string(iter->first.c_str(), p_abort);
+		data.write_lendian_t(iter->second.m_stats.m_size, p_abort);
+		data.write_lendian_t(iter->second.m_stats.m_timestamp, p_abort);
+		data.write_lendian_t(iter->second.m_pid, p_abort);
+	}
+
+	pfc::string8 path;
+	g_get_path(p_ipod, path);
+	service_ptr_t<file> p_file;
+	filesystem::g_open_write_new(p_file, path, p_abort);
+	p_file->write(data.get_ptr(), data.get_size(), p_abort);
+}
+
 void ipod_sync::on_exit()
 	{
 		file_move_helper::g_on_deleted(m_remover.m_deleted_items);
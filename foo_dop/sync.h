@@ -248,6 +248,7 @@ public:
 	ipod_update_playback_data m_update_playback_data;
 	t_field_mappings m_mappings;
 	t_scan_items m_item_scanner;
+	sync_journal_t m_journal;
 
 	class t_playlist
 	{
@@ -259,7 +260,7 @@ public:
 	virtual void on_run()
 	{
 		TRACK_CALL_TEXT("ipod_sync");
-		bool b_started = false, b_need_to_update_database=false;
+		bool b_started = false, b_need_to_update_database=false, b_save_journal=false;
 		m_failed = false;
 		try 
 		{
@@ -284,13 +285,54 @@ public:
 			}
 			handles.add_items(m_items);
 			//m_items.remove_duplicates();
-			g_load_info(m_process.get_wnd(), handles, m_process);
+
+			//Only files changed since foobar2000 last read them need their info loading again
+			t_size count_handles = handles.get_count();
+			pfc::array_t<t_filestats> handle_stats;
+			handle_stats.set_size(count_handles);
+			{
+				m_process.update_text("Checking files");
+				abort_callback & p_abort = m_process.get_abort();
+				auto get_stats = [&] (t_size index)
+				{
+					handle_stats[index] = filestats_invalid;
+					if (p_abort.is_aborting()) return;
+					try
+					{
+						bool dummy;
+						filesystem::g_get_stats(handles[index]->get_path(), handle_stats[index], dummy, p_abort);
+					}
+					catch (pfc::exception const &) {};
+				};
+				parallel_for_t<decltype(get_stats)>(count_handles, get_stats).run(8);
+				m_process.checkpoint();
+			}
+			metadb_handle_list handles_changed;
+			for (k=0; k<count_handles; k++)
+			{
+				if (handle_stats[k] == filestats_invalid || handle_stats[k] != handles[k]->get_filestats() || !handles[k]->is_info_loaded_async())
+					handles_changed.add_item(handles[k]);
+			}
+			if (handles_changed.get_count())
+				g_load_info(m_process.get_wnd(), handles_changed, m_process);
 
 			m_library.cleanup_before_write(m_drive_scanner.m_ipods[0], m_process, abort_callback_dummy());
 			b_started = true; b_need_to_update_database = true;
 
 			bool b_stopped = false;
 
+			//Items unchanged since the last sync keep the track they were synced to
+			m_journal.load(m_drive_scanner.m_ipods[0], m_process.get_abort());
+			m_checker.m_known_indices.set_size(count_handles);
+			for (k=0; k<count_handles; k++)
+			{
+				t_size index = pfc_infinite;
+				const sync_journal_t::entry_t * entry = m_journal.find(handles[k]);
+				if (!entry || handle_stats[k] == filestats_invalid || entry->m_stats != handle_stats[k] || !m_library.find_track_by_pid(entry->m_pid, index))
+					index = pfc_infinite;
+				m_checker.m_known_indices[k] = index;
+			}
+
 			m_checker.run(m_drive_scanner.m_ipods[0], handles, m_library, m_process,m_process.get_abort());
 			m_item_scanner.run(m_drive_scanner.m_ipods[0], handles, m_checker, m_library, m_process,m_process.get_abort());
 			
@@ -322,11 +364,19 @@ public:
 				t_size i, count,j=0,base=0;
 				//count = m_item_scanner.m_tracks_to_remove.get_size();
 				t_size count_items = m_checker.m_result.get_size();
-				for (i=0; i<count_items; i++)
 				{
-					t_size index = m_checker.m_result[i].index;
-					for (k=0; k < index; k++)
-						if (m_item_scanner.m_tracks_to_remove[k]) m_checker.m_result[i].index--;
+					//Number of tracks removed before each index
+					t_size count_removal_mask = m_item_scanner.m_tracks_to_remove.get_size();
+					pfc::array_t<t_size> removed_before;
+					removed_before.set_size(count_removal_mask + 1);
+					removed_before[0] = 0;
+					for (k=0; k<count_removal_mask; k++)
+						removed_before[k+1] = removed_before[k] + (m_item_scanner.m_tracks_to_remove[k] ? 1 : 0);
+					for (i=0; i<count_items; i++)
+					{
+						t_size index = m_checker.m_result[i].index;
+						m_checker.m_result[i].index -= removed_before[min(index, count_removal_mask)];
+					}
 				}
 				m_process.advance_progresstep();
 				m_adder.run(m_drive_scanner.m_ipods[0], m_item_scanner.m_new_tracks, m_library, m_mappings, m_process,m_process.get_abort());
@@ -334,18 +384,36 @@ public:
 				m_process.update_progress_subpart_helper(0,1);
 				m_process.update_text("Building playlists");
 
-				//Make all names unique
-				for (t_size i = 0, count = m_playlists.get_count(); i<count; i++)
+				//Make all names unique. Each name is renamed past any later playlist with the same name, as a
+				//scan of the later playlists would, but the later playlists are found by a case-folded lookup.
 				{
-					pfc::string8 original_name = m_playlists[i].name;
-					pfc::string8 fixed_name = original_name;
-					t_size k = 0;
-					for (t_size j = i+1; j<count; j++)
+					t_size count = m_playlists.get_count();
+					std::unordered_map<std::string, std::vector<t_size> > playlists_by_name;
+					std::string folded;
+					for (t_size i = 0; i<count; i++)
 					{
-						if (!stricmp_utf8(fixed_name, m_playlists[j].name))
-							fixed_name = original_name << " (" << (++k) << ")";
+						ipod::tasks::library_index_t::g_fold_name(m_playlists[i].name, folded);
+						playlists_by_name[folded].push_back(i);
+					}
+					for (t_size i = 0; i<count; i++)
+					{
+						pfc::string8 fixed_name = m_playlists[i].name;
+						t_size k = 0, position = i;
+						while (true)
+						{
+							ipod::tasks::library_index_t::g_fold_name(fixed_name, folded);
+							auto iter = playlists_by_name.find(folded);
+							if (iter == playlists_by_name.end()) break;
+							const std::vector<t_size> & indices = iter->second;
+							auto next = std::upper_bound(indices.begin(), indices.end(), position);
+							while (next != indices.end() && stricmp_utf8(fixed_name, m_playlists[*next].name)) ++next;
+							if (next == indices.end()) break;
+							position = *next;
+							//Suffixes accumulate, e.g. "Name (1) (2)", so that names match earlier syncs
+							fixed_name << " (" << (++k) << ")";
+						}
+						m_playlists[i].name = fixed_name;
 					}
-					m_playlists[i].name = fixed_name;
 				}
 
 				pfc::array_t<bool> mask_remove_playlists;
@@ -363,10 +431,20 @@ public:
 						if (!is_keep_type)
 							m_library.m_playlists[u-1]->items.remove_all();
 					}
-					for (t_size i = 0, count = m_playlists.get_count(); i<count; i++)
+				}
+
+				//Existing playlists that may be reused, by case-folded name
+				std::unordered_map<std::string, std::vector<t_size> > library_playlists_by_name;
+				{
+					std::string folded;
+					for (t_size u = 0, ucount = mask_remove_playlists.get_size(); u<ucount; u++)
 					{
+						if (!mask_remove_playlists[u]) continue;
+						ipod::tasks::library_index_t::g_fold_name(m_library.m_playlists[u]->name, folded);
+						library_playlists_by_name[folded].push_back(u);
 					}
 				}
+				std::string folded_name;
 				for (k=0; k<count_playlists; k++)
 				{
 					count = m_playlists[k].items.get_count();
@@ -388,14 +466,22 @@ public:
 						}
 					}
 					bool b_found = false;
-					for (t_size j=0, jcount = m_library.m_playlists.get_count(); j<jcount; j++)
+					ipod::tasks::library_index_t::g_fold_name(m_playlists[k].name, folded_name);
+					auto iter = library_playlists_by_name.find(folded_name);
+					if (iter != library_playlists_by_name.end())
 					{
-						if (mask_remove_playlists[j] && !stricmp_utf8(m_playlists[k].name, m_library.m_playlists[j]->name))
+						std::vector<t_size> & indices = iter->second;
+						for (auto it = indices.begin(); it != indices.end(); ++it)
 						{
-							m_library.set_up_playlist(m_library.m_playlists[j], items.get_ptr(), items.get_count());
-							b_found = true;
-							mask_remove_playlists[j] = false;
-							break;
+							t_size j = *it;
+							if (mask_remove_playlists[j] && !stricmp_utf8(m_playlists[k].name, m_library.m_playlists[j]->name))
+							{
+								m_library.set_up_playlist(m_library.m_playlists[j], items.get_ptr(), items.get_count());
+								b_found = true;
+								mask_remove_playlists[j] = false;
+								indices.erase(it);
+								break;
+							}
 						}
 					}
 					if (!b_found)
@@ -406,7 +492,24 @@ public:
 					base += count;
 				}
 				if (m_remove_playlists)
-					m_library.m_playlists.remove_mask(mask_remove_playlists.get_ptr());
+					m_library.remove_playlists(mask_remove_playlists.get_ptr());
+
+				m_journal.reset();
+				for (i=0, j=0; i<count_items; i++)
+				{
+					t_size index = pfc_infinite;
+					if (m_checker.m_result[i].have)
+						index = m_checker.m_result[i].index;
+					else if (j < m_adder.m_results.get_count())
+					{
+						if (m_adder.m_results[j].b_added)
+							index = m_adder.m_results[j].index;
+						j++;
+					}
+					if (index < m_library.m_tracks.get_count())
+						m_journal.set(handles[i], handle_stats[i], m_library.m_tracks[index]->pid);
+				}
+				b_save_journal = true;
 
 				m_process.advance_progresstep();
 			}
@@ -414,6 +517,18 @@ public:
 			m_process.checkpoint();
 			b_need_to_update_database = false;
 			m_writer.run(m_drive_scanner.m_ipods[0], m_library, m_mappings, m_process,m_process.get_abort());
+			if (b_save_journal)
+			{
+				try
+				{
+					m_journal.save(m_drive_scanner.m_ipods[0], m_process.get_abort());
+				}
+				catch (exception_aborted const &) {throw;}
+				catch (pfc::exception const & ex)
+				{
+					console::formatter() << "iPod manager: Failed to save sync journal - " << ex.what();
+				}
+			}
 			m_process.advance_progresstep();
 
 			/*if (m_remover.m_error_list.get_count() || m_adder.m_error_list.get_count())
@@ -613,6 +728,7 @@ public:
 					if (p_info_loader->m_checked[i-1])
 						m_library.m_playlists.remove_by_idx(i-1);//newplaylists.append_single(m_library.m_playlists[i]);
 				}
+				m_library.invalidate_index();
 
 				//m_library.m_playlists = newplaylists;
 
@@ -34,3 +34,54 @@ public:
 	metadb_handle_list_t<pfc::alloc_fast> m_new_tracks;
 	pfc::array_t<bool> m_tracks_to_remove;
 };
+
+/**
+ * Source file stats and device track of each item as of the last sync, kept next to the dopdb.
+ * Items whose files have not changed since are matched to their tracks without comparing tags again.
+ */
+class sync_journal_t
+{
+public:
+	class entry_t
+	{
+	public:
+		t_filestats m_stats;
+		t_uint64 m_pid;
+
+		entry_t() : m_stats(filestats_invalid), m_pid(0) {};
+	};
+
+	/** A missing or unreadable journal leaves it empty. */
+	void load(ipod_device_ptr_ref_t p_ipod, abort_callback & p_abort);
+	void save(ipod_device_ptr_ref_t p_ipod, abort_callback & p_abort);
+
+	const entry_t * find(const metadb_handle_ptr & p_item) const
+	{
+		auto iter = m_entries.find(g_get_key(p_item));
+		return iter != m_entries.end() ? &iter->second : NULL;
+	}
+	void set(const metadb_handle_ptr & p_item, const t_filestats & p_stats, t_uint64 pid)
+	{
+		entry_t & entry = m_entries[g_get_key(p_item)];
+		entry.m_stats = p_stats;
+		entry.m_pid = pid;
+	}
+	void reset() {m_entries.clear();}
+private:
+	enum {journal_identifier = 'dsj1'};
+
+	static void g_get_path(ipod_device_ptr_ref_t p_ipod, pfc::string8 & p_out)
+	{
+		p_ipod->get_database_path(p_out);
+		p_out << p_ipod->get_path_separator_ptr() << "iTunes" << p_ipod->get_path_separator_ptr() << "dopsync";
+	}
+	static std::string g_get_key(const metadb_handle_ptr & p_item)
+	{
+		std::string key = p_item->get_path();
+		key.push_back('|');
+		key += pfc::format_uint(p_item->get_subsong_index()).get_ptr();
+		return key;
+	}
+
+	std::unordered_map<std::string, entry_t> m_entries;
+};
@@ -12,7 +12,7 @@ namespace ipod
 namespace tasks
 {
 
-void database_writer_t::write_artworkdb(ipod_device_ptr_ref_t p_ipod, const ipod::tasks::load_database_t & m_library, threaded_process_v2_t & p_status,abort_callback & p_abort)
+void database_writer_t::write_artworkdb(ipod_device_ptr_ref_t p_ipod, const ipod::tasks::load_database_t & m_library, database_file_t & p_out, threaded_process_v2_t & p_status,abort_callback & p_abort)
 {
 	pfc::string8 database_folder;
 	p_ipod->get_database_path(database_folder);
@@ -22,7 +22,6 @@ void database_writer_t::write_artworkdb(ipod_device_ptr_ref_t p_ipod, const ipod
 		try
 		{
 			pfc::string8 path;
-			pfc::string8 backup_path, temp_path;
 
 			{
 				path = database_folder;
@@ -30,28 +29,68 @@ void database_writer_t::write_artworkdb(ipod_device_ptr_ref_t p_ipod, const ipod
 				if (!filesystem::g_exists(path, p_abort))
 					filesystem::g_create_directory(path, p_abort);
 				path<< p_ipod->get_path_separator_ptr() << "ArtworkDB";
-				backup_path << path << ".dop.backup";
-				temp_path << path << ".dop.temp";
-				service_ptr_t<file> p_file;
-				filesystem::g_open_write_new(p_file, temp_path, p_abort);
-				photodb::writer w(p_file.get_ptr());
+				photodb::writer w(&p_out.m_data);
 				w.write_dfhm(m_library.m_artwork, p_abort);
-				p_file.release();
-				if (filesystem::g_exists(path, p_abort))
-				{
-					if (filesystem::g_exists(backup_path, p_abort))
-						filesystem::g_remove(backup_path, p_abort);
-					filesystem::g_move(path, backup_path, p_abort);
-				}
-				filesystem::g_move(temp_path, path, p_abort);
+				p_out.set_paths(path, ".dop.temp", ".dop.backup");
+				p_out.m_valid = true;
 			}
 		}
+		catch (const exception_aborted &)
+		{
+			throw;
+		}
 		catch (const pfc::exception &)
 		{
+			p_out.m_valid = false;
 		};
 	}
 }
 
+void database_file_t::commit(abort_callback & p_abort)
+{
+	if (!m_valid) return;
+
+	bool b_opened = false;
+	try
+	{
+		{
+			service_ptr_t<file> p_file;
+			filesystem::g_open_write_new(p_file, m_temp_path, p_abort);
+			b_opened = true;
+			p_file->write(m_data.get_ptr(), m_data.get_size(), p_abort);
+		}
+
+		//Not interrupted once the previous file is being replaced
+		abort_callback_dummy p_dummy_abort;
+		if (filesystem::g_exists(m_backup_path, p_dummy_abort))
+			filesystem::g_remove(m_backup_path, p_dummy_abort);
+		if (filesystem::g_exists(m_path, p_dummy_abort))
+			filesystem::g_move(m_path, m_backup_path, p_dummy_abort);
+		filesystem::g_move(m_temp_path, m_path, p_dummy_abort);
+		b_opened = false;
+
+		for (t_size i=0, count = m_obsolete_paths.get_count(); i<count; i++)
+			if (filesystem::g_exists(m_obsolete_paths[i], p_dummy_abort))
+				filesystem::g_remove(m_obsolete_paths[i], p_dummy_abort);
+		for (t_size i=0, count = m_placeholder_paths.get_count(); i<count; i++)
+		{
+			try {
+				filesystem::g_open_write_new(file::ptr(), m_placeholder_paths[i], p_dummy_abort);
+			} catch (exception_io const &) {};
+		}
+	}
+	catch (const pfc::exception &)
+	{
+		try
+		{
+			if (b_opened)
+				filesystem::g_remove(m_temp_path, abort_callback_dummy());
+		}
+		catch (const pfc::exception &) {}
+		throw;
+	}
+}
+
 void database_writer_t::clean_up_after_write(ipod::tasks::load_database_t& p_library)
 {
 	p_library.clean_up_device_playlists();
@@ -87,58 +126,141 @@ void database_writer_t::run(ipod_device_ptr_ref_t p_ipod, ipod::tasks::load_data
 			m_library.remove_playlist_voiceover_title(p_ipod, m_library.m_playlists_removed[i]->id);
 		}
 	} catch (pfc::exception const & ex) {console::formatter() << "iPod manager: Error updating playlist VoiceOver sounds: " << ex.what();}
-	write_itunesdb(p_ipod, m_library, p_mappings, p_status, p_abort);
+	//The iTunesDB is generated first, as it updates the album list and track records used by the other databases
+	database_file_t itunesdb, shadowdb, artworkdb, dopdb;
+	write_itunesdb(p_ipod, m_library, p_mappings, itunesdb, p_status, p_abort);
 
 	pfc::string8 database_folder;
 	p_ipod->get_database_path(database_folder);
-	if (p_ipod->shuffle || p_ipod->m_device_properties.m_ShadowDB)
-	{
-		progress_details[0].m_value = "Shadow";
-		p_status.update_text_and_details("Saving database files", progress_details);
-		if (p_ipod->m_device_properties.m_ShadowDB && p_ipod->m_device_properties.m_ShadowDBVersion >= 2)
-			ipod_write_shadowdb_v2(p_ipod, database_folder, m_library, p_status, p_abort);
-		else //if (p_ipod->shuffle || p_ipod->m_device_properties.m_ShadowDB)
-			ipod_write_shuffledb(p_ipod, database_folder, m_library, p_status, p_abort);
-	}
 
+	const bool b_shadowdb = p_ipod->shuffle || p_ipod->m_device_properties.m_ShadowDB;
+	bool b_sqlitedb = p_ipod->m_device_properties.m_SQLiteDB;
+#ifdef _FORCE_SQLDB
+	b_sqlitedb = true;
+#endif
 
-	if (0)
+	//The remaining databases only read the library, so they are generated concurrently. Errors are
+	//reported when their database would have been written, so the same files are written as before.
+	progress_details[0].m_value = "Generating";
+	p_status.update_text_and_details("Saving database files", progress_details);
+	pfc::string8 shadowdb_error, sqlitedb_error;
+	bool b_shadowdb_failed = false, b_sqlitedb_failed = false;
 	{
-		/*try
+		auto generate = [&] (t_size index)
 		{
-			pfc::string8 path;
-			pfc::string8 backup_path;
-
+			switch (index)
 			{
-				path = m_path;
-				path << "Photos\\Photo Database.dop";
-				service_ptr_t<file> p_file;
-				filesystem::g_open_write_new(p_file, path, p_abort);
-				photodb::writer w(p_file.get_ptr());
-				w.write_dfhm(m_library.m_photos, p_abort);
-			}
+			case 0:
+				if (b_shadowdb)
+				{
+					try
+					{
+						if (p_ipod->m_device_properties.m_ShadowDB && p_ipod->m_device_properties.m_ShadowDBVersion >= 2)
+							ipod_write_shadowdb_v2(p_ipod, database_folder, m_library, shadowdb, p_status, p_abort);
+						else //if (p_ipod->shuffle || p_ipod->m_device_properties.m_ShadowDB)
+							ipod_write_shuffledb(p_ipod, database_folder, m_library, shadowdb, p_status, p_abort);
+					}
+					catch (const exception_aborted &) {throw;}
+					catch (const pfc::exception & ex)
+					{
+						shadowdb_error = ex.what();
+						b_shadowdb_failed = true;
+					}
+				}
+				break;
+			case 1:
+				write_artworkdb(p_ipod, m_library, artworkdb, p_status, p_abort);
+				break;
+			case 2:
+				ipod_write_dopdb(database_folder, m_library, dopdb, p_status, p_abort);
+				break;
+			case 3:
+				if (b_sqlitedb)
+				{
+					try
+					{
+						write_sqlitedb(p_ipod, m_library, p_mappings, p_status, p_abort);
+					}
+					catch (const exception_aborted &) {throw;}
+					catch (const pfc::exception & ex)
+					{
+						sqlitedb_error = ex.what();
+						b_sqlitedb_failed = true;
+					}
+				}
+				break;
+			};
+		};
+		try
+		{
+			parallel_for_t<decltype(generate)>(4, generate, 1).run(4);
 		}
 		catch (const pfc::exception &)
 		{
-		};*/
+			p_abort.check();
+			throw;
+		}
+	}
+
+	//Device files are replaced one at a time, in a fixed order
+	progress_details[0].m_value = "iTunes";
+	p_status.update_text_and_details("Saving database files", progress_details);
+	try
+	{
+		itunesdb.commit(p_abort);
+	}
+	catch (const exception_aborted &) {throw;}
+	catch (const pfc::exception & ex)
+	{
+		throw pfc::exception(pfc::string_formatter() << "Error writing iTunesDB file : " << ex.what());
+	}
+
+	if (b_shadowdb)
+	{
+		progress_details[0].m_value = "Shadow";
+		p_status.update_text_and_details("Saving database files", progress_details);
+		if (b_shadowdb_failed)
+			throw pfc::exception(shadowdb_error);
+		try
+		{
+			shadowdb.commit(p_abort);
+		}
+		catch (const exception_aborted &) {throw;}
+		catch (const pfc::exception & ex)
+		{
+			throw pfc::exception(pfc::string_formatter() << "Error writing iTunesSD file : " << ex.what());
+		}
 	}
 
 	progress_details[0].m_value = "Artwork";
 	p_status.update_text_and_details("Saving database files", progress_details);
 	p_status.update_progress_subpart_helper(13,15 + (p_ipod->m_device_properties.m_SQLiteDB?15:0) );
-	write_artworkdb(p_ipod, m_library, p_status, p_abort);
+	try
+	{
+		artworkdb.commit(p_abort);
+	}
+	catch (const exception_aborted &) {throw;}
+	catch (const pfc::exception &) {};
 
 	progress_details[0].m_value = "iPod manager";
 	p_status.update_text_and_details("Saving database files", progress_details);
-	ipod_write_dopdb(database_folder, m_library, p_status, p_abort);
+	try
+	{
+		dopdb.commit(p_abort);
+	}
+	catch (const exception_aborted &) {throw;}
+	catch (const pfc::exception & ex)
+	{
+		console::print(pfc::string_formatter() << "iPod manager: Error writing dopdb file - " << ex.what());
+	}
 
-#ifndef _FORCE_SQLDB
-	if (p_ipod->m_device_properties.m_SQLiteDB)
-#endif
+	if (b_sqlitedb)
 	{
 		progress_details[0].m_value = "SQLite";
 		p_status.update_text_and_details("Saving database files", progress_details);
-		write_sqlitedb(p_ipod, m_library, p_mappings, p_status, p_abort);
+		if (b_sqlitedb_failed)
+			throw pfc::exception(sqlitedb_error);
+		install_sqlitedb(p_ipod);
 		//p_status.update_progress_subpart_helper(14,15);
 	}
 
@@ -251,63 +373,77 @@ void check_files_in_library_t::run (ipod_device_ptr_ref_t p_ipod, const pfc::lis
 
 	mmh::sort_get_permutation(m_stats, permutation, g_compare_filesize, false);
 
-	pfc::list_const_permutation_t<t_filestats, const mmh::Permutation &> sorted_stats(m_stats, permutation);
+	//Build both lookup tables up front. Candidates for the same key are stored in
+	//filesize-sorted order, so the first match is the same one the old bsearch and
+	//linear walk found.
+	std::unordered_map<const metadb_handle *, t_size> handle_index;
+	handle_index.reserve(count_tracks);
+	for (i=0; i<count_tracks; i++)
+		handle_index.emplace(p_library.m_handles[i].get_ptr(), i);
+
+	std::unordered_map<t_filestats_key, std::vector<t_size>, t_filestats_key::hash> stats_index;
+	stats_index.reserve(count_tracks);
+	for (i=0; i<count_tracks; i++)
+	{
+		const t_filestats & stats = m_stats[permutation[i]];
+		stats_index[t_filestats_key(stats.m_size, g_round_timestamp(stats.m_timestamp, p_ipod->mobile))].push_back(i);
+	}
+
+	p_status.checkpoint();
+
+	pfc::string8 can;
+	p_ipod->get_root_path(can);
+
+	t_filetimestamp hour = 60*60;
+	hour *= 10000000;
+
+	std::vector<t_size> candidates;
 
 	for (i=0; i<count_items; i++)
 	{
-		pfc::string8 can;
-		p_ipod->get_root_path(can);
-		t_uint32 index;
-		if (!stricmp_utf8_max(items[i]->get_path(), can, can.length()) && ((index = p_library.m_handles.find_item(items[i]))!=pfc_infinite) )
+		bool b_found = false;
+		if (i < m_known_indices.get_size() && m_known_indices[i] < count_tracks)
 		{
 			m_result[i].have = true;
-			m_result[i].index = index;
+			m_result[i].index = m_known_indices[i];
+			b_found = true;
 		}
-		else
+		else if (!stricmp_utf8_max(items[i]->get_path(), can, can.length()))
 		{
-			if (pfc::bsearch_t(count_tracks,sorted_stats,g_compare_filestats_with_filesize,items[i]->get_filesize(),index))
+			auto iter = handle_index.find(items[i].get_ptr());
+			if (iter != handle_index.end())
 			{
-				while (index > 0 && items[i]->get_filesize() == sorted_stats[index-1].m_size) 
-					{
-						index--;
-					}
+				m_result[i].have = true;
+				m_result[i].index = iter->second;
+				b_found = true;
+			}
+		}
 
-				do {
-					t_filetimestamp t1=sorted_stats[index].m_timestamp;
-					t_filestats t2 = items[i]->get_filestats();
-					//g_get_filestats(items[i]->get_path(), t2, p_abort);
+		if (!b_found)
+		{
+			t_filestats stats = items[i]->get_filestats();
+			t_filesize size = items[i]->get_filesize();
+			t_filetimestamp timestamp = g_round_timestamp(stats.m_timestamp, p_ipod->mobile);
 
-					//pfc::string8 msg; msg << "t1 raw: " << t1 << "; t2 raw: " << t2.m_timestamp;
+			candidates.clear();
+			const t_filetimestamp timestamps[] = {timestamp, timestamp - hour, timestamp + hour};
+			for (t_size j=0; j<tabsize(timestamps); j++)
+			{
+				auto iter = stats_index.find(t_filestats_key(size, timestamps[j]));
+				if (iter != stats_index.end())
+					candidates.insert(candidates.end(), iter->second.begin(), iter->second.end());
+			}
+			std::sort(candidates.begin(), candidates.end());
 
-					if (p_ipod->mobile)
-					{
-						if ((t1%10000000))
-							t1 -= 10000000-(t1%10000000);
-						if ((t2.m_timestamp%10000000))
-							t2.m_timestamp -= 10000000-(t2.m_timestamp%10000000);
-					}
-					else
-					{
-						if ((t1%20000000))
-							t1 += 20000000-(t1%20000000);
-						if ((t2.m_timestamp%20000000))
-							t2.m_timestamp += 20000000-(t2.m_timestamp%20000000);
-					}
-					//msg << "; t1 adj: " << t1 << "; t2 adj: " << t2.m_timestamp;
-					//console::formatter() << "iPod manager: " << msg;
-					t_uint64 hour = 60*60;
-					hour *= 10000000;
-					if (t1 == t2.m_timestamp || _abs64(t1-t2.m_timestamp) == hour)
-					{
-						m_result[i].have = g_compare_meta(items[i], p_library.m_handles[permutation[index]]);
-						if (m_result[i].have)
-						{
-							m_result[i].index = permutation[index];
-							break;
-						}
-					}
+			for (t_size j=0, count_candidates = candidates.size(); j<count_candidates; j++)
+			{
+				t_size index = permutation[candidates[j]];
+				if (g_compare_meta(items[i], p_library.m_handles[index]))
+				{
+					m_result[i].have = true;
+					m_result[i].index = index;
+					break;
 				}
-				while (index +1 < count_tracks && items[i]->get_filesize() == sorted_stats[++index].m_size);
 			}
 		}
 		p_status.update_progress_subpart_helper(i+1+count_tracks,count_tracks+count_items);
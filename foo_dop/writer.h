@@ -162,9 +162,39 @@ public:
 	//bool m_load_cache;
 };
 
-void ipod_write_dopdb(const char * m_path, const ipod::tasks::load_database_t & p_library, threaded_process_v2_t & p_status,abort_callback & p_abort);
-void ipod_write_shuffledb(ipod_device_ptr_ref_t p_ipod, const char * m_path, const ipod::tasks::load_database_t & p_library, threaded_process_v2_t & p_status,abort_callback & p_abort);
-void ipod_write_shadowdb_v2(ipod_device_ptr_ref_t p_ipod, const char * m_path, const ipod::tasks::load_database_t & p_library, threaded_process_v2_t & p_status,abort_callback & p_abort);
+namespace ipod
+{
+	namespace tasks
+	{
+		/** A database file serialised in memory, written to the device later by commit(). */
+		class database_file_t
+		{
+		public:
+			pfc::string8 m_path, m_temp_path, m_backup_path;
+			stream_writer_mem m_data;
+			/** Removed once the new file is in place. */
+			pfc::list_t<pfc::string8> m_obsolete_paths;
+			/** Created empty once the new file is in place. */
+			pfc::list_t<pfc::string8> m_placeholder_paths;
+			bool m_valid;
+
+			void set_paths(const char * path, const char * temp_extension, const char * backup_extension)
+			{
+				m_path = path;
+				m_temp_path.reset(); m_temp_path << path << temp_extension;
+				m_backup_path.reset(); m_backup_path << path << backup_extension;
+			}
+			/** Writes a temporary file, keeps the previous file as a backup and moves the new file into place. */
+			void commit(abort_callback & p_abort);
+
+			database_file_t() : m_valid(false) {};
+		};
+	}
+}
+
+void ipod_write_dopdb(const char * m_path, const ipod::tasks::load_database_t & p_library, ipod::tasks::database_file_t & p_out, threaded_process_v2_t & p_status,abort_callback & p_abort);
+void ipod_write_shuffledb(ipod_device_ptr_ref_t p_ipod, const char * m_path, const ipod::tasks::load_database_t & p_library, ipod::tasks::database_file_t & p_out, threaded_process_v2_t & p_status,abort_callback & p_abort);
+void ipod_write_shadowdb_v2(ipod_device_ptr_ref_t p_ipod, const char * m_path, const ipod::tasks::load_database_t & p_library, ipod::tasks::database_file_t & p_out, threaded_process_v2_t & p_status,abort_callback & p_abort);
 
 namespace ipod
 {
@@ -179,9 +209,13 @@ namespace ipod
 
 			void run(ipod_device_ptr_ref_t p_ipod, ipod::tasks::load_database_t & p_library, const t_field_mappings & p_mappings, threaded_process_v2_t & p_status,abort_callback & p_abort);
 
-			void write_itunesdb		(ipod_device_ptr_ref_t p_ipod, ipod::tasks::load_database_t & p_library, const t_field_mappings & p_mappings, threaded_process_v2_t & p_status,abort_callback & p_abort);
-			void write_artworkdb	(ipod_device_ptr_ref_t p_ipod, const ipod::tasks::load_database_t & p_library, threaded_process_v2_t & p_status,abort_callback & p_abort);
+			//The write_ functions serialise without writing to the device, except where noted
+
+			void write_itunesdb		(ipod_device_ptr_ref_t p_ipod, ipod::tasks::load_database_t & p_library, const t_field_mappings & p_mappings, database_file_t & p_out, threaded_process_v2_t & p_status,abort_callback & p_abort);
+			void write_artworkdb	(ipod_device_ptr_ref_t p_ipod, const ipod::tasks::load_database_t & p_library, database_file_t & p_out, threaded_process_v2_t & p_status,abort_callback & p_abort);
+			/** Builds the databases in the local temporary folder. install_sqlitedb() moves them to the device. */
 			void write_sqlitedb		(ipod_device_ptr_ref_t p_ipod, ipod::tasks::load_database_t & p_library, const t_field_mappings & p_mappings, threaded_process_v2_t & p_status,abort_callback & p_abort);
+			void install_sqlitedb	(ipod_device_ptr_ref_t p_ipod);
 			pfc::array_staticsize_t<t_uint8> calculate_cbk(ipod_device_ptr_ref_t p_ipod, const char* locations_itdb_path);
 			void clean_up_after_write(ipod::tasks::load_database_t & p_library);
 			//construct from main thread only
@@ -218,6 +252,38 @@ namespace ipod
 			};
 			pfc::array_t<t_result> m_result;
 			pfc::list_t<t_filestats> m_stats;
+			/** Library indices already known for items, e.g. from the sync journal. Items past its end or set to pfc_infinite are looked up. */
+			pfc::array_t<t_size> m_known_indices;
+		private:
+			struct t_filestats_key
+			{
+				t_filesize m_size;
+				t_filetimestamp m_timestamp;
+				t_filestats_key(t_filesize p_size, t_filetimestamp p_timestamp) : m_size(p_size), m_timestamp(p_timestamp) {};
+				bool operator == (const t_filestats_key & other) const {return m_size == other.m_size && m_timestamp == other.m_timestamp;}
+				struct hash
+				{
+					size_t operator () (const t_filestats_key & key) const
+					{
+						return std::hash<t_uint64>()(key.m_size ^ (key.m_timestamp * 0x9e3779b97f4a7c15));
+					}
+				};
+			};
+			/** Timestamps are compared after rounding to the device filesystem's resolution. */
+			static t_filetimestamp g_round_timestamp(t_filetimestamp timestamp, bool b_mobile)
+			{
+				if (b_mobile)
+				{
+					if ((timestamp%10000000))
+						timestamp -= 10000000-(timestamp%10000000);
+				}
+				else
+				{
+					if ((timestamp%20000000))
+						timestamp += 20000000-(timestamp%20000000);
+				}
+				return timestamp;
+			}
 		};
 
 	}
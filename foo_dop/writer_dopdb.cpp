@@ -1,26 +1,21 @@
 #include "stdafx.h"
 
 #include "dopdb.h"
-#include "reader.h"
+#include "writer.h"
 
-void ipod_write_dopdb(const char * m_path, const ipod::tasks::load_database_t & p_library, threaded_process_v2_t & p_status,abort_callback & p_abort)
+void ipod_write_dopdb(const char * m_path, const ipod::tasks::load_database_t & p_library, ipod::tasks::database_file_t & p_out, threaded_process_v2_t & p_status,abort_callback & p_abort)
 {
-	pfc::string8 newpath;
-	bool b_opened = false;
 	//string_print_drive m_path(p_ipod->drive);
 
 	try
 	{
 		pfc::string8 path = m_path;
-		pfc::string8 backup_path;
 		path << "\\iTunes\\dopdb";
 
-		newpath << path << ".temp";
-
 		//static_api_ptr_t<metadb> metadb_api;
 		//in_metadb_sync metadb_lock;
 		//tlhm
-		stream_writer_mem header;
+		stream_writer_mem & header = p_out.m_data;
 
 		header.write_lendian_t(dopdb::header, p_abort);
 		dopdb::writer tlhm;
@@ -60,44 +55,16 @@ void ipod_write_dopdb(const char * m_path, const ipod::tasks::load_database_t &
 		//tlhm.write_element(dopdb::t_root_track, tracklist.get_ptr(), tracklist.get_size(), p_abort);
 		header.write(tlhm.get_ptr(), tlhm.get_size(), p_abort);
 
-		service_ptr_t<file> p_file;
-		filesystem::g_open_write_new(p_file, newpath, p_abort);
-		b_opened=true;
-
-		p_file->write(header.get_ptr(), header.get_size(), p_abort);
-
-
-		p_file.release();
-		b_opened=false;
-
-
-		backup_path << path.get_ptr() << ".backup";
-		try {filesystem::g_remove(backup_path, p_abort);} catch (exception_io_not_found const &) {};
-
-		if (filesystem::g_exists(path, p_abort))
-			filesystem::g_move(path, backup_path, p_abort);
-		filesystem::g_move(newpath, path, p_abort);
+		p_out.set_paths(path, ".temp", ".backup");
+		p_out.m_valid = true;
 	}
 	catch (const exception_aborted &) 
 	{
-		try
-		{
-			abort_callback_impl p_dummy_abort;
-			if (b_opened)
-				filesystem::g_remove(newpath, p_dummy_abort);
-		}
-		catch (const pfc::exception &) {}
 		throw;
 	}
 	catch (const pfc::exception & ex)
 	{
-		try
-		{
-			abort_callback_impl p_dummy_abort;
-			if (b_opened)
-				filesystem::g_remove(newpath, p_dummy_abort);
-		}
-		catch (const pfc::exception &) {}
+		p_out.m_valid = false;
 		//throw pfc::exception
 		console::print
 			(pfc::string_formatter() << "iPod manager: Error writing dopdb file - " << ex.what());
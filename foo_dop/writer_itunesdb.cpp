@@ -11,18 +11,15 @@ namespace ipod
 namespace tasks
 {
 
-void database_writer_t::write_itunesdb(ipod_device_ptr_ref_t p_ipod, ipod::tasks::load_database_t & m_library, const t_field_mappings & p_mappings, threaded_process_v2_t & p_status,abort_callback & p_abort)
+void database_writer_t::write_itunesdb(ipod_device_ptr_ref_t p_ipod, ipod::tasks::load_database_t & m_library, const t_field_mappings & p_mappings, database_file_t & p_out, threaded_process_v2_t & p_status,abort_callback & p_abort)
 {
 	const bool b_numbers_last = p_mappings.numbers_last;
 
 	//string_print_drive m_path(p_ipod->drive);
 	pfc::string8 base;
 	p_ipod->get_database_path(base);
-	pfc::string8 newpath;
-	bool b_opened = false;
 
 	pfc::string8 path;
-	pfc::string8 backup_path;
 
 	try
 	{
@@ -43,8 +40,6 @@ void database_writer_t::write_itunesdb(ipod_device_ptr_ref_t p_ipod, ipod::tasks
 		path_db << "iTunesDB";
 		path << (compressed ? "iTunesCDB" : "iTunesDB");
 
-		newpath << path << ".dop.temp";
-
 		//static_api_ptr_t<metadb> metadb_api;
 		//in_metadb_sync metadb_lock;
 		//tlhm
@@ -893,33 +888,11 @@ void database_writer_t::write_itunesdb(ipod_device_ptr_ref_t p_ipod, ipod::tasks
 						sort_permutations[j].resize(count_tracks);
 				}
 
-				for (i=0; i<tabsize(library_indices); i++)
+				//The indices only read the sort entries, so they are sorted concurrently
+				auto sort_index = [&] (t_size i)
 				{
-					//pfc::hires_timer timer;
-					//timer.start();
-					//profiler (indicies_run);
-					stream_writer_mem do_index;
-
-					do_index.write_lendian_t(t_uint32(library_indices[i].type), p_abort);
-					do_index.write_lendian_t(count_tracks, p_abort);
-					do_index.write_lendian_t(t_uint32(0), p_abort);
-					do_index.write_lendian_t(t_uint32(0), p_abort);
-					do_index.write_lendian_t(t_uint32(0), p_abort);
-					do_index.write_lendian_t(t_uint32(0), p_abort);
-					do_index.write_lendian_t(t_uint32(0), p_abort);
-					do_index.write_lendian_t(t_uint32(0), p_abort);
-					do_index.write_lendian_t(t_uint32(0), p_abort);
-					do_index.write_lendian_t(t_uint32(0), p_abort);
-					do_index.write_lendian_t(t_uint32(0), p_abort);
-					do_index.write_lendian_t(t_uint32(0), p_abort);
-				
-					mmh::Permutation ptemp(count_tracks);
-
-					//m_library.m_handles.sort_by_format_get_order(permutation.get_ptr(), library_indices[i].sort_pattern, NULL);
-					
-	//#pragma warning( disable : 4101 )
-
-					t_size j;
+					if (p_abort.is_aborting())
+						return;
 					if (i==0)
 					{
 						//profiler (indicies_0);
@@ -1168,7 +1141,35 @@ void database_writer_t::write_itunesdb(ipod_device_ptr_ref_t p_ipod, ipod::tasks
 								>, false);
 						}
 					}
-	//#pragma warning( default : 4101 )
+				};
+				parallel_for_t<decltype(sort_index)>(tabsize(library_indices), sort_index, 1).run(max(std::thread::hardware_concurrency(), 1u));
+				p_abort.check();
+
+				for (i=0; i<tabsize(library_indices); i++)
+				{
+					//pfc::hires_timer timer;
+					//timer.start();
+					//profiler (indicies_run);
+					stream_writer_mem do_index;
+
+					do_index.write_lendian_t(t_uint32(library_indices[i].type), p_abort);
+					do_index.write_lendian_t(count_tracks, p_abort);
+					do_index.write_lendian_t(t_uint32(0), p_abort);
+					do_index.write_lendian_t(t_uint32(0), p_abort);
+					do_index.write_lendian_t(t_uint32(0), p_abort);
+					do_index.write_lendian_t(t_uint32(0), p_abort);
+					do_index.write_lendian_t(t_uint32(0), p_abort);
+					do_index.write_lendian_t(t_uint32(0), p_abort);
+					do_index.write_lendian_t(t_uint32(0), p_abort);
+					do_index.write_lendian_t(t_uint32(0), p_abort);
+					do_index.write_lendian_t(t_uint32(0), p_abort);
+					do_index.write_lendian_t(t_uint32(0), p_abort);
+				
+					mmh::Permutation ptemp(count_tracks);
+
+					//m_library.m_handles.sort_by_format_get_order(permutation.get_ptr(), library_indices[i].sort_pattern, NULL);
+
+					t_size j;
 
 					do_index.write(sort_permutations[i].data(), count_tracks*sizeof(t_uint32), p_abort);
 
@@ -1691,8 +1692,18 @@ void database_writer_t::write_itunesdb(ipod_device_ptr_ref_t p_ipod, ipod::tasks
 			pl5.get_size(), count_special_playlists, p_abort);
 		p_status.update_progress_subpart_helper(11,15 + (sqlite_db ? 15 : 0));
 
-		stream_writer_mem db, db_header;
+		stream_writer_mem db_header;
 		const t_size header_size = dbhm.get_size() + 4*3;
+
+		//The total size is filled in once the data sets have been written (and compressed)
+		db_header.write_bendian_t(identifiers::dbhm, p_abort);
+		db_header.write_lendian_t(t_uint32(header_size), p_abort);
+		db_header.write_lendian_t(t_uint32(0), p_abort);
+		db_header.write(dbhm.get_ptr(), dbhm.get_size(), p_abort);
+		dbhm.force_reset();
+
+		zlib_deflate_writer db_deflate(db_header);
+		stream_writer & db = compressed ? static_cast<stream_writer &>(db_deflate) : db_header;
 		/*const t_size total_size_decompressed = header_size
 			+ 4*3 + dshm.get_size() + ds.get_size() 
 			+ 4*3 + ds2hm.get_size() + ds2.get_size()
@@ -1797,26 +1808,15 @@ void database_writer_t::write_itunesdb(ipod_device_ptr_ref_t p_ipod, ipod::tasks
 			ds9hm.force_reset();
 		}
 
-		pfc::array_t<t_uint8, pfc::alloc_fast_aggressive> compressed_data;
-		if (compressed)
-		{
-			zlib_stream zs;
-			zs.compress_singlerun(db.get_ptr(), db.get_size(), compressed_data);
-		}
-
-		db_header.write_bendian_t(identifiers::dbhm, p_abort);
-		db_header.write_lendian_t(t_uint32(header_size), p_abort);
-		db_header.write_lendian_t(t_uint32(header_size + (compressed ? compressed_data.get_size() : db.get_size())), p_abort);
-		db_header.write(dbhm.get_ptr(), dbhm.get_size(), p_abort);
 		if (compressed)
-			db_header.write(compressed_data.get_ptr(), compressed_data.get_size(), p_abort);
-		else
-			db_header.write(db.get_ptr(), db.get_size(), p_abort);
-
-		compressed_data.force_reset();
-		db.force_reset();
+			db_deflate.finish(p_abort);
 
 		t_uint8 * ptr = db_header.get_ptr();
+		{
+			t_uint32 total_size = pfc::downcast_guarded<t_uint32>(db_header.get_size());
+			byte_order::order_native_to_le_t(total_size);
+			memcpy(ptr+8, &total_size, sizeof(total_size));
+		}
 		if (sign_flags & ipod::candy_flag_version_3)
 		{
 			pfc::string8 struid;
@@ -1892,28 +1892,11 @@ void database_writer_t::write_itunesdb(ipod_device_ptr_ref_t p_ipod, ipod::tasks
 		byte_order::order_native_to_le_t(dbid);
 		memcpy(ptr+0x18, &dbid, sizeof(dbid));
 
-		backup_path << path.get_ptr() << ".dop.backup";
-		try { filesystem::g_remove(backup_path, p_abort); } catch (exception_io_not_found const &) {};
-
-		service_ptr_t<file> p_file;
-		filesystem::g_open_write_new(p_file, newpath, p_abort);
-		b_opened=true;
-
-		p_file->write(db_header.get_ptr(), db_header.get_size(), p_abort);
-
-		p_file.release();
-		b_opened=false;
-
-		if (filesystem::g_exists(path, p_abort))
-			filesystem::g_move(path, backup_path, p_abort);
-		filesystem::g_move(newpath, path, p_abort);
-
+		p_out.m_data.write(db_header.get_ptr(), db_header.get_size(), p_abort);
+		p_out.set_paths(path, ".dop.temp", ".dop.backup");
 		if (compressed && sqlite_db)
-		{
-			try {
-				filesystem::g_open_write_new(file::ptr(), path_db, p_abort);
-			} catch (exception_io const &) {};
-		}
+			p_out.m_placeholder_paths.add_item(path_db);
+		p_out.m_valid = true;
 #if 0//_DEBUG //FIXME TEST
 		try
 		{
@@ -1949,24 +1932,10 @@ void database_writer_t::write_itunesdb(ipod_device_ptr_ref_t p_ipod, ipod::tasks
 	}
 	catch (const exception_aborted &) 
 	{
-		try
-		{
-			abort_callback_impl p_dummy_abort;
-			if (b_opened)
-				filesystem::g_remove(newpath, p_dummy_abort);
-		}
-		catch (const pfc::exception &) {}
 		throw;
 	}
 	catch (const pfc::exception & ex)
 	{
-		try
-		{
-			abort_callback_impl p_dummy_abort;
-			if (b_opened)
-				filesystem::g_remove(newpath, p_dummy_abort);
-		}
-		catch (const pfc::exception &) {}
 		throw pfc::exception(pfc::string_formatter() << "Error writing iTunesDB file : " << ex.what());
 	}
 
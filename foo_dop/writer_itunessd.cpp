@@ -1,6 +1,7 @@
 #include "stdafx.h"
 
 #include "ipod_manager.h"
+#include "writer.h"
 #include "shadowdb.h"
 
 t_int32 round_float_signed(double f)
@@ -8,22 +9,18 @@ t_int32 round_float_signed(double f)
 	return t_int32 (f >= -0.5 ? f + 0.5 : f - 0.5f);
 }
 
-void ipod_write_shuffledb(ipod_device_ptr_ref_t p_ipod, const char * m_path, const ipod::tasks::load_database_t & p_library, threaded_process_v2_t & p_status,abort_callback & p_abort)
+void ipod_write_shuffledb(ipod_device_ptr_ref_t p_ipod, const char * m_path, const ipod::tasks::load_database_t & p_library, ipod::tasks::database_file_t & p_out, threaded_process_v2_t & p_status,abort_callback & p_abort)
 {
-	pfc::string8 newpath;
-	bool b_opened = false;
 	//string_print_drive m_path(p_ipod->drive);
 
 	try
 	{
 		pfc::string8 path = m_path, path_shuffle, path_pstate, path_stats;
-		pfc::string8 backup_path;
 		path << "\\iTunes\\" << "iTunesSD";
 		path_shuffle << m_path << "\\iTunes\\" << "iTunesShuffle";
 		path_pstate << m_path << "\\iTunes\\" << "iTunesPState";
 		path_stats << m_path << "\\iTunes\\" << "iTunesStats";
 
-		newpath << path << ".temp";
 
 		itunessd::writer header;
 		t_size i, count = p_library.m_tracks.get_count();
@@ -109,76 +106,37 @@ void ipod_write_shuffledb(ipod_device_ptr_ref_t p_ipod, const char * m_path, con
 			header.write(track.get_ptr(), track.get_size(), p_abort);
 		}
 
-		service_ptr_t<file> p_file;
-		filesystem::g_open_write_new(p_file, newpath, p_abort);
-		b_opened=true;
-
-		p_file->write(header.get_ptr(), header.get_size(), p_abort);
-
-
-		p_file.release();
-		b_opened=false;
-
-
-		backup_path << path.get_ptr() << ".backup";
-		if (filesystem::g_exists(backup_path, p_abort))
-			filesystem::g_remove(backup_path, p_abort);
-
-		if (filesystem::g_exists(path, p_abort))
-			filesystem::g_move(path, backup_path, p_abort);
-		filesystem::g_move(newpath, path, p_abort);
-
-		if (filesystem::g_exists(path_shuffle, p_abort))
-			filesystem::g_remove(path_shuffle, p_abort);
-
-		if (filesystem::g_exists(path_pstate, p_abort))
-			filesystem::g_remove(path_pstate, p_abort);
-
-		if (filesystem::g_exists(path_stats, p_abort))
-			filesystem::g_remove(path_stats, p_abort);
+		p_out.m_data.write(header.get_ptr(), header.get_size(), p_abort);
+		p_out.set_paths(path, ".temp", ".backup");
+		p_out.m_obsolete_paths.add_item(path_shuffle);
+		p_out.m_obsolete_paths.add_item(path_pstate);
+		p_out.m_obsolete_paths.add_item(path_stats);
+		p_out.m_valid = true;
 	}
 	catch (const exception_aborted &) 
 	{
-		try
-		{
-			abort_callback_impl p_dummy_abort;
-			if (b_opened)
-				filesystem::g_remove(newpath, p_dummy_abort);
-		}
-		catch (const pfc::exception &) {}
 		throw;
 	}
 	catch (const pfc::exception & ex)
 	{
-		try
-		{
-			abort_callback_impl p_dummy_abort;
-			if (b_opened)
-				filesystem::g_remove(newpath, p_dummy_abort);
-		}
-		catch (const pfc::exception &) {}
 		throw pfc::exception
 		//console::print
 			(pfc::string_formatter() << "Error writing iTunesSD file : " << ex.what());
 	}
 }
 
-void ipod_write_shadowdb_v2(ipod_device_ptr_ref_t p_ipod, const char * m_path, const ipod::tasks::load_database_t & p_library, threaded_process_v2_t & p_status,abort_callback & p_abort)
+void ipod_write_shadowdb_v2(ipod_device_ptr_ref_t p_ipod, const char * m_path, const ipod::tasks::load_database_t & p_library, ipod::tasks::database_file_t & p_out, threaded_process_v2_t & p_status,abort_callback & p_abort)
 {
-	pfc::string8 newpath;
-	bool b_opened = false;
 	//string_print_drive m_path(p_ipod->drive);
 
 	try
 	{
 		pfc::string8 path = m_path, path_shuffle, path_pstate, path_stats;
-		pfc::string8 backup_path;
 		path << "\\iTunes\\" << "iTunesSD";
 		path_shuffle << m_path << "\\iTunes\\" << "iTunesShuffle";
 		path_pstate << m_path << "\\iTunes\\" << "iTunesPState";
 		path_stats << m_path << "\\iTunes\\" << "iTunesStats";
 
-		newpath << path << ".temp";
 
 		t_size i, count_tracks = p_library.m_tracks.get_count(), count_playlists = p_library.m_playlists.get_count();
 
@@ -395,55 +353,19 @@ void ipod_write_shadowdb_v2(ipod_device_ptr_ref_t p_ipod, const char * m_path, c
 			header.write(shph, p_abort);
 		}
 
-		service_ptr_t<file> p_file;
-		filesystem::g_open_write_new(p_file, newpath, p_abort);
-		b_opened=true;
-
-		p_file->write(header.get_ptr(), header.get_size(), p_abort);
-
-
-		p_file.release();
-		b_opened=false;
-
-		abort_callback_dummy p_dummy_abort;
-
-		backup_path << path.get_ptr() << ".backup";
-		if (filesystem::g_exists(backup_path, p_dummy_abort))
-			filesystem::g_remove(backup_path, p_dummy_abort);
-
-		if (filesystem::g_exists(path, p_dummy_abort))
-			filesystem::g_move(path, backup_path, p_dummy_abort);
-		filesystem::g_move(newpath, path, p_dummy_abort);
-
-		if (filesystem::g_exists(path_shuffle, p_dummy_abort))
-			filesystem::g_remove(path_shuffle, p_dummy_abort);
-
-		if (filesystem::g_exists(path_pstate, p_dummy_abort))
-			filesystem::g_remove(path_pstate, p_dummy_abort);
-
-		if (filesystem::g_exists(path_stats, p_dummy_abort))
-			filesystem::g_remove(path_stats, p_dummy_abort);
+		p_out.m_data.write(header.get_ptr(), header.get_size(), p_abort);
+		p_out.set_paths(path, ".temp", ".backup");
+		p_out.m_obsolete_paths.add_item(path_shuffle);
+		p_out.m_obsolete_paths.add_item(path_pstate);
+		p_out.m_obsolete_paths.add_item(path_stats);
+		p_out.m_valid = true;
 	}
 	catch (const exception_aborted &) 
 	{
-		try
-		{
-			abort_callback_impl p_dummy_abort;
-			if (b_opened)
-				filesystem::g_remove(newpath, p_dummy_abort);
-		}
-		catch (const pfc::exception &) {}
 		throw;
 	}
 	catch (const pfc::exception & ex)
 	{
-		try
-		{
-			abort_callback_impl p_dummy_abort;
-			if (b_opened)
-				filesystem::g_remove(newpath, p_dummy_abort);
-		}
-		catch (const pfc::exception &) {}
 		throw pfc::exception
 		//console::print
 			(pfc::string_formatter() << "Error writing iTunesSD file : " << ex.what());
@@ -11,21 +11,42 @@ bool g_test_sort_string(const char * str);
 class t_sort_entry
 {
 public:
-	class string_valid_t : public pfc::string_simple_t<WCHAR>
+	/** Sort string together with its collation key. Keys compare with memcmp as the strings do with CompareString. */
+	class sort_string_t : public pfc::string_simple_t<WCHAR>
+	{
+	public:
+		pfc::array_t<t_uint8> m_key;
+
+		void update_key()
+		{
+			int size = LCMapString(LOCALE_USER_DEFAULT, LCMAP_SORTKEY|NORM_IGNORECASE, get_ptr(), -1, NULL, 0);
+			m_key.set_size(size > 0 ? size : 0);
+			if (size > 0)
+				LCMapString(LOCALE_USER_DEFAULT, LCMAP_SORTKEY|NORM_IGNORECASE, get_ptr(), -1, (LPWSTR)m_key.get_ptr(), size);
+		}
+		/** Keys include their null terminator, so comparing up to the shorter one also orders prefixes. */
+		static int g_compare_key(const sort_string_t & str1, const sort_string_t & str2)
+		{
+			int ret = memcmp(str1.m_key.get_ptr(), str2.m_key.get_ptr(), min(str1.m_key.get_size(), str2.m_key.get_size()));
+			if (!ret) ret = pfc::compare_t(str1.m_key.get_size(), str2.m_key.get_size());
+			return ret < 0 ? -1 : (ret > 0 ? 1 : 0);
+		}
+	};
+	class string_valid_t : public sort_string_t
 	{
 	public:
 		bool m_valid;
 
 		string_valid_t() : m_valid (false) {};
 	};
-	pfc::string_simple_t<WCHAR> artist;
-	pfc::string_simple_t<WCHAR> title;
-	pfc::string_simple_t<WCHAR> album;
-	pfc::string_simple_t<WCHAR> genre;
-	pfc::string_simple_t<WCHAR> composer;
-	pfc::string_simple_t<WCHAR> show;
-	pfc::string_simple_t<WCHAR> episode;
-	pfc::string_simple_t<WCHAR> album_artist;
+	sort_string_t artist;
+	sort_string_t title;
+	sort_string_t album;
+	sort_string_t genre;
+	sort_string_t composer;
+	sort_string_t show;
+	sort_string_t episode;
+	sort_string_t album_artist;
 	string_valid_t sort_artist;
 	string_valid_t sort_title;
 	string_valid_t sort_album;
@@ -142,6 +163,12 @@ public:
 		tracknumber = track.tracknumber;
 		discnumber = track.discnumber;
 		episodenumber = track.episode_sort_id;
+
+		//Keys are made once here rather than on every comparison while sorting
+		sort_string_t * strings[] = {&artist, &title, &album, &genre, &composer, &show, &episode, &album_artist,
+			&sort_artist, &sort_title, &sort_album, &sort_composer, &sort_show, &sort_episode, &sort_album_artist};
+		for (t_size i=0; i<tabsize(strings); i++)
+			strings[i]->update_key();
 	}
 
 	typedef int (__cdecl * t_comparefunc)(const t_sort_entry &, const t_sort_entry &);
@@ -293,19 +320,29 @@ public:
 		return ret;
 	}
 
-	static int g_compare_string(const pfc::string_simple_t<WCHAR> & str1, const pfc::string_simple_t<WCHAR> & str2)
+	static int g_compare_string(const t_sort_entry::sort_string_t & str1, const t_sort_entry::sort_string_t & str2)
 	{
-		return g_compare_string(str1.get_ptr(), str2.get_ptr());
+		int ret = 0;
+		if (numbersLast)
+		{
+			wchar_t firsta = g_get_first_character(str1.get_ptr()), firstb= g_get_first_character(str2.get_ptr());
+			ret = g_compare_string_empties(firsta, firstb);
+			if (!ret)
+				ret = g_compare_string_numbers(firsta, firstb);
+		}
+		if (!ret)
+			ret = t_sort_entry::sort_string_t::g_compare_key(str1, str2);
+		return ret;
 	}
 
-	static int g_compare_sort_field(const t_sort_entry::string_valid_t & str1sort, const pfc::string_simple_t<WCHAR> & str1,
-		const t_sort_entry::string_valid_t & str2sort, const pfc::string_simple_t<WCHAR> & str2)
+	static int g_compare_sort_field(const t_sort_entry::string_valid_t & str1sort, const t_sort_entry::sort_string_t & str1,
+		const t_sort_entry::string_valid_t & str2sort, const t_sort_entry::sort_string_t & str2)
 	{
 		int ret = 0;
 		bool b_sort = str1sort.m_valid || str2sort.m_valid;
-		ret = g_compare_string(str1sort.m_valid ? str1sort.get_ptr() : str1.get_ptr(), str2sort.m_valid ? str2sort.get_ptr() : str2.get_ptr());
+		ret = g_compare_string(str1sort.m_valid ? str1sort : str1, str2sort.m_valid ? str2sort : str2);
 		if (ret == 0 && b_sort)
-			ret = g_compare_string(str1.get_ptr(), str2.get_ptr());
+			ret = g_compare_string(str1, str2);
 		return ret;
 	}
 	static int g_compare_artist(const t_sort_entry & item1, const t_sort_entry & item2)
@@ -495,6 +495,668 @@ private:
 	sqlite_database::ptr m_database;
 };
 
+/** Prepares an INSERT statement with one parameter per column. */
+void g_prepare_insert(sqlite_statement & p_stmt, sqlite_database::ptr const & p_db, const char * table, const char * columns)
+{
+	pfc::string8 query;
+	query << "INSERT INTO " << table << " (" << columns << ") VALUES (?";
+	for (const char * ptr = columns; *ptr; ptr++)
+		if (*ptr == ',') query << ",?";
+	query << ")";
+	p_stmt.prepare(p_db, query, query.length());
+}
+
+void g_bind_string(sqlite_statement & p_stmt, bool b_valid, const pfc::string8 & p_value)
+{
+	if (b_valid)
+		p_stmt.autobind_text(p_value, p_value.get_length());
+	else
+		p_stmt.autobind_null();
+}
+
+void g_bind_sort_string(sqlite_statement & p_stmt, bool b_sort_valid, const char * p_sort_value, bool b_valid, const char * p_value)
+{
+	if (b_sort_valid || b_valid)
+	{
+		pfc::string_simple_t<WCHAR> temp;
+		g_get_sort_string_for_sorting(b_sort_valid ? p_sort_value : p_value, temp, false);
+		p_stmt.autobind_text(temp.get_ptr(), temp.length(), SQLITE_TRANSIENT);
+	}
+	else
+		p_stmt.autobind_null();
+}
+
+/** State shared by the functions filling each database. It is not modified while they run. */
+class itdb_build_context_t
+{
+public:
+	itdb_build_context_t(ipod::tasks::load_database_t & p_library, const char * p_root_folder)
+		: m_library(p_library), m_permutation_tid(p_library.m_tracks.get_count())
+	{
+		m_media_path << p_root_folder << "/Music";
+		m_ringtones_path << p_root_folder << "/Ringtones";
+		m_podcasts_path << "Podcasts";
+		m_purchases_path << "Purchases";
+
+		m_sort_orders.run(m_library);
+
+		t_size i, count_tracks = m_library.m_tracks.get_count();
+		t_size count_artists = m_library.m_artist_list.get_count();
+		t_size count_albums = m_library.m_album_list.m_master_list.get_count();
+
+		mmh::sort_get_permutation(m_library.m_tracks.get_ptr(), m_permutation_tid, m_library.g_compare_track_id, false);
+
+		mmh::Permutation perm_artists(count_artists);
+		mmh::Permutation perm_albums(count_albums);
+
+		mmh::sort_get_permutation(m_library.m_artist_list.get_ptr(), perm_artists, t_artist::g_compare_id, false);
+		mmh::sort_get_permutation(m_library.m_album_list.m_master_list.get_ptr(), perm_albums, t_album::g_compare_id, false);
+
+		m_track_included.set_size(count_tracks);
+		m_track_artist_index.set_size(count_tracks);
+		m_track_album_index.set_size(count_tracks);
+
+		for (i=0; i<count_tracks; i++)
+		{
+			pfc::rcptr_t<t_track> & track = m_library.m_tracks[i];
+			m_track_included[i] = /*!track->dshm_type_6 &&*/ (track->media_type & 0xC61010) == 0;
+
+			t_size index = pfc_infinite;
+			if (!pfc::bsearch_permutation_t(count_artists, m_library.m_artist_list, t_artist::g_compare_id_value, track->artist_id, perm_artists, index))
+				index = pfc_infinite;
+			m_track_artist_index[i] = index;
+			if (!pfc::bsearch_permutation_t(count_albums, m_library.m_album_list.m_master_list, t_album::g_compare_id_value, track->album_id, perm_albums, index))
+				index = pfc_infinite;
+			m_track_album_index[i] = index;
+		}
+	}
+
+	ipod::tasks::load_database_t & m_library;
+	sort_orders_generator_t m_sort_orders;
+	mmh::Permutation m_permutation_tid;
+	/** Whether each track is written, and the index of its artist and album (pfc_infinite if none). */
+	pfc::array_t<bool> m_track_included;
+	pfc::array_t<t_size> m_track_artist_index, m_track_album_index;
+	pfc::string8 m_media_path, m_ringtones_path, m_podcasts_path, m_purchases_path;
+};
+
+void g_fill_library_itdb(sqlite_database::ptr const & librarydb, const itdb_build_context_t & p_context)
+{
+	ipod::tasks::load_database_t & m_library = p_context.m_library;
+	const sort_orders_generator_t & sort_orders = p_context.m_sort_orders;
+
+	t_size i, count_library_entries = m_library.m_tracks.get_count();
+	t_size count_artists = m_library.m_artist_list.get_count();
+	t_size count_albums = m_library.m_album_list.m_master_list.get_count();
+
+	sqlite_statement stmt_db_info, stmt_container, stmt_item_to_container, stmt_album, stmt_artist, stmt_genre, stmt_composer;
+	sqlite_statement stmt_item, stmt_avformat_info, stmt_video_info, stmt_podcast_info, stmt_store_info;
+
+	g_prepare_insert(stmt_db_info, librarydb, "db_info", "pid,primary_container_pid,audio_language,subtitle_language");
+	g_prepare_insert(stmt_container, librarydb, "container", "pid,name,name_order,distinguished_kind,media_kinds,date_created,date_modified,parent_pid,workout_template_id,smart_is_folder,is_hidden,"
+		"smart_is_dynamic,smart_is_filtered,smart_is_genius,smart_enabled_only,smart_is_limited,smart_limit_kind,smart_limit_value,smart_limit_order,smart_reverse_limit_order,smart_criteria");
+	g_prepare_insert(stmt_item_to_container, librarydb, "item_to_container", "item_pid,container_pid,physical_order");
+	g_prepare_insert(stmt_album, librarydb, "album", "pid,kind,artwork_status,artwork_item_pid,all_compilations,user_rating,name_order,season_number,name,feed_url,artist_pid");
+	g_prepare_insert(stmt_artist, librarydb, "artist", "pid,kind,artwork_status,artwork_album_pid,name_order,name,sort_name");
+	g_prepare_insert(stmt_genre, librarydb, "genre_map", "id,genre,genre_order");
+	g_prepare_insert(stmt_composer, librarydb, "composer", "pid,name,sort_name,name_order");
+	g_prepare_insert(stmt_item, librarydb, "item", "pid,media_kind,is_song,is_audio_book,is_music_video,is_movie,is_tv_show,is_ringtone,is_voice_memo,is_book,is_podcast,is_rental,is_itunes_u,is_digital_booklet,"
+		"date_modified,year,content_rating,content_rating_level,is_compilation,is_user_disabled,remember_bookmark,exclude_from_shuffle,part_of_gapless_album,chosen_by_auto_fill,artwork_status,"
+		"artwork_cache_id,start_time_ms,stop_time_ms,total_time_ms,track_number,track_count,disc_number,disc_count,bpm,"
+		"relative_volume,genius_id,album_pid,artist_pid"
+		",composer_pid,genre_id,title_order,artist_order,album_order,genre_order,composer_order,album_artist_order,series_name_order"
+		",title,artist,album,album_artist,composer,sort_title,sort_artist,sort_album,sort_album_artist,sort_composer,comment,grouping,description,description_long,collection_description,copyright,eq_preset");
+	g_prepare_insert(stmt_avformat_info, librarydb, "avformat_info", "item_pid,sub_id,audio_format,bit_rate,channels,sample_rate,duration,gapless_heuristic_info,"
+		"gapless_encoding_delay,gapless_encoding_drain,gapless_last_frame_resynch,analysis_inhibit_flags,audio_fingerprint,volume_normalization_energy");
+	g_prepare_insert(stmt_video_info, librarydb, "video_info", "item_pid,has_alternate_audio,has_subtitles,characteristics_valid,has_closed_captions,"
+		"is_self_contained,is_compressed,is_anamorphic,is_hd,episode_sort_id,season_number,audio_language,audio_track_index,"
+		"audio_track_id,subtitle_language,subtitle_track_index,subtitle_track_id,series_name,sort_series_name,network_name,episode_id,extended_content_rating");
+	g_prepare_insert(stmt_podcast_info, librarydb, "podcast_info", "item_pid,date_released,external_guid,feed_url,feed_keywords");
+	g_prepare_insert(stmt_store_info, librarydb, "store_info", "item_pid,store_kind,date_purchased,date_released,store_item_id,account_id,key_versions,"
+		"key_platform_id,key_id,key_id2,artist_id,composer_id,genre_id,playlist_id,storefront_id");
+
+	/** DB INFO */
+
+	stmt_db_info.autobind_int64(m_library.pid);
+	stmt_db_info.autobind_int64(m_library.m_library_playlist->id);
+	stmt_db_info.autobind_int64((t_int16)m_library.audio_language);
+	stmt_db_info.autobind_int64((t_int16)m_library.subtitle_language);
+	stmt_db_info.run();
+
+	/** INSERT PLAYLISTS */
+	{
+		stmt_container.autobind_int64(m_library.m_library_playlist->id);
+		stmt_container.autobind_text(m_library.m_library_playlist->name, m_library.m_library_playlist->name.get_length());
+		stmt_container.autobind_int64(100);
+		stmt_container.autobind_int64(0);
+		stmt_container.autobind_int64(1);
+		stmt_container.autobind_int64(0);
+		stmt_container.autobind_int64(0);
+		stmt_container.autobind_int64(0);
+		stmt_container.autobind_int64(0);
+		stmt_container.autobind_int64(0);
+		stmt_container.autobind_int64(1);
+		for (t_size k = 0; k<10; k++)
+			stmt_container.autobind_null();
+		stmt_container.run();
+
+		for (i=0; i<count_library_entries; i++)
+		{
+			stmt_item_to_container.autobind_int64(m_library.m_tracks[i]->pid);
+			stmt_item_to_container.autobind_int64(m_library.m_library_playlist->id);
+			stmt_item_to_container.autobind_int64(i);
+			stmt_item_to_container.run();
+		}
+
+		for (i=0; i<m_library.m_playlists.get_count(); i++)
+		{
+			const t_playlist & playlist = *m_library.m_playlists[i];
+
+			stmt_container.autobind_int64(playlist.id);
+			stmt_container.autobind_text(playlist.name, playlist.name.get_length());
+			stmt_container.autobind_int64(sort_orders.m_container_order[i] + 100);
+			stmt_container.autobind_int64(0);
+			stmt_container.autobind_int64(1); //media_kinds ??
+			stmt_container.autobind_int64(sqldbtime_from_itunesdbtime(playlist.timestamp));
+			stmt_container.autobind_int64(sqldbtime_from_itunesdbtime(playlist.date_modified));
+			stmt_container.autobind_int64(playlist.parentid);
+			stmt_container.autobind_int64(playlist.workout_template_id);
+			stmt_container.autobind_int64(playlist.folder_flag);
+			stmt_container.autobind_int64(playlist.is_master);
+
+			stream_writer_mem slst;
+			if (playlist.smart_data_valid)
+			{
+				t_uint8 limit_kind = 0, limit_value = playlist.smart_playlist_data.limit_value;
+				if (playlist.smart_playlist_data.limit_type >= 1 && playlist.smart_playlist_data.limit_type <= 4)
+				{
+					limit_kind = playlist.smart_playlist_data.limit_type -1;
+				}
+				else
+					limit_value = 62;
+
+				stmt_container.autobind_int64(playlist.smart_playlist_data.live_update);
+				stmt_container.autobind_int64(playlist.smart_playlist_data.live_update);
+				stmt_container.autobind_int64(playlist.smart_playlist_data.unk4);
+				stmt_container.autobind_int64(playlist.smart_playlist_data.match_checked_only);
+				stmt_container.autobind_int64(playlist.smart_playlist_data.check_limits);
+				stmt_container.autobind_int64(limit_kind);
+				stmt_container.autobind_int64(limit_value);
+				stmt_container.autobind_int64(g_translate_limit_order(playlist.smart_playlist_data.limit_sort));
+				stmt_container.autobind_int64(playlist.smart_playlist_data.reverse_limit_sort);
+
+				if (playlist.smart_rules_valid)
+				{
+					itunesdb::writer::g_write_smart_playlist_rules_content(playlist.smart_playlist_rules, slst, abort_callback_dummy());
+					stmt_container.autobind_blob(slst.get_ptr(), slst.get_size());
+				}
+				else
+					stmt_container.autobind_null();
+			}
+			else
+			{
+				for (t_size k = 0; k<10; k++)
+					stmt_container.autobind_null();
+			}
+			stmt_container.run();
+
+			for (t_size k = 0, j=0, count_entries = playlist.items.get_count(); j<count_entries; j++)
+			{
+				t_size index;
+				if (pfc::bsearch_permutation_t(count_library_entries, m_library.m_tracks, m_library.g_compare_track_id_with_id,
+					playlist.items[j].track_id, p_context.m_permutation_tid, index))
+				{
+					stmt_item_to_container.autobind_int64(m_library.m_tracks[index]->pid);
+					stmt_item_to_container.autobind_int64(playlist.id);
+					stmt_item_to_container.autobind_int64(k);
+					stmt_item_to_container.run();
+					++k;
+				}
+			}
+		}
+	}
+
+	/** INSERT TRACKS */
+
+	pfc::array_staticsize_t<t_uint32> genre_ids(count_library_entries), composer_ids(count_library_entries);
+	pfc::list_t<t_size> genre_tracks, composer_tracks; //first track of each genre and composer
+
+	{
+		mmh::Permutation pgenre(count_library_entries), pcomposer(count_library_entries);
+
+		mmh::sort_get_permutation(m_library.m_tracks.get_ptr(), pgenre, t_track::g_compare_genre, false);
+		mmh::sort_get_permutation(m_library.m_tracks.get_ptr(), pcomposer, t_track::g_compare_composer, false);
+
+		for (i=0; i<count_library_entries; i++)
+		{
+			if (i==0 || t_track::g_compare_genre(m_library.m_tracks[pgenre[i-1]], m_library.m_tracks[pgenre[i]]))
+			{
+				if (m_library.m_tracks[pgenre[i]]->genre_valid && m_library.m_tracks[pgenre[i]]->genre.length())
+					genre_tracks.add_item(pgenre[i]);
+			}
+			if (m_library.m_tracks[pgenre[i]]->genre_valid && m_library.m_tracks[pgenre[i]]->genre.length())
+			{
+				genre_ids[pgenre[i]] = genre_tracks.get_count();
+			}
+			else genre_ids[pgenre[i]] = 0;
+		}
+
+		for (i=0; i<count_library_entries; i++)
+		{
+			if (i==0 || t_track::g_compare_composer(m_library.m_tracks[pcomposer[i-1]], m_library.m_tracks[pcomposer[i]]))
+			{
+				if (m_library.m_tracks[pcomposer[i]]->composer_valid && m_library.m_tracks[pcomposer[i]]->composer.length())
+					composer_tracks.add_item(pcomposer[i]);
+			}
+			if (m_library.m_tracks[pcomposer[i]]->composer_valid && m_library.m_tracks[pcomposer[i]]->composer.length())
+			{
+				composer_ids[pcomposer[i]] = composer_tracks.get_count();
+			}
+			else composer_ids[pcomposer[i]] = 0;
+		}
+	}
+
+	//The name orders of albums, artists, composers and genres are taken from the last track referencing them
+	pfc::array_staticsize_t<t_size> album_last_track(count_albums), artist_last_track(count_artists),
+		genre_last_track(genre_tracks.get_count() + 1), composer_last_track(composer_tracks.get_count() + 1);
+	pfc::fill_array_t(album_last_track, pfc_infinite);
+	pfc::fill_array_t(artist_last_track, pfc_infinite);
+	pfc::fill_array_t(genre_last_track, pfc_infinite);
+	pfc::fill_array_t(composer_last_track, pfc_infinite);
+
+	for (i=0; i<count_library_entries; i++)
+	{
+		if (!p_context.m_track_included[i]) continue;
+		t_size album_index = p_context.m_track_album_index[i], artist_index = p_context.m_track_artist_index[i];
+		if (album_index != pfc_infinite && m_library.m_album_list.m_master_list[album_index]->pid)
+			album_last_track[album_index] = i;
+		if (artist_index != pfc_infinite && m_library.m_artist_list[artist_index]->pid)
+			artist_last_track[artist_index] = i;
+		genre_last_track[genre_ids[i]] = i;
+		composer_last_track[composer_ids[i]] = i;
+	}
+
+	for (i=0; i<count_albums; i++)
+	{
+		t_album::ptr album = m_library.m_album_list.m_master_list[i];
+		t_size last_track = album_last_track[i];
+		const pfc::string8 & name = album->kind == ai_types::tv_show ? album->show : album->album;
+		stmt_album.autobind_int64(album->pid);
+		stmt_album.autobind_int64(album->kind);
+		stmt_album.autobind_int64(album->artwork_status);
+		stmt_album.autobind_int64(album->artwork_item_pid);
+		stmt_album.autobind_int64(album->all_compilations);
+		stmt_album.autobind_int64(album->user_rating);
+		stmt_album.autobind_int64(last_track != pfc_infinite ? sort_orders.m_album_or_show_order[last_track] : 0);
+		stmt_album.autobind_int64(album->season_number);
+		stmt_album.autobind_text(name, name.get_length());
+		stmt_album.autobind_text(album->podcast_url, album->podcast_url.get_length());
+		if (last_track != pfc_infinite)
+		{
+			t_size artist_index = p_context.m_track_artist_index[last_track];
+			stmt_album.autobind_int64(artist_index != pfc_infinite ? m_library.m_artist_list[artist_index]->pid : 0);
+		}
+		else
+			stmt_album.autobind_null();
+		stmt_album.run();
+	}
+
+	for (i=0; i<count_artists; i++)
+	{
+		t_artist::ptr artist = m_library.m_artist_list[i];
+		stmt_artist.autobind_int64(artist->pid);
+		stmt_artist.autobind_int64(artist->type);
+		stmt_artist.autobind_int64(artist->artwork_status);
+		stmt_artist.autobind_int64(artist->artwork_album_pid);
+		stmt_artist.autobind_int64(artist_last_track[i] != pfc_infinite ? sort_orders.m_album_artist_order[artist_last_track[i]] : 0);
+		stmt_artist.autobind_text(artist->artist, artist->artist.get_length());
+		g_bind_sort_string(stmt_artist, artist->sort_artist_valid, artist->sort_artist, true, artist->artist);
+		stmt_artist.run();
+	}
+
+	for (i=0; i<genre_tracks.get_count(); i++)
+	{
+		const t_track & track = *m_library.m_tracks[genre_tracks[i]];
+		t_size last_track = genre_last_track[i+1];
+		stmt_genre.autobind_int64(i+1);
+		stmt_genre.autobind_text(track.genre, track.genre.get_length());
+		stmt_genre.autobind_int64(last_track != pfc_infinite ? sort_orders.m_genre_order[last_track]/100 : 0);
+		stmt_genre.run();
+	}
+
+	for (i=0; i<composer_tracks.get_count(); i++)
+	{
+		const t_track & track = *m_library.m_tracks[composer_tracks[i]];
+		const pfc::string8 & sort_name = track.sort_composer_valid ? track.sort_composer : track.composer;
+		t_size last_track = composer_last_track[i+1];
+		stmt_composer.autobind_int64(i+1);
+		stmt_composer.autobind_text(track.composer, track.composer.get_length());
+		stmt_composer.autobind_text(sort_name, sort_name.get_length());
+		if (last_track != pfc_infinite)
+			stmt_composer.autobind_int64(sort_orders.m_composer_order[last_track]);
+		else
+			stmt_composer.autobind_null();
+		stmt_composer.run();
+	}
+
+	for (i=0; i<count_library_entries; i++)
+	{
+		if (!p_context.m_track_included[i]) continue;
+		pfc::rcptr_t<t_track> & track = m_library.m_tracks[i];
+
+		t_uint32 media_type;
+		if (track->media_type2)
+			media_type = track->media_type2;
+		else
+		{
+			media_type = track->media_type;
+			if (media_type & (t_track::type_is_voice_memo|t_track::type_itunes_u))
+				media_type &= ~t_track::type_audio;
+		}
+
+		t_int64 artist_pid = 0, album_pid = 0;
+		if (p_context.m_track_artist_index[i] != pfc_infinite)
+			artist_pid = m_library.m_artist_list[p_context.m_track_artist_index[i]]->pid;
+		if (p_context.m_track_album_index[i] != pfc_infinite)
+			album_pid = m_library.m_album_list.m_master_list[p_context.m_track_album_index[i]]->pid;
+
+		pfc::string_list_impl ExtCR;
+		pfc::splitStringSimple_toList(ExtCR, '|', track->extended_content_rating);
+		t_uint32 CRLevel = ExtCR.get_count() >=3 ? mmh::strtoul_n(ExtCR[2], pfc_infinite) : 0;
+
+		stmt_item.autobind_int64(track->pid);
+		stmt_item.autobind_int64(media_type);
+		stmt_item.autobind_int64((media_type & t_track::type_audio) ? 1 : 0);
+		stmt_item.autobind_int64((media_type & t_track::type_audiobook) ? 1 : 0);
+		stmt_item.autobind_int64((media_type & t_track::type_music_video) ? 1 : 0);
+		stmt_item.autobind_int64((media_type & t_track::type_video) ? 1 : 0);
+		stmt_item.autobind_int64((media_type & t_track::type_tv_show) ? 1 : 0);
+		stmt_item.autobind_int64((media_type & t_track::type_ringtone) ? 1 : 0);
+		stmt_item.autobind_int64((media_type & t_track::type_is_voice_memo) ? 1 : 0);
+		stmt_item.autobind_int64((media_type & t_track::type_book) ? 1 : 0);
+		stmt_item.autobind_int64((media_type & t_track::type_podcast) ? 1 : 0);
+		stmt_item.autobind_int64((media_type & t_track::type_rental) ? 1 : 0);
+		stmt_item.autobind_int64((media_type & t_track::type_itunes_u) ? 1 : 0);
+		stmt_item.autobind_int64((media_type & t_track::type_digital_booklet) ? 1 : 0);
+		stmt_item.autobind_int64(sqldbtime_from_itunesdbtime(track->lastmodifiedtime));
+		stmt_item.autobind_int64(track->year);
+		stmt_item.autobind_int64(track->content_rating);
+		stmt_item.autobind_int64(CRLevel);
+		stmt_item.autobind_int64(track->is_compilation);
+		stmt_item.autobind_int64(track->is_user_disabled);
+		stmt_item.autobind_int64(track->remember_playback_position);
+		stmt_item.autobind_int64(track->skip_on_shuffle);
+		stmt_item.autobind_int64(track->gapless_album != 0);
+		stmt_item.autobind_int64(track->chosen_by_auto_fill != 0);
+		stmt_item.autobind_int64(track->artwork_flag);
+		stmt_item.autobind_int64(track->artwork_cache_id);
+		stmt_item.autobind_int64(track->starttime);
+		stmt_item.autobind_int64(track->stoptime);
+		stmt_item.autobind_int64(track->length);
+		stmt_item.autobind_int64(track->tracknumber);
+		stmt_item.autobind_int64(track->totaltracks);
+		stmt_item.autobind_int64(track->discnumber);
+		stmt_item.autobind_int64(track->totaldiscs);
+		stmt_item.autobind_int64(track->bpm);
+		stmt_item.autobind_int64(track->volume);
+		stmt_item.autobind_int64(track->genius_id);
+		stmt_item.autobind_int64(album_pid);
+		stmt_item.autobind_int64(artist_pid);
+		stmt_item.autobind_int64(composer_ids[i]);
+		stmt_item.autobind_int64(genre_ids[i]);
+		stmt_item.autobind_int64(sort_orders.m_title_order[i]);
+		stmt_item.autobind_int64(sort_orders.m_artist_order[i]);
+		stmt_item.autobind_int64(sort_orders.m_album_order[i]);
+		stmt_item.autobind_int64(sort_orders.m_genre_order[i]);
+		stmt_item.autobind_int64(sort_orders.m_composer_order[i]);
+		stmt_item.autobind_int64(sort_orders.m_album_artist_order[i]);
+		stmt_item.autobind_int64(sort_orders.m_series_name_order[i]);
+		g_bind_string(stmt_item, track->title_valid, track->title);
+		g_bind_string(stmt_item, track->artist_valid, track->artist);
+		g_bind_string(stmt_item, track->album_valid, track->album);
+		g_bind_string(stmt_item, track->album_artist_valid, track->album_artist);
+		g_bind_string(stmt_item, track->composer_valid, track->composer);
+		g_bind_sort_string(stmt_item, track->sort_title_valid, track->sort_title, track->title_valid, track->title);
+		g_bind_sort_string(stmt_item, track->sort_artist_valid, track->sort_artist, track->artist_valid, track->artist);
+		g_bind_sort_string(stmt_item, track->sort_album_valid, track->sort_album, track->album_valid, track->album);
+		g_bind_sort_string(stmt_item, track->sort_album_artist_valid, track->sort_album_artist, track->album_artist_valid, track->album_artist);
+		g_bind_sort_string(stmt_item, track->sort_composer_valid, track->sort_composer, track->composer_valid, track->composer);
+		g_bind_string(stmt_item, track->comment_valid, track->comment);
+		g_bind_string(stmt_item, track->grouping_valid, track->grouping);
+		g_bind_string(stmt_item, track->subtitle_valid, track->subtitle);
+		g_bind_string(stmt_item, track->description_valid, track->description);
+		g_bind_string(stmt_item, track->collection_description_valid, track->collection_description);
+		g_bind_string(stmt_item, track->copyright_valid, track->copyright);
+		g_bind_string(stmt_item, track->eq_settings_valid, track->eq_settings);
+		stmt_item.run();
+
+		stmt_avformat_info.autobind_int64(track->pid);
+		stmt_avformat_info.autobind_int64(0);
+		stmt_avformat_info.autobind_int64(g_translate_audio_format(track->audio_format));
+		stmt_avformat_info.autobind_int64(track->bitrate);
+		stmt_avformat_info.autobind_int64(track->channel_count);
+		stmt_avformat_info.autobind_double(track->samplerate_float);
+		stmt_avformat_info.autobind_int64(track->samplecount);
+		stmt_avformat_info.autobind_int64(track->gapless_heuristic_info);
+		stmt_avformat_info.autobind_int64(track->gapless_encoding_delay);
+		stmt_avformat_info.autobind_int64(track->gapless_encoding_drain);
+		stmt_avformat_info.autobind_int64(track->gapless_last_frame_resync);
+		stmt_avformat_info.autobind_int64(0);
+		stmt_avformat_info.autobind_int64(track->audio_fingerprint);
+		stmt_avformat_info.autobind_int64(track->volume_normalisation_energy);
+		stmt_avformat_info.run();
+
+		if (track->video_flag)
+		{
+			stmt_video_info.autobind_int64(track->pid);
+			stmt_video_info.autobind_int64(track->has_alternate_audio);
+			stmt_video_info.autobind_int64(track->has_subtitles);
+			stmt_video_info.autobind_int64(track->characteristics_valid);
+			stmt_video_info.autobind_int64(track->has_closed_captions);
+			stmt_video_info.autobind_int64(track->is_not_self_contained == 0 ?1:0);
+			stmt_video_info.autobind_int64(track->is_compressed);
+			stmt_video_info.autobind_int64(track->is_anamorphic);
+			stmt_video_info.autobind_int64(track->is_hd);
+			stmt_video_info.autobind_int64(track->episode_sort_id);
+			stmt_video_info.autobind_int64(track->season_number);
+			stmt_video_info.autobind_int64((t_int16)track->audio_language);
+			stmt_video_info.autobind_int64(track->audio_track_index);
+			stmt_video_info.autobind_int64(track->audio_track_id);
+			stmt_video_info.autobind_int64((t_int16)track->subtitle_language);
+			stmt_video_info.autobind_int64(track->subtitle_track_index);
+			stmt_video_info.autobind_int64(track->subtitle_track_id);
+			g_bind_string(stmt_video_info, track->show_valid, track->show);
+			g_bind_string(stmt_video_info, track->show_valid, track->sort_show_valid ? track->sort_show : track->show);
+			g_bind_string(stmt_video_info, track->tv_network_valid, track->tv_network);
+			g_bind_string(stmt_video_info, track->episode_valid, track->episode);
+			g_bind_string(stmt_video_info, track->extended_content_rating_valid, track->extended_content_rating);
+			stmt_video_info.run();
+		}
+
+		if (track->podcast_flag)
+		{
+			stmt_podcast_info.autobind_int64(track->pid);
+			stmt_podcast_info.autobind_int64(sqldbtime_from_itunesdbtime(track->datereleased, false));
+			stmt_podcast_info.autobind_text(track->podcast_enclosure_url, track->podcast_enclosure_url.get_length());
+			stmt_podcast_info.autobind_text(track->podcast_rss_url, track->podcast_rss_url.get_length());
+			stmt_podcast_info.autobind_text(track->keywords, track->keywords.get_length());
+			stmt_podcast_info.run();
+		}
+
+		if (g_track_has_store_info(track))
+		{
+			stmt_store_info.autobind_int64(track->pid);
+			stmt_store_info.autobind_int64(track->store_kind);
+			stmt_store_info.autobind_int64(sqldbtime_from_itunesdbtime(track->date_purchased)); //FIXME
+			stmt_store_info.autobind_int64(sqldbtime_from_itunesdbtime(track->datereleased)); //FIXME
+			stmt_store_info.autobind_int64(track->store_item_id);
+			stmt_store_info.autobind_int64(track->account_id_primary ? track->account_id_primary : track->account_id_secondary);
+			stmt_store_info.autobind_int64(track->store_key_versions);
+			stmt_store_info.autobind_int64(track->key_platform_id);
+			stmt_store_info.autobind_int64(track->key_id);
+			stmt_store_info.autobind_int64(track->key_id2);
+			stmt_store_info.autobind_int64(track->store_artist_id);
+			stmt_store_info.autobind_int64(track->store_composer_id);
+			stmt_store_info.autobind_int64(track->store_genre_id);
+			stmt_store_info.autobind_int64(track->store_playlist_id);
+			stmt_store_info.autobind_int64(track->store_front_id);
+			stmt_store_info.run();
+		}
+	}
+
+}
+
+void g_fill_locations_itdb(sqlite_database::ptr const & locationsdb, const itdb_build_context_t & p_context)
+{
+	ipod::tasks::load_database_t & m_library = p_context.m_library;
+	const pfc::string8 & media_path = p_context.m_media_path, & ringtones_path = p_context.m_ringtones_path,
+		& podcasts_path = p_context.m_podcasts_path, & purchases_path = p_context.m_purchases_path;
+	t_size media_path_len = media_path.get_length();
+	t_size ringtones_path_len = ringtones_path.get_length();
+	t_size podcasts_path_len = podcasts_path.get_length();
+	t_size purchases_path_len = purchases_path.get_length();
+
+	sqlite_statement stmt_base_location, stmt_location;
+	g_prepare_insert(stmt_base_location, locationsdb, "base_location", "id,path");
+	g_prepare_insert(stmt_location, locationsdb, "location", "item_pid,sub_id,base_location_id,location_type,location,extension,date_created,file_size");
+
+	const pfc::string8 * base_paths[] = {&media_path, &podcasts_path, &ringtones_path, &purchases_path};
+	const t_uint32 base_ids[] = {1, 4, 6, 7};
+	for (t_size i=0; i<tabsize(base_paths); i++)
+	{
+		stmt_base_location.autobind_int64(base_ids[i]);
+		stmt_base_location.autobind_text(*base_paths[i], base_paths[i]->get_length());
+		stmt_base_location.run();
+	}
+
+	for (t_size i=0, count = m_library.m_tracks.get_count(); i<count; i++)
+	{
+		if (!p_context.m_track_included[i]) continue;
+		pfc::rcptr_t<t_track> & track = m_library.m_tracks[i];
+
+		t_uint32 location_type = hm4(F,I,L,E), base_type = 1;
+		pfc::string8 path = track->location;
+		path.replace_byte(':','/');
+		const char * file = path;
+		if (*path == '/') file++;
+		if (!stricmp_utf8_max(file, media_path, media_path_len))
+			file += media_path_len;
+		else if (!stricmp_utf8_max(file, ringtones_path, ringtones_path_len))
+		{
+			file += ringtones_path_len;
+			base_type = 6;
+		}
+		else if (!stricmp_utf8_max(file, podcasts_path, podcasts_path_len))
+		{
+			file += podcasts_path_len;
+			base_type = 4;
+		}
+		else if (!stricmp_utf8_max(file, purchases_path, purchases_path_len))
+		{
+			file += purchases_path_len;
+			base_type = 7;
+		}
+
+		if (*file == '/') file++;
+
+		t_uint32 extension = 0;
+		pfc::string_extension ext(path);
+		string_upper extupper(ext);
+		if (extupper.length() == 3)
+			extension = extupper[0]<<24 | extupper[1] <<16 | extupper[2] << 8 | ' ';
+
+		stmt_location.autobind_int64(track->pid);
+		stmt_location.autobind_int64(0);
+		stmt_location.autobind_int64(base_type);
+		stmt_location.autobind_int64(location_type);
+		//track->filetype
+		stmt_location.autobind_text(file, strlen(file));
+		stmt_location.autobind_int64(extension);
+		stmt_location.autobind_int64(sqldbtime_from_itunesdbtime(track->dateadded));
+		stmt_location.autobind_int64(track->file_size_64 ? track->file_size_64 : track->file_size_32);
+		stmt_location.run();
+	}
+}
+
+void g_fill_dynamic_itdb(sqlite_database::ptr const & dynamicdb, const itdb_build_context_t & p_context)
+{
+	ipod::tasks::load_database_t & m_library = p_context.m_library;
+
+	sqlite_statement stmt_container_ui, stmt_item_stats;
+	g_prepare_insert(stmt_container_ui, dynamicdb, "container_ui", "container_pid,play_order,is_reversed,album_field_order,repeat_mode,shuffle_items,has_been_shuffled");
+	g_prepare_insert(stmt_item_stats, dynamicdb, "item_stats", "item_pid,has_been_played,date_played,play_count_user,play_count_recent,date_skipped,"
+		"skip_count_user,skip_count_recent,bookmark_time_ms,bookmark_time_ms_common,user_rating,user_rating_common");
+
+	//The library playlist first, then the other playlists
+	for (t_size i=0, count = m_library.m_playlists.get_count(); i<=count; i++)
+	{
+		const t_playlist & playlist = i ? *m_library.m_playlists[i-1] : *m_library.m_library_playlist;
+
+		t_uint16 repeat_mode = 0;
+		if (playlist.repeat_mode == 2)
+			repeat_mode = 2;
+		else if (playlist.repeat_mode == 3)
+			repeat_mode = 1;
+
+		stmt_container_ui.autobind_int64(playlist.id);
+		stmt_container_ui.autobind_int64(g_translate_limit_order(playlist.sort_order));
+		stmt_container_ui.autobind_int64(playlist.sort_direction);
+		stmt_container_ui.autobind_int64(g_translate_limit_order(playlist.album_field_order));
+		stmt_container_ui.autobind_int64(repeat_mode);
+		stmt_container_ui.autobind_int64(playlist.shuffle_items);
+		stmt_container_ui.autobind_int64(playlist.has_been_shuffled);
+		stmt_container_ui.run();
+	}
+
+	for (t_size i=0, count = m_library.m_tracks.get_count(); i<count; i++)
+	{
+		if (!p_context.m_track_included[i]) continue;
+		pfc::rcptr_t<t_track> & track = m_library.m_tracks[i];
+
+		stmt_item_stats.autobind_int64(track->pid);
+		stmt_item_stats.autobind_int64(track->played_marker == 1 ? 1 : 0);
+		stmt_item_stats.autobind_int64(sqldbtime_from_itunesdbtime(track->lastplayedtime));
+		stmt_item_stats.autobind_int64(track->play_count_user);
+		stmt_item_stats.autobind_int64(track->play_count_recent);
+		stmt_item_stats.autobind_int64(sqldbtime_from_itunesdbtime(track->last_skipped));
+		stmt_item_stats.autobind_int64(track->skip_count_user);
+		stmt_item_stats.autobind_int64(track->skip_count_recent);
+		stmt_item_stats.autobind_int64(track->bookmarktime);
+		stmt_item_stats.autobind_int64(track->bookmark_time_ms_common);
+		stmt_item_stats.autobind_int64(track->rating);
+		stmt_item_stats.autobind_int64(track->rating);
+		stmt_item_stats.run();
+	}
+}
+
+void g_fill_extras_itdb(sqlite_database::ptr const & extrasdb, const itdb_build_context_t & p_context)
+{
+	ipod::tasks::load_database_t & m_library = p_context.m_library;
+
+	sqlite_statement stmt_lyrics, stmt_chapter;
+	g_prepare_insert(stmt_lyrics, extrasdb, "lyrics", "item_pid,checksum");
+	g_prepare_insert(stmt_chapter, extrasdb, "chapter", "item_pid,data");
+
+	for (t_size i=0, count = m_library.m_tracks.get_count(); i<count; i++)
+	{
+		if (!p_context.m_track_included[i]) continue;
+		pfc::rcptr_t<t_track> & track = m_library.m_tracks[i];
+
+		if (track->lyrics_flag)
+		{
+			stmt_lyrics.autobind_int64(track->pid);
+			stmt_lyrics.autobind_int64((t_int32)track->lyrics_checksum);
+			stmt_lyrics.run();
+		}
+		if (track->chapter_data_valid && track->do_chapter_data.get_size() > 12)
+		{
+			stmt_chapter.autobind_int64(track->pid);
+			stmt_chapter.autobind_blob(track->do_chapter_data.get_ptr(), track->do_chapter_data.get_size());
+			stmt_chapter.run();
+		}
+	}
+}
+
 void ipod::tasks::database_writer_t::write_sqlitedb(ipod_device_ptr_ref_t p_ipod, ipod::tasks::load_database_t & m_library, const t_field_mappings & p_mappings, threaded_process_v2_t & p_status,abort_callback & p_abort)
 {
 	//if (p_ipod->m_device_properties.m_SQLiteDB)
@@ -516,9 +1178,6 @@ void ipod::tasks::database_writer_t::write_sqlitedb(ipod_device_ptr_ref_t p_ipod
 			sqlite_handle sqlh;
 			sqlite_database::ptr locationsdb, librarydb, dynamicdb, extrasdb;
 
-			pfc::string8_fast_aggressive query;
-			query.prealloc(1024);
-
 			t_size i=NULL, count=NULL;
 
 			try { filesystem::g_remove(pfc::string8() << tempbase << "Locations.itdb.dop.temp", p_abort); } catch (const exception_io_not_found) {};
@@ -549,743 +1208,28 @@ void ipod::tasks::database_writer_t::write_sqlitedb(ipod_device_ptr_ref_t p_ipod
 			pfc::string8 rootFolder;
 			p_ipod->get_database_folder(rootFolder);
 
-			pfc::string8 media_path; media_path << rootFolder << "/Music";
-			pfc::string8 ringtones_path; ringtones_path << rootFolder << "/Ringtones";
-			pfc::string8 podcasts_path; podcasts_path << "Podcasts";
-			pfc::string8 purchases_path; purchases_path << "Purchases";
-			t_size media_path_len = strlen(media_path);
-			t_size ringtones_path_len = strlen(ringtones_path);
-			t_size podcasts_path_len = strlen(podcasts_path);
-			t_size purchases_path_len = strlen(purchases_path);
-
-			locationsdb->exec(pfc::string8() << "INSERT INTO base_location (id,path) VALUES (1, '" << media_path <<"')");
-			locationsdb->exec(pfc::string8() << "INSERT INTO base_location (id,path) VALUES (4, '" << podcasts_path <<"')");
-			locationsdb->exec(pfc::string8() << "INSERT INTO base_location (id,path) VALUES (6, '" << ringtones_path <<"')");
-			locationsdb->exec(pfc::string8() << "INSERT INTO base_location (id,path) VALUES (7, '" << purchases_path <<"')");
-
-			/** DB INFO */
-
-			query.reset();
-			query << "INSERT INTO db_info (pid,primary_container_pid,audio_language,subtitle_language) VALUES (" //"%lld,%d,%d)"
-				<< (t_int64)m_library.pid << ","
-				<< (t_int64)m_library.m_library_playlist->id << ","
-				<< (t_int16)m_library.audio_language << ","
-				<< (t_int16)m_library.subtitle_language
-				<< ")";
-			librarydb->exec(query);
-
-			sort_orders_generator_t sort_orders;
-			sort_orders.run(m_library);
-
-			/** INSERT PLAYLISTS */
-			{
-				t_size j, count_entries = m_library.m_tracks.get_count(), count_library_entries = m_library.m_tracks.get_count();
-
-				count = m_library.m_playlists.get_count();
-
-				query.reset();
-
-				query << "INSERT INTO container (pid,name,name_order,distinguished_kind,media_kinds,date_created,date_modified,parent_pid,workout_template_id,smart_is_folder,is_hidden) VALUES ("
-					<< (t_int64)m_library.m_library_playlist->id << ","
-					<< "'" << string_escape_sql(m_library.m_library_playlist->name) << "',"
-					<< "100" << ","
-					<< "0" << ","
-					<< "1" << ","
-					<< "0" << ","
-					<< "0" << ","
-					<< "0" << ","
-					<< "0" << ","
-					<< "0" << ","
-					<< "1" << ")";
-
-				librarydb->exec(query);
-
-				query.reset();
-
-				t_uint16 repeat_mode = 0;
-				if (m_library.m_library_playlist->repeat_mode == 2)
-					repeat_mode = 2;
-				else if (m_library.m_library_playlist->repeat_mode == 3)
-					repeat_mode = 1;
-
-				query << "INSERT INTO container_ui (container_pid,play_order,is_reversed,album_field_order,repeat_mode,shuffle_items,has_been_shuffled) VALUES ("
-					<< (t_int64)m_library.m_library_playlist->id << ","
-					<< g_translate_limit_order(m_library.m_library_playlist->sort_order) << ","
-					<< m_library.m_library_playlist->sort_direction << ","
-					<< g_translate_limit_order(m_library.m_library_playlist->album_field_order) << ","
-					<< repeat_mode << ","
-					<< m_library.m_library_playlist->shuffle_items << ","
-					<< m_library.m_library_playlist->has_been_shuffled 
-					<< ")";
-
-				dynamicdb->exec(query);
-
-				mmh::Permutation permutation_tid(m_library.m_tracks.get_count());
-				mmh::sort_get_permutation(m_library.m_tracks.get_ptr(), permutation_tid, m_library.g_compare_track_id, false);
-
-				for (j=0; j< count_entries; j++)
-				{
-					pfc::rcptr_t<t_track> & track = m_library.m_tracks[j];
-					query.reset();
-					query << "INSERT INTO item_to_container (item_pid,container_pid,physical_order) VALUES ("
-						<< (t_int64)track->pid << ","
-						<< (t_int64)m_library.m_library_playlist->id << ","
-						<< j << ")";
-					librarydb->exec(query);
-				}
-
-				for (i=0; i<count; i++)
-				{
-
-					query.reset();
-
-					query << "INSERT INTO container (pid,name,name_order,distinguished_kind,media_kinds,date_created,date_modified,parent_pid,workout_template_id,smart_is_folder,is_hidden) VALUES ("
-						<< (t_int64)m_library.m_playlists[i]->id << ","
-						<< "'" << string_escape_sql(m_library.m_playlists[i]->name) << "',"
-						<< (sort_orders.m_container_order[i] + 100) << ","
-						<< "0" << ","
-						<< "1" << "," //media_kinds ??
-						<< sqldbtime_from_itunesdbtime(m_library.m_playlists[i]->timestamp) << ","
-						<< sqldbtime_from_itunesdbtime(m_library.m_playlists[i]->date_modified) << ","
-						<< (t_int64)m_library.m_playlists[i]->parentid << ","
-						<< m_library.m_playlists[i]->workout_template_id << ","
-						<< m_library.m_playlists[i]->folder_flag << ","
-						<< m_library.m_playlists[i]->is_master
-						<< ")";
-
-					librarydb->exec(query);
-
-					query.reset();
-
-					t_uint16 repeat_mode = 0;
-					if (m_library.m_playlists[i]->repeat_mode == 2)
-						repeat_mode = 2;
-					else if (m_library.m_playlists[i]->repeat_mode == 3)
-						repeat_mode = 1;
-
-					query << "INSERT INTO container_ui (container_pid,play_order,is_reversed,album_field_order,repeat_mode,shuffle_items,has_been_shuffled) VALUES ("
-						<< (t_int64)m_library.m_playlists[i]->id << ","
-						<< g_translate_limit_order(m_library.m_playlists[i]->sort_order) << ","
-						<< m_library.m_playlists[i]->sort_direction << ","
-						<< g_translate_limit_order(m_library.m_playlists[i]->album_field_order) << ","
-						<< repeat_mode << ","
-						<< m_library.m_playlists[i]->shuffle_items << ","
-						<< m_library.m_playlists[i]->has_been_shuffled 
-						<< ")";
-
-					dynamicdb->exec(query);
-
-					if (m_library.m_playlists[i]->smart_data_valid)
-					{
-						t_uint8 limit_kind = 0, limit_value = m_library.m_playlists[i]->smart_playlist_data.limit_value;
-						if (m_library.m_playlists[i]->smart_playlist_data.limit_type >= 1 && m_library.m_playlists[i]->smart_playlist_data.limit_type <= 4)
-						{
-							limit_kind = m_library.m_playlists[i]->smart_playlist_data.limit_type -1;
-						}
-						else
-							limit_value = 62;
-
-
-
-						query.reset();
-						query << "UPDATE container SET smart_is_dynamic="  << m_library.m_playlists[i]->smart_playlist_data.live_update 
-							<< ",smart_is_filtered=" <<  m_library.m_playlists[i]->smart_playlist_data.live_update 
-							<< ",smart_is_genius=" << m_library.m_playlists[i]->smart_playlist_data.unk4
-							<< ",smart_enabled_only=" << m_library.m_playlists[i]->smart_playlist_data.match_checked_only
-							<< ",smart_is_limited=" << m_library.m_playlists[i]->smart_playlist_data.check_limits
-							<< ",smart_limit_kind=" << limit_kind
-							<< ",smart_limit_value=" << limit_value
-							<< ",smart_limit_order=" << g_translate_limit_order(m_library.m_playlists[i]->smart_playlist_data.limit_sort)
-							<< ",smart_reverse_limit_order=" << m_library.m_playlists[i]->smart_playlist_data.reverse_limit_sort
-							<< " WHERE pid=" << (t_int64)m_library.m_playlists[i]->id;
-						librarydb->exec(query);
-						query.reset();
-
-						if (m_library.m_playlists[i]->smart_rules_valid)
-						{
-							stream_writer_mem slst;
-							itunesdb::writer::g_write_smart_playlist_rules_content(m_library.m_playlists[i]->smart_playlist_rules, slst, abort_callback_dummy());
-							query << "UPDATE container SET smart_criteria=X'" << pfc::format_hexdump(slst.get_ptr(), slst.get_size(), "")
-								<< "' WHERE pid=" << (t_int64)m_library.m_playlists[i]->id;
-							librarydb->exec(query);
-						}
-					}
-
-					count_entries = m_library.m_playlists[i]->items.get_count();
-					for (t_size k = 0, j=0; j<count_entries; j++)
-					{
-						//t_int64 pid = m_library.m_playlists[i]->items[j].item_pid;
-						t_size index;
-						if (pfc::bsearch_permutation_t(count_library_entries, m_library.m_tracks, m_library.g_compare_track_id_with_id, 
-							m_library.m_playlists[i]->items[j].track_id, permutation_tid, index))
-						{
-							pfc::rcptr_t<t_track> & track = m_library.m_tracks[index];
-							query.reset();
-							query << "INSERT INTO item_to_container (item_pid,container_pid,physical_order) VALUES ("
-								<< (t_int64)track->pid << ","
-								<< (t_int64)m_library.m_playlists[i]->id << ","
-								<< k << ")";
-							librarydb->exec(query);
-							++k;
-						}
-					}
-				}
-
-			}
-
-			/** INSERT TRACKS */
-
-			t_size count_artists = m_library.m_artist_list.get_count();
-			t_size count_albums = m_library.m_album_list.m_master_list.get_count();
-
-			mmh::Permutation perm_artists(count_artists);
-			mmh::Permutation perm_albums(count_albums);
-
-			mmh::sort_get_permutation(m_library.m_artist_list.get_ptr(), perm_artists, t_artist::g_compare_id, false);
-			mmh::sort_get_permutation(m_library.m_album_list.m_master_list.get_ptr(), perm_albums, t_album::g_compare_id, false);			
-
-			for (i=0; i<count_albums; i++)
-			{
-				t_album::ptr album = m_library.m_album_list.m_master_list[i];
-				query.reset();
-				query << "INSERT INTO album (pid,kind,artwork_status,artwork_item_pid,all_compilations,user_rating,name_order,season_number,name,feed_url) VALUES ("
-					<< (t_int64)album->pid << ","
-					<< album->kind << ","
-					<< album->artwork_status << ","
-					<< (t_int64)album->artwork_item_pid << ","
-					<< album->all_compilations << ","
-					<< album->user_rating << ","
-					<< "0" << ","
-					<< album->season_number << ","
-					<< "'" << string_escape_sql(album->kind == ai_types::tv_show ? album->show : album->album) << "',"
-					<< "'" << string_escape_sql(album->podcast_url) <<"'"
-					<< ")";
-				librarydb->exec(query);
-			}
-
-			for (i=0; i<count_artists; i++)
-			{
-				query.reset();
-				query << "INSERT INTO artist (pid,kind,artwork_status,artwork_album_pid,name_order,name,sort_name) VALUES ("
-					<< (t_int64)m_library.m_artist_list[i]->pid << ","
-					<< m_library.m_artist_list[i]->type << ","
-					<< m_library.m_artist_list[i]->artwork_status << ","
-					<< (t_int64)m_library.m_artist_list[i]->artwork_album_pid << ","
-					<< "0" ","
-					<< "'" << string_escape_sql(m_library.m_artist_list[i]->artist) << "',"
-					<< "?"
-					//<< "'" << string_escape_sql(m_library.m_artist_list[i]->sort_artist_valid ? m_library.m_artist_list[i]->sort_artist : m_library.m_artist_list[i]->artist) << "'" 
-					<< ")";
-				
-				sqlite_statement stmt;
-				stmt.prepare(librarydb, query, query.length());
-
-				{
-					pfc::string_simple_t<WCHAR> temp; 
-					if (m_library.m_artist_list[i]->sort_artist_valid) 
-					{
-						g_get_sort_string_for_sorting(m_library.m_artist_list[i]->sort_artist, temp, false);
-					}
-					else 
-					{
-						g_get_sort_string_for_sorting(m_library.m_artist_list[i]->artist, temp, false);
-					}
-					stmt.autobind_text(temp.get_ptr(), temp.length(), SQLITE_TRANSIENT);
-				}
-
-				stmt.finalise();
-
-				//librarydb->exec(query);
-			}
-
-			t_size count_library_entries = m_library.m_tracks.get_count();
-			pfc::array_staticsize_t<t_uint32> genre_ids(count_library_entries), composer_ids(count_library_entries);
+			itdb_build_context_t context(m_library, rootFolder);
 
+			//Each database has its own connection, so the four can be filled concurrently
+			auto fill_database = [&](t_size index)
 			{
-				t_size counter = 0;
-				mmh::Permutation pgenre(count_library_entries), pcomposer(count_library_entries);
-
-				mmh::sort_get_permutation(m_library.m_tracks.get_ptr(), pgenre, t_track::g_compare_genre, false);
-				mmh::sort_get_permutation(m_library.m_tracks.get_ptr(), pcomposer, t_track::g_compare_composer, false);
-
-				for (i=0; i<count_library_entries; i++)
+				switch (index)
 				{
-					if (i==0 || t_track::g_compare_genre(m_library.m_tracks[pgenre[i-1]], m_library.m_tracks[pgenre[i]]))
-					{
-						if (m_library.m_tracks[pgenre[i]]->genre_valid && m_library.m_tracks[pgenre[i]]->genre.length())
-						{
-							counter++;
-							query.reset();
-							query << "INSERT INTO genre_map (id,genre) VALUES (" << counter << ",'" << string_escape_sql(m_library.m_tracks[pgenre[i]]->genre) << "')";
-							librarydb->exec(query);
-						}
-					}
-					if (m_library.m_tracks[pgenre[i]]->genre_valid && m_library.m_tracks[pgenre[i]]->genre.length())
-					{
-						genre_ids[pgenre[i]] = counter;
-					}
-					else genre_ids[pgenre[i]] = 0;
-				}
-
-				counter = 0;
-
-				for (i=0; i<count_library_entries; i++)
-				{
-					if (i==0 || t_track::g_compare_composer(m_library.m_tracks[pcomposer[i-1]], m_library.m_tracks[pcomposer[i]]))
-					{
-						if (m_library.m_tracks[pcomposer[i]]->composer_valid && m_library.m_tracks[pcomposer[i]]->composer.length())
-						{
-							counter++;
-							query.reset();
-							query << "INSERT INTO composer (pid,name,sort_name) VALUES (" << counter << ",'" 
-								<< string_escape_sql(m_library.m_tracks[pcomposer[i]]->composer) << "','" 
-								<< string_escape_sql(m_library.m_tracks[pcomposer[i]]->sort_composer_valid ? m_library.m_tracks[pcomposer[i]]->sort_composer : m_library.m_tracks[pcomposer[i]]->composer) << "')";
-							librarydb->exec(query);
-						}
-					}
-					if (m_library.m_tracks[pcomposer[i]]->composer_valid && m_library.m_tracks[pcomposer[i]]->composer.length())
-					{
-						composer_ids[pcomposer[i]] = counter;
-					}
-					else composer_ids[pcomposer[i]] = 0;
-				}
-
-			}
-
-			count = m_library.m_tracks.get_count();
-			for (i=0; i<count; i++)
-			{
-				pfc::rcptr_t<t_track> & track = m_library.m_tracks[i];
-				if (/*!track->dshm_type_6 &&*/ (track->media_type & 0xC61010) == 0)
-				{
-					t_uint32 media_type;
-					if (track->media_type2)
-						media_type = track->media_type2;
-					else
-					{
-						media_type = track->media_type;
-						if (media_type & (t_track::type_is_voice_memo|t_track::type_itunes_u))
-							media_type &= ~t_track::type_audio;
-					}
-					int is_song = (media_type & t_track::type_audio) ? 1 : 0;
-					int is_audio_book = (media_type & t_track::type_audiobook) ? 1 : 0;
-					int is_music_video = (media_type & t_track::type_music_video) ? 1 : 0;
-					int is_movie = (media_type & t_track::type_video) ? 1 : 0;
-					int is_tv_show = (media_type & t_track::type_tv_show) ? 1 : 0;
-					int is_ringtone = (media_type & t_track::type_ringtone) ? 1 : 0;
-					int is_voice_memo = (media_type & t_track::type_is_voice_memo) ? 1 : 0;
-					int is_podcast = (media_type & t_track::type_podcast) ? 1 : 0;
-					int is_rental = (media_type & t_track::type_rental) ? 1 : 0;
-					int is_itunes_u = (media_type & t_track::type_itunes_u) ? 1 : 0;
-					int is_digital_booklet = (media_type & t_track::type_digital_booklet) ? 1 : 0;
-					int is_book = (media_type & t_track::type_book) ? 1 : 0;
-
-					t_size index = pfc_infinite;
-					t_int64 artist_pid = 0, album_pid = 0;
-					if (pfc::bsearch_permutation_t(count_artists, m_library.m_artist_list, t_artist::g_compare_id_value, track->artist_id, perm_artists, index))
-						artist_pid = m_library.m_artist_list[index]->pid;
-					if (pfc::bsearch_permutation_t(count_albums, m_library.m_album_list.m_master_list, t_album::g_compare_id_value, track->album_id, perm_albums, index))
-						album_pid = m_library.m_album_list.m_master_list[index]->pid;
-
-#define INSERT_ITEM_STRING(x) \
-	if (track->##x##_valid) librarydb->exec(pfc::string8() << "UPDATE item SET " << #x << "='" << string_escape_sql(track->##x) << "' WHERE pid=" << (t_int64)track->pid)
-
-#define INSERT_ITEM_STRING2(x,y) \
-	if (track->##x##_valid) librarydb->exec(pfc::string8() << "UPDATE item SET " << y << "='" << string_escape_sql(track->##x) << "' WHERE pid=" << (t_int64)track->pid)
-
-#define INSERT_ITEM_STRING_EX(d,t,p,x,y) \
-	if (track->##x##_valid) d->exec(pfc::string8() << "UPDATE " t " SET " << y << "='" << string_escape_sql(track->##x) << "' WHERE "p"=" << (t_int64)track->pid)
-
-#define INSERT_ITEM_SORT_STRING_EX(d,t,p,x,y) \
-	if (track->##x##_valid) d->exec(pfc::string8() << "UPDATE " t " SET " << y << "='" << string_escape_sql(track->sort_##x##_valid ? track->sort_##x : track->##x) << "' WHERE "p"=" << (t_int64)track->pid)
-
-#define ITEM_SET_STRING(x) \
-	if (track->##x##_valid) inner_query << (inner_query.length() ? "," : "") << #x << "='" << string_escape_sql(track->##x) << "'"
-
-#define ITEM_SET_STRING2(x,y) \
-	if (track->##x##_valid) inner_query << (inner_query.length() ? "," : "") << y << "='" << string_escape_sql(track->##x) << "'"
-
-#define ITEM_SET_STRING_BIND(x) \
-	if (track->##x##_valid) {stmt.autobind_text(track->##x, track->##x##.get_length());}
-
-#define ITEM_SET_SORT_STRING_BIND(x) \
-	{pfc::string_simple_t<WCHAR> temp;  if (track->sort_##x##_valid) {g_get_sort_string_for_sorting(track->sort_##x, temp, false);} else if (track->##x##_valid) {g_get_sort_string_for_sorting(track->##x, temp, false);} stmt.autobind_text(temp.get_ptr(), temp.length(), SQLITE_TRANSIENT);}
-
-#define ITEM_SET_STRING_TOBIND(x) \
-	if (track->##x##_valid) query << ",?"
-
-#define ITEM_SET_SORT_STRING_TOBIND(x) \
-	if (track->sort_##x##_valid || track->##x##_valid) query << ",?"
-
-#define ITEM_SET_STRING_TOBINDF(x) \
-	if (track->##x##_valid) query << ","#x
-
-#define ITEM_SET_SORT_STRING_TOBINDF(x) \
-	if (track->sort_##x##_valid || track->##x##_valid) query << ",sort_"#x
-
-#define ITEM_SET_STRING_TOBINDF2(x,y) \
-	if (track->##x##_valid) query << ","#y
-
-
-					pfc::string_list_impl ExtCR;
-					pfc::splitStringSimple_toList(ExtCR, '|', track->extended_content_rating);
-					t_uint32 CRLevel = ExtCR.get_count() >=3 ? mmh::strtoul_n(ExtCR[2], pfc_infinite) : 0;
-					query.reset();
-
-					query << "INSERT INTO item (pid,media_kind,is_song,is_audio_book,is_music_video,is_movie,is_tv_show,is_ringtone,is_voice_memo,is_book,is_podcast,is_rental,is_itunes_u,is_digital_booklet,"
-						"date_modified,year,content_rating,content_rating_level,is_compilation,is_user_disabled,remember_bookmark,exclude_from_shuffle,part_of_gapless_album,chosen_by_auto_fill,artwork_status,"
-						"artwork_cache_id,start_time_ms,stop_time_ms,total_time_ms,track_number,track_count,disc_number,disc_count,bpm,"
-						"relative_volume,genius_id,album_pid,artist_pid"
-						",composer_pid,genre_id,title_order,artist_order,album_order,genre_order,composer_order,album_artist_order,series_name_order";
-					//",title,artist,album,album_artist,composer,sort_title,sort_artist,sort_album,sort_album_artist,comment,grouping,description,description_long,eq_preset";
-
-					ITEM_SET_STRING_TOBINDF(title);
-					ITEM_SET_STRING_TOBINDF(artist);
-					ITEM_SET_STRING_TOBINDF(album);
-					ITEM_SET_STRING_TOBINDF(album_artist);
-					ITEM_SET_STRING_TOBINDF(composer);
-					ITEM_SET_SORT_STRING_TOBINDF(title);
-					ITEM_SET_SORT_STRING_TOBINDF(artist);
-					ITEM_SET_SORT_STRING_TOBINDF(album);
-					ITEM_SET_SORT_STRING_TOBINDF(album_artist);
-					ITEM_SET_SORT_STRING_TOBINDF(composer);
-					ITEM_SET_STRING_TOBINDF(comment);
-					ITEM_SET_STRING_TOBINDF(grouping);
-					ITEM_SET_STRING_TOBINDF2(subtitle, "description");
-					ITEM_SET_STRING_TOBINDF2(description, "description_long");
-					ITEM_SET_STRING_TOBINDF2(collection_description, "collection_description");
-					ITEM_SET_STRING_TOBINDF(copyright);
-					ITEM_SET_STRING_TOBINDF2(eq_settings, "eq_preset");
-
-					query <<
-						") VALUES ("
-						<< (t_int64)track->pid << ","
-						<< media_type << ","
-						<< is_song<< "," 
-						<< is_audio_book<< "," 
-						<<is_music_video<< "," 
-						<<is_movie<< "," 
-						<<is_tv_show<< "," 
-						<<is_ringtone<< "," 
-						<<is_voice_memo<< "," 
-						<<is_book<< "," 
-						<<is_podcast<< "," 
-						<<is_rental << "," 
-						<<is_itunes_u << "," 
-						<< is_digital_booklet << ","
-						<< sqldbtime_from_itunesdbtime(track->lastmodifiedtime) << ","
-						<< track->year << ","
-						<< track->content_rating << ","
-						<< CRLevel << ","
-						<< track->is_compilation << ","
-						<< track->is_user_disabled << ","
-						<< track->remember_playback_position << ","
-						<< track->skip_on_shuffle << ","
-						<< (track->gapless_album !=0) << ","
-						<< (track->chosen_by_auto_fill !=0) << ","
-						<< track->artwork_flag << ","
-						<< (track->artwork_cache_id) << ","
-						<< track->starttime << ","
-						<< track->stoptime << ","
-						<< track->length << ","
-						<< track->tracknumber << ","
-						<< track->totaltracks << ","
-						<< track->discnumber << ","
-						<< track->totaldiscs << ","
-						<< track->bpm << ","
-						<< track->volume << ","
-						<< (t_int64)track->genius_id << ","
-						<< album_pid << ","
-						<< artist_pid
-
-						<< ","
-						<< composer_ids[i] << ","
-						<< genre_ids[i]
-					<< ","
-
-						<< sort_orders.m_title_order[i] << ","
-						<< sort_orders.m_artist_order[i] << ","
-						<< sort_orders.m_album_order[i] << ","
-						<< sort_orders.m_genre_order[i] << ","
-						<< sort_orders.m_composer_order[i] << ","
-						<< sort_orders.m_album_artist_order[i] << ","
-						<< sort_orders.m_series_name_order[i];
-
-#if 1
-					ITEM_SET_STRING_TOBIND(title);
-					ITEM_SET_STRING_TOBIND(artist);
-					ITEM_SET_STRING_TOBIND(album);
-					ITEM_SET_STRING_TOBIND(album_artist);
-					ITEM_SET_STRING_TOBIND(composer);
-					ITEM_SET_SORT_STRING_TOBIND(title);
-					ITEM_SET_SORT_STRING_TOBIND(artist);
-					ITEM_SET_SORT_STRING_TOBIND(album);
-					ITEM_SET_SORT_STRING_TOBIND(album_artist);
-					ITEM_SET_SORT_STRING_TOBIND(composer);
-					ITEM_SET_STRING_TOBIND(comment);
-					ITEM_SET_STRING_TOBIND(grouping);
-					ITEM_SET_STRING_TOBIND(subtitle);
-					ITEM_SET_STRING_TOBIND(description);
-					ITEM_SET_STRING_TOBIND(copyright);
-					ITEM_SET_STRING_TOBIND(eq_settings);
-					//<< "?,?,?,?,?,?,?,?,?,?,?,?,?,?"
-#else
-					<< string_escape_quote_sql(track->title) << ","
-						<< string_escape_quote_sql(track->artist) << ","
-						<< string_escape_quote_sql(track->album) << ","
-						<< string_escape_quote_sql(track->album_artist) << ","
-						<< string_escape_quote_sql(track->composer) << ","
-						<< string_escape_quote_sql(track->sort_title) << ","
-						<< string_escape_quote_sql(track->sort_artist) << ","
-						<< string_escape_quote_sql(track->sort_album) << ","
-						<< string_escape_quote_sql(track->sort_album_artist) << ","
-						<< string_escape_quote_sql(track->comment) << ","
-						<< string_escape_quote_sql(track->grouping) << ","
-						<< string_escape_quote_sql(track->subtitle) << ","
-						<< string_escape_quote_sql(track->description) << ","
-						<< string_escape_quote_sql(track->eq_settings)// << ","
-#endif
-
-						query << ")";
-
-#if 1
-					sqlite_statement stmt;
-					stmt.prepare(librarydb, query, query.length());
-					ITEM_SET_STRING_BIND(title);
-					ITEM_SET_STRING_BIND(artist);
-					ITEM_SET_STRING_BIND(album);
-					ITEM_SET_STRING_BIND(album_artist);
-					ITEM_SET_STRING_BIND(composer);
-					ITEM_SET_SORT_STRING_BIND(title);
-					ITEM_SET_SORT_STRING_BIND(artist);
-					ITEM_SET_SORT_STRING_BIND(album);
-					ITEM_SET_SORT_STRING_BIND(album_artist);
-					ITEM_SET_SORT_STRING_BIND(composer);
-					ITEM_SET_STRING_BIND(comment);
-					ITEM_SET_STRING_BIND(grouping);
-					ITEM_SET_STRING_BIND(subtitle);
-					ITEM_SET_STRING_BIND(description);
-					ITEM_SET_STRING_BIND(collection_description);
-					ITEM_SET_STRING_BIND(copyright);
-					ITEM_SET_STRING_BIND(eq_settings);
-					stmt.finalise();
-#else
-					librarydb->exec(query);
-#endif
-
-					query.reset();
-
-					if (album_pid)
-					{
-						query << "UPDATE album SET artist_pid=" << artist_pid << ",name_order=" << sort_orders.m_album_or_show_order[i] <<" WHERE pid=" << album_pid;
-						librarydb->exec(query);
-						query.reset();
-					}
-
-					if (artist_pid)
-					{
-						query << "UPDATE artist SET name_order=" << sort_orders.m_album_artist_order[i] <<" WHERE pid=" << artist_pid;
-						librarydb->exec(query);
-						query.reset();
-					}
-
-					if (composer_ids[i])
-					{
-						query << "UPDATE composer SET name_order=" << sort_orders.m_composer_order[i] <<" WHERE pid=" << composer_ids[i];
-						librarydb->exec(query);
-						query.reset();
-					}
-
-					if (genre_ids[i])
-					{
-						query << "UPDATE genre_map SET genre_order=" << sort_orders.m_genre_order[i]/100 <<" WHERE id=" << genre_ids[i];
-						librarydb->exec(query);
-						query.reset();
-					}
-
-
-					t_uint32 location_type = hm4(F,I,L,E), base_type = 1;
-					pfc::string8 path = track->location;
-					path.replace_byte(':','/');
-					const char * file = path;
-					if (*path == '/') file++;
-					if (!stricmp_utf8_max(file, media_path, media_path_len))
-						file += media_path_len;
-					else if (!stricmp_utf8_max(file, ringtones_path, ringtones_path_len))
-					{
-						file += ringtones_path_len;
-						base_type = 6;
-					}
-					else if (!stricmp_utf8_max(file, podcasts_path, podcasts_path_len))
-					{
-						file += podcasts_path_len;
-						base_type = 4;
-					}
-					else if (!stricmp_utf8_max(file, purchases_path, purchases_path_len))
-					{
-						file += purchases_path_len;
-						base_type = 7;
-					}
-
-					if (*file == '/') file++;
-
-					t_uint32 extension = 0;
-					pfc::string_extension ext(path);
-					string_upper extupper(ext);
-					if (extupper.length() == 3)
-						extension = extupper[0]<<24 | extupper[1] <<16 | extupper[2] << 8 | ' ';
-
-					query.reset();
-					query << "INSERT INTO location (item_pid,sub_id,base_location_id,location_type,location,extension,date_created,file_size)VALUES ("
-						<< (t_int64)track->pid << ","
-						<< "0" << "," 
-						<< base_type << ","
-						<< location_type << ","
-						//<< track->filetype << ","
-						<< "'" << string_escape_sql(file) << "',"
-						<< extension << ","
-						<< sqldbtime_from_itunesdbtime(track->dateadded) << ","
-						<< (track->file_size_64 ? track->file_size_64 : track->file_size_32)
-						<< ")";
-
-					locationsdb->exec(query);
-
-					query.reset();
-					query << "INSERT INTO avformat_info (item_pid,sub_id,audio_format,bit_rate,channels,sample_rate,duration,gapless_heuristic_info,"
-						"gapless_encoding_delay,gapless_encoding_drain,gapless_last_frame_resynch,analysis_inhibit_flags,audio_fingerprint,volume_normalization_energy) VALUES ("
-						<< (t_int64)track->pid << ","
-						<< "0" << ","
-						<< g_translate_audio_format(track->audio_format) << ","
-						<< track->bitrate << ","
-						<< track->channel_count << ","
-						<< (track->samplerate_float) << ","
-						<< track->samplecount << ","
-						<< track->gapless_heuristic_info << ","
-						<< track->gapless_encoding_delay << ","
-						<< track->gapless_encoding_drain << ","
-						<< track->gapless_last_frame_resync << ","
-						<< "0" << ","
-						<< track->audio_fingerprint << ","
-						<< track->volume_normalisation_energy
-						<< ")";
-
-					librarydb->exec(query);
-
-					if (track->video_flag)
-					{
-						query.reset();
-
-						query << "INSERT INTO video_info (item_pid,has_alternate_audio,has_subtitles,characteristics_valid,has_closed_captions,"
-							"is_self_contained,is_compressed,is_anamorphic,is_hd,episode_sort_id,season_number,audio_language,audio_track_index,"
-							"audio_track_id,subtitle_language,subtitle_track_index,subtitle_track_id) VALUES ("
-							<< (t_int64)track->pid << ","
-							<< track->has_alternate_audio << ","
-							<< track->has_subtitles << ","
-							<< track->characteristics_valid << ","
-							<< track->has_closed_captions << ","
-							<< (track->is_not_self_contained == 0 ?1:0) << ","
-							<< track->is_compressed << ","
-							<< track->is_anamorphic << ","
-							<< track->is_hd << ","
-							<< track->episode_sort_id << ","
-							<< track->season_number << ","
-							<< (t_int16)track->audio_language << ","
-							<< track->audio_track_index << ","
-							<< track->audio_track_id << ","
-							<< (t_int16)track->subtitle_language << ","
-							<< track->subtitle_track_index << ","
-							<< track->subtitle_track_id 
-							<< ")";
-
-						librarydb->exec(query);
-
-						INSERT_ITEM_STRING_EX(librarydb,"video_info","item_pid",show,"series_name");
-						INSERT_ITEM_SORT_STRING_EX(librarydb,"video_info","item_pid",show,"sort_series_name");
-						INSERT_ITEM_STRING_EX(librarydb,"video_info","item_pid",tv_network,"network_name");
-						INSERT_ITEM_STRING_EX(librarydb,"video_info","item_pid",episode,"episode_id");
-						INSERT_ITEM_STRING_EX(librarydb,"video_info","item_pid",extended_content_rating,"extended_content_rating");
-					}
-
-					query.reset();
-
-					if (track->podcast_flag)
-					{
-						query << "INSERT INTO podcast_info (item_pid, date_released, external_guid, feed_url, feed_keywords) VALUES ("
-							<< (t_int64)track->pid << ","
-							<< sqldbtime_from_itunesdbtime(track->datereleased, false) << ","
-							<< string_escape_quote_sql(track->podcast_enclosure_url) << ","
-							<< string_escape_quote_sql(track->podcast_rss_url) << ","
-							<< string_escape_quote_sql(track->keywords) 
-							<< ")";
-
-						librarydb->exec(query);
-
-						query.reset();
-					}
-
-					if (g_track_has_store_info(track))
-					{
-						query << "INSERT INTO store_info (item_pid,store_kind,date_purchased,date_released,store_item_id,account_id,key_versions,"
-							"key_platform_id,key_id,key_id2,artist_id,composer_id,genre_id,playlist_id,storefront_id) VALUES ("
-							<< (t_int64)track->pid << ","
-							<< track->store_kind << ","
-							<< sqldbtime_from_itunesdbtime(track->date_purchased) << "," //FIXME
-							<< sqldbtime_from_itunesdbtime(track->datereleased) << "," //FIXME
-							<< (t_int64)track->store_item_id << ","
-							<< (t_int64)(track->account_id_primary ? track->account_id_primary : track->account_id_secondary) << ","
-							<< track->store_key_versions << ","
-							<< track->key_platform_id << ","
-							<< (t_int64)track->key_id << ","
-							<< (t_int64)track->key_id2 << ","
-							<< (t_int64)track->store_artist_id << ","
-							<< (t_int64)track->store_composer_id << ","
-							<< (t_int64)track->store_genre_id << ","
-							<< (t_int64)track->store_playlist_id << ","
-							<< (t_int64)track->store_front_id
-							<< ")";
-
-						librarydb->exec(query);
-
-						query.reset();
-					}
-
-					if (track->lyrics_flag)
-					{
-						query << "INSERT INTO lyrics (item_pid,checksum) VALUES (" << (t_int64)track->pid << "," << (t_int32)track->lyrics_checksum << ")";
-						extrasdb->exec(query);
-						query.reset();
-					}
-					if (track->chapter_data_valid && track->do_chapter_data.get_size() > 12)
-					{
-						query << "INSERT INTO chapter (item_pid,data) VALUES (" << (t_int64)track->pid << ",?)";
-						sqlite_statement stmt;
-						stmt.prepare(extrasdb, query, query.length());
-						stmt.autobind_blob(track->do_chapter_data.get_ptr(), track->do_chapter_data.get_size());
-						stmt.finalise();
-						query.reset();
-					}
-				query.reset();
-
-				query << "INSERT INTO item_stats(item_pid,has_been_played,date_played,play_count_user,play_count_recent,date_skipped,"
-					"skip_count_user,skip_count_recent,bookmark_time_ms,bookmark_time_ms_common,user_rating,user_rating_common) VALUES ("
-					<< (t_int64)track->pid << ","
-					<< (t_uint32)(track->played_marker == 1 ? 1 : 0) << ","
-					<< sqldbtime_from_itunesdbtime(track->lastplayedtime) << ","
-					<< track->play_count_user << ","
-					<< track->play_count_recent << ","
-					<< sqldbtime_from_itunesdbtime(track->last_skipped) << ","
-					<< track->skip_count_user << ","
-					<< track->skip_count_recent << ","
-					<< track->bookmarktime << ","
-					<< track->bookmark_time_ms_common << ","
-					<< track->rating << ","
-					<< track->rating
-					<< ")";
-
-				dynamicdb->exec(query);
-				}
-			}
-
+				case 0:
+					g_fill_library_itdb(librarydb, context);
+					break;
+				case 1:
+					g_fill_locations_itdb(locationsdb, context);
+					break;
+				case 2:
+					g_fill_dynamic_itdb(dynamicdb, context);
+					break;
+				case 3:
+					g_fill_extras_itdb(extrasdb, context);
+					break;
+				};
+			};
+			parallel_for_t<decltype(fill_database)>(4, fill_database, 1).run(4);
 
 			librarydb->exec("INSERT OR REPLACE INTO version_info (ROWID, major, minor, compatibility, update_level, platform) VALUES (1, 1, 55, 0, 0, 2)");
 			librarydb->exec(pfc::string8() <<  "PRAGMA user_version = " << 26);
@@ -1397,36 +1341,6 @@ void ipod::tasks::database_writer_t::write_sqlitedb(ipod_device_ptr_ref_t p_ipod
 			cbk_file->write(cbk_data.get_ptr(), cbk_data.get_size(), dummy_aborter);
 
 			cbk_file.release();
-
-			try {filesystem::g_remove(pfc::string8() << base << "Library.itdb.dop.backup", dummy_aborter); } catch (exception_io_not_found const &) {};
-			try {filesystem::g_remove(pfc::string8() << base << "Extras.itdb.dop.backup", dummy_aborter); } catch (exception_io_not_found const &) {};
-			try {filesystem::g_remove(pfc::string8() << base << "Locations.itdb.dop.backup", dummy_aborter); } catch (exception_io_not_found const &) {};
-			try {filesystem::g_remove(pfc::string8() << base << "Locations.itdb.cbk.dop.backup", dummy_aborter); } catch (exception_io_not_found const &) {};
-			try {filesystem::g_remove(pfc::string8() << base << "Dynamic.itdb.dop.backup", dummy_aborter); } catch (exception_io_not_found const &) {};
-
-			filesystem::g_copy(pfc::string8() << tempbase << "Library.itdb.dop.temp", pfc::string8() << base << "Library.itdb.dop.temp", dummy_aborter);
-			filesystem::g_copy(pfc::string8() << tempbase << "Extras.itdb.dop.temp", pfc::string8() << base << "Extras.itdb.dop.temp", dummy_aborter);
-			filesystem::g_copy(pfc::string8() << tempbase << "Locations.itdb.dop.temp", pfc::string8() << base << "Locations.itdb.dop.temp", dummy_aborter);
-			filesystem::g_copy(pfc::string8() << tempbase << "Locations.itdb.cbk.dop.temp", pfc::string8() << base << "Locations.itdb.cbk.dop.temp", dummy_aborter);
-			filesystem::g_copy(pfc::string8() << tempbase << "Dynamic.itdb.dop.temp", pfc::string8() << base << "Dynamic.itdb.dop.temp", dummy_aborter);
-
-			filesystem::g_remove(pfc::string8() << tempbase << "Library.itdb.dop.temp", dummy_aborter);
-			filesystem::g_remove(pfc::string8() << tempbase << "Extras.itdb.dop.temp", dummy_aborter);
-			filesystem::g_remove(pfc::string8() << tempbase << "Locations.itdb.dop.temp", dummy_aborter);
-			filesystem::g_remove(pfc::string8() << tempbase << "Locations.itdb.cbk.dop.temp", dummy_aborter);
-			filesystem::g_remove(pfc::string8() << tempbase << "Dynamic.itdb.dop.temp", dummy_aborter);
-
-			try {filesystem::g_move(pfc::string8() << base << "Library.itdb", pfc::string8() << base << "Library.itdb.dop.backup", dummy_aborter); } catch (exception_io_not_found const &) {};
-			try {filesystem::g_move(pfc::string8() << base << "Extras.itdb", pfc::string8() << base << "Extras.itdb.dop.backup", dummy_aborter); } catch (exception_io_not_found const &) {};
-			try {filesystem::g_move(pfc::string8() << base << "Locations.itdb", pfc::string8() << base << "Locations.itdb.dop.backup", dummy_aborter); } catch (exception_io_not_found const &) {};
-			try {filesystem::g_move(pfc::string8() << base << "Locations.itdb.cbk", pfc::string8() << base << "Locations.itdb.cbk.dop.backup", dummy_aborter); } catch (exception_io_not_found const &) {};
-			try {filesystem::g_move(pfc::string8() << base << "Dynamic.itdb", pfc::string8() << base << "Dynamic.itdb.dop.backup", dummy_aborter); } catch (exception_io_not_found const &) {};
-
-			filesystem::g_move(pfc::string8() << base << "Library.itdb.dop.temp", pfc::string8() << base << "Library.itdb", dummy_aborter);
-			filesystem::g_move(pfc::string8() << base << "Extras.itdb.dop.temp", pfc::string8() << base << "Extras.itdb", dummy_aborter);
-			filesystem::g_move(pfc::string8() << base << "Locations.itdb.dop.temp", pfc::string8() << base << "Locations.itdb", dummy_aborter);
-			filesystem::g_move(pfc::string8() << base << "Locations.itdb.cbk.dop.temp", pfc::string8() << base << "Locations.itdb.cbk", dummy_aborter);
-			filesystem::g_move(pfc::string8() << base << "Dynamic.itdb.dop.temp", pfc::string8() << base << "Dynamic.itdb", dummy_aborter);
 		}
 		catch (pfc::exception const & ex)
 		{
@@ -1437,6 +1351,53 @@ void ipod::tasks::database_writer_t::write_sqlitedb(ipod_device_ptr_ref_t p_ipod
 
 }
 
+void ipod::tasks::database_writer_t::install_sqlitedb(ipod_device_ptr_ref_t p_ipod)
+{
+	pfc::string8 base, tempbase;
+	p_ipod->get_database_path(base);
+	base << p_ipod->get_path_separator_ptr() << "iTunes" << p_ipod->get_path_separator_ptr() << "iTunes Library.itlp" << p_ipod->get_path_separator_ptr();
+	uGetTempPath(tempbase);
+
+	try
+	{
+		abort_callback_dummy dummy_aborter;
+
+		try {filesystem::g_remove(pfc::string8() << base << "Library.itdb.dop.backup", dummy_aborter); } catch (exception_io_not_found const &) {};
+		try {filesystem::g_remove(pfc::string8() << base << "Extras.itdb.dop.backup", dummy_aborter); } catch (exception_io_not_found const &) {};
+		try {filesystem::g_remove(pfc::string8() << base << "Locations.itdb.dop.backup", dummy_aborter); } catch (exception_io_not_found const &) {};
+		try {filesystem::g_remove(pfc::string8() << base << "Locations.itdb.cbk.dop.backup", dummy_aborter); } catch (exception_io_not_found const &) {};
+		try {filesystem::g_remove(pfc::string8() << base << "Dynamic.itdb.dop.backup", dummy_aborter); } catch (exception_io_not_found const &) {};
+
+		filesystem::g_copy(pfc::string8() << tempbase << "Library.itdb.dop.temp", pfc::string8() << base << "Library.itdb.dop.temp", dummy_aborter);
+		filesystem::g_copy(pfc::string8() << tempbase << "Extras.itdb.dop.temp", pfc::string8() << base << "Extras.itdb.dop.temp", dummy_aborter);
+		filesystem::g_copy(pfc::string8() << tempbase << "Locations.itdb.dop.temp", pfc::string8() << base << "Locations.itdb.dop.temp", dummy_aborter);
+		filesystem::g_copy(pfc::string8() << tempbase << "Locations.itdb.cbk.dop.temp", pfc::string8() << base << "Locations.itdb.cbk.dop.temp", dummy_aborter);
+		filesystem::g_copy(pfc::string8() << tempbase << "Dynamic.itdb.dop.temp", pfc::string8() << base << "Dynamic.itdb.dop.temp", dummy_aborter);
+
+		filesystem::g_remove(pfc::string8() << tempbase << "Library.itdb.dop.temp", dummy_aborter);
+		filesystem::g_remove(pfc::string8() << tempbase << "Extras.itdb.dop.temp", dummy_aborter);
+		filesystem::g_remove(pfc::string8() << tempbase << "Locations.itdb.dop.temp", dummy_aborter);
+		filesystem::g_remove(pfc::string8() << tempbase << "Locations.itdb.cbk.dop.temp", dummy_aborter);
+		filesystem::g_remove(pfc::string8() << tempbase << "Dynamic.itdb.dop.temp", dummy_aborter);
+
+		try {filesystem::g_move(pfc::string8() << base << "Library.itdb", pfc::string8() << base << "Library.itdb.dop.backup", dummy_aborter); } catch (exception_io_not_found const &) {};
+		try {filesystem::g_move(pfc::string8() << base << "Extras.itdb", pfc::string8() << base << "Extras.itdb.dop.backup", dummy_aborter); } catch (exception_io_not_found const &) {};
+		try {filesystem::g_move(pfc::string8() << base << "Locations.itdb", pfc::string8() << base << "Locations.itdb.dop.backup", dummy_aborter); } catch (exception_io_not_found const &) {};
+		try {filesystem::g_move(pfc::string8() << base << "Locations.itdb.cbk", pfc::string8() << base << "Locations.itdb.cbk.dop.backup", dummy_aborter); } catch (exception_io_not_found const &) {};
+		try {filesystem::g_move(pfc::string8() << base << "Dynamic.itdb", pfc::string8() << base << "Dynamic.itdb.dop.backup", dummy_aborter); } catch (exception_io_not_found const &) {};
+
+		filesystem::g_move(pfc::string8() << base << "Library.itdb.dop.temp", pfc::string8() << base << "Library.itdb", dummy_aborter);
+		filesystem::g_move(pfc::string8() << base << "Extras.itdb.dop.temp", pfc::string8() << base << "Extras.itdb", dummy_aborter);
+		filesystem::g_move(pfc::string8() << base << "Locations.itdb.dop.temp", pfc::string8() << base << "Locations.itdb", dummy_aborter);
+		filesystem::g_move(pfc::string8() << base << "Locations.itdb.cbk.dop.temp", pfc::string8() << base << "Locations.itdb.cbk", dummy_aborter);
+		filesystem::g_move(pfc::string8() << base << "Dynamic.itdb.dop.temp", pfc::string8() << base << "Dynamic.itdb", dummy_aborter);
+	}
+	catch (pfc::exception const & ex)
+	{
+		throw pfc::exception(pfc::string8() << "" << ex.what());
+	}
+}
+
 pfc::array_staticsize_t<t_uint8> ipod::tasks::database_writer_t::calculate_cbk(ipod_device_ptr_ref_t p_ipod, const char* locations_itdb_path)
 {
 	const t_size cbk_version = p_ipod->m_device_properties.m_db_version >= 5 ? 3 : 2;
@@ -179,3 +179,112 @@ private:
 	z_stream m_zstream;
 	//zlib_handle m_zlib;
 };
+
+/** Inflates a zlib stream from a file as it is read, so neither side is held in memory in full. */
+class zlib_inflate_reader
+{
+public:
+	zlib_inflate_reader(const file::ptr & p_file) : m_file(p_file), m_input(input_buffer_size), m_finished(false)
+	{
+		memset(&m_zstream, 0, sizeof(m_zstream));
+		if (inflateInit(&m_zstream) != Z_OK)
+			throw pfc::exception("zlib: inflateInit error");
+	}
+	~zlib_inflate_reader()
+	{
+		inflateEnd(&m_zstream);
+	}
+	/** Returns the number of bytes read, which is only less than p_bytes at the end of the stream. */
+	t_size read(void * p_buffer, t_size p_bytes, abort_callback & p_abort)
+	{
+		m_zstream.next_out = (Bytef*)p_buffer;
+		m_zstream.avail_out = p_bytes;
+		while (m_zstream.avail_out && !m_finished)
+		{
+			if (m_zstream.avail_in == 0)
+			{
+				t_size read = m_file->read(m_input.get_ptr(), m_input.get_size(), p_abort);
+				if (read == 0)
+					throw exception_io_data_truncation();
+				m_zstream.next_in = m_input.get_ptr();
+				m_zstream.avail_in = read;
+			}
+			int ret = inflate(&m_zstream, Z_NO_FLUSH);
+			if (ret == Z_STREAM_END)
+				m_finished = true;
+			else if (ret != Z_OK)
+				throw pfc::exception("zlib: inflate error");
+		}
+		return p_bytes - m_zstream.avail_out;
+	}
+	void read_object(void * p_buffer, t_size p_bytes, abort_callback & p_abort)
+	{
+		if (read(p_buffer, p_bytes, p_abort) != p_bytes)
+			throw exception_io_data_truncation();
+	}
+	void skip_object(t_size p_bytes, abort_callback & p_abort)
+	{
+		pfc::array_staticsize_t<t_uint8> buffer(min(p_bytes, input_buffer_size));
+		while (p_bytes)
+		{
+			t_size delta = min(p_bytes, buffer.get_size());
+			read_object(buffer.get_ptr(), delta, p_abort);
+			p_bytes -= delta;
+		}
+	}
+private:
+	enum {input_buffer_size = 256*1024};
+
+	z_stream m_zstream;
+	file::ptr m_file;
+	pfc::array_staticsize_t<t_uint8> m_input;
+	bool m_finished;
+};
+
+/** Deflates everything written to it into another stream. finish() must be called after the last write. */
+class zlib_deflate_writer : public stream_writer
+{
+public:
+	zlib_deflate_writer(stream_writer & p_output) : m_output(p_output), m_buffer(output_buffer_size)
+	{
+		memset(&m_zstream, 0, sizeof(m_zstream));
+		if (deflateInit(&m_zstream, Z_BEST_SPEED) != Z_OK)
+			throw pfc::exception("zlib: deflateInit error");
+	}
+	~zlib_deflate_writer()
+	{
+		deflateEnd(&m_zstream);
+	}
+	void write(const void * p_buffer, t_size p_bytes, abort_callback & p_abort)
+	{
+		if (p_bytes)
+			run(p_buffer, p_bytes, Z_NO_FLUSH, p_abort);
+	}
+	void finish(abort_callback & p_abort)
+	{
+		run(NULL, 0, Z_FINISH, p_abort);
+	}
+private:
+	enum {output_buffer_size = 256*1024};
+
+	void run(const void * p_buffer, t_size p_bytes, int flush, abort_callback & p_abort)
+	{
+		m_zstream.next_in = (Bytef*)const_cast<void*>(p_buffer);
+		m_zstream.avail_in = p_bytes;
+		int ret;
+		do
+		{
+			m_zstream.next_out = m_buffer.get_ptr();
+			m_zstream.avail_out = m_buffer.get_size();
+			ret = deflate(&m_zstream, flush);
+			if (ret == Z_STREAM_ERROR)
+				throw pfc::exception("zlib: deflate error");
+			m_output.write(m_buffer.get_ptr(), m_buffer.get_size() - m_zstream.avail_out, p_abort);
+		}
+		while (m_zstream.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+	}
+
+	z_stream m_zstream;
+	stream_writer & m_output;
+	pfc::array_staticsize_t<t_uint8> m_buffer;
+};